@@ -0,0 +1,125 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+/** An index of the nick!ident\@host masks on a ban list that finds out whether a user
+ * matches any of them without matching the user against every mask.
+ *
+ * Masks with a host part free of wildcards are found by looking up the host, displayed
+ * host and IP of the user in a hash map, and CIDR masks are found by walking a binary trie
+ * with the IP of the user. Only masks with wildcards in the host part are matched one by one.
+ * Extbans are not indexed as they are matched by modules.
+ *
+ * The index gives the same result as calling MatchMask() with every mask on the list.
+ */
+class CoreExport BanIndex
+{
+	/** A mask split at its first '@'
+	 */
+	struct Entry
+	{
+		/** The nick!ident part of the mask
+		 */
+		std::string prefix;
+
+		/** The host part of the mask
+		 */
+		std::string suffix;
+
+		/** True if prefix matches everything
+		 */
+		bool anyprefix;
+
+		/** Compiled forms of prefix and suffix
+		 */
+		CompiledMask prefixmatch;
+		CompiledMask suffixmatch;
+
+		Entry(const std::string& mask, std::string::size_type at);
+	};
+
+	/** A node of the CIDR trie, children and entries are positions in nodes and entries
+	 */
+	struct TrieNode
+	{
+		unsigned int children[2];
+		std::vector<unsigned int> bans;
+
+		TrieNode() { children[0] = children[1] = 0; }
+	};
+
+	typedef TR1NS::unordered_multimap<std::string, unsigned int, irc::insensitive, irc::StrHashComp> ExactMap;
+
+	/** All indexed masks
+	 */
+	std::vector<Entry> entries;
+
+	/** Masks without wildcards in the host part, keyed by the host part
+	 */
+	ExactMap exact;
+
+	/** The CIDR trie, node 0 is the IPv4 root and node 1 is the IPv6 root
+	 */
+	std::vector<TrieNode> nodes;
+
+	/** Masks with wildcards in the host part
+	 */
+	std::vector<unsigned int> wildcards;
+
+	/** Masks that can only be matched by MatchMask()
+	 */
+	std::vector<std::string> others;
+
+	bool MatchPrefix(const Entry& entry, const std::string& nickident) const;
+	bool MatchExact(const std::string& host, const std::string& nickident) const;
+	bool MatchTrie(User* user, const std::string& nickident) const;
+	void AddCIDR(const irc::sockets::cidr_mask& cidr, unsigned int ban);
+
+ public:
+	BanIndex() { Clear(); }
+
+	/** Remove all masks from the index
+	 */
+	void Clear();
+
+	/** Add a mask from the ban list to the index
+	 * @param mask The mask to add
+	 */
+	void Add(const std::string& mask);
+
+	/** Check whether a user matches any mask in the index
+	 * @param user The user to check
+	 * @return True if the user matches at least one mask
+	 */
+	bool Matches(User* user) const;
+
+	/** Check whether a user with a different host matches any mask in the index, e.g. with a cloak they are not using
+	 * @param user The user to check
+	 * @param host The host to match the host part of the masks against instead of the host, displayed host and IP of the user
+	 * @return True if the user matches at least one mask
+	 */
+	bool MatchesHost(User* user, const std::string& host) const;
+
+	/** Match a user against a nick!ident\@host ban mask, checking the host, displayed host and IP of the user
+	 * @param user The user to check
+	 * @param mask The mask to match against, extbans never match
+	 * @return True if the user matches the mask
+	 */
+	static bool MatchMask(User* user, const std::string& mask);
+};
@@ -33,6 +33,14 @@ class ModeChannelBan : public ListModeBase
 		: ListModeBase(NULL, "ban", 'b', "End of channel ban list", 367, 368, true, "maxbans")
 	{
 	}
+
+	ModeAction OnModeChange(User* source, User* dest, Channel* channel, std::string& parameter, bool adding) CXX11_OVERRIDE
+	{
+		ModeAction res = ListModeBase::OnModeChange(source, dest, channel, parameter, adding);
+		if (res == MODEACTION_ALLOW)
+			channel->InvalidateBans();
+		return res;
+	}
 };
 
 /** Channel mode +k
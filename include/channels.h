@@ -22,6 +22,7 @@
 
 #pragma once
 
+#include "banindex.h"
 #include "membership.h"
 #include "mode.h"
 #include "parammode.h"
@@ -37,9 +38,10 @@
 class CoreExport Channel : public Extensible, public InviteBase<Channel>
 {
  public:
-	/** A map of Memberships on a channel keyed by User pointers
+	/** A map of Memberships on a channel keyed by User pointers.
+	 * Removing a member reorders the map, see insp::dense_map.
 	 */
- 	typedef std::map<User*, insp::aligned_storage<Membership> > MemberMap;
+	typedef insp::dense_map<User, Membership*> MemberMap;
 
  private:
 	/** Set default modes for the channel on creation
@@ -61,6 +63,40 @@ class CoreExport Channel : public Extensible, public InviteBase<Channel>
 	 */
 	void DelUser(const MemberMap::iterator& membiter);
 
+	/** Index of the ban list, rebuilt on demand when banindexgeneration differs from bangeneration
+	 */
+	BanIndex banindex;
+
+	/** Incremented every time the ban list changes
+	 */
+	unsigned long bangeneration;
+
+	/** Value of bangeneration when banindex was last built
+	 */
+	unsigned long banindexgeneration;
+
+	/** The strings returned by ChanModes(), indexed by its showkey parameter
+	 */
+	std::string modestrings[2];
+
+	/** True for each entry of modestrings which is up to date, reset by SetMode()
+	 */
+	bool modestringvalid[2];
+
+	/** Check whether a user matches a nick!ident\@host mask on the ban list using the ban index.
+	 * The result for the hosts of the user is cached in the Membership of the user if the user is
+	 * on the channel, the hosts given by the OnGetBanHosts hook are matched every time.
+	 * @param user The user to check
+	 * @return True if the user matches a nick!ident\@host mask on the list
+	 */
+	bool GetDefaultBanMatch(User* user);
+
+	/** Check whether a user matches any mask on the ban list, calling the OnCheckBan hook for each extban
+	 * @param user The user to check
+	 * @return True if the user matches a mask on the list
+	 */
+	bool MatchesBanList(User* user);
+
  public:
 	/** Creates a channel record and initialises it with default values
 	 * @param name The name of the channel
@@ -228,6 +264,17 @@ class CoreExport Channel : public Extensible, public InviteBase<Channel>
 	 */
 	Membership* ForceJoin(User* user, const std::string* privs = NULL, bool bursting = false, bool created_by_local = false);
 
+	/** Join several users to an existing channel at once, without doing any permission checks.
+	 * Every user joins like with ForceJoin() without privileges, the OnUserJoin and OnPostJoin hooks are
+	 * called for each of them. The JOIN lines are sent to each local member of the channel in one write
+	 * instead of one at a time, local members who see all of them share the same buffer.
+	 * @param users The users to join to the channel
+	 * @param bursting True if the joins are the result of a netburst (passed to modules in the OnUserJoin hook)
+	 * @param joined Set to the new Membership of each user in the same order as users, or NULL for users
+	 * who were already inside the channel and for server users
+	 */
+	void ForceJoinUsers(const std::vector<User*>& users, bool bursting, std::vector<Membership*>& joined);
+
 	/** Write to a channel, from a user, using va_args for text
 	 * @param user User whos details to prefix the line with
 	 * @param text A printf-style format string which builds the output line without prefix
@@ -299,9 +346,10 @@ class CoreExport Channel : public Extensible, public InviteBase<Channel>
 	void RawWriteAllExcept(User* user, bool serversource, char status, CUList &except_list, const std::string& text);
 
 	/** Return the channel's modes with parameters.
+	 * The string is built once and kept until a mode of the channel changes.
 	 * @param showkey If this is set to true, the actual key is shown,
 	 * otherwise it is replaced with '&lt;KEY&gt;'
-	 * @return The channel mode string
+	 * @return The channel mode string, valid until the modes of the channel change
 	 */
 	const char* ChanModes(bool showkey);
 
@@ -330,6 +378,11 @@ class CoreExport Channel : public Extensible, public InviteBase<Channel>
 	 */
 	bool IsBanned(User* user);
 
+	/** Notify the channel that its ban list has changed, invalidating the ban index and
+	 * the ban verdicts cached in the Memberships
+	 */
+	void InvalidateBans() { bangeneration++; }
+
 	/** Check a single ban for match
 	 */
 	bool CheckBan(User* user, const std::string& banmask);
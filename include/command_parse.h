@@ -39,10 +39,42 @@ class CoreExport CommandParser
 	 */
 	void ProcessCommand(LocalUser* user, std::string& cmd);
 
+	/** Process a command from a user, using the given list to hold its parameters.
+	 * @param user The user to parse the command for
+	 * @param cmd The command string to process
+	 * @param command_p Parameter list to fill with the parameters of the command
+	 */
+	void ProcessCommand(LocalUser* user, std::string& cmd, std::vector<std::string>& command_p);
+
+	/** Rebuild cmdtable and cmdbuckets from cmdlist
+	 */
+	void BuildCommandTable();
+
 	/** Command list, a hash_map of command names to Command*
 	 */
 	CommandMap cmdlist;
 
+	/** Case insensitive perfect hash table of the commands in cmdlist, rebuilt whenever a command
+	 * is added or removed. The hash of a command name selects an entry in cmdbuckets, and the
+	 * displacement value there selects the slot of the command in this table, so finding a
+	 * command takes a single hash of its name and a single comparison.
+	 */
+	std::vector<Command*> cmdtable;
+
+	/** Displacement values for the buckets of cmdtable
+	 */
+	std::vector<unsigned int> cmdbuckets;
+
+	/** Parameter lists reused by ProcessCommand() so parsing a line doesn't have to allocate a new list
+	 * and new strings every time. A command can make a user execute another command, so there is one
+	 * list for every ProcessCommand() call in progress.
+	 */
+	std::deque<std::vector<std::string> > paramlists;
+
+	/** Number of ProcessCommand() calls in progress, the index of the first unused list in paramlists
+	 */
+	size_t paramlistsinuse;
+
  public:
 	/** Default constructor.
 	 */
@@ -68,7 +100,7 @@ class CoreExport CommandParser
 	CmdResult CallHandler(const std::string& commandname, const std::vector<std::string>& parameters, User* user, Command** cmd = NULL);
 
 	/** Get the handler function for a command.
-	 * @param commandname The command required. Always use uppercase for this parameter.
+	 * @param commandname The command required. The name is matched case insensitively.
 	 * @return a pointer to the command handler, or NULL
 	 */
 	Command* GetHandler(const std::string &commandname);
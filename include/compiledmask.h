@@ -0,0 +1,110 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+/** A wildcard mask prepared for matching many strings against it.
+ * The mask is split into the literal runs (which may contain '?') between its '*' characters
+ * once, so matching a string first rejects it by its length and by the runs the mask starts
+ * and ends with, then finds the remaining runs left to right without backtracking.
+ *
+ * Matching gives the same result as InspIRCd::Match() with the same mask and case map for any
+ * string which does not contain a NUL.
+ */
+class CoreExport CompiledMask
+{
+	/** A run of the mask between two '*' characters
+	 */
+	struct Segment
+	{
+		/** Position of the run in mask
+		 */
+		std::string::size_type start;
+
+		/** Length of the run
+		 */
+		std::string::size_type length;
+
+		/** True if the first character of the run can be searched for with memchr()
+		 * because no case map maps any other character to it
+		 */
+		bool scannable;
+	};
+
+	/** The mask as given
+	 */
+	std::string mask;
+
+	/** The case map to compare characters with, or NULL for national_case_insensitive_map
+	 */
+	unsigned const char* casemap;
+
+	/** The runs of the mask
+	 */
+	std::vector<Segment> segments;
+
+	/** True if the mask starts with a '*', false if the first run must match at the start of the string
+	 */
+	bool leadingstar;
+
+	/** True if the mask ends with a '*', false if the last run must match at the end of the string
+	 */
+	bool trailingstar;
+
+	/** Length of the shortest string that can match
+	 */
+	std::string::size_type minlength;
+
+	/** True if the mask may be a CIDR mask, see MatchCIDR()
+	 */
+	bool cidr;
+
+	bool SegmentEquals(const Segment& seg, const unsigned char* str, unsigned const char* map) const;
+	std::string::size_type FindSegment(const Segment& seg, const std::string& str, std::string::size_type from, std::string::size_type to, unsigned const char* map) const;
+
+ public:
+	/** Create a compiled mask
+	 * @param newmask The wildcard mask
+	 * @param map The case map to compare characters with, NULL to use the national case map at the time of matching
+	 */
+	CompiledMask(const std::string& newmask = std::string(), unsigned const char* map = NULL);
+
+	/** Replace the mask
+	 * @param newmask The new wildcard mask
+	 * @param map The case map to compare characters with, NULL to use the national case map at the time of matching
+	 */
+	void Compile(const std::string& newmask, unsigned const char* map = NULL);
+
+	/** Get the mask this object was compiled from
+	 * @return The wildcard mask
+	 */
+	const std::string& GetMask() const { return mask; }
+
+	/** Match a string against the mask like InspIRCd::Match() does
+	 * @param str The string to match
+	 * @return True if the string matches the mask
+	 */
+	bool Match(const std::string& str) const;
+
+	/** Match a string against the mask like InspIRCd::MatchCIDR() does, first as a CIDR mask and
+	 * then as a wildcard mask
+	 * @param str The string to match
+	 * @return True if the string matches the mask
+	 */
+	bool MatchCIDR(const std::string& str) const;
+};
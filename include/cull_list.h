@@ -32,15 +32,34 @@ class CoreExport CullList
 	std::vector<classbase*> list;
 	std::vector<LocalUser*> SQlist;
 
+	/** Items which are deleted a slice at a time by Apply()
+	 */
+	std::deque<classbase*> deferred;
+
  public:
+	/** Maximum number of deferred items deleted by one call to Apply()
+	 */
+	static const unsigned int CULL_SLICE = 1000;
+
 	/** Adds an item to the cull list
 	 */
 	void AddItem(classbase* item) { list.push_back(item); }
 	void AddSQItem(LocalUser* item) { SQlist.push_back(item); }
 
+	/** Adds an item to the cull list which may be deleted in a later call to Apply() than the next one.
+	 * Use this when many items are culled at once, so that deleting them does not stall the main loop.
+	 */
+	void AddDeferredItem(classbase* item) { deferred.push_back(item); }
+
+	/** Check whether there are deferred items that were not deleted yet
+	 * @return True if there are deferred items left, false if not
+	 */
+	bool HasDeferredItems() const { return !deferred.empty(); }
+
 	/** Applies the cull list (deletes the contents)
+	 * @param all True to delete all deferred items as well, false to only delete a slice of them
 	 */
-	void Apply();
+	void Apply(bool all = false);
 };
 
 class CoreExport ActionList
@@ -0,0 +1,232 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <vector>
+
+namespace insp
+{
+	template <typename Key, typename T> class dense_map;
+}
+
+/** An unordered map from Key pointers to T values that stores its elements in a contiguous array.
+ * Iterating over the elements only walks the array; lookups use an open addressing index of
+ * positions in the array, which is only built when the map has more than INDEX_THRESHOLD
+ * elements (smaller maps are searched linearly).
+ *
+ * Erasing an element moves the last element into its place, so the order of the elements is
+ * unspecified and inserting or erasing invalidates all iterators. The key of an element must
+ * not be modified through an iterator.
+ */
+template <typename Key, typename T>
+class insp::dense_map
+{
+ public:
+	typedef Key* key_type;
+	typedef T mapped_type;
+	typedef std::pair<Key*, T> value_type;
+
+ private:
+	typedef std::vector<value_type> storage_type;
+
+ public:
+	typedef typename storage_type::iterator iterator;
+	typedef typename storage_type::const_iterator const_iterator;
+	typedef typename storage_type::size_type size_type;
+
+ private:
+	/** Maps with at most this many elements have no index
+	 */
+	static const size_type INDEX_THRESHOLD = 16;
+
+	/** Value of unused slots in the index
+	 */
+	static const uint32_t EMPTY_SLOT = static_cast<uint32_t>(-1);
+
+	/** The elements of the map
+	 */
+	storage_type vect;
+
+	/** Open addressing (linear probing) table of positions in vect, or empty if the map is small.
+	 * Its size is a power of two and it is at most half full.
+	 */
+	std::vector<uint32_t> index;
+
+	/** log2 of the size of the index
+	 */
+	unsigned int indexbits;
+
+	size_type GetHomeSlot(const Key* key) const
+	{
+		// Fold the pointer into 32 bits, the low bits are always zero due to alignment
+		const uintptr_t val = reinterpret_cast<uintptr_t>(key);
+		const uint32_t folded = static_cast<uint32_t>(val >> 4) ^ static_cast<uint32_t>((val >> 16) >> 20);
+		return (folded * 0x9E3779B9U) >> (32 - indexbits);
+	}
+
+	/** Find the index slot holding the position of a key that is in the map
+	 */
+	size_type FindSlot(const Key* key) const
+	{
+		const size_type mask = index.size() - 1;
+		size_type slot = GetHomeSlot(key);
+		while (vect[index[slot]].first != key)
+			slot = (slot + 1) & mask;
+		return slot;
+	}
+
+	void IndexInsert(size_type pos)
+	{
+		const size_type mask = index.size() - 1;
+		size_type slot = GetHomeSlot(vect[pos].first);
+		while (index[slot] != EMPTY_SLOT)
+			slot = (slot + 1) & mask;
+		index[slot] = pos;
+	}
+
+	/** Remove a slot from the index, shifting back entries after it so no probe sequence is broken
+	 */
+	void IndexErase(size_type slot)
+	{
+		const size_type mask = index.size() - 1;
+		for (size_type next = (slot + 1) & mask; index[next] != EMPTY_SLOT; next = (next + 1) & mask)
+		{
+			// The entry in next can fill the hole if the hole is not before its home slot
+			const size_type home = GetHomeSlot(vect[index[next]].first);
+			if (((next - home) & mask) >= ((next - slot) & mask))
+			{
+				index[slot] = index[next];
+				slot = next;
+			}
+		}
+		index[slot] = EMPTY_SLOT;
+	}
+
+	/** Rebuild the index with the smallest size that keeps it at most half full,
+	 * or drop it if the map has become small.
+	 */
+	void Reindex()
+	{
+		if (vect.size() <= INDEX_THRESHOLD / 2)
+		{
+			std::vector<uint32_t>().swap(index);
+			return;
+		}
+
+		indexbits = 6;
+		while ((size_type(1) << indexbits) < vect.size() * 2)
+			indexbits++;
+
+		index.assign(size_type(1) << indexbits, uint32_t(EMPTY_SLOT));
+		for (size_type pos = 0; pos < vect.size(); ++pos)
+			IndexInsert(pos);
+	}
+
+ public:
+	dense_map()
+		: indexbits(0)
+	{
+	}
+
+	iterator begin() { return vect.begin(); }
+	iterator end() { return vect.end(); }
+	const_iterator begin() const { return vect.begin(); }
+	const_iterator end() const { return vect.end(); }
+
+	bool empty() const { return vect.empty(); }
+	size_type size() const { return vect.size(); }
+
+	iterator find(const Key* key)
+	{
+		if (index.empty())
+		{
+			for (iterator i = vect.begin(); i != vect.end(); ++i)
+			{
+				if (i->first == key)
+					return i;
+			}
+			return vect.end();
+		}
+
+		const size_type mask = index.size() - 1;
+		for (size_type slot = GetHomeSlot(key); index[slot] != EMPTY_SLOT; slot = (slot + 1) & mask)
+		{
+			const uint32_t pos = index[slot];
+			if (vect[pos].first == key)
+				return vect.begin() + pos;
+		}
+		return vect.end();
+	}
+
+	const_iterator find(const Key* key) const
+	{
+		return const_cast<dense_map*>(this)->find(key);
+	}
+
+	/** Insert an element if there is no element with the same key in the map
+	 * @param val Element to insert
+	 * @return Iterator to the element with the key of val, and true if it was inserted
+	 */
+	std::pair<iterator, bool> insert(const value_type& val)
+	{
+		iterator it = find(val.first);
+		if (it != vect.end())
+			return std::make_pair(it, false);
+
+		vect.push_back(val);
+		if ((vect.size() * 2 > index.size()) && ((!index.empty()) || (vect.size() > INDEX_THRESHOLD)))
+			Reindex();
+		else if (!index.empty())
+			IndexInsert(vect.size() - 1);
+
+		return std::make_pair(vect.end() - 1, true);
+	}
+
+	/** Erase an element, moving the last element into its place
+	 * @param it Iterator to the element to erase, must be valid
+	 * @return Iterator to the element that took the place of the erased one, or end()
+	 */
+	iterator erase(iterator it)
+	{
+		const size_type pos = it - vect.begin();
+		const size_type last = vect.size() - 1;
+		if (!index.empty())
+		{
+			IndexErase(FindSlot(it->first));
+			if (pos != last)
+				index[FindSlot(vect[last].first)] = pos;
+		}
+
+		if (pos != last)
+			vect[pos] = vect[last];
+		vect.pop_back();
+
+		// Shrink the index once it becomes mostly empty
+		if ((!index.empty()) && (vect.size() * 8 < index.size()))
+			Reindex();
+
+		return vect.begin() + pos;
+	}
+
+	void clear()
+	{
+		vect.clear();
+		std::vector<uint32_t>().swap(index);
+	}
+};
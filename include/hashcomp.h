@@ -284,6 +284,40 @@ namespace irc
 		bool GetToken(long &token);
 	};
 
+	/** irc::linetokenizer splits a line of IRC protocol data into tokens exactly like
+	 * irc::tokenstream does, but without making a copy of the line first.
+	 * Each token is assigned to the string passed to GetToken(), so passing the same
+	 * strings for every line reuses their storage instead of allocating new strings.
+	 * The line must not be modified or destroyed while it is being tokenized.
+	 */
+	class CoreExport linetokenizer
+	{
+		/** The line being tokenized
+		 */
+		const std::string& line;
+
+		/** Position in the line where the search for the next token starts
+		 */
+		std::string::size_type pos;
+
+	 public:
+		/** Create a linetokenizer which reads the given line
+		 */
+		linetokenizer(const std::string& source) : line(source), pos(0) { }
+
+		/** Fetch the next token from the line
+		 * @param token The next token available, or an empty string if none remain
+		 * @return True if a token was read, false if none remain
+		 */
+		bool GetToken(std::string& token);
+
+		/** Fetch all remaining tokens from the line into a parameter list.
+		 * Strings which are already in the list are reused.
+		 * @param tokens The list to fill, it is resized to the number of tokens read
+		 */
+		void GetTokens(std::vector<std::string>& tokens);
+	};
+
 	/** The portparser class seperates out a port range into integers.
 	 * A port range may be specified in the input string in the form
 	 * "6660,6661,6662-6669,7020". The end of the stream is indicated by
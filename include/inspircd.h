@@ -47,6 +47,7 @@
 #include "flat_map.h"
 #include "compat.h"
 #include "aligned_storage.h"
+#include "dense_map.h"
 #include "typedefs.h"
 #include "stdalgo.h"
 
@@ -73,9 +74,10 @@ struct fakederef
 #include "numerics.h"
 #include "uid.h"
 #include "server.h"
+#include "timer.h"
+#include "compiledmask.h"
 #include "users.h"
 #include "channels.h"
-#include "timer.h"
 #include "hashcomp.h"
 #include "logger.h"
 #include "usermanager.h"
@@ -642,6 +644,11 @@ class CoreExport InspIRCd
 	 */
 	static std::string TimeString(time_t curtime, const char* format = NULL, bool utc = false);
 
+	/** Get the current time from a monotonic clock, for measuring how long something takes
+	 * @return The time in nanoseconds since an unspecified starting point
+	 */
+	static uint64_t GetMonotonicClock();
+
 	/** Compare two strings in a timing-safe way. If the lengths of the strings differ, the function
 	 * returns false immediately (leaking information about the length), otherwise it compares each
 	 * character and only returns after all characters have been compared.
@@ -97,29 +97,185 @@ class CoreExport SocketTimeout : public Timer
 	virtual bool Tick(time_t now);
 };
 
+/** An immutable, reference counted block of data which can be placed on the
+ * send queue of any number of StreamSockets without being copied.
+ */
+class CoreExport SharedBuffer : public refcountbase
+{
+	/** The data held by this buffer, it is never changed after the constructor */
+	std::string data;
+
+ public:
+	/** Create a new buffer
+	 * @param str The data to hold, this is copied into the buffer
+	 */
+	SharedBuffer(const std::string& str) : data(str) { }
+
+	/** Create a new buffer holding the concatenation of two strings
+	 * @param str The start of the data to hold
+	 * @param suffix The data to hold after str, e.g. a line terminator
+	 */
+	SharedBuffer(const std::string& str, const std::string& suffix)
+	{
+		data.reserve(str.length() + suffix.length());
+		data.append(str).append(suffix);
+	}
+
+	/** Get the data held by this buffer
+	 * @return The data held by this buffer
+	 */
+	const std::string& GetData() const { return data; }
+};
+
 /**
  * StreamSocket is a class that wraps a TCP socket and handles send
  * and receive queues, including passing them to IO hooks
  */
 class CoreExport StreamSocket : public EventHandler
 {
-	/** The IOHook that handles raw I/O for this socket, or NULL */
+ public:
+	/** A queue of data waiting to be sent. The buffers in it may be shared with the send queues of other sockets,
+	 * so they are only ever read from; data which has been sent is skipped instead of being erased from them.
+	 */
+	class CoreExport SendQueue
+	{
+		typedef std::deque<reference<SharedBuffer> > Container;
+
+		/** The buffers in the queue */
+		Container buffers;
+
+		/** Number of bytes at the start of the first buffer which have already been sent */
+		size_t offset;
+
+		/** Number of bytes in the queue which have not been sent yet */
+		size_t nbytes;
+
+	 public:
+		SendQueue() : offset(0), nbytes(0) { }
+
+		/** Check whether the queue is empty
+		 * @return True if there is nothing left to send
+		 */
+		bool empty() const { return buffers.empty(); }
+
+		/** Get the number of buffers in the queue
+		 * @return Number of buffers in the queue
+		 */
+		size_t size() const { return buffers.size(); }
+
+		/** Get the number of bytes waiting to be sent
+		 * @return Number of bytes in the queue
+		 */
+		size_t bytes() const { return nbytes; }
+
+		/** Get the unsent data of a buffer in the queue
+		 * @param index Position of the buffer in the queue, 0 is the front
+		 * @param length Set to the length of the unsent data in the buffer
+		 * @return Pointer to the unsent data in the buffer
+		 */
+		const char* GetData(size_t index, size_t& length) const
+		{
+			const std::string& data = buffers[index]->GetData();
+			const size_t skip = (index ? 0 : offset);
+			length = data.length() - skip;
+			return data.data() + skip;
+		}
+
+		/** Add a buffer to the end of the queue
+		 * @param buffer The buffer to add
+		 */
+		void push_back(const reference<SharedBuffer>& buffer)
+		{
+			buffers.push_back(buffer);
+			nbytes += buffer->GetData().length();
+		}
+
+		/** Remove data which has been sent from the front of the queue
+		 * @param amount Number of bytes to remove
+		 */
+		void erase_front(size_t amount);
+
+		/** Remove everything from the queue */
+		void clear()
+		{
+			buffers.clear();
+			offset = 0;
+			nbytes = 0;
+		}
+
+		/** If the buffer at the front of the queue is short, merge it with the ones following it so
+		 * it can be handed to e.g. an SSL library in one call. This copies the merged data once.
+		 * @param minlength Buffers are merged until the front of the queue is at least this long
+		 */
+		void Flatten(size_t minlength);
+	};
+
+ private:
+	/** The IOHook that handles raw I/O for this socket, or NULL. If it is a middle hook
+	 * the hooks below it are reached through IOHookMiddle::GetNextHook().
+	 */
 	IOHook* iohook;
 
-	/** Private send queue. Note that individual strings may be shared
+	/** Private send queue. Buffers may be shared with the send queues of other sockets.
 	 */
-	std::deque<std::string> sendq;
-	/** Length, in bytes, of the sendq */
-	size_t sendq_len;
+	SendQueue sendq;
 	/** Error - if nonempty, the socket is dead, and this is the reason. */
 	std::string error;
+
+	/** Number of bytes at the start of the recvq which have already been returned by GetNextLine().
+	 * They are removed from the recvq in one go instead of after every line.
+	 */
+	std::string::size_type recvq_pos;
+
+	/** Remove data which has been consumed by GetNextLine() from the front of the recvq */
+	void CompactRecvQ();
+
+	/** Read data from the socket into a recvq, without any IOHook
+	 * @param rq The recvq to append the data to
+	 * @return 1 if new data has been read, 0 if no new data is ready, -1 if there was an error or close
+	 */
+	int ReadToRecvQ(std::string& rq);
+
+	/** Read data through an IOHook and the hooks below it
+	 * @param hook The hook to read through, NULL to read from the socket
+	 * @param rq The recvq to append the data to
+	 * @return 1 if new data has been read, 0 if no new data is ready, -1 if there was an error or close
+	 */
+	int HookChainRead(IOHook* hook, std::string& rq);
+
+	/** Send data from a sendq to the socket, without any IOHook
+	 * @param sq The sendq to send from, the data sent is removed from it
+	 * @return 1 if the sendq has been completely emptied, 0 if there is still data to send, -1 if there was an error
+	 */
+	int FlushSendQ(SendQueue& sq);
+
+	/** Send data through an IOHook and the hooks below it
+	 * @param hook The hook to send through, NULL to send to the socket
+	 * @param sq The sendq to send from, the data sent is removed from it
+	 * @return 1 if the sendq has been completely emptied, 0 if there is still data to send, -1 if there was an error
+	 */
+	int HookChainWrite(IOHook* hook, SendQueue& sq);
+
  protected:
 	std::string recvq;
  public:
-	StreamSocket() : iohook(NULL), sendq_len(0) {}
+	StreamSocket() : iohook(NULL), recvq_pos(0) {}
 	IOHook* GetIOHook() const;
+	/** Add an IOHook to the socket. A middle hook is put on top of the hooks the socket
+	 * already has, any other hook is put below all middle hooks.
+	 * @param hook The hook to add
+	 */
 	void AddIOHook(IOHook* hook);
 	void DelIOHook();
+	/** Get the IOHook of a module on this socket, it may be below a middle hook
+	 * @param mod The module whose hook to find
+	 * @return The hook of the module, or NULL if the module does not hook this socket
+	 */
+	IOHook* GetModHook(Module* mod) const;
+	/** Get the IOHook which does the I/O on the socket itself, i.e. the one below all middle hooks
+	 * @return The last hook in the chain of hooks, or NULL if the socket has no hooks
+	 */
+	IOHook* GetLastHook() const;
 	/** Handle event from socket engine.
 	 * This will call OnDataReady if there is *new* data in recvq
 	 */
@@ -137,20 +293,45 @@ class CoreExport StreamSocket : public EventHandler
 
 	/** Called when new data is present in recvq */
 	virtual void OnDataReady() = 0;
+	/** Called after the socket became writable and as much of the sendq as possible was written */
+	virtual void OnDataWritten() { }
 	/** Called when the socket gets an error from socket engine or IO hook */
 	virtual void OnError(BufferedSocketError e) = 0;
 
 	/** Send the given data out the socket, either now or when writes unblock
 	 */
 	void WriteData(const std::string& data);
-	/** Convenience function: read a line from the socket
+	/** Send the given shared buffer out the socket, either now or when writes unblock.
+	 * The buffer is not copied, so the same buffer can be queued on many sockets.
+	 */
+	void WriteData(const reference<SharedBuffer>& data);
+	/** Convenience function: read a line from the socket.
+	 * Lines which have been read are only removed from the recvq once there are no
+	 * more complete lines left, so use GetRecvQSize() to find out how much data is
+	 * still waiting to be read.
 	 * @param line The line read
 	 * @param delim The line delimiter
 	 * @return true if a line was read
 	 */
 	bool GetNextLine(std::string& line, char delim = '\n');
-	/** Useful for implementing sendq exceeded */
-	inline size_t getSendQSize() const { return sendq_len; }
+	/** Get the data in the recvq which has not been read yet, for protocols which are not line based.
+	 * Use ConsumeRecvQ() to mark the part of it which has been processed as read.
+	 * @param length Set to the length of the data
+	 * @return Pointer to the data, it is valid until more data is read from the socket
+	 */
+	const char* PeekRecvQ(size_t& length) const { length = GetRecvQSize(); return recvq.data() + (recvq.length() - length); }
+	/** Mark data returned by PeekRecvQ() as read
+	 * @param amount Number of bytes to mark as read
+	 */
+	void ConsumeRecvQ(size_t amount) { recvq_pos += amount; }
+	/** Useful for implementing recvq exceeded
+	 * @return Number of bytes in the recvq which have not yet been read by GetNextLine()
+	 */
+	inline size_t GetRecvQSize() const { return recvq.length() - std::min(recvq_pos, recvq.length()); }
+	/** Useful for implementing sendq exceeded
+	 * @return Number of bytes waiting to be sent, including data held by middle hooks
+	 */
+	size_t getSendQSize() const;
 
 	/**
 	 * Close the socket, remove from socket engine, etc
@@ -232,5 +413,4 @@ class CoreExport BufferedSocket : public StreamSocket
 };
 
 inline IOHook* StreamSocket::GetIOHook() const { return iohook; }
-inline void StreamSocket::AddIOHook(IOHook* hook) { iohook = hook; }
 inline void StreamSocket::DelIOHook() { iohook = NULL; }
@@ -19,7 +19,7 @@
 
 #pragma once
 
-class StreamSocket;
+#include "inspsocket.h"
 
 class IOHookProvider : public ServiceProvider
 {
@@ -32,8 +32,18 @@ class IOHookProvider : public ServiceProvider
 
 	const Type type;
 
-	IOHookProvider(Module* mod, const std::string& Name, Type hooktype = IOH_UNKNOWN)
-		: ServiceProvider(mod, Name, SERVICE_IOHOOK), type(hooktype) { }
+	/** True if the hooks of this provider are middle hooks, which can be stacked
+	 * on top of another hook (e.g. SSL) of the same socket
+	 */
+	const bool middlehook;
+
+	IOHookProvider(Module* mod, const std::string& Name, Type hooktype = IOH_UNKNOWN, bool middle = false)
+		: ServiceProvider(mod, Name, SERVICE_IOHOOK), type(hooktype), middlehook(middle) { }
+
+	/** Check whether the hooks of this provider are middle hooks
+	 * @return True if the hooks are IOHookMiddle instances, false otherwise
+	 */
+	bool IsMiddle() const { return middlehook; }
 
 	/** Called immediately after a connection is accepted. This is intended for raw socket
 	 * processing (e.g. modules which wrap the tcp connection within another library) and provides
@@ -66,11 +76,12 @@ class IOHook : public classbase
 	 * Called when a hooked stream has data to write, or when the socket
 	 * engine returns it as writable
 	 * @param sock The socket in question
-	 * @param sendq Data to send to the socket
+	 * @param sendq Data to send to the socket, the hook removes the data it has
+	 *  sent from the front of it
 	 * @return 1 if the sendq has been completely emptied, 0 if there is
 	 *  still data to send, and -1 if there was an error
 	 */
-	virtual int OnStreamSocketWrite(StreamSocket* sock, std::string& sendq) = 0;
+	virtual int OnStreamSocketWrite(StreamSocket* sock, StreamSocket::SendQueue& sendq) = 0;
 
 	/** Called immediately before any socket is closed. When this event is called, shutdown()
 	 * has not yet been called on the socket.
@@ -87,3 +98,61 @@ class IOHook : public classbase
 	 */
 	virtual int OnStreamSocketRead(StreamSocket* sock, std::string& recvq) = 0;
 };
+
+/** An IOHook which does not do I/O on the socket itself but transforms the data
+ * passed to and from the hook below it, e.g. to compress it. If there is no hook
+ * below it the data is sent and received by the socket.
+ *
+ * OnStreamSocketRead() takes the data received by the hooks below from GetRecvQ()
+ * and OnStreamSocketWrite() puts the data to send into GetSendQ().
+ */
+class IOHookMiddle : public IOHook
+{
+	/** Data received by the hooks below this one which has not been processed by this hook yet
+	 */
+	std::string precvq;
+
+	/** Data processed by this hook which has not been sent by the hooks below it yet
+	 */
+	StreamSocket::SendQueue psendq;
+
+	/** The hook below this one, NULL if this hook is at the bottom
+	 */
+	IOHook* nexthook;
+
+ public:
+	IOHookMiddle(IOHookProvider* provider)
+		: IOHook(provider), nexthook(NULL) { }
+
+	/** Get the recvq of this hook, which the hooks below it append the data they receive to
+	 * @return The recvq of this hook
+	 */
+	std::string& GetRecvQ() { return precvq; }
+
+	/** Get the sendq of this hook, the hooks below it send the data in it
+	 * @return The sendq of this hook
+	 */
+	StreamSocket::SendQueue& GetSendQ() { return psendq; }
+	const StreamSocket::SendQueue& GetSendQ() const { return psendq; }
+
+	/** Get the hook below this one
+	 * @return The next hook in the chain, NULL if there is none
+	 */
+	IOHook* GetNextHook() const { return nexthook; }
+
+	/** Set the hook below this one
+	 * @param hook The new next hook
+	 */
+	void SetNextHook(IOHook* hook) { nexthook = hook; }
+
+	/** Cast a hook to an IOHookMiddle if it is one
+	 * @param hook The hook to cast
+	 * @return The hook as an IOHookMiddle, or NULL if it is not a middle hook
+	 */
+	static IOHookMiddle* ToMiddleHook(IOHook* hook)
+	{
+		if (hook->prov->IsMiddle())
+			return static_cast<IOHookMiddle*>(hook);
+		return NULL;
+	}
+};
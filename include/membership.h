@@ -54,6 +54,18 @@ class CoreExport Membership : public Extensible, public insp::intrusive_list_nod
 	 */
 	Id id;
 
+	/** Value of Channel::bangeneration when banned was last computed, not meaningful otherwise
+	 */
+	unsigned long bangeneration;
+
+	/** Value of User::maskgeneration when banned was last computed
+	 */
+	unsigned int banmaskgeneration;
+
+	/** Cached result of matching the user against the ban list of the channel without modules
+	 */
+	bool banned;
+
 	/** Converts a string to a Membership::Id
 	 * @param str The string to convert
 	 * @return Raw value of type Membership::Id
@@ -68,7 +80,7 @@ class CoreExport Membership : public Extensible, public insp::intrusive_list_nod
 	 * Call Channel::JoinUser() or ForceJoin() to make a user join a channel instead of constructing
 	 * Membership objects directly.
 	 */
-	Membership(User* u, Channel* c) : user(u), chan(c) {}
+	Membership(User* u, Channel* c) : user(u), chan(c), bangeneration(0), banmaskgeneration(0), banned(false) {}
 
 	/** Returns true if this member has a given prefix mode set
 	 * @param m The prefix mode letter to check
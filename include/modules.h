@@ -128,6 +128,7 @@ struct ModResult {
 		_next = _i+1; \
 		try \
 		{ \
+			HookProfileTimer _hookprofile(_handlers, _i, I_ ## y); \
 			(*_i)->y x ; \
 		} \
 		catch (CoreException& modexcept) \
@@ -151,6 +152,7 @@ do { \
 		_next = _i+1; \
 		try \
 		{ \
+			HookProfileTimer _hookprofile(_handlers, _i, I_ ## n); \
 			v = (*_i)->n args;
 
 #define WHILE_EACH_HOOK(n) \
@@ -229,7 +231,7 @@ enum Implementation
 	I_OnChangeHost, I_OnChangeName, I_OnAddLine, I_OnDelLine, I_OnExpireLine,
 	I_OnUserPostNick, I_OnPreMode, I_On005Numeric, I_OnKill, I_OnLoadModule,
 	I_OnUnloadModule, I_OnBackgroundTimer, I_OnPreCommand, I_OnCheckReady, I_OnCheckInvite,
-	I_OnRawMode, I_OnCheckKey, I_OnCheckLimit, I_OnCheckBan, I_OnCheckChannelBan, I_OnExtBanCheck,
+	I_OnRawMode, I_OnCheckKey, I_OnCheckLimit, I_OnCheckBan, I_OnCheckChannelBan, I_OnExtBanCheck, I_OnGetBanHosts,
 	I_OnStats, I_OnChangeLocalUserHost, I_OnPreTopicChange,
 	I_OnPostTopicChange, I_OnPostConnect,
 	I_OnChangeLocalUserGECOS, I_OnUserRegister, I_OnChannelPreDelete, I_OnChannelDelete,
@@ -240,6 +242,32 @@ enum Implementation
 	I_END
 };
 
+/** Statistics about the calls made to one hook of a module.
+ * These are only collected when hook profiling is enabled with \<performance:profilehooks>.
+ */
+struct CoreExport HookProfile
+{
+	/** Number of calls made to the hook
+	 */
+	unsigned long calls;
+
+	/** Total time spent in the hook in nanoseconds, including time spent in any hooks called from it
+	 */
+	uint64_t time;
+
+	/** Time spent in the slowest call to the hook in nanoseconds
+	 */
+	uint64_t maxtime;
+
+	HookProfile() : calls(0), time(0), maxtime(0) { }
+
+	/** Get the name of a hook
+	 * @param hook The hook to get the name of
+	 * @return The name of the hook, for example "OnUserConnect" for I_OnUserConnect
+	 */
+	static const char* GetHookName(Implementation hook);
+};
+
 /** Base class for all InspIRCd modules
  *  This class is the base class for InspIRCd modules. All modules must inherit from this class,
  *  its methods will be called when irc server events occur. class inherited from module must be
@@ -265,6 +293,11 @@ class CoreExport Module : public classbase, public usecountbase
 	 */
 	bool dying;
 
+	/** Statistics about the calls made to the hooks of this module, indexed by Implementation.
+	 * Empty until a hook of this module is called while hook profiling is enabled.
+	 */
+	std::vector<HookProfile> HookProfiles;
+
 	/** Default constructor.
 	 * Creates a module class. Don't do any type of hook registration or checks
 	 * for other modules here; do that in init().
@@ -351,7 +384,8 @@ class CoreExport Module : public classbase, public usecountbase
 
 	/** Called after a user joins a channel
 	 * Identical to OnUserJoin, but called immediately afterwards, when any linking module has
-	 * seen the join.
+	 * seen the join. When several users join at once with Channel::ForceJoinUsers(), OnUserJoin
+	 * is called for all of them before OnPostJoin is called for any of them.
 	 * @param memb The channel membership created
 	 */
 	virtual void OnPostJoin(Membership* memb);
@@ -864,6 +898,8 @@ class CoreExport Module : public classbase, public usecountbase
 
 	/**
 	 * Checks for a user's match of a single ban
+	 * When a user is checked against the whole ban list this is only called for extbans,
+	 * the nick!ident\@host masks are matched by the ban index of the channel.
 	 * @param user The user to check for match
 	 * @param chan The channel on which the match is being checked
 	 * @param mask The mask being checked
@@ -872,6 +908,13 @@ class CoreExport Module : public classbase, public usecountbase
 	 */
 	virtual ModResult OnCheckBan(User* user, Channel* chan, const std::string& mask);
 
+	/** Called when a user is matched against nick!ident\@host ban masks, to give hosts that the
+	 * bans are matched against besides the host, displayed host and IP of the user
+	 * @param user The user being checked
+	 * @param hosts A list to add the hosts to
+	 */
+	virtual void OnGetBanHosts(User* user, std::vector<std::string>& hosts);
+
 	/** Checks for a match on a given extban type
 	 * @return MOD_RES_DENY to mark as banned, MOD_RES_ALLOW to skip the
 	 * ban check, or MOD_RES_PASSTHRU to check bans normally
@@ -1232,6 +1275,61 @@ class CoreExport ModuleManager : public fakederef<ModuleManager>
 	const ModuleMap& GetModules() const { return Modules; }
 };
 
+/** Measures the time a module spends in a hook for FOREACH_MOD and DO_EACH_HOOK, and adds it
+ * to the HookProfiles of the module. When hook profiling is disabled this only checks a flag.
+ */
+class CoreExport HookProfileTimer
+{
+	/** The modules attached to the hook
+	 */
+	const IntModuleList& handlers;
+
+	/** Position of the module in handlers
+	 */
+	const size_t pos;
+
+	/** The module the hook is called on
+	 */
+	Module* const mod;
+
+	/** The hook being called
+	 */
+	const Implementation hook;
+
+	/** Time the call started at, or 0 if hook profiling is disabled
+	 */
+	const uint64_t start;
+
+	/** Read the clock at the start of a call, out of line as InspIRCd is incomplete here
+	 * @return The time from InspIRCd::GetMonotonicClock()
+	 */
+	static uint64_t Now();
+
+	/** Add the time since the start of the call to the profile of the hook
+	 */
+	void Record();
+
+ public:
+	/** True if hook profiling is enabled, set from \<performance:profilehooks>
+	 */
+	static bool Enabled;
+
+	HookProfileTimer(const IntModuleList& list, IntModuleList::const_reverse_iterator it, Implementation i)
+		: handlers(list)
+		, pos(it.base() - list.begin() - 1)
+		, mod(*it)
+		, hook(i)
+		, start(Enabled ? Now() : 0)
+	{
+	}
+
+	~HookProfileTimer()
+	{
+		if (start)
+			Record();
+	}
+};
+
 /** Do not mess with these functions unless you know the C preprocessor
  * well enough to explain why they are needed. The order is important.
  */
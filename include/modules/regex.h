@@ -37,18 +37,65 @@ public:
 
 	virtual bool Matches(const std::string& text) = 0;
 
+	/** Get a string which every text matching this regex contains, used to skip regexes
+	 * which cannot match a text without running them.
+	 * @param literal Set to the string. Texts are searched for it ignoring case as
+	 * national_case_insensitive_map does.
+	 * @return True if literal was set, false if the regex has no such string
+	 */
+	virtual bool GetRequiredLiteral(std::string& literal) const
+	{
+		return false;
+	}
+
 	const std::string& GetRegexString() const
 	{
 		return regex_string;
 	}
 };
 
+/** A set of regexes which are matched against a text in one pass
+ */
+class RegexSet : public classbase
+{
+ public:
+	virtual ~RegexSet() { }
+
+	/** Add a regex to the set, this must be done before Compile()
+	 * @param expr The regex to add
+	 * @return The position of the regex in the set, counting from 0
+	 * @throw RegexException if the regex is not valid
+	 */
+	virtual unsigned int Add(const std::string& expr) = 0;
+
+	/** Prepare the set for matching after all regexes have been added
+	 * @throw RegexException if the set can not be built
+	 */
+	virtual void Compile() = 0;
+
+	/** Find the regexes in the set which match a text
+	 * @param text The text to match
+	 * @param matches Filled with the positions of the matching regexes
+	 * @return False if the engine failed to match the set against the text (e.g. it ran out of
+	 * memory), in which case any regex in the set may match and they have to be matched one by one
+	 */
+	virtual bool Match(const std::string& text, std::vector<unsigned int>& matches) = 0;
+};
+
 class RegexFactory : public DataProvider
 {
  public:
 	RegexFactory(Module* Creator, const std::string& Name) : DataProvider(Creator, Name) { }
 
 	virtual Regex* Create(const std::string& expr) = 0;
+
+	/** Create an empty set of regexes, for engines which can match many regexes at once
+	 * @return A new set which the caller must delete, or NULL if the engine does not support sets
+	 */
+	virtual RegexSet* CreateSet()
+	{
+		return NULL;
+	}
 };
 
 class RegexException : public ModuleException
@@ -180,7 +180,8 @@ class SSLClientCert
 	 */
 	static ssl_cert* GetCertificate(StreamSocket* sock)
 	{
-		IOHook* iohook = sock->GetIOHook();
+		// The SSL hook does the I/O on the socket, middle hooks (e.g. compression) may be stacked on top of it
+		IOHook* iohook = sock->GetLastHook();
 		if ((!iohook) || (iohook->prov->type != IOHookProvider::IOH_SSL))
 			return NULL;
 
@@ -0,0 +1,60 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+namespace ZipLink
+{
+	class Provider;
+}
+
+/** Compresses the data sent over a server link. The compression is done by a middle IOHook, so it
+ * is stacked on top of the SSL hook of the link if there is one.
+ *
+ * m_spanningtree compresses a link if both servers advertise the same capability in CAPAB. Each
+ * side compresses what it sends after its BURST line and decompresses what it receives after the
+ * BURST line of the other side.
+ */
+class ZipLink::Provider : public DataProvider
+{
+ public:
+	Provider(Module* mod)
+		: DataProvider(mod, "ziplink")
+	{
+	}
+
+	/** Get the value of the ZIPLINK key advertised in CAPAB. Two servers can compress the link
+	 * between them if they advertise the same value.
+	 * @return The capability, it identifies the compression method and the dictionary used
+	 */
+	virtual const std::string& GetCapability() const = 0;
+
+	/** Compress everything written to a socket from now on. Data written before this call is sent as it is.
+	 * @param sock The socket to compress the data of
+	 */
+	virtual void StartCompression(StreamSocket* sock) = 0;
+
+	/** Decompress everything received by a socket from now on
+	 * @param sock The socket to decompress the data of
+	 * @param data Data which has already been received after the point where the other side
+	 * started compressing, it is decompressed right away
+	 * @param recvq The recvq of the socket, the decompressed data is appended to it
+	 * @return True on success, false if the data could not be decompressed, the error is set on the socket
+	 */
+	virtual bool StartDecompression(StreamSocket* sock, const std::string& data, std::string& recvq) = 0;
+};
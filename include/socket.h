@@ -127,8 +127,8 @@ namespace irc
 	}
 }
 
-#include "iohook.h"
 #include "socketengine.h"
+#include "iohook.h"
 /** This class handles incoming connections on client ports.
  * It will create a new User for every valid connection
  * and assign it a file descriptor.
@@ -306,6 +306,13 @@ class CoreExport SocketEngine
 
 	static void DelFdRef(EventHandler* eh);
 
+	/** Get the number of milliseconds DispatchEvents() should wait for events.
+	 * This is the time until the next timer is due, but at most until the start of the next second
+	 * so the once a second housekeeping in the main loop still runs on time. It is zero while
+	 * XLineManager is applying lines in the background.
+	 */
+	static unsigned int GetTimeout();
+
 	template <typename T>
 	static void ResizeDouble(std::vector<T>& vect)
 	{
@@ -397,7 +404,7 @@ public:
 	static EventHandler* GetRef(int fd);
 
 	/** Waits for events and dispatches them to handlers.  Please note that
-	 * this doesn't wait long, only a couple of milliseconds. It returns the
+	 * this doesn't wait longer than until the next timer is due. It returns the
 	 * number of events which occurred during this call.  This method will
 	 * dispatch events to their handlers by calling their
 	 * EventHandler::HandleEvent() methods with the necessary EventType
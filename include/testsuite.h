@@ -31,6 +31,8 @@ class TestSuite
 	bool DoCommaSepStreamTests();
 	bool DoSpaceSepStreamTests();
 	bool DoGenerateUIDTests();
+	bool DoMemberMapTests();
+	bool DoUIDIndexTests();
 };
 
 #endif
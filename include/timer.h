@@ -32,12 +32,15 @@ class Module;
  * queue using Server::AddTimer(). The Tick() method of
  * your object (which you have to override) will be called
  * at the given time.
+ * Internally the triggering time is kept with millisecond precision,
+ * so a timer ticks the given number of seconds after it was set up
+ * rather than at the next whole second after that.
  */
-class CoreExport Timer
+class CoreExport Timer : public insp::intrusive_list_node<Timer>
 {
-	/** The triggering time
+	/** The triggering time, in milliseconds on the clock of the TimerManager
 	 */
-	time_t trigger;
+	uint64_t trigger;
 
 	/** Number of seconds between triggers
 	 */
@@ -47,6 +50,12 @@ class CoreExport Timer
 	 */
 	bool repeat;
 
+	/** Index of the TimerManager wheel slot this timer is in, or -1 if it is not scheduled
+	 */
+	int slot;
+
+	friend class TimerManager;
+
  public:
 	/** Default constructor, initializes the triggering time
 	 * @param secs_from_now The number of seconds from now to trigger the timer
@@ -60,19 +69,13 @@ class CoreExport Timer
 
 	/** Retrieve the current triggering time
 	 */
-	time_t GetTrigger() const
-	{
-		return trigger;
-	}
+	time_t GetTrigger() const;
 
 	/** Sets the trigger timeout to a new value
 	 * This does not update the bookkeeping in TimerManager, use SetInterval()
 	 * to change the interval between ticks while keeping TimerManager updated
 	 */
-	void SetTrigger(time_t nexttrigger)
-	{
-		trigger = nexttrigger;
-	}
+	void SetTrigger(time_t nexttrigger);
 
 	/** Sets the interval between two ticks.
 	 */
@@ -114,16 +117,80 @@ class CoreExport Timer
 /** This class manages sets of Timers, and triggers them at their defined times.
  * This will ensure timers are not missed, as well as removing timers that have
  * expired and allowing the addition of new ones.
+ *
+ * Timers are kept in a hierarchical timing wheel with a resolution of one millisecond.
+ * Each level of the wheel has SLOTS slots, and each slot of a level covers SLOTS times
+ * as much time as a slot of the level below it. Adding and removing a timer only links
+ * or unlinks it from the list of a slot. When the slots of a level have all been
+ * processed the timers in the next slot of the level above are moved down to the
+ * levels below, according to how much time they have left.
  */
 class CoreExport TimerManager
 {
-	typedef std::multimap<time_t, Timer*> TimerMap;
+	typedef insp::intrusive_list<Timer> TimerList;
+
+	/** Number of bits of a tick which select the slot on one level of the wheel
+	 */
+	static const unsigned int SLOT_BITS = 6;
+
+	/** Number of slots on each level of the wheel
+	 */
+	static const unsigned int SLOTS = 1 << SLOT_BITS;
+
+	/** Number of levels in the wheel. Timers set further in the future than the
+	 * wheel can represent (about two years) are moved down the wheel as late as possible
+	 * and rescheduled once they reach the bottom.
+	 */
+	static const unsigned int LEVELS = 6;
+
+	/** Timer lists, indexed by level * SLOTS + slot
+	 */
+	TimerList wheel[LEVELS * SLOTS];
+
+	/** One bit per slot for every level, set if the slot is not empty
+	 */
+	uint64_t occupied[LEVELS];
 
-	/** A list of all pending timers
+	/** Number of timers in the wheel
 	 */
-	TimerMap Timers;
+	size_t count;
+
+	/** The next tick to process; all timers due before this tick have been ticked
+	 */
+	uint64_t nexttick;
+
+	/** The current time in milliseconds. This is not wall clock time: it only ever moves forward,
+	 * by the amount the wall clock has moved forward since TickTimers() was last called.
+	 */
+	uint64_t now;
+
+	/** The wall clock time in milliseconds when TickTimers() was last called
+	 */
+	uint64_t lastrealtime;
+
+	/** Link a timer into the slot where it belongs, based on its trigger time
+	 * @param t Timer to link
+	 */
+	void Link(Timer* t);
+
+	/** Unlink a timer from its slot
+	 * @param t Timer to unlink
+	 */
+	void Unlink(Timer* t);
+
+	/** Move all timers in a slot down to the lower levels of the wheel
+	 * @param level Level of the slot
+	 * @param pos Position of the slot on the level
+	 */
+	void Cascade(unsigned int level, unsigned int pos);
 
  public:
+	TimerManager();
+
+	/** Get the current time in milliseconds on the clock used for the trigger time of timers
+	 */
+	uint64_t GetTime() const { return now; }
+
 	/** Tick all pending Timers
 	 * @param TIME the current system time
 	 */
@@ -138,4 +205,12 @@ class CoreExport TimerManager
 	 * @param T an Timer derived class to remove
 	 */
 	void DelTimer(Timer* T);
+
+	/** Get the number of milliseconds until the next timer is due to tick.
+	 * This is exact for timers due in the next few milliseconds and never later
+	 * than the actual time for timers which are further away.
+	 * @param maxwait The maximum number of milliseconds to return
+	 * @return Number of milliseconds to wait before calling TickTimers() again
+	 */
+	unsigned int GetNextTimeout(unsigned int maxwait) const;
 };
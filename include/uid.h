@@ -56,4 +56,85 @@ class CoreExport UIDGenerator
 	 * @return A valid SID
 	 */
 	static std::string GenerateSID(const std::string& servername, const std::string& serverdesc);
+
+	/** Pack a SID or a UUID into an integer. Every letter or digit takes 6 bits and is packed as a
+	 * nonzero value, so the packed values of SIDs and UUIDs never collide. Letters are case insensitive,
+	 * like the keys of UserManager::uuidlist.
+	 * @param uid The SID or UUID to pack
+	 * @return The packed value, or 0 if uid is not 3 or UUID_LENGTH characters long or has a character
+	 * that is not a letter or a digit
+	 */
+	static uint64_t Pack(const std::string& uid);
+};
+
+/** Index of users by their packed UUID and of server users by their packed SID, see UIDGenerator::Pack().
+ * This is a flat open addressing hash table with linear probing, users are looked up by UUID for
+ * almost every line received from other servers.
+ */
+class CoreExport UIDIndex
+{
+	/** An entry in the table, key is 0 if the slot is unused
+	 */
+	struct Slot
+	{
+		uint64_t key;
+		User* user;
+	};
+
+	/** The table, its size is always a power of two and it is kept at most half full
+	 */
+	std::vector<Slot> slots;
+
+	/** Number of users in the index
+	 */
+	size_t count;
+
+	/** The hash of a key is shifted right by this many bits to get the slot where its search starts
+	 */
+	unsigned int shift;
+
+	/** Get the slot where the search for a key starts
+	 * @param key The key to search for
+	 * @return Index of the first slot to look at
+	 */
+	size_t GetHome(uint64_t key) const { return static_cast<size_t>((key * 0x9E3779B97F4A7C15ULL) >> shift); }
+
+	/** Double the size of the table
+	 */
+	void Grow();
+
+ public:
+	UIDIndex();
+
+	/** Find a user
+	 * @param key Packed UUID or SID of the user
+	 * @return The user, or NULL if no user has the given key
+	 */
+	User* Find(uint64_t key) const
+	{
+		const size_t mask = slots.size() - 1;
+		for (size_t i = GetHome(key); slots[i].key; i = (i + 1) & mask)
+		{
+			if (slots[i].key == key)
+				return slots[i].user;
+		}
+		return NULL;
+	}
+
+	/** Add a user to the index
+	 * @param key Packed UUID or SID of the user, must not be 0
+	 * @param user The user to add
+	 * @return True if the user was added, false if another user has the same key
+	 */
+	bool Add(uint64_t key, User* user);
+
+	/** Remove a user from the index, does nothing if no user has the given key
+	 * @param key Packed UUID or SID of the user
+	 */
+	void Remove(uint64_t key);
+
+	/** Get the number of users in the index
+	 * @return Number of users in the index
+	 */
+	size_t size() const { return count; }
 };
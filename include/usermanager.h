@@ -43,6 +43,10 @@ class CoreExport UserManager : public fakederef<UserManager>
 	*/
 	typedef insp::intrusive_list<LocalUser> LocalList;
 
+	/** Container that maps the full IP addresses of local users to the users
+	 */
+	typedef std::multimap<irc::sockets::cidr_mask, LocalUser*> LocalIPMap;
+
  private:
 	/** Map of IP addresses for clone counting
 	 */
@@ -56,6 +60,16 @@ class CoreExport UserManager : public fakederef<UserManager>
 	 */
 	LocalList local_users;
 
+	/** Local clients keyed by their IP address, for finding the local clients in a CIDR range
+	 */
+	LocalIPMap local_ips;
+
+	/** Remove a user who is being quit from the user lists and from their channels
+	 * @param user The user to remove
+	 * @param operreason The quit reason shown to opers
+	 */
+	void FinishQuit(User* user, const std::string& operreason);
+
  public:
 	/** Constructor, initializes variables
 	 */
@@ -74,6 +88,11 @@ class CoreExport UserManager : public fakederef<UserManager>
 	 */
 	user_hash uuidlist;
 
+	/** The users in uuidlist whose UUID (or SID, for server users) can be packed, by their packed UUID.
+	 * Used by InspIRCd::FindUUID(), updated along with uuidlist.
+	 */
+	UIDIndex uuidindex;
+
 	/** Oper list, a vector containing all local and remote opered users
 	 */
 	OperList all_opers;
@@ -89,10 +108,6 @@ class CoreExport UserManager : public fakederef<UserManager>
      */
 	void GarbageCollect();
 
-	/** Perform background user events such as PING checks
-	 */
-	void DoBackgroundUserStuff();
-
 	/** Returns true when all modules have done pre-registration checks on a user
 	 * @param user The user to verify
 	 * @return True if all modules have finished checking this user
@@ -118,6 +133,15 @@ class CoreExport UserManager : public fakederef<UserManager>
 	 */
 	void QuitUser(User* user, const std::string& quitreason, const std::string* operreason = NULL);
 
+	/** Disconnect many users at once, e.g. all users of a server that split.
+	 * Every channel of the users is walked only once and each local user who shares a channel with any
+	 * of them is sent all of their QUIT lines in one write. The users are deleted a few at a time later.
+	 * @param users The users to remove
+	 * @param quitreason The quit reason to show to normal users
+	 * @param operreason The quit reason to show to opers, can be NULL if same as quitreason
+	 */
+	void QuitUsers(const std::vector<User*>& users, const std::string& quitreason, const std::string* operreason = NULL);
+
 	/** Add a user to the clone map
 	 * @param user The user to add
 	 */
@@ -178,6 +202,23 @@ class CoreExport UserManager : public fakederef<UserManager>
 	 */
 	const LocalList& GetLocalUsers() const { return local_users; }
 
+	/** Get the local users whose IP address is in a CIDR range
+	 * @param range The CIDR range to look up
+	 * @param users Vector to append the users to
+	 */
+	void GetLocalUsersInRange(const irc::sockets::cidr_mask& range, std::vector<LocalUser*>& users) const;
+
+	/** Add a local user to the IP address index, called when the IP address of the user is set
+	 * @param user The user to add
+	 */
+	void AddLocalIP(LocalUser* user);
+
+	/** Remove a local user from the IP address index, called before the IP address of the user changes
+	 * @param user The user to remove
+	 * @return True if the user was in the index
+	 */
+	bool RemoveLocalIP(LocalUser* user);
+
 	/** Send a server notice to all local users
 	 * @param text The text format string to send
 	 * @param ... The format arguments
@@ -85,6 +85,10 @@ struct CoreExport ConnectClass : public refcountbase
 	 */
 	std::string host;
 
+	/** Compiled form of host
+	 */
+	CompiledMask hostmatch;
+
 	/** Number of seconds between pings for this line
 	 */
 	unsigned int pingtime;
@@ -211,6 +215,33 @@ struct CoreExport ConnectClass : public refcountbase
 	}
 };
 
+/** A line of text which is sent to many local users at once, e.g. a channel message.
+ * The line is cropped to the maximum line length and terminated with CR/LF only once,
+ * when it is constructed, and the resulting buffer is shared by the send queues of
+ * all recipients instead of being copied for each one of them.
+ */
+class CoreExport SharedLine
+{
+	/** The serialized line, including the CR/LF terminator */
+	reference<SharedBuffer> buffer;
+
+ public:
+	/** Serialize a line for sending
+	 * @param text The line to send, without a CR/LF terminator
+	 */
+	SharedLine(const std::string& text);
+
+	/** Get the buffer holding the serialized line
+	 * @return The buffer holding the line, including the CR/LF terminator
+	 */
+	const reference<SharedBuffer>& GetBuffer() const { return buffer; }
+
+	/** Get the length of the serialized line
+	 * @return Length of the line in bytes, including the CR/LF terminator
+	 */
+	size_t length() const { return buffer->GetData().length(); }
+};
+
 /** Holds all information about a user
  * This class stores all information about a user connected to the irc server. Everything about a
  * connection is stored here primarily, from the user's socket ID (file descriptor) through to the
@@ -354,6 +385,11 @@ class CoreExport User : public Extensible
 	/** What type of user is this? */
 	const unsigned int usertype:2;
 
+	/** Incremented every time the nick, ident, host, displayed host or IP of the user changes.
+	 * Used to find out whether ban verdicts cached in Memberships are still valid.
+	 */
+	unsigned int maskgeneration;
+
 	/** Get client IP string from sockaddr, using static internal buffer
 	 * @return The IP string
 	 */
@@ -623,12 +659,29 @@ class CoreExport User : public Extensible
 	virtual CullResult cull();
 };
 
+/** Output to a local user which is too large to queue all at once, for example the reply to LIST
+ * on a network with many channels. It is written a part at a time, each time some of the sendq of
+ * the user has been written out, until it is complete.
+ */
+class CoreExport DeferredOutput
+{
+ public:
+	virtual ~DeferredOutput() { }
+
+	/** Write the next part of the output, called when data has been written out to the user.
+	 * When the output is complete the object must set LocalUser::deferred to NULL.
+	 * @param user The user the output is for
+	 */
+	virtual void Continue(LocalUser* user) = 0;
+};
+
 class CoreExport UserIOHandler : public StreamSocket
 {
  public:
 	LocalUser* const user;
 	UserIOHandler(LocalUser* me) : user(me) {}
 	void OnDataReady();
+	void OnDataWritten();
 	void OnError(BufferedSocketError error);
 
 	/** Adds to the user's write buffer.
@@ -637,6 +690,45 @@ class CoreExport UserIOHandler : public StreamSocket
 	 * @param data The data to add to the write buffer
 	 */
 	void AddWriteBuf(const std::string &data);
+
+	/** Adds a shared buffer to the user's write buffer without copying it.
+	 * The same sendq limits as for AddWriteBuf(const std::string&) apply.
+	 * @param data The buffer to add to the write buffer
+	 */
+	void AddWriteBuf(const reference<SharedBuffer>& data);
+
+ private:
+	/** Check whether adding the given number of bytes to the sendq would exceed the hard sendq limit.
+	 * If it would, the user is marked as quitting due to sendq exceeded.
+	 * @param len Number of bytes about to be added
+	 * @return True if the data may be added, false if it should be dropped
+	 */
+	bool CheckSendQ(size_t len);
+};
+
+/** Timer which does the periodic work for a local user: ping checks, the registration timeout,
+ * command flood penalty decay and resuming the processing of lines held back by the penalty.
+ * It is only scheduled for the next time something is due for the user, so registered users
+ * which are idle are only looked at when they have to be pinged.
+ */
+class CoreExport UserHousekeepingTimer : public Timer
+{
+	LocalUser* const user;
+
+ public:
+	UserHousekeepingTimer(LocalUser* me);
+	bool Tick(time_t currenttime) CXX11_OVERRIDE;
+
+	/** Make sure the timer ticks within the next second.
+	 * Called when the user has flood penalty which has to decay.
+	 */
+	void ScheduleSoon();
+
+	/** Schedule the next tick for the next thing due for the user.
+	 * Called after a tick and when the connect class, and with it the ping time, changes.
+	 * @param currenttime The current time
+	 */
+	void Reschedule(time_t currenttime);
 };
 
 typedef unsigned int already_sent_t;
@@ -649,6 +741,10 @@ class CoreExport LocalUser : public User, public InviteBase<LocalUser>, public i
 
 	UserIOHandler eh;
 
+	/** Timer doing the ping checks and other periodic work for this user
+	 */
+	UserHousekeepingTimer housekeeping;
+
 	/** Stats counter for bytes inbound
 	 */
 	unsigned int bytes_in;
@@ -720,6 +816,11 @@ class CoreExport LocalUser : public User, public InviteBase<LocalUser>, public i
 	 */
 	unsigned int CommandFloodPenalty;
 
+	/** Output which is being written to this user a part at a time, or NULL.
+	 * The object is owned by whoever created it, which must reset this when destroying it.
+	 */
+	DeferredOutput* deferred;
+
 	static already_sent_t already_sent_id;
 	already_sent_t already_sent;
 
@@ -748,6 +849,24 @@ class CoreExport LocalUser : public User, public InviteBase<LocalUser>, public i
 	void Write(const std::string& text);
 	void Write(const char*, ...) CUSTOM_PRINTF(2, 3);
 
+	/** Write a line which has already been serialized to this user.
+	 * The line is shared with any other users it is written to rather than copied.
+	 * @param line The line to write
+	 */
+	void Write(const SharedLine& line);
+
+	/** Write several lines which have already been serialized to this user in one go.
+	 * @param lines The lines to write, each one terminated by CR LF
+	 * @param count The number of lines in the buffer
+	 */
+	void WriteLines(const std::string& lines, unsigned int count);
+
+	/** Write several lines which have already been serialized and are shared with other users in one go.
+	 * @param lines Buffer holding the lines to write, each one terminated by CR LF
+	 * @param count The number of lines in the buffer
+	 */
+	void WriteLines(const reference<SharedBuffer>& lines, unsigned int count);
+
 	/** Returns the list of channels this user has been invited to but has not yet joined.
 	 * @return A list of channels the user is invited to
 	 */
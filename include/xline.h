@@ -22,6 +22,8 @@
 
 #pragma once
 
+class XLineIndex;
+
 /** XLine is the base class for ban lines such as G lines and K lines.
  * Modules may derive from this, and their xlines will automatically be
  * handled as expected by any protocol modules (e.g. m_spanningtree will
@@ -111,6 +113,26 @@ class CoreExport XLine : public classbase
 	 */
 	virtual const std::string& Displayable() = 0;
 
+	/** Ways XLineManager can index a line to avoid matching it against every user
+	 */
+	enum IndexKind
+	{
+		/** The line is matched against every user */
+		INDEX_NONE,
+		/** Every user the line matches has a real host or IP that matches the key (using MatchCIDR()) */
+		INDEX_HOST,
+		/** Every user the line matches has an IP that matches the key (using MatchCIDR()) */
+		INDEX_IP,
+		/** Every user and every string the line matches is a nick that matches the key (using Match()) */
+		INDEX_NICK
+	};
+
+	/** Returns how XLineManager can index this line. The key must not change while the line is added.
+	 * @param key Set to the mask the line is indexed by, unless INDEX_NONE is returned
+	 * @return The kind of index the line can be found by
+	 */
+	virtual IndexKind GetIndexKey(std::string& key) { return INDEX_NONE; }
+
 	/** Called when the xline has just been added.
 	 */
 	virtual void OnAdd() { }
@@ -159,6 +181,7 @@ class CoreExport KLine : public XLine
 	 */
 	KLine(time_t s_time, long d, std::string src, std::string re, std::string ident, std::string host)
 		: XLine(s_time, d, src, re, "K"), identmask(ident), hostmask(host)
+		, identmatch(ident, ascii_case_insensitive_map), hostmatch(host, ascii_case_insensitive_map)
 	{
 		matchtext = this->identmask;
 		matchtext.append("@").append(this->hostmask);
@@ -178,6 +201,8 @@ class CoreExport KLine : public XLine
 
 	virtual const std::string& Displayable();
 
+	virtual IndexKind GetIndexKey(std::string& key);
+
 	virtual bool IsBurstable();
 
 	/** Ident mask (ident part only)
@@ -188,6 +213,11 @@ class CoreExport KLine : public XLine
 	std::string hostmask;
 
 	std::string matchtext;
+
+	/** Compiled forms of identmask and hostmask
+	 */
+	CompiledMask identmatch;
+	CompiledMask hostmatch;
 };
 
 /** GLine class
@@ -205,6 +235,7 @@ class CoreExport GLine : public XLine
 	 */
 	GLine(time_t s_time, long d, std::string src, std::string re, std::string ident, std::string host)
 		: XLine(s_time, d, src, re, "G"), identmask(ident), hostmask(host)
+		, identmatch(ident, ascii_case_insensitive_map), hostmatch(host, ascii_case_insensitive_map)
 	{
 		matchtext = this->identmask;
 		matchtext.append("@").append(this->hostmask);
@@ -224,6 +255,8 @@ class CoreExport GLine : public XLine
 
 	virtual const std::string& Displayable();
 
+	virtual IndexKind GetIndexKey(std::string& key);
+
 	/** Ident mask (ident part only)
 	 */
 	std::string identmask;
@@ -232,6 +265,11 @@ class CoreExport GLine : public XLine
 	std::string hostmask;
 
 	std::string matchtext;
+
+	/** Compiled forms of identmask and hostmask
+	 */
+	CompiledMask identmatch;
+	CompiledMask hostmatch;
 };
 
 /** ELine class
@@ -249,6 +287,7 @@ class CoreExport ELine : public XLine
 	 */
 	ELine(time_t s_time, long d, std::string src, std::string re, std::string ident, std::string host)
 		: XLine(s_time, d, src, re, "E"), identmask(ident), hostmask(host)
+		, identmatch(ident, ascii_case_insensitive_map), hostmatch(host, ascii_case_insensitive_map)
 	{
 		matchtext = this->identmask;
 		matchtext.append("@").append(this->hostmask);
@@ -268,6 +307,8 @@ class CoreExport ELine : public XLine
 
 	virtual const std::string& Displayable();
 
+	virtual IndexKind GetIndexKey(std::string& key);
+
 	/** Ident mask (ident part only)
 	 */
 	std::string identmask;
@@ -276,6 +317,11 @@ class CoreExport ELine : public XLine
 	std::string hostmask;
 
 	std::string matchtext;
+
+	/** Compiled forms of identmask and hostmask
+	 */
+	CompiledMask identmatch;
+	CompiledMask hostmatch;
 };
 
 /** ZLine class
@@ -291,7 +337,7 @@ class CoreExport ZLine : public XLine
 	 * @param ip IP to match
 	 */
 	ZLine(time_t s_time, long d, std::string src, std::string re, std::string ip)
-		: XLine(s_time, d, src, re, "Z"), ipaddr(ip)
+		: XLine(s_time, d, src, re, "Z"), ipaddr(ip), ipmatch(ip)
 	{
 	}
 
@@ -309,9 +355,15 @@ class CoreExport ZLine : public XLine
 
 	virtual const std::string& Displayable();
 
+	virtual IndexKind GetIndexKey(std::string& key);
+
 	/** IP mask (no ident part)
 	 */
 	std::string ipaddr;
+
+	/** Compiled form of ipaddr
+	 */
+	CompiledMask ipmatch;
 };
 
 /** QLine class
@@ -327,7 +379,7 @@ class CoreExport QLine : public XLine
 	 * @param nickname Nickname to match
 	 */
 	QLine(time_t s_time, long d, std::string src, std::string re, std::string nickname)
-		: XLine(s_time, d, src, re, "Q"), nick(nickname)
+		: XLine(s_time, d, src, re, "Q"), nick(nickname), nickmatch(nickname)
 	{
 	}
 
@@ -344,9 +396,15 @@ class CoreExport QLine : public XLine
 
 	virtual const std::string& Displayable();
 
+	virtual IndexKind GetIndexKey(std::string& key);
+
 	/** Nickname mask
 	 */
 	std::string nick;
+
+	/** Compiled form of nick
+	 */
+	CompiledMask nickmatch;
 };
 
 /** XLineFactory is used to generate an XLine pointer, given just the
@@ -402,17 +460,93 @@ class CoreExport XLineManager
 	 */
 	std::vector<XLine *> pending_lines;
 
+	/** State of the background job that applies lines to every local user, a few users per main loop iteration
+	 */
+	struct ApplyJob
+	{
+		/** Lines being applied, empty if the job is not running. Lines removed while the job is
+		 * running are set to NULL so the remaining ones keep their position.
+		 */
+		std::vector<XLine*> lines;
+
+		/** Number of lines in lines which have not been removed
+		 */
+		size_t remaining;
+
+		/** UUIDs of the local users that were connected when the job started
+		 */
+		std::vector<std::string> users;
+
+		/** Position of the next user to check in users
+		 */
+		size_t pos;
+
+		/** Number of users the lines were applied to
+		 */
+		unsigned int matches;
+
+		/** Number of main loop iterations the job has run in
+		 */
+		unsigned int iterations;
+
+		/** Time the job started, from InspIRCd::GetMonotonicClock()
+		 */
+		uint64_t start;
+
+		/** Time progress of the job was last reported to opers
+		 */
+		time_t lastreport;
+	};
+
+	/** The running ApplyJob
+	 */
+	ApplyJob applyjob;
+
+	/** Lines waiting for the running ApplyJob to finish before they are applied to every local user
+	 */
+	std::vector<XLine*> queued_lines;
+
+	/** Number of user and line pairs the ApplyJob checks per main loop iteration
+	 */
+	static const unsigned int APPLY_SLICE = 2000;
+
+	/** Start applying the queued lines to every local user
+	 */
+	void StartApplyJob();
+
+	/** Stop applying a line that is about to be removed
+	 * @param line The line to stop applying
+	 */
+	void CancelApply(XLine* line);
+
 	/** Current xline factories
 	 */
 	XLineFactMap line_factory;
 
 	/** Container of all lines, this is a map of maps which
-	 * allows for fast lookup for add/remove of a line, and
-	 * the shortest possible timed O(n) for checking a user
-	 * against a line.
+	 * allows for fast lookup for add/remove of a line.
 	 */
 	XLineContainer lookup_lines;
 
+	/** Indexes of the lines of each type, used for checking a user or a pattern against the lines
+	 * without matching every line, see XLine::GetIndexKey()
+	 */
+	std::map<std::string, XLineIndex*> line_index;
+
+	/** Lines with a duration ordered by expiry time, the first element expires first
+	 */
+	std::set<std::pair<time_t, XLine*> > expiry_queue;
+
+	/** Add a line to the index of its type and to the expiry queue
+	 * @param line The line to add
+	 */
+	void AddToIndex(XLine* line);
+
+	/** Remove a line from the index of its type and from the expiry queue
+	 * @param line The line to remove
+	 */
+	void RemoveFromIndex(XLine* line);
+
  public:
 
 	/** Constructor
@@ -509,12 +643,30 @@ class CoreExport XLineManager
 	 */
 	void ExpireLine(ContainerIter container, LookupIter item);
 
+	/** Expire all lines whose expiry time has passed.
+	 * This is called every second and before lines are looked up.
+	 */
+	void ExpireLines();
+
 	/** Apply any new lines that are pending to be applied.
 	 * This will only apply lines in the pending_lines list, to save on
 	 * CPU time.
+	 * Lines matching a range of IP addresses are applied to the local users
+	 * in that range immediately. Other lines are applied to every local user
+	 * in the background by ContinueApplyLines().
 	 */
 	void ApplyLines();
 
+	/** Apply the lines being applied in the background to the next few local users.
+	 * This is called on every iteration of the main loop.
+	 */
+	void ContinueApplyLines();
+
+	/** Check whether lines are being applied in the background
+	 * @return True if ContinueApplyLines() has work to do
+	 */
+	bool IsApplyingLines() const { return !applyjob.lines.empty(); }
+
 	/** Handle /STATS for a given type.
 	 * NOTE: Any items in the list for this particular line type which have expired
 	 * will be expired and removed before the list is displayed.
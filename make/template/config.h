@@ -35,4 +35,5 @@
  %target include/config.h
  %define HAS_CLOCK_GETTIME
  %define HAS_EVENTFD
+ %define SOCKETENGINE_HAS_IO
 #endif
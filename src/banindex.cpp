@@ -0,0 +1,232 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "inspircd.h"
+
+namespace
+{
+	/** Check whether a host part of a ban mask is a CIDR mask, using the same rules as irc::sockets::MatchCIDR()
+	 */
+	bool IsCIDR(const std::string& suffix)
+	{
+		const std::string::size_type per_pos = suffix.rfind('/');
+		return ((per_pos != std::string::npos) && (per_pos != suffix.length()-1)
+			&& (suffix.find_first_not_of("0123456789", per_pos+1) == std::string::npos)
+			&& (suffix.find_first_not_of("0123456789abcdefABCDEF.:") >= per_pos));
+	}
+
+	inline unsigned int GetBit(const unsigned char* bits, unsigned int bit)
+	{
+		return (bits[bit / 8] >> (7 - (bit % 8))) & 1;
+	}
+}
+
+BanIndex::Entry::Entry(const std::string& mask, std::string::size_type at)
+	: prefix(mask, 0, at)
+	, suffix(mask, at + 1)
+	, anyprefix((prefix == "*") || (prefix == "*!*"))
+	, prefixmatch(prefix)
+	, suffixmatch(suffix)
+{
+}
+
+void BanIndex::Clear()
+{
+	entries.clear();
+	exact.clear();
+	wildcards.clear();
+	others.clear();
+	nodes.assign(2, TrieNode());
+}
+
+void BanIndex::AddCIDR(const irc::sockets::cidr_mask& cidr, unsigned int ban)
+{
+	unsigned int node = (cidr.type == AF_INET) ? 0 : 1;
+	for (unsigned int bit = 0; bit < cidr.length; ++bit)
+	{
+		const unsigned int dir = GetBit(cidr.bits, bit);
+		if (!nodes[node].children[dir])
+		{
+			nodes[node].children[dir] = nodes.size();
+			nodes.push_back(TrieNode());
+		}
+		node = nodes[node].children[dir];
+	}
+	nodes[node].bans.push_back(ban);
+}
+
+void BanIndex::Add(const std::string& mask)
+{
+	// Extbans and masks without an '@' never match in MatchMask()
+	if ((mask.length() <= 2) || (mask[1] == ':'))
+		return;
+
+	std::string::size_type at = mask.find('@');
+	if (at == std::string::npos)
+		return;
+
+	// irc::sockets::MatchCIDR() treats another '@' specially, leave those masks to MatchMask()
+	if (mask.find('@', at + 1) != std::string::npos)
+	{
+		others.push_back(mask);
+		return;
+	}
+
+	const unsigned int ban = entries.size();
+	entries.push_back(Entry(mask, at));
+	const std::string& suffix = entries.back().suffix;
+	if (suffix.find_first_of("*?") != std::string::npos)
+	{
+		wildcards.push_back(ban);
+		return;
+	}
+
+	// Without wildcards the host part can only match a host, displayed host or IP equal to it
+	exact.insert(std::make_pair(suffix, ban));
+
+	if (IsCIDR(suffix))
+	{
+		irc::sockets::cidr_mask cidr(suffix);
+		if ((cidr.type == AF_INET) || (cidr.type == AF_INET6))
+			AddCIDR(cidr, ban);
+	}
+}
+
+bool BanIndex::MatchPrefix(const Entry& entry, const std::string& nickident) const
+{
+	return ((entry.anyprefix) || (entry.prefixmatch.Match(nickident)));
+}
+
+bool BanIndex::MatchExact(const std::string& host, const std::string& nickident) const
+{
+	std::pair<ExactMap::const_iterator, ExactMap::const_iterator> range = exact.equal_range(host);
+	for (ExactMap::const_iterator i = range.first; i != range.second; ++i)
+	{
+		if (MatchPrefix(entries[i->second], nickident))
+			return true;
+	}
+	return false;
+}
+
+bool BanIndex::MatchTrie(User* user, const std::string& nickident) const
+{
+	const irc::sockets::cidr_mask ip(user->client_sa, 128);
+	if ((ip.type != AF_INET) && (ip.type != AF_INET6))
+		return false;
+
+	unsigned int node = (ip.type == AF_INET) ? 0 : 1;
+	for (unsigned int bit = 0; ; ++bit)
+	{
+		const TrieNode& current = nodes[node];
+		for (std::vector<unsigned int>::const_iterator i = current.bans.begin(); i != current.bans.end(); ++i)
+		{
+			if (MatchPrefix(entries[*i], nickident))
+				return true;
+		}
+
+		if (bit == ip.length)
+			return false;
+
+		node = current.children[GetBit(ip.bits, bit)];
+		if (!node)
+			return false;
+	}
+}
+
+bool BanIndex::Matches(User* user) const
+{
+	if ((entries.empty()) && (others.empty()))
+		return false;
+
+	const std::string nickident = user->nick + "!" + user->ident;
+	const std::string& ip = user->GetIPString();
+	if (!exact.empty())
+	{
+		if ((MatchExact(user->host, nickident)) || (MatchExact(ip, nickident)))
+			return true;
+		if ((user->dhost != user->host) && (MatchExact(user->dhost, nickident)))
+			return true;
+	}
+
+	if ((nodes.size() > 2) && (MatchTrie(user, nickident)))
+		return true;
+
+	for (std::vector<unsigned int>::const_iterator i = wildcards.begin(); i != wildcards.end(); ++i)
+	{
+		// A host part with wildcards is never a valid CIDR mask so the IP is matched as a string
+		const Entry& entry = entries[*i];
+		if ((MatchPrefix(entry, nickident)) && ((entry.suffixmatch.Match(user->host)) ||
+			(entry.suffixmatch.Match(user->dhost)) || (entry.suffixmatch.Match(ip))))
+			return true;
+	}
+
+	for (std::vector<std::string>::const_iterator i = others.begin(); i != others.end(); ++i)
+	{
+		if (MatchMask(user, *i))
+			return true;
+	}
+	return false;
+}
+
+bool BanIndex::MatchesHost(User* user, const std::string& host) const
+{
+	if ((entries.empty()) && (others.empty()))
+		return false;
+
+	const std::string nickident = user->nick + "!" + user->ident;
+	if ((!exact.empty()) && (MatchExact(host, nickident)))
+		return true;
+
+	for (std::vector<unsigned int>::const_iterator i = wildcards.begin(); i != wildcards.end(); ++i)
+	{
+		const Entry& entry = entries[*i];
+		if ((MatchPrefix(entry, nickident)) && (entry.suffixmatch.Match(host)))
+			return true;
+	}
+
+	const std::string fullhost = nickident + "@" + host;
+	for (std::vector<std::string>::const_iterator i = others.begin(); i != others.end(); ++i)
+	{
+		if (InspIRCd::Match(fullhost, *i))
+			return true;
+	}
+	return false;
+}
+
+bool BanIndex::MatchMask(User* user, const std::string& mask)
+{
+	// extbans are matched by modules, if this is one it obviously didn't match
+	if ((mask.length() <= 2) || (mask[1] == ':'))
+		return false;
+
+	std::string::size_type at = mask.find('@');
+	if (at == std::string::npos)
+		return false;
+
+	const std::string nickIdent = user->nick + "!" + user->ident;
+	std::string prefix(mask, 0, at);
+	if (InspIRCd::Match(nickIdent, prefix, NULL))
+	{
+		std::string suffix(mask, at + 1);
+		if (InspIRCd::Match(user->host, suffix, NULL) ||
+			InspIRCd::Match(user->dhost, suffix, NULL) ||
+			InspIRCd::MatchCIDR(user->GetIPString(), suffix, NULL))
+			return true;
+	}
+	return false;
+}
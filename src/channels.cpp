@@ -38,15 +38,19 @@ namespace
 }
 
 Channel::Channel(const std::string &cname, time_t ts)
-	: name(cname), age(ts), topicset(0)
+	: bangeneration(1), banindexgeneration(0), name(cname), age(ts), topicset(0)
 {
 	if (!ServerInstance->chanlist.insert(std::make_pair(cname, this)).second)
 		throw CoreException("Cannot create duplicate channel " + cname);
+	modestringvalid[0] = modestringvalid[1] = false;
 }
 
 void Channel::SetMode(ModeHandler* mh, bool on)
 {
 	modes[mh->GetId()] = on;
+
+	// Parameter modes also come here when their parameter changes
+	modestringvalid[0] = modestringvalid[1] = false;
 }
 
 void Channel::SetTopic(User* u, const std::string& ntopic)
@@ -61,11 +65,12 @@ void Channel::SetTopic(User* u, const std::string& ntopic)
 
 Membership* Channel::AddUser(User* user)
 {
-	std::pair<MemberMap::iterator, bool> ret = userlist.insert(std::make_pair(user, insp::aligned_storage<Membership>()));
+	std::pair<MemberMap::iterator, bool> ret = userlist.insert(std::make_pair(user, static_cast<Membership*>(NULL)));
 	if (!ret.second)
 		return NULL;
 
-	Membership* memb = new(ret.first->second) Membership(user, this);
+	Membership* memb = new Membership(user, this);
+	ret.first->second = memb;
 	return memb;
 }
 
@@ -101,7 +106,7 @@ void Channel::DelUser(const MemberMap::iterator& membiter)
 {
 	Membership* memb = membiter->second;
 	memb->cull();
-	memb->~Membership();
+	delete memb;
 	userlist.erase(membiter);
 
 	// If this channel became empty then it should be removed
@@ -358,6 +363,115 @@ Membership* Channel::ForceJoin(User* user, const std::string* privs, bool bursti
 	return memb;
 }
 
+namespace
+{
+	/** Send the JOIN lines of new members of a channel to its local members. Local members who a module
+	 * hid at least one of the joins from get a buffer of their own, everyone else shares one buffer.
+	 * @param chan The channel the users joined
+	 * @param lines The JOIN lines, each one terminated by CR LF, cleared after sending
+	 * @param excepts The users who must not see each of the lines, cleared after sending
+	 */
+	void SendJoinLines(Channel* chan, std::vector<std::string>& lines, std::vector<CUList>& excepts)
+	{
+		if (lines.empty())
+			return;
+
+		// Mark the users who don't see every line
+		const already_sent_t newid = ++LocalUser::already_sent_id;
+		for (std::vector<CUList>::const_iterator i = excepts.begin(); i != excepts.end(); ++i)
+		{
+			for (CUList::const_iterator j = i->begin(); j != i->end(); ++j)
+			{
+				LocalUser* curr = IS_LOCAL(*j);
+				if (curr)
+					curr->already_sent = newid;
+			}
+		}
+
+		std::string buffer;
+		for (std::vector<std::string>::const_iterator i = lines.begin(); i != lines.end(); ++i)
+			buffer.append(*i);
+		const reference<SharedBuffer> shared = new SharedBuffer(buffer);
+
+		const Channel::MemberMap& userlist = chan->GetUsers();
+		for (Channel::MemberMap::const_iterator i = userlist.begin(); i != userlist.end(); ++i)
+		{
+			LocalUser* curr = IS_LOCAL(i->first);
+			if (!curr)
+				continue;
+
+			if (curr->already_sent != newid)
+			{
+				curr->WriteLines(shared, lines.size());
+				continue;
+			}
+
+			unsigned int count = 0;
+			buffer.clear();
+			for (size_t j = 0; j < lines.size(); j++)
+			{
+				if (excepts[j].find(curr) == excepts[j].end())
+				{
+					buffer.append(lines[j]);
+					count++;
+				}
+			}
+
+			if (count)
+				curr->WriteLines(buffer, count);
+		}
+
+		lines.clear();
+		excepts.clear();
+	}
+}
+
+void Channel::ForceJoinUsers(const std::vector<User*>& users, bool bursting, std::vector<Membership*>& joined)
+{
+	// JOIN lines that were not sent yet and the users modules excepted from seeing them
+	std::vector<std::string> lines;
+	std::vector<CUList> excepts;
+	const std::string::size_type maxlen = ServerInstance->Config->Limits.MaxLine - 2;
+
+	joined.clear();
+	joined.reserve(users.size());
+	for (std::vector<User*>::const_iterator i = users.begin(); i != users.end(); ++i)
+	{
+		User* user = *i;
+		if (IS_LOCAL(user))
+		{
+			// Local users get the topic and the names list when they join, send them the joins before theirs first
+			SendJoinLines(this, lines, excepts);
+			joined.push_back(ForceJoin(user, NULL, bursting));
+			continue;
+		}
+
+		Membership* memb = (IS_SERVER(user) ? NULL : this->AddUser(user));
+		joined.push_back(memb);
+		if (!memb)
+			continue;
+
+		user->chans.push_front(memb);
+
+		excepts.push_back(CUList());
+		FOREACH_MOD(OnUserJoin, (memb, bursting, false, excepts.back()));
+
+		lines.push_back(":" + user->GetFullHost() + " JOIN :" + this->name);
+		if (lines.back().length() > maxlen)
+			lines.back().erase(maxlen);
+		lines.back().append("\r\n");
+	}
+
+	SendJoinLines(this, lines, excepts);
+
+	for (std::vector<Membership*>::const_iterator i = joined.begin(); i != joined.end(); ++i)
+	{
+		Membership* memb = *i;
+		if ((memb) && (!IS_LOCAL(memb->user)))
+			FOREACH_MOD(OnPostJoin, (memb));
+	}
+}
+
 bool Channel::IsBanned(User* user)
 {
 	ModResult result;
@@ -366,15 +480,80 @@ bool Channel::IsBanned(User* user)
 	if (result != MOD_RES_PASSTHRU)
 		return (result == MOD_RES_DENY);
 
-	ListModeBase* banlm = static_cast<ListModeBase*>(*ban);
-	const ListModeBase::ModeList* bans = banlm->GetList(this);
-	if (bans)
+	return MatchesBanList(user);
+}
+
+bool Channel::GetDefaultBanMatch(User* user)
+{
+	if (banindexgeneration != bangeneration)
+	{
+		banindex.Clear();
+		ListModeBase* banlm = static_cast<ListModeBase*>(*ban);
+		const ListModeBase::ModeList* bans = banlm->GetList(this);
+		if (bans)
+		{
+			for (ListModeBase::ModeList::const_iterator it = bans->begin(); it != bans->end(); ++it)
+				banindex.Add(it->mask);
+		}
+		banindexgeneration = bangeneration;
+	}
+
+	Membership* memb = GetUser(user);
+	if (!memb)
+	{
+		if (banindex.Matches(user))
+			return true;
+	}
+	else
 	{
-		for (ListModeBase::ModeList::const_iterator it = bans->begin(); it != bans->end(); it++)
+		if ((memb->bangeneration != bangeneration) || (memb->banmaskgeneration != user->maskgeneration))
 		{
-			if (CheckBan(user, it->mask))
-				return true;
+			memb->banned = banindex.Matches(user);
+			memb->bangeneration = bangeneration;
+			memb->banmaskgeneration = user->maskgeneration;
 		}
+		if (memb->banned)
+			return true;
+	}
+
+	// Hosts given by modules are not cached as modules can change them at any time
+	if (ServerInstance->Modules->EventHandlers[I_OnGetBanHosts].empty())
+		return false;
+
+	std::vector<std::string> hosts;
+	FOREACH_MOD(OnGetBanHosts, (user, hosts));
+	for (std::vector<std::string>::const_iterator i = hosts.begin(); i != hosts.end(); ++i)
+	{
+		if (banindex.MatchesHost(user, *i))
+			return true;
+	}
+	return false;
+}
+
+bool Channel::MatchesBanList(User* user)
+{
+	ListModeBase* banlm = static_cast<ListModeBase*>(*ban);
+	const ListModeBase::ModeList* bans = banlm->GetList(this);
+	if ((!bans) || (bans->empty()))
+		return false;
+
+	if (GetDefaultBanMatch(user))
+		return true;
+
+	if (ServerInstance->Modules->EventHandlers[I_OnCheckBan].empty())
+		return false;
+
+	// Only extbans are left for modules to match, the other masks are all in the index
+	for (ListModeBase::ModeList::const_iterator it = bans->begin(); it != bans->end(); ++it)
+	{
+		const std::string& mask = it->mask;
+		if ((mask.length() <= 2) || (mask[1] != ':'))
+			continue;
+
+		ModResult result;
+		FIRST_MOD_RESULT(OnCheckBan, result, (user, this, mask));
+		if (result == MOD_RES_DENY)
+			return true;
 	}
 	return false;
 }
@@ -386,22 +565,17 @@ bool Channel::CheckBan(User* user, const std::string& mask)
 	if (result != MOD_RES_PASSTHRU)
 		return (result == MOD_RES_DENY);
 
-	// extbans were handled above, if this is one it obviously didn't match
-	if ((mask.length() <= 2) || (mask[1] == ':'))
-		return false;
+	if (BanIndex::MatchMask(user, mask))
+		return true;
 
-	std::string::size_type at = mask.find('@');
-	if (at == std::string::npos)
+	if ((mask.length() <= 2) || (mask[1] == ':') || (ServerInstance->Modules->EventHandlers[I_OnGetBanHosts].empty()))
 		return false;
 
-	const std::string nickIdent = user->nick + "!" + user->ident;
-	std::string prefix(mask, 0, at);
-	if (InspIRCd::Match(nickIdent, prefix, NULL))
+	std::vector<std::string> hosts;
+	FOREACH_MOD(OnGetBanHosts, (user, hosts));
+	for (std::vector<std::string>::const_iterator i = hosts.begin(); i != hosts.end(); ++i)
 	{
-		std::string suffix(mask, at + 1);
-		if (InspIRCd::Match(user->host, suffix, NULL) ||
-			InspIRCd::Match(user->dhost, suffix, NULL) ||
-			InspIRCd::MatchCIDR(user->GetIPString(), suffix, NULL))
+		if (InspIRCd::Match(user->nick + "!" + user->ident + "@" + *i, mask))
 			return true;
 	}
 	return false;
@@ -414,17 +588,7 @@ ModResult Channel::GetExtBanStatus(User *user, char type)
 	if (rv != MOD_RES_PASSTHRU)
 		return rv;
 
-	ListModeBase* banlm = static_cast<ListModeBase*>(*ban);
-	const ListModeBase::ModeList* bans = banlm->GetList(this);
-	if (bans)
-	{
-		for (ListModeBase::ModeList::const_iterator it = bans->begin(); it != bans->end(); ++it)
-		{
-			if (CheckBan(user, it->mask))
-				return MOD_RES_DENY;
-		}
-	}
-	return MOD_RES_PASSTHRU;
+	return (MatchesBanList(user) ? MOD_RES_DENY : MOD_RES_PASSTHRU);
 }
 
 /* Channel::PartUser
@@ -472,12 +636,13 @@ void Channel::WriteChannel(User* user, const char* text, ...)
 
 void Channel::WriteChannel(User* user, const std::string &text)
 {
-	const std::string message = ":" + user->GetFullHost() + " " + text;
+	const SharedLine message(":" + user->GetFullHost() + " " + text);
 
 	for (MemberMap::iterator i = userlist.begin(); i != userlist.end(); i++)
 	{
-		if (IS_LOCAL(i->first))
-			i->first->Write(message);
+		LocalUser* curr = IS_LOCAL(i->first);
+		if (curr)
+			curr->Write(message);
 	}
 }
 
@@ -490,12 +655,13 @@ void Channel::WriteChannelWithServ(const std::string& ServName, const char* text
 
 void Channel::WriteChannelWithServ(const std::string& ServName, const std::string &text)
 {
-	const std::string message = ":" + (ServName.empty() ? ServerInstance->Config->ServerName : ServName) + " " + text;
+	const SharedLine message(":" + (ServName.empty() ? ServerInstance->Config->ServerName : ServName) + " " + text);
 
 	for (MemberMap::iterator i = userlist.begin(); i != userlist.end(); i++)
 	{
-		if (IS_LOCAL(i->first))
-			i->first->Write(message);
+		LocalUser* curr = IS_LOCAL(i->first);
+		if (curr)
+			curr->Write(message);
 	}
 }
 
@@ -531,15 +697,18 @@ void Channel::RawWriteAllExcept(User* user, bool serversource, char status, CULi
 		if (mh)
 			minrank = mh->GetPrefixRank();
 	}
+	// Serialize the line once, all recipients share the same buffer
+	const SharedLine line(out);
 	for (MemberMap::iterator i = userlist.begin(); i != userlist.end(); i++)
 	{
-		if (IS_LOCAL(i->first) && (except_list.find(i->first) == except_list.end()))
+		LocalUser* curr = IS_LOCAL(i->first);
+		if (curr && (except_list.find(curr) == except_list.end()))
 		{
 			/* User doesn't have the status we're after */
 			if (minrank && i->second->getRank() < minrank)
 				continue;
 
-			i->first->Write(out);
+			curr->Write(line);
 		}
 	}
 }
@@ -553,9 +722,11 @@ void Channel::WriteAllExceptSender(User* user, bool serversource, char status, c
 
 const char* Channel::ChanModes(bool showkey)
 {
-	static std::string scratch;
-	std::string sparam;
+	std::string& scratch = modestrings[showkey];
+	if (modestringvalid[showkey])
+		return scratch.c_str();
 
+	std::string sparam;
 	scratch.clear();
 
 	/* This was still iterating up to 190, Channel::modes is only 64 elements -- Om */
@@ -583,6 +754,7 @@ const char* Channel::ChanModes(bool showkey)
 	}
 
 	scratch += sparam;
+	modestringvalid[showkey] = true;
 	return scratch.c_str();
 }
 
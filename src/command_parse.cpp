@@ -107,11 +107,140 @@ bool CommandParser::LoopCall(User* user, Command* handler, const std::vector<std
 	return true;
 }
 
+namespace
+{
+	/** Hash a command name, ignoring the case of ASCII letters (FNV-1a) */
+	uint32_t HashCommandName(const std::string& name)
+	{
+		uint32_t hash = 2166136261U;
+		for (std::string::const_iterator i = name.begin(); i != name.end(); ++i)
+		{
+			unsigned char chr = *i;
+			if (chr >= 'a' && chr <= 'z')
+				chr -= 'a' - 'A';
+			hash = (hash ^ chr) * 16777619U;
+		}
+		return hash;
+	}
+
+	/** Get the cmdtable slot of a command from the hash of its name and the displacement of its bucket */
+	uint32_t GetCommandSlot(uint32_t hash, unsigned int displacement)
+	{
+		uint32_t slot = hash ^ (displacement * 0x9E3779B9U);
+		slot ^= slot >> 16;
+		slot *= 0x85EBCA6BU;
+		slot ^= slot >> 13;
+		slot *= 0xC2B2AE35U;
+		slot ^= slot >> 16;
+		return slot;
+	}
+
+	/** Compare two command names, ignoring the case of ASCII letters */
+	bool CommandNameEquals(const std::string& name1, const std::string& name2)
+	{
+		if (name1.length() != name2.length())
+			return false;
+
+		for (std::string::size_type i = 0; i < name1.length(); ++i)
+		{
+			unsigned char chr1 = name1[i];
+			unsigned char chr2 = name2[i];
+			if (chr1 >= 'a' && chr1 <= 'z')
+				chr1 -= 'a' - 'A';
+			if (chr2 >= 'a' && chr2 <= 'z')
+				chr2 -= 'a' - 'A';
+			if (chr1 != chr2)
+				return false;
+		}
+		return true;
+	}
+
+	typedef std::vector<std::pair<uint32_t, Command*> > CommandBucket;
+
+	bool CompareBucketSize(const CommandBucket* bucket1, const CommandBucket* bucket2)
+	{
+		return bucket1->size() > bucket2->size();
+	}
+}
+
+void CommandParser::BuildCommandTable()
+{
+	// Keep the table at most half full and put two commands in a bucket on average, that way
+	// a displacement which puts all commands of a bucket into free slots is found quickly
+	size_t tablesize = 4;
+	while (tablesize < cmdlist.size() * 2)
+		tablesize *= 2;
+
+	while (true)
+	{
+		std::vector<CommandBucket> buckets(tablesize / 4);
+		for (CommandMap::const_iterator i = cmdlist.begin(); i != cmdlist.end(); ++i)
+		{
+			const uint32_t hash = HashCommandName(i->first);
+			buckets[hash & (buckets.size() - 1)].push_back(std::make_pair(hash, i->second));
+		}
+
+		// Place the commands in the biggest buckets first, while most slots are still free
+		std::vector<CommandBucket*> order;
+		for (std::vector<CommandBucket>::iterator i = buckets.begin(); i != buckets.end(); ++i)
+			order.push_back(&*i);
+		std::sort(order.begin(), order.end(), CompareBucketSize);
+
+		cmdtable.assign(tablesize, NULL);
+		cmdbuckets.assign(buckets.size(), 0);
+
+		bool success = true;
+		std::vector<size_t> slots;
+		for (std::vector<CommandBucket*>::const_iterator i = order.begin(); i != order.end() && success; ++i)
+		{
+			const CommandBucket& bucket = **i;
+			if (bucket.empty())
+				break;
+
+			// Try displacements until every command in the bucket has a free slot of its own
+			success = false;
+			for (unsigned int displacement = 0; displacement < 10000 && !success; displacement++)
+			{
+				slots.clear();
+				success = true;
+				for (CommandBucket::const_iterator j = bucket.begin(); j != bucket.end(); ++j)
+				{
+					const size_t slot = GetCommandSlot(j->first, displacement) & (tablesize - 1);
+					if (cmdtable[slot] || std::find(slots.begin(), slots.end(), slot) != slots.end())
+					{
+						success = false;
+						break;
+					}
+					slots.push_back(slot);
+				}
+
+				if (success)
+				{
+					for (size_t j = 0; j < bucket.size(); j++)
+						cmdtable[slots[j]] = bucket[j].second;
+					cmdbuckets[*i - &buckets[0]] = displacement;
+				}
+			}
+		}
+
+		if (success)
+			break;
+
+		// Extremely unlikely, but if a bucket can't be placed try again with a bigger table
+		tablesize *= 2;
+	}
+}
+
 Command* CommandParser::GetHandler(const std::string &commandname)
 {
-	CommandMap::iterator n = cmdlist.find(commandname);
-	if (n != cmdlist.end())
-		return n->second;
+	if (cmdbuckets.empty())
+		return NULL;
+
+	const uint32_t hash = HashCommandName(commandname);
+	const unsigned int displacement = cmdbuckets[hash & (cmdbuckets.size() - 1)];
+	Command* const handler = cmdtable[GetCommandSlot(hash, displacement) & (cmdtable.size() - 1)];
+	if (handler && CommandNameEquals(handler->name, commandname))
+		return handler;
 
 	return NULL;
 }
@@ -120,22 +249,22 @@ Command* CommandParser::GetHandler(const std::string &commandname)
 
 CmdResult CommandParser::CallHandler(const std::string& commandname, const std::vector<std::string>& parameters, User* user, Command** cmd)
 {
-	CommandMap::iterator n = cmdlist.find(commandname);
+	Command* const handler = GetHandler(commandname);
 
-	if (n != cmdlist.end())
+	if (handler)
 	{
-		if ((!parameters.empty()) && (parameters.back().empty()) && (!n->second->allow_empty_last_param))
+		if ((!parameters.empty()) && (parameters.back().empty()) && (!handler->allow_empty_last_param))
 			return CMD_INVALID;
 
-		if (parameters.size() >= n->second->min_params)
+		if (parameters.size() >= handler->min_params)
 		{
 			bool bOkay = false;
 
-			if (IS_LOCAL(user) && n->second->flags_needed)
+			if (IS_LOCAL(user) && handler->flags_needed)
 			{
 				/* if user is local, and flags are needed .. */
 
-				if (user->IsModeSet(n->second->flags_needed))
+				if (user->IsModeSet(handler->flags_needed))
 				{
 					/* if user has the flags, and now has the permissions, go ahead */
 					if (user->HasPermission(commandname))
@@ -151,8 +280,8 @@ CmdResult CommandParser::CallHandler(const std::string& commandname, const std::
 			if (bOkay)
 			{
 				if (cmd)
-					*cmd = n->second;
-				return n->second->Handle(parameters,user);
+					*cmd = handler;
+				return handler->Handle(parameters,user);
 			}
 		}
 	}
@@ -161,9 +290,27 @@ CmdResult CommandParser::CallHandler(const std::string& commandname, const std::
 
 void CommandParser::ProcessCommand(LocalUser *user, std::string &cmd)
 {
-	std::vector<std::string> command_p;
-	irc::tokenstream tokens(cmd);
-	std::string command, token;
+	// Borrow a parameter list, the strings in it keep their storage from earlier lines
+	if (paramlistsinuse == paramlists.size())
+		paramlists.push_back(std::vector<std::string>());
+	std::vector<std::string>& command_p = paramlists[paramlistsinuse++];
+
+	try
+	{
+		ProcessCommand(user, cmd, command_p);
+	}
+	catch (...)
+	{
+		paramlistsinuse--;
+		throw;
+	}
+	paramlistsinuse--;
+}
+
+void CommandParser::ProcessCommand(LocalUser *user, std::string &cmd, std::vector<std::string>& command_p)
+{
+	irc::linetokenizer tokens(cmd);
+	std::string command;
 	tokens.GetToken(command);
 
 	/* A client sent a nick prefix on their command (ick)
@@ -174,8 +321,7 @@ void CommandParser::ProcessCommand(LocalUser *user, std::string &cmd)
 	if (command[0] == ':')
 		tokens.GetToken(command);
 
-	while (tokens.GetToken(token))
-		command_p.push_back(token);
+	tokens.GetTokens(command_p);
 
 	std::transform(command.begin(), command.end(), command.begin(), ::toupper);
 
@@ -324,7 +470,10 @@ void CommandParser::RemoveCommand(Command* x)
 {
 	CommandMap::iterator n = cmdlist.find(x->name);
 	if (n != cmdlist.end() && n->second == x)
+	{
 		cmdlist.erase(n);
+		BuildCommandTable();
+	}
 }
 
 CommandBase::CommandBase(Module* mod, const std::string& cmd, unsigned int minpara, unsigned int maxpara)
@@ -380,12 +529,14 @@ bool CommandParser::AddCommand(Command *f)
 	if (cmdlist.find(f->name) == cmdlist.end())
 	{
 		cmdlist[f->name] = f;
+		BuildCommandTable();
 		return true;
 	}
 	return false;
 }
 
 CommandParser::CommandParser()
+	: paramlistsinuse(0)
 {
 }
 
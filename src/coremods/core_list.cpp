@@ -20,20 +20,27 @@
 
 #include "inspircd.h"
 
+class ListCursor;
+
 /** Handle /LIST.
  */
 class CommandList : public Command
 {
+ public:
 	ChanModeReference secretmode;
 	ChanModeReference privatemode;
 
- public:
+	/** The LIST each local user is receiving, if it did not fit into the sendq at once
+	 */
+	SimpleExtItem<ListCursor> cursorext;
+
 	/** Constructor for list.
 	 */
 	CommandList(Module* parent)
 		: Command(parent,"LIST", 0, 0)
 		, secretmode(creator, "secret")
 		, privatemode(creator, "private")
+		, cursorext("list_cursor", ExtensionItem::EXT_USER, creator)
 	{
 		Penalty = 5;
 	}
@@ -46,69 +53,151 @@ class CommandList : public Command
 	CmdResult Handle(const std::vector<std::string>& parameters, User *user);
 };
 
-
-/** Handle /LIST
+/** A LIST in progress. The channel hash map is walked one bucket at a time, and the replies
+ * for a local user are only written while its sendq is below the soft sendq limit of its
+ * connect class, the rest follows as the sendq drains.
+ *
+ * Channels created or destroyed while a LIST is in progress may or may not be listed, and if
+ * the hash map is rehashed in the meantime, as it grows, some channels may be listed twice or
+ * not at all.
  */
-CmdResult CommandList::Handle (const std::vector<std::string>& parameters, User *user)
+class ListCursor : public DeferredOutput
 {
-	int minusers = 0, maxusers = 0;
+	CommandList& cmd;
+	User* const user;
 
-	user->WriteNumeric(RPL_LISTSTART, "Channel :Users Name");
+	/** The glob pattern to match channel names and topics against, or empty to match all channels
+	 */
+	const std::string pattern;
 
-	/* Work around mIRC suckyness. YOU SUCK, KHALED! */
-	if (parameters.size() == 1)
-	{
-		if (parameters[0][0] == '<')
-		{
-			maxusers = atoi((parameters[0].c_str())+1);
-		}
-		else if (parameters[0][0] == '>')
-		{
-			minusers = atoi((parameters[0].c_str())+1);
-		}
-	}
+	/** List only channels with more than minusers and less than maxusers users, 0 disables the check
+	 */
+	long minusers;
+	long maxusers;
 
-	const bool has_privs = user->HasPrivPermission("channels/auspex");
-	const bool match_name_topic = ((!parameters.empty()) && (!parameters[0].empty()) && (parameters[0][0] != '<') && (parameters[0][0] != '>'));
+	/** True if the user may see the names and modes of all channels
+	 */
+	const bool has_privs;
 
-	const chan_hash& chans = ServerInstance->GetChans();
-	for (chan_hash::const_iterator i = chans.begin(); i != chans.end(); ++i)
-	{
-		Channel* const chan = i->second;
+	/** The next bucket of the channel hash map to list
+	 */
+	size_t bucket;
 
-		// attempt to match a glob pattern
+	void ListChannel(Channel* chan)
+	{
 		long users = chan->GetUserCounter();
 
 		bool too_few = (minusers && (users <= minusers));
 		bool too_many = (maxusers && (users >= maxusers));
 
 		if (too_many || too_few)
-			continue;
+			return;
 
-		if (match_name_topic)
+		// attempt to match a glob pattern
+		if (!pattern.empty())
 		{
-			if (!InspIRCd::Match(chan->name, parameters[0]) && !InspIRCd::Match(chan->topic, parameters[0]))
-				continue;
+			if (!InspIRCd::Match(chan->name, pattern) && !InspIRCd::Match(chan->topic, pattern))
+				return;
 		}
 
 		// if the channel is not private/secret, OR the user is on the channel anyway
 		bool n = (has_privs || chan->HasUser(user));
 
-		if ((!n) && (chan->IsModeSet(privatemode)))
+		if ((!n) && (chan->IsModeSet(cmd.privatemode)))
 		{
 			/* Channel is +p and user is outside/not privileged */
 			user->WriteNumeric(RPL_LIST, "* %ld :", users);
 		}
 		else
 		{
-			if ((n) || (!chan->IsModeSet(secretmode)))
+			if ((n) || (!chan->IsModeSet(cmd.secretmode)))
 			{
 				/* User is in the channel/privileged, channel is not +s */
 				user->WriteNumeric(RPL_LIST, "%s %ld :[+%s] %s", chan->name.c_str(), users, chan->ChanModes(n), chan->topic.c_str());
 			}
 		}
 	}
-	user->WriteNumeric(RPL_LISTEND, ":End of channel list.");
+
+ public:
+	ListCursor(CommandList& Cmd, User* Source, const std::vector<std::string>& parameters)
+		: cmd(Cmd)
+		, user(Source)
+		, pattern(((!parameters.empty()) && (!parameters[0].empty()) && (parameters[0][0] != '<') && (parameters[0][0] != '>')) ? parameters[0] : "")
+		, minusers(0)
+		, maxusers(0)
+		, has_privs(Source->HasPrivPermission("channels/auspex"))
+		, bucket(0)
+	{
+		/* Work around mIRC suckyness. YOU SUCK, KHALED! */
+		if (parameters.size() == 1)
+		{
+			if (parameters[0][0] == '<')
+			{
+				maxusers = atoi((parameters[0].c_str())+1);
+			}
+			else if (parameters[0][0] == '>')
+			{
+				minusers = atoi((parameters[0].c_str())+1);
+			}
+		}
+	}
+
+	~ListCursor()
+	{
+		LocalUser* const localuser = IS_LOCAL(user);
+		if ((localuser) && (localuser->deferred == this))
+			localuser->deferred = NULL;
+	}
+
+	/** List channels until all channels are listed or the sendq of a local user reaches its soft limit.
+	 * Once all channels are listed, the list is ended and the cursor of a local user is destroyed.
+	 * @param localuser The user if it is local, NULL to list all channels at once
+	 */
+	void Continue(LocalUser* localuser) CXX11_OVERRIDE
+	{
+		const chan_hash& chans = ServerInstance->GetChans();
+		for (; bucket < chans.bucket_count(); bucket++)
+		{
+			if ((localuser) && (localuser->eh.getSendQSize() >= localuser->MyClass->GetSendqSoftMax()))
+				return;
+
+			for (chan_hash::const_local_iterator i = chans.begin(bucket); i != chans.end(bucket); ++i)
+				ListChannel(i->second);
+		}
+
+		user->WriteNumeric(RPL_LISTEND, ":End of channel list.");
+		if (localuser)
+			cmd.cursorext.unset(localuser);
+	}
+};
+
+/** Handle /LIST
+ */
+CmdResult CommandList::Handle (const std::vector<std::string>& parameters, User *user)
+{
+	LocalUser* const localuser = IS_LOCAL(user);
+
+	// A new LIST ends the one the user is still receiving
+	if ((localuser) && (cursorext.get(localuser)))
+	{
+		user->WriteNumeric(RPL_LISTEND, ":End of channel list.");
+		cursorext.unset(localuser);
+	}
+
+	user->WriteNumeric(RPL_LISTSTART, "Channel :Users Name");
+
+	ListCursor* const cursor = new ListCursor(*this, user, parameters);
+	if (localuser)
+	{
+		cursorext.set(localuser, cursor);
+		localuser->deferred = cursor;
+		cursor->Continue(localuser);
+	}
+	else
+	{
+		cursor->Continue(NULL);
+		delete cursor;
+	}
 
 	return CMD_SUCCESS;
 }
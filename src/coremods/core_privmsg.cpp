@@ -66,7 +66,7 @@ class MessageCommandBase : public Command
 
 void MessageCommandBase::SendAll(User* user, const std::string& msg, MessageType mt)
 {
-	const std::string message = ":" + user->GetFullHost() + " " + MessageTypeString[mt] + " $* :" + msg;
+	const SharedLine message(":" + user->GetFullHost() + " " + MessageTypeString[mt] + " $* :" + msg);
 	const UserManager::LocalList& list = ServerInstance->Users.GetLocalUsers();
 	for (UserManager::LocalList::const_iterator i = list.begin(); i != list.end(); ++i)
 	{
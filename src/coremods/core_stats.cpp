@@ -214,6 +214,41 @@ void CommandStats::DoStats(char statschar, User* user, string_list &results)
 		}
 		break;
 
+		/* stats h (time spent by modules in each hook, see <performance:profilehooks>) */
+		case 'h':
+		{
+			if (!HookProfileTimer::Enabled)
+			{
+				results.push_back("249 "+user->nick+" :Hook profiling is disabled, enable it with <performance:profilehooks>");
+				break;
+			}
+
+			typedef std::vector<std::pair<uint64_t, std::string> > HookLines;
+			HookLines lines;
+			const ModuleManager::ModuleMap& mods = ServerInstance->Modules->GetModules();
+			for (ModuleManager::ModuleMap::const_iterator i = mods.begin(); i != mods.end(); ++i)
+			{
+				const std::vector<HookProfile>& profiles = i->second->HookProfiles;
+				for (size_t hook = 0; hook < profiles.size(); ++hook)
+				{
+					const HookProfile& profile = profiles[hook];
+					if (!profile.calls)
+						continue;
+
+					const uint64_t total = profile.time / 1000;
+					lines.push_back(std::make_pair(profile.time, "249 "+user->nick+" :"+i->first+" "+HookProfile::GetHookName(static_cast<Implementation>(hook))
+						+" calls "+ConvToStr(profile.calls)+" total "+ConvToStr(total)+"us avg "+ConvToStr(total / profile.calls)
+						+"us max "+ConvToStr(profile.maxtime / 1000)+"us"));
+				}
+			}
+
+			// Slowest hooks first
+			std::sort(lines.begin(), lines.end(), std::greater<HookLines::value_type>());
+			for (HookLines::const_iterator i = lines.begin(); i != lines.end(); ++i)
+				results.push_back(i->second);
+		}
+		break;
+
 		/* stats z (debug and memory info) */
 		case 'z':
 		{
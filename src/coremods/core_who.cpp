@@ -19,6 +19,224 @@
 
 
 #include "inspircd.h"
+#include "modules/account.h"
+
+/** Indexes of the registered users on the network by displayed host, IP address and server.
+ * WHO uses them to find the users a mask can match without matching the mask against every user.
+ */
+class WhoIndex
+{
+	typedef std::multimap<std::string, User*> HostMap;
+	typedef std::multimap<irc::sockets::cidr_mask, User*> IPMap;
+	typedef std::map<Server*, std::set<User*> > ServerMap;
+
+	/** Users by displayed host in lower case
+	 */
+	HostMap hosts;
+
+	/** Users by displayed host in lower case, reversed, for masks which end in a literal string
+	 */
+	HostMap reversehosts;
+
+	/** Users by IP address
+	 */
+	IPMap ips;
+
+	/** Users by the server they are on, servers without users are removed
+	 */
+	ServerMap servers;
+
+	static std::string Lower(const std::string& str)
+	{
+		std::string ret(str);
+		for (std::string::iterator i = ret.begin(); i != ret.end(); ++i)
+			*i = ascii_case_insensitive_map[static_cast<unsigned char>(*i)];
+		return ret;
+	}
+
+	static std::string Reverse(const std::string& str)
+	{
+		return std::string(str.rbegin(), str.rend());
+	}
+
+	/** Remove a user from a map, looking at every entry if the key of the user has changed without
+	 * the index being told, so the map never keeps a pointer to a user who has quit
+	 */
+	template<typename Map>
+	static void Erase(Map& map, const typename Map::key_type& key, User* user)
+	{
+		std::pair<typename Map::iterator, typename Map::iterator> range = map.equal_range(key);
+		for (typename Map::iterator i = range.first; i != range.second; ++i)
+		{
+			if (i->second == user)
+			{
+				map.erase(i);
+				return;
+			}
+		}
+
+		for (typename Map::iterator i = map.begin(); i != map.end(); ++i)
+		{
+			if (i->second == user)
+			{
+				map.erase(i);
+				return;
+			}
+		}
+	}
+
+	/** Add the users whose key starts with a string to a vector
+	 */
+	static void FindPrefix(const HostMap& map, const std::string& prefix, std::vector<User*>& users)
+	{
+		for (HostMap::const_iterator i = map.lower_bound(prefix); i != map.end(); ++i)
+		{
+			if (i->first.compare(0, prefix.length(), prefix))
+				break;
+			users.push_back(i->second);
+		}
+	}
+
+	void AddHost(User* user, const std::string& host)
+	{
+		const std::string key = Lower(host);
+		hosts.insert(std::make_pair(key, user));
+		reversehosts.insert(std::make_pair(Reverse(key), user));
+	}
+
+	void RemoveHost(User* user, const std::string& host)
+	{
+		const std::string key = Lower(host);
+		Erase(hosts, key, user);
+		Erase(reversehosts, Reverse(key), user);
+	}
+
+	/** Check whether a mask can match a nickname, it can't if it contains a character nicknames can't contain
+	 */
+	static bool CanMatchNick(const std::string& mask)
+	{
+		for (std::string::const_iterator i = mask.begin(); i != mask.end(); ++i)
+		{
+			// Check the character in the middle of a nick, as many are not allowed at its start
+			if ((*i != '*') && (*i != '?') && (!ServerInstance->IsNick(std::string("a") + *i)))
+				return false;
+		}
+		return true;
+	}
+
+ public:
+	/** Add a user, called once the user is registered
+	 */
+	void Add(User* user)
+	{
+		AddHost(user, user->dhost);
+		ips.insert(std::make_pair(irc::sockets::cidr_mask(user->client_sa, 128), user));
+		servers[user->server].insert(user);
+	}
+
+	/** Remove a user, does nothing if the user is not in the index
+	 */
+	void Remove(User* user)
+	{
+		ServerMap::iterator server = servers.find(user->server);
+		if ((server == servers.end()) || (!server->second.erase(user)))
+			return;
+		if (server->second.empty())
+			servers.erase(server);
+
+		RemoveHost(user, user->dhost);
+		Erase(ips, irc::sockets::cidr_mask(user->client_sa, 128), user);
+	}
+
+	/** Update the displayed host of a user, called before it changes
+	 */
+	void ChangeHost(User* user, const std::string& newhost)
+	{
+		ServerMap::const_iterator server = servers.find(user->server);
+		if ((server == servers.end()) || (!server->second.count(user)))
+			return;
+
+		RemoveHost(user, user->dhost);
+		AddHost(user, newhost.substr(0, ServerInstance->Config->Limits.MaxHost));
+	}
+
+	/** Find the users a WHO mask may match by its displayed host, nickname or server.
+	 * The users found may include users the mask doesn't match and users more than once.
+	 * @param mask The mask
+	 * @param realhost True if the mask is also matched against the real host and IP address of users
+	 * @param users Vector to append the users to
+	 * @return True if the users were found, false if the mask has no literal part to look up
+	 * and must be matched against every user
+	 */
+	bool FindUsers(const std::string& mask, bool realhost, std::vector<User*>& users) const
+	{
+		const std::string::size_type first = mask.find_first_of("*?");
+		if (CanMatchNick(mask))
+		{
+			// Wildcard masks could match any nickname
+			if (first != std::string::npos)
+				return false;
+
+			User* target = ServerInstance->FindNickOnly(mask);
+			if (target)
+				users.push_back(target);
+		}
+
+		if (realhost)
+		{
+			// Only exact CIDR ranges can be looked up, other masks may match any real host or IP address
+			if ((first != std::string::npos) || (mask.find('/') == std::string::npos))
+				return false;
+
+			const irc::sockets::cidr_mask range(mask);
+			if (((range.type == AF_INET) && (range.length <= 32)) || ((range.type == AF_INET6) && (range.length <= 128)))
+			{
+				// The keys are full addresses, the ones in the range follow the first address of the range
+				irc::sockets::cidr_mask start(range);
+				start.length = (range.type == AF_INET) ? 32 : 128;
+
+				const unsigned int bytes = range.length / 8;
+				const unsigned char bitmask = (0xFF00 >> (range.length & 7)) & 0xFF;
+				for (IPMap::const_iterator i = ips.lower_bound(start); i != ips.end(); ++i)
+				{
+					const irc::sockets::cidr_mask& ip = i->first;
+					if ((ip.type != start.type) || (ip.length != start.length) || (memcmp(ip.bits, range.bits, bytes)))
+						break;
+					if ((bitmask) && ((ip.bits[bytes] & bitmask) != range.bits[bytes]))
+						break;
+					users.push_back(i->second);
+				}
+			}
+		}
+
+		const std::string lower = Lower(mask);
+		if (first == std::string::npos)
+		{
+			std::pair<HostMap::const_iterator, HostMap::const_iterator> range = hosts.equal_range(lower);
+			for (HostMap::const_iterator i = range.first; i != range.second; ++i)
+				users.push_back(i->second);
+		}
+		else
+		{
+			// Look up the longer of the literal strings the mask starts and ends with
+			const std::string::size_type last = mask.find_last_of("*?");
+			if ((!first) && (last == mask.length() - 1))
+				return false;
+
+			if (first >= mask.length() - last - 1)
+				FindPrefix(hosts, lower.substr(0, first), users);
+			else
+				FindPrefix(reversehosts, Reverse(lower.substr(last + 1)), users);
+		}
+
+		for (ServerMap::const_iterator i = servers.begin(); i != servers.end(); ++i)
+		{
+			if (InspIRCd::Match(i->first->GetName(), mask))
+				users.insert(users.end(), i->second.begin(), i->second.end());
+		}
+		return true;
+	}
+};
 
 /** Handle /WHO.
  */
@@ -36,9 +254,19 @@ class CommandWho : public Command
 	bool opt_local;
 	bool opt_far;
 	bool opt_time;
+
+	/** The WHOX fields requested after a '%' in the flags, empty to send normal WHO replies
+	 */
+	std::string whoxfields;
+
+	/** The WHOX query type requested after the fields, sent in the 't' field
+	 */
+	std::string whoxquerytype;
+
 	ChanModeReference secretmode;
 	ChanModeReference privatemode;
 	UserModeReference invisiblemode;
+	WhoIndex& index;
 
 	Membership* get_first_visible_channel(User* u)
 	{
@@ -51,16 +279,21 @@ class CommandWho : public Command
 		return NULL;
 	}
 
+	/** Build the WHOX reply with the requested fields out of a normal WHO reply that modules have seen
+	 */
+	std::string MakeWhoxLine(User* user, User* u, const std::string& wholine);
+
  public:
 	/** Constructor for who.
 	 */
-	CommandWho(Module* parent)
+	CommandWho(Module* parent, WhoIndex& Index)
 		: Command(parent, "WHO", 1)
 		, secretmode(parent, "secret")
 		, privatemode(parent, "private")
 		, invisiblemode(parent, "invisible")
+		, index(Index)
 	{
-		syntax = "<server>|<nickname>|<channel>|<realname>|<host>|0 [ohurmMiaplf]";
+		syntax = "<server>|<nickname>|<channel>|<realname>|<host>|0 [ohurmMiaplf][%tcuihsnfdlaor[,<querytype>]]";
 	}
 
 	void SendWhoLine(User* user, const std::vector<std::string>& parms, const std::string& initial, Membership* memb, User* u, std::vector<std::string>& whoresults);
@@ -123,7 +356,13 @@ bool CommandWho::whomatch(User* cuser, User* user, const char* matchtext)
 		else if (opt_realname)
 			match = InspIRCd::Match(user->fullname, matchtext);
 		else if (opt_showrealhost)
+		{
 			match = InspIRCd::Match(user->host, matchtext, ascii_case_insensitive_map);
+
+			// CIDR ranges match the IP address
+			if ((!match) && (strchr(matchtext, '/')))
+				match = irc::sockets::cidr_mask(matchtext).match(user->client_sa);
+		}
 		else if (opt_ident)
 			match = InspIRCd::Match(user->ident, matchtext, ascii_case_insensitive_map);
 		else if (opt_port)
@@ -228,7 +467,94 @@ void CommandWho::SendWhoLine(User* user, const std::vector<std::string>& parms,
 	FOREACH_MOD(OnSendWhoLine, (user, parms, u, memb, wholine));
 
 	if (!wholine.empty())
-		whoresults.push_back(wholine);
+		whoresults.push_back(whoxfields.empty() ? wholine : MakeWhoxLine(user, u, wholine));
+}
+
+std::string CommandWho::MakeWhoxLine(User* user, User* u, const std::string& wholine)
+{
+	// The line is "352 <nick> <channel> <ident> <host> <server> <nick> <flags> :<hops> <realname>"
+	// by now, modules may have changed the fields but not their order
+	std::string::size_type trailing = wholine.find(" :");
+	if (trailing == std::string::npos)
+		trailing = wholine.length();
+
+	irc::spacesepstream fieldstream(wholine.substr(0, trailing));
+	std::string field;
+	std::vector<std::string> fields;
+	while (fieldstream.GetToken(field))
+		fields.push_back(field);
+	fields.resize(8);
+
+	std::string hops("0");
+	std::string realname;
+	if (trailing < wholine.length())
+	{
+		const std::string::size_type space = wholine.find(' ', trailing + 2);
+		hops.assign(wholine, trailing + 2, space - trailing - 2);
+		if (space != std::string::npos)
+			realname.assign(wholine, space + 1, std::string::npos);
+	}
+
+	std::string whoxline = "354 " + user->nick;
+	const bool auspex = ((user == u) || (user->HasPrivPermission("users/auspex")));
+	static const char order[] = "tcuihsnfdlaor";
+	for (const char* c = order; *c; ++c)
+	{
+		if (whoxfields.find(*c) == std::string::npos)
+			continue;
+
+		whoxline.push_back(' ');
+		switch (*c)
+		{
+			case 't':
+				whoxline.append(whoxquerytype.empty() ? "0" : whoxquerytype);
+				break;
+			case 'c':
+				whoxline.append(fields[2]);
+				break;
+			case 'u':
+				whoxline.append(fields[3]);
+				break;
+			case 'i':
+				whoxline.append(auspex ? u->GetIPString() : "255.255.255.255");
+				break;
+			case 'h':
+				whoxline.append(fields[4]);
+				break;
+			case 's':
+				whoxline.append(fields[5]);
+				break;
+			case 'n':
+				whoxline.append(fields[6]);
+				break;
+			case 'f':
+				whoxline.append(fields[7]);
+				break;
+			case 'd':
+				whoxline.append(hops);
+				break;
+			case 'l':
+			{
+				LocalUser* const lu = IS_LOCAL(u);
+				whoxline.append((auspex && lu) ? ConvToStr(ServerInstance->Time() - lu->idle_lastmsg) : "0");
+				break;
+			}
+			case 'a':
+			{
+				const AccountExtItem* accountext = GetAccountExtItem();
+				const std::string* account = accountext ? accountext->get(u) : NULL;
+				whoxline.append((account && !account->empty()) ? *account : "0");
+				break;
+			}
+			case 'o':
+				whoxline.append("n/a");
+				break;
+			case 'r':
+				whoxline.append(":" + realname);
+				break;
+		}
+	}
+	return whoxline;
 }
 
 CmdResult CommandWho::Handle (const std::vector<std::string>& parameters, User *user)
@@ -252,6 +578,8 @@ CmdResult CommandWho::Handle (const std::vector<std::string>& parameters, User *
 	opt_local = false;
 	opt_far = false;
 	opt_time = false;
+	whoxfields.clear();
+	whoxquerytype.clear();
 
 	std::vector<std::string> whoresults;
 	std::string initial = "352 " + user->nick + " ";
@@ -264,7 +592,22 @@ CmdResult CommandWho::Handle (const std::vector<std::string>& parameters, User *
 
 	if (parameters.size() > 1)
 	{
-		for (std::string::const_iterator iter = parameters[1].begin(); iter != parameters[1].end(); ++iter)
+		// WHOX: the flags may be followed by %<fields>[,<querytype>]
+		const std::string::size_type whox = parameters[1].find('%');
+		if (whox != std::string::npos)
+		{
+			const std::string::size_type comma = parameters[1].find(',', whox);
+			whoxfields.assign(parameters[1], whox + 1, comma - whox - 1);
+			if (comma != std::string::npos)
+				whoxquerytype.assign(parameters[1], comma + 1, 3);
+
+			// Field letters are not flags, and no fields means the default fields
+			if (whoxfields.empty())
+				whoxfields = "cuhsnfdr";
+		}
+
+		const std::string::const_iterator flagsend = parameters[1].begin() + std::min(whox, parameters[1].length());
+		for (std::string::const_iterator iter = parameters[1].begin(); iter != flagsend; ++iter)
 		{
 			switch (*iter)
 			{
@@ -366,18 +709,35 @@ CmdResult CommandWho::Handle (const std::vector<std::string>& parameters, User *
 		}
 		else
 		{
-			const user_hash& users = ServerInstance->Users->GetUsers();
-			for (user_hash::const_iterator i = users.begin(); i != users.end(); ++i)
+			// Look up the users the mask may match in the index, unless the flags match other fields
+			std::vector<User*> candidates;
+			const bool indexed = ((!opt_realname) && (!opt_mode) && (!opt_ident) && (!opt_metadata) && (!opt_port) && (!opt_away) && (!opt_time) &&
+				(index.FindUsers(matchtext, opt_showrealhost, candidates)));
+			if (indexed)
+			{
+				std::sort(candidates.begin(), candidates.end());
+				candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+			}
+			else
 			{
-				if (whomatch(user, i->second, matchtext.c_str()))
+				const user_hash& users = ServerInstance->Users->GetUsers();
+				candidates.reserve(users.size());
+				for (user_hash::const_iterator i = users.begin(); i != users.end(); ++i)
+					candidates.push_back(i->second);
+			}
+
+			for (std::vector<User*>::const_iterator i = candidates.begin(); i != candidates.end(); ++i)
+			{
+				User* const u = *i;
+				if (whomatch(user, u, matchtext.c_str()))
 				{
-					if (!user->SharesChannelWith(i->second))
+					if (!user->SharesChannelWith(u))
 					{
-						if (usingwildcards && (i->second->IsModeSet(invisiblemode)) && (!user->HasPrivPermission("users/auspex")))
+						if (usingwildcards && (u->IsModeSet(invisiblemode)) && (!user->HasPrivPermission("users/auspex")))
 							continue;
 					}
 
-					SendWhoLine(user, parameters, initial, NULL, i->second, whoresults);
+					SendWhoLine(user, parameters, initial, NULL, u, whoresults);
 				}
 			}
 		}
@@ -394,4 +754,53 @@ CmdResult CommandWho::Handle (const std::vector<std::string>& parameters, User *
 	return CMD_SUCCESS;
 }
 
-COMMAND_INIT(CommandWho)
+class CoreModWho : public Module
+{
+	WhoIndex index;
+	CommandWho cmd;
+
+ public:
+	CoreModWho()
+		: cmd(this, index)
+	{
+	}
+
+	void init() CXX11_OVERRIDE
+	{
+		const user_hash& users = ServerInstance->Users->GetUsers();
+		for (user_hash::const_iterator i = users.begin(); i != users.end(); ++i)
+		{
+			User* const user = i->second;
+			if ((user->registered == REG_ALL) && (!user->quitting))
+				index.Add(user);
+		}
+	}
+
+	void OnPostConnect(User* user) CXX11_OVERRIDE
+	{
+		if (!user->quitting)
+			index.Add(user);
+	}
+
+	void OnUserQuit(User* user, const std::string& message, const std::string& oper_message) CXX11_OVERRIDE
+	{
+		index.Remove(user);
+	}
+
+	void OnChangeHost(User* user, const std::string& newhost) CXX11_OVERRIDE
+	{
+		index.ChangeHost(user, newhost);
+	}
+
+	void On005Numeric(std::map<std::string, std::string>& tokens) CXX11_OVERRIDE
+	{
+		tokens["WHOX"];
+	}
+
+	Version GetVersion() CXX11_OVERRIDE
+	{
+		return Version("Provides the WHO command", VF_VENDOR|VF_CORE);
+	}
+};
+
+MODULE_INIT(CoreModWho)
@@ -25,7 +25,7 @@
 #include <typeinfo>
 #endif
 
-void CullList::Apply()
+void CullList::Apply(bool all)
 {
 	std::vector<LocalUser *> working;
 	while (!SQlist.empty())
@@ -40,6 +40,11 @@ void CullList::Apply()
 		}
 		working.clear();
 	}
+
+	const size_t slice = (all ? deferred.size() : std::min<size_t>(deferred.size(), CULL_SLICE));
+	list.insert(list.end(), deferred.begin(), deferred.begin() + slice);
+	deferred.erase(deferred.begin(), deferred.begin() + slice);
+
 	std::set<classbase*> gone;
 	std::vector<classbase*> queue;
 	queue.reserve(list.size() + 32);
@@ -72,7 +77,7 @@ void CullList::Apply()
 	if (list.size())
 	{
 		ServerInstance->Logs->Log("CULLLIST", LOG_DEBUG, "WARNING: Objects added to cull list in a destructor");
-		Apply();
+		Apply(all);
 	}
 }
 
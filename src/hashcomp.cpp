@@ -304,6 +304,49 @@ bool irc::tokenstream::GetToken(long &token)
 	return returnval;
 }
 
+bool irc::linetokenizer::GetToken(std::string& token)
+{
+	const bool first = !pos;
+
+	pos = line.find_first_not_of(' ', pos);
+	if (pos == std::string::npos)
+	{
+		pos = line.length();
+		token.clear();
+		return false;
+	}
+
+	/* This is the last parameter */
+	if (line[pos] == ':' && !first)
+	{
+		token.assign(line, pos + 1, std::string::npos);
+		pos = line.length();
+		return true;
+	}
+
+	std::string::size_type end = line.find(' ', pos);
+	if (end == std::string::npos)
+		end = line.length();
+
+	token.assign(line, pos, end - pos);
+	pos = end;
+	return true;
+}
+
+void irc::linetokenizer::GetTokens(std::vector<std::string>& tokens)
+{
+	std::vector<std::string>::size_type count = 0;
+	while (true)
+	{
+		if (count == tokens.size())
+			tokens.resize(count + 1);
+		if (!GetToken(tokens[count]))
+			break;
+		count++;
+	}
+	tokens.resize(count);
+}
+
 irc::sepstream::sepstream(const std::string& source, char separator, bool allowempty)
 	: tokens(source), sep(separator), pos(0), allow_empty(allowempty)
 {
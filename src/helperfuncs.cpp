@@ -59,6 +59,11 @@ User* InspIRCd::FindNickOnly(const std::string &nick)
 
 User *InspIRCd::FindUUID(const std::string &uid)
 {
+	// UUIDs and SIDs are found in the index, uuidlist is only searched for ids that can't be packed
+	const uint64_t packed = UIDGenerator::Pack(uid);
+	if (packed)
+		return this->Users->uuidindex.Find(packed);
+
 	user_hash::iterator finduuid = this->Users->uuidlist.find(uid);
 
 	if (finduuid == this->Users->uuidlist.end())
@@ -404,6 +409,24 @@ const char* InspIRCd::Format(const char* formatString, ...)
 	return ret;
 }
 
+uint64_t InspIRCd::GetMonotonicClock()
+{
+#ifdef _WIN32
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	const uint64_t frequency = ServerInstance->stats.QPFrequency.QuadPart;
+	return (now.QuadPart / frequency) * 1000000000 + (now.QuadPart % frequency) * 1000000000 / frequency;
+#elif defined HAS_CLOCK_GETTIME
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return static_cast<uint64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+#else
+	timeval now;
+	gettimeofday(&now, NULL);
+	return static_cast<uint64_t>(now.tv_sec) * 1000000000 + now.tv_usec * 1000;
+#endif
+}
+
 std::string InspIRCd::TimeString(time_t curtime, const char* format, bool utc)
 {
 #ifdef _WIN32
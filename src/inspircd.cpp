@@ -113,7 +113,7 @@ void InspIRCd::Cleanup()
 	for (UserManager::LocalList::const_iterator i = list.begin(); i != list.end(); ++i)
 		Users->QuitUser(*i, "Server shutdown");
 
-	GlobalCulls.Apply();
+	GlobalCulls.Apply(true);
 	Modules->UnloadAll();
 
 	/* Delete objects dynamically allocated in constructor (destructor would be more appropriate, but we're likely exiting) */
@@ -583,7 +583,7 @@ void InspIRCd::UpdateTime()
 	GetSystemTime(&st);
 
 	TIME.tv_sec = time(NULL);
-	TIME.tv_nsec = st.wMilliseconds;
+	TIME.tv_nsec = st.wMilliseconds * 1000000;
 #else
 	#ifdef HAS_CLOCK_GETTIME
 		clock_gettime(CLOCK_REALTIME, &TIME);
@@ -668,14 +668,14 @@ void InspIRCd::Run()
 
 			OLDTIME = TIME.tv_sec;
 
+			XLines->ExpireLines();
+
 			if ((TIME.tv_sec % 3600) == 0)
 			{
 				Users->GarbageCollect();
 				FOREACH_MOD(OnGarbageCollect, ());
 			}
 
-			Timers.TickTimers(TIME.tv_sec);
-			Users->DoBackgroundUserStuff();
 
 			if ((TIME.tv_sec % 5) == 0)
 			{
@@ -684,6 +684,14 @@ void InspIRCd::Run()
 			}
 		}
 
+		/* Timers have millisecond resolution, so they are checked on every
+		 * iteration. The socket engine wakes up in time for the next one.
+		 */
+		Timers.TickTimers(TIME.tv_sec);
+
+		/* Apply new xlines to a few more users if they are being applied in the background */
+		XLines->ContinueApplyLines();
+
 		/* Call the socket engine to wait on the active
 		 * file descriptors. The socket engine has everything's
 		 * descriptors in its list... dns, modules, users,
@@ -112,20 +112,24 @@ void StreamSocket::Close()
 	{
 		// final chance, dump as much of the sendq as we can
 		DoWrite();
-		if (GetIOHook())
+		IOHook* hook = GetIOHook();
+		while (hook)
 		{
 			try
 			{
-				GetIOHook()->OnStreamSocketClose(this);
+				hook->OnStreamSocketClose(this);
 			}
 			catch (CoreException& modexcept)
 			{
 				ServerInstance->Logs->Log("SOCKET", LOG_DEFAULT, "%s threw an exception: %s",
 					modexcept.GetSource().c_str(), modexcept.GetReason().c_str());
 			}
-			delete iohook;
-			DelIOHook();
+			IOHookMiddle* const iohm = IOHookMiddle::ToMiddleHook(hook);
+			IOHook* const next = (iohm ? iohm->GetNextHook() : NULL);
+			delete hook;
+			hook = next;
 		}
+		DelIOHook();
 		SocketEngine::Shutdown(this, 2);
 		SocketEngine::Close(this);
 	}
@@ -139,235 +143,344 @@ CullResult StreamSocket::cull()
 
 bool StreamSocket::GetNextLine(std::string& line, char delim)
 {
-	std::string::size_type i = recvq.find(delim);
-	if (i == std::string::npos)
+	const size_t left = GetRecvQSize();
+	const char* const start = recvq.data() + (recvq.length() - left);
+	const char* const end = static_cast<const char*>(memchr(start, delim, left));
+	if (!end)
+	{
+		// No complete line left, drop everything which has been read so far at once
+		CompactRecvQ();
 		return false;
-	line.assign(recvq, 0, i);
-	recvq.erase(0, i + 1);
+	}
+
+	line.assign(start, end - start);
+	recvq_pos += (end - start) + 1;
 	return true;
 }
 
+void StreamSocket::CompactRecvQ()
+{
+	if (!recvq_pos)
+		return;
+
+	recvq.erase(0, std::min(recvq_pos, recvq.length()));
+	recvq_pos = 0;
+}
+
 void StreamSocket::DoRead()
 {
+	CompactRecvQ();
+	int rv = -1;
+	try
+	{
+		rv = HookChainRead(GetIOHook(), recvq);
+	}
+	catch (CoreException& modexcept)
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEFAULT, "%s threw an exception: %s",
+			modexcept.GetSource().c_str(), modexcept.GetReason().c_str());
+		return;
+	}
+	if (rv > 0)
+		OnDataReady();
+	if (rv < 0)
+		SetError("Read Error"); // will not overwrite a better error message
+}
+
+int StreamSocket::HookChainRead(IOHook* hook, std::string& rq)
+{
+	if (!hook)
+		return ReadToRecvQ(rq);
+
+	IOHookMiddle* const iohm = IOHookMiddle::ToMiddleHook(hook);
+	if (iohm)
+	{
+		// Call the next hook to put data into the recvq of the current hook
+		const int rv = HookChainRead(iohm->GetNextHook(), iohm->GetRecvQ());
+		if (rv <= 0)
+			return rv;
+	}
+	return hook->OnStreamSocketRead(this, rq);
+}
+
+int StreamSocket::ReadToRecvQ(std::string& rq)
+{
+	char* ReadBuffer = ServerInstance->GetReadBuffer();
+	int n = SocketEngine::Recv(this, ReadBuffer, ServerInstance->Config->NetBufferSize, 0);
+	if (n == ServerInstance->Config->NetBufferSize)
+	{
+		SocketEngine::ChangeEventMask(this, FD_WANT_FAST_READ | FD_ADD_TRIAL_READ);
+		rq.append(ReadBuffer, n);
+		return 1;
+	}
+	else if (n > 0)
+	{
+		SocketEngine::ChangeEventMask(this, FD_WANT_FAST_READ);
+		rq.append(ReadBuffer, n);
+		return 1;
+	}
+	else if (n == 0)
+	{
+		error = "Connection closed";
+		SocketEngine::ChangeEventMask(this, FD_WANT_NO_READ | FD_WANT_NO_WRITE);
+		return -1;
+	}
+	else if (SocketEngine::IgnoreError())
+	{
+		SocketEngine::ChangeEventMask(this, FD_WANT_FAST_READ | FD_READ_WILL_BLOCK);
+		return 0;
+	}
+	else if (errno == EINTR)
+	{
+		SocketEngine::ChangeEventMask(this, FD_WANT_FAST_READ | FD_ADD_TRIAL_READ);
+		return 0;
+	}
+	else
+	{
+		error = SocketEngine::LastError();
+		SocketEngine::ChangeEventMask(this, FD_WANT_NO_READ | FD_WANT_NO_WRITE);
+		return -1;
+	}
+}
+
+/* Don't try to prepare huge blobs of data to send to a blocked socket */
+static const int MYIOV_MAX = IOV_MAX < 128 ? IOV_MAX : 128;
+
+void StreamSocket::DoWrite()
+{
+	if (getSendQSize() == 0)
+		return;
+	if (!error.empty() || fd < 0)
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "DoWrite on errored or closed socket");
+		return;
+	}
+
 	if (GetIOHook())
 	{
 		int rv = -1;
 		try
 		{
-			rv = GetIOHook()->OnStreamSocketRead(this, recvq);
+			// The IOHook takes as much data from the front of the sendq as it can send
+			rv = HookChainWrite(GetIOHook(), sendq);
+			if (rv < 0)
+				SetError("Write Error"); // will not overwrite a better error message
 		}
 		catch (CoreException& modexcept)
 		{
-			ServerInstance->Logs->Log("SOCKET", LOG_DEFAULT, "%s threw an exception: %s",
+			ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "%s threw an exception: %s",
 				modexcept.GetSource().c_str(), modexcept.GetReason().c_str());
-			return;
 		}
-		if (rv > 0)
-			OnDataReady();
-		if (rv < 0)
-			SetError("Read Error"); // will not overwrite a better error message
 	}
 	else
 	{
-		char* ReadBuffer = ServerInstance->GetReadBuffer();
-		int n = SocketEngine::Recv(this, ReadBuffer, ServerInstance->Config->NetBufferSize, 0);
-		if (n == ServerInstance->Config->NetBufferSize)
+		FlushSendQ(sendq);
+	}
+}
+
+int StreamSocket::HookChainWrite(IOHook* hook, SendQueue& sq)
+{
+	if (!hook)
+		return FlushSendQ(sq);
+
+	IOHookMiddle* const iohm = IOHookMiddle::ToMiddleHook(hook);
+	int rv = hook->OnStreamSocketWrite(this, sq);
+	if ((iohm) && (rv >= 0) && (!iohm->GetSendQ().empty()))
+	{
+		// Let the next hook send what the middle hook put into its sendq
+		const int nextrv = HookChainWrite(iohm->GetNextHook(), iohm->GetSendQ());
+		if (nextrv <= 0)
+			rv = nextrv;
+	}
+	return rv;
+}
+
+int StreamSocket::FlushSendQ(SendQueue& sq)
+{
+	// don't even try if we are known to be blocking
+	if (GetEventMask() & FD_WRITE_WILL_BLOCK)
+		return 0;
+	// start out optimistic - we won't need to write any more
+	int eventChange = FD_WANT_EDGE_WRITE;
+	while (error.empty() && !sq.empty() && eventChange == FD_WANT_EDGE_WRITE)
+	{
+		// Prepare a writev() call to write all buffers efficiently
+		int bufcount = sq.size();
+
+		// cap the number of buffers at MYIOV_MAX
+		if (bufcount > MYIOV_MAX)
 		{
-			SocketEngine::ChangeEventMask(this, FD_WANT_FAST_READ | FD_ADD_TRIAL_READ);
-			recvq.append(ReadBuffer, n);
-			OnDataReady();
+			bufcount = MYIOV_MAX;
 		}
-		else if (n > 0)
+
+		int rv_max = 0;
+		int rv;
+		{
+			SocketEngine::IOVector iovecs[MYIOV_MAX];
+			for (int i = 0; i < bufcount; i++)
+			{
+				// The buffers are shared with other sockets so the iovecs point
+				// straight into them; only the first one may be partially sent
+				size_t length;
+				iovecs[i].iov_base = const_cast<char*>(sq.GetData(i, length));
+				iovecs[i].iov_len = length;
+				rv_max += length;
+			}
+			rv = SocketEngine::WriteV(this, iovecs, bufcount);
+		}
+
+		if (rv == (int)sq.bytes())
+		{
+			// it's our lucky day, everything got written out. Fast cleanup.
+			// This won't ever happen if the number of buffers got capped.
+			sq.clear();
+		}
+		else if (rv > 0)
 		{
-			SocketEngine::ChangeEventMask(this, FD_WANT_FAST_READ);
-			recvq.append(ReadBuffer, n);
-			OnDataReady();
+			// Partial write. Clean out buffers from the sendq
+			if (rv < rv_max)
+			{
+				// it's going to block now
+				eventChange = FD_WANT_FAST_WRITE | FD_WRITE_WILL_BLOCK;
+			}
+			sq.erase_front(rv);
 		}
-		else if (n == 0)
+		else if (rv == 0)
 		{
 			error = "Connection closed";
-			SocketEngine::ChangeEventMask(this, FD_WANT_NO_READ | FD_WANT_NO_WRITE);
 		}
 		else if (SocketEngine::IgnoreError())
 		{
-			SocketEngine::ChangeEventMask(this, FD_WANT_FAST_READ | FD_READ_WILL_BLOCK);
+			eventChange = FD_WANT_FAST_WRITE | FD_WRITE_WILL_BLOCK;
 		}
 		else if (errno == EINTR)
 		{
-			SocketEngine::ChangeEventMask(this, FD_WANT_FAST_READ | FD_ADD_TRIAL_READ);
+			// restart interrupted syscall
+			errno = 0;
 		}
 		else
 		{
 			error = SocketEngine::LastError();
-			SocketEngine::ChangeEventMask(this, FD_WANT_NO_READ | FD_WANT_NO_WRITE);
 		}
 	}
+	if (!error.empty())
+	{
+		// error - kill all events
+		SocketEngine::ChangeEventMask(this, FD_WANT_NO_READ | FD_WANT_NO_WRITE);
+		return -1;
+	}
+	SocketEngine::ChangeEventMask(this, eventChange);
+	return (sq.empty() ? 1 : 0);
 }
 
-/* Don't try to prepare huge blobs of data to send to a blocked socket */
-static const int MYIOV_MAX = IOV_MAX < 128 ? IOV_MAX : 128;
+size_t StreamSocket::getSendQSize() const
+{
+	size_t ret = sendq.bytes();
+	IOHook* curr = GetIOHook();
+	while (curr)
+	{
+		const IOHookMiddle* const iohm = IOHookMiddle::ToMiddleHook(curr);
+		if (!iohm)
+			break;
 
-void StreamSocket::DoWrite()
+		ret += iohm->GetSendQ().bytes();
+		curr = iohm->GetNextHook();
+	}
+	return ret;
+}
+
+void StreamSocket::AddIOHook(IOHook* newhook)
 {
-	if (sendq.empty())
+	IOHookMiddle* const newiohm = IOHookMiddle::ToMiddleHook(newhook);
+	if ((!iohook) || (newiohm))
+	{
+		// A middle hook goes on top of the hooks the socket already has
+		if (newiohm)
+			newiohm->SetNextHook(iohook);
+		iohook = newhook;
 		return;
-	if (!error.empty() || fd < 0)
+	}
+
+	// Other hooks go below all middle hooks
+	IOHookMiddle* lasthook = IOHookMiddle::ToMiddleHook(iohook);
+	if (!lasthook)
 	{
-		ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "DoWrite on errored or closed socket");
+		iohook = newhook;
 		return;
 	}
+	while (lasthook->GetNextHook())
+	{
+		IOHookMiddle* const next = IOHookMiddle::ToMiddleHook(lasthook->GetNextHook());
+		if (!next)
+			break;
+		lasthook = next;
+	}
+	lasthook->SetNextHook(newhook);
+}
 
-	if (GetIOHook())
+IOHook* StreamSocket::GetModHook(Module* mod) const
+{
+	for (IOHook* curr = GetIOHook(); curr; )
 	{
-		int rv = -1;
-		try
-		{
-			while (error.empty() && !sendq.empty())
-			{
-				if (sendq.size() > 1 && sendq[0].length() < 1024)
-				{
-					// Avoid multiple repeated SSL encryption invocations
-					// This adds a single copy of the queue, but avoids
-					// much more overhead in terms of system calls invoked
-					// by the IOHook.
-					//
-					// The length limit of 1024 is to prevent merging strings
-					// more than once when writes begin to block.
-					std::string tmp;
-					tmp.reserve(1280);
-					while (!sendq.empty() && tmp.length() < 1024)
-					{
-						tmp.append(sendq.front());
-						sendq.pop_front();
-					}
-					sendq.push_front(tmp);
-				}
-				std::string& front = sendq.front();
-				int itemlen = front.length();
+		if (curr->prov->creator == mod)
+			return curr;
 
-				{
-					rv = GetIOHook()->OnStreamSocketWrite(this, front);
-					if (rv > 0)
-					{
-						// consumed the entire string, and is ready for more
-						sendq_len -= itemlen;
-						sendq.pop_front();
-					}
-					else if (rv == 0)
-					{
-						// socket has blocked. Stop trying to send data.
-						// IOHook has requested unblock notification from the socketengine
-
-						// Since it is possible that a partial write took place, adjust sendq_len
-						sendq_len = sendq_len - itemlen + front.length();
-						return;
-					}
-					else
-					{
-						SetError("Write Error"); // will not overwrite a better error message
-						return;
-					}
-				}
-			}
-		}
-		catch (CoreException& modexcept)
-		{
-			ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "%s threw an exception: %s",
-				modexcept.GetSource().c_str(), modexcept.GetReason().c_str());
-		}
+		IOHookMiddle* const iohm = IOHookMiddle::ToMiddleHook(curr);
+		curr = (iohm ? iohm->GetNextHook() : NULL);
 	}
-	else
+	return NULL;
+}
+
+IOHook* StreamSocket::GetLastHook() const
+{
+	IOHook* curr = GetIOHook();
+	while (curr)
 	{
-		// don't even try if we are known to be blocking
-		if (GetEventMask() & FD_WRITE_WILL_BLOCK)
-			return;
-		// start out optimistic - we won't need to write any more
-		int eventChange = FD_WANT_EDGE_WRITE;
-		while (error.empty() && sendq_len && eventChange == FD_WANT_EDGE_WRITE)
+		IOHookMiddle* const iohm = IOHookMiddle::ToMiddleHook(curr);
+		if ((!iohm) || (!iohm->GetNextHook()))
+			break;
+		curr = iohm->GetNextHook();
+	}
+	return curr;
+}
+
+void StreamSocket::SendQueue::erase_front(size_t amount)
+{
+	nbytes -= amount;
+	while (!buffers.empty())
+	{
+		size_t remaining = buffers.front()->GetData().length() - offset;
+		if (remaining > amount)
 		{
-			// Prepare a writev() call to write all buffers efficiently
-			int bufcount = sendq.size();
+			// stopped in the middle of this buffer
+			offset += amount;
+			return;
+		}
 
-			// cap the number of buffers at MYIOV_MAX
-			if (bufcount > MYIOV_MAX)
-			{
-				bufcount = MYIOV_MAX;
-			}
+		// this buffer got fully written out
+		amount -= remaining;
+		offset = 0;
+		buffers.pop_front();
+	}
+}
 
-			int rv_max = 0;
-			int rv;
-			{
-				SocketEngine::IOVector iovecs[MYIOV_MAX];
-				for (int i = 0; i < bufcount; i++)
-				{
-					iovecs[i].iov_base = const_cast<char*>(sendq[i].data());
-					iovecs[i].iov_len = sendq[i].length();
-					rv_max += sendq[i].length();
-				}
-				rv = SocketEngine::WriteV(this, iovecs, bufcount);
-			}
+void StreamSocket::SendQueue::Flatten(size_t minlength)
+{
+	if ((buffers.size() < 2) || (buffers.front()->GetData().length() - offset >= minlength))
+		return;
 
-			if (rv == (int)sendq_len)
-			{
-				// it's our lucky day, everything got written out. Fast cleanup.
-				// This won't ever happen if the number of buffers got capped.
-				sendq_len = 0;
-				sendq.clear();
-			}
-			else if (rv > 0)
-			{
-				// Partial write. Clean out strings from the sendq
-				if (rv < rv_max)
-				{
-					// it's going to block now
-					eventChange = FD_WANT_FAST_WRITE | FD_WRITE_WILL_BLOCK;
-				}
-				sendq_len -= rv;
-				while (rv > 0 && !sendq.empty())
-				{
-					std::string& front = sendq.front();
-					if (front.length() <= (size_t)rv)
-					{
-						// this string got fully written out
-						rv -= front.length();
-						sendq.pop_front();
-					}
-					else
-					{
-						// stopped in the middle of this string
-						front.erase(0, rv);
-						rv = 0;
-					}
-				}
-			}
-			else if (rv == 0)
-			{
-				error = "Connection closed";
-			}
-			else if (SocketEngine::IgnoreError())
-			{
-				eventChange = FD_WANT_FAST_WRITE | FD_WRITE_WILL_BLOCK;
-			}
-			else if (errno == EINTR)
-			{
-				// restart interrupted syscall
-				errno = 0;
-			}
-			else
-			{
-				error = SocketEngine::LastError();
-			}
-		}
-		if (!error.empty())
-		{
-			// error - kill all events
-			SocketEngine::ChangeEventMask(this, FD_WANT_NO_READ | FD_WANT_NO_WRITE);
-		}
-		else
-		{
-			SocketEngine::ChangeEventMask(this, eventChange);
-		}
+	// Merge buffers into a new one until it is long enough. Merging stops at the
+	// first buffer which makes it long enough, so a busy queue is only merged once
+	std::string merged(buffers.front()->GetData(), offset);
+	buffers.pop_front();
+	while ((!buffers.empty()) && (merged.length() < minlength))
+	{
+		merged.append(buffers.front()->GetData());
+		buffers.pop_front();
 	}
+
+	buffers.push_front(new SharedBuffer(merged));
+	offset = 0;
 }
 
 void StreamSocket::WriteData(const std::string &data)
@@ -379,9 +492,20 @@ void StreamSocket::WriteData(const std::string &data)
 		return;
 	}
 
+	WriteData(new SharedBuffer(data));
+}
+
+void StreamSocket::WriteData(const reference<SharedBuffer>& data)
+{
+	if (fd < 0)
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "Attempt to write data to dead socket: %s",
+			data->GetData().c_str());
+		return;
+	}
+
 	/* Append the data to the back of the queue ready for writing */
 	sendq.push_back(data);
-	sendq_len += data.length();
 
 	SocketEngine::ChangeEventMask(this, FD_ADD_TRIAL_WRITE);
 }
@@ -477,6 +601,8 @@ void StreamSocket::HandleEvent(EventType et, int errornum)
 			case EVENT_WRITE:
 			{
 				DoWrite();
+				if (error.empty())
+					OnDataWritten();
 				break;
 			}
 		}
@@ -55,6 +55,22 @@ ListenSocket::ListenSocket(ConfigTag* tag, const irc::sockets::sockaddrs& bind_t
 #endif
 
 	SocketEngine::SetReuse(fd);
+
+	if (tag->getBool("reuseport"))
+	{
+#ifdef SO_REUSEPORT
+		/* Let other processes, e.g. other servers on this machine, bind to the
+		 * same address and port. The kernel then shares the incoming connections
+		 * between all of the listening sockets.
+		 */
+		const int enable = 1;
+		if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, reinterpret_cast<const char *>(&enable), sizeof(enable)) < 0)
+			ServerInstance->Logs->Log("SOCKET", LOG_DEFAULT, "Unable to enable SO_REUSEPORT on %s: %s", bind_desc.c_str(), strerror(errno));
+#else
+		ServerInstance->Logs->Log("SOCKET", LOG_DEFAULT, "Ignoring reuseport on %s, SO_REUSEPORT is not supported on this system", bind_desc.c_str());
+#endif
+	}
+
 	int rv = SocketEngine::Bind(this->fd, bind_to);
 	if (rv >= 0)
 		rv = SocketEngine::Listen(this->fd, ServerInstance->Config->MaxConn);
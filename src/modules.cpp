@@ -54,6 +54,59 @@ Version::Version(const std::string &desc, int flags, const std::string& linkdata
 
 // These declarations define the behavours of the base class Module (which does nothing at all)
 
+bool HookProfileTimer::Enabled = false;
+
+uint64_t HookProfileTimer::Now()
+{
+	return InspIRCd::GetMonotonicClock();
+}
+
+void HookProfileTimer::Record()
+{
+	const uint64_t elapsed = Now() - start;
+
+	// Calls to hooks a module does not implement only detach the module from the hook,
+	// which removes it from the position it was called at
+	if (pos >= handlers.size() || handlers[pos] != mod)
+		return;
+
+	if (mod->HookProfiles.empty())
+		mod->HookProfiles.resize(I_END);
+
+	HookProfile& profile = mod->HookProfiles[hook];
+	profile.calls++;
+	profile.time += elapsed;
+	if (elapsed > profile.maxtime)
+		profile.maxtime = elapsed;
+}
+
+static const char* const HookNames[] = {
+	"OnUserConnect", "OnUserQuit", "OnUserDisconnect", "OnUserJoin", "OnUserPart",
+	"OnSendSnotice", "OnUserPreJoin", "OnUserPreKick", "OnUserKick", "OnOper", "OnInfo", "OnWhois",
+	"OnUserPreInvite", "OnUserInvite", "OnUserPreMessage", "OnUserPreNick",
+	"OnUserMessage", "OnMode", "OnSyncUser",
+	"OnSyncChannel", "OnDecodeMetaData", "OnAcceptConnection", "OnUserInit",
+	"OnChangeHost", "OnChangeName", "OnAddLine", "OnDelLine", "OnExpireLine",
+	"OnUserPostNick", "OnPreMode", "On005Numeric", "OnKill", "OnLoadModule",
+	"OnUnloadModule", "OnBackgroundTimer", "OnPreCommand", "OnCheckReady", "OnCheckInvite",
+	"OnRawMode", "OnCheckKey", "OnCheckLimit", "OnCheckBan", "OnCheckChannelBan", "OnExtBanCheck", "OnGetBanHosts",
+	"OnStats", "OnChangeLocalUserHost", "OnPreTopicChange",
+	"OnPostTopicChange", "OnPostConnect",
+	"OnChangeLocalUserGECOS", "OnUserRegister", "OnChannelPreDelete", "OnChannelDelete",
+	"OnPostOper", "OnSyncNetwork", "OnSetAway", "OnPostCommand", "OnPostJoin",
+	"OnWhoisLine", "OnBuildNeighborList", "OnGarbageCollect", "OnSetConnectClass",
+	"OnText", "OnPassCompare", "OnNamesListItem", "OnNumeric",
+	"OnPreRehash", "OnModuleRehash", "OnSendWhoLine", "OnChangeIdent", "OnSetUserIP"
+};
+
+// If this fails to compile HookNames is out of sync with the Implementation enum
+typedef char HookNamesMatchImplementation[(sizeof(HookNames) / sizeof(HookNames[0]) == I_END) ? 1 : -1];
+
+const char* HookProfile::GetHookName(Implementation hook)
+{
+	return HookNames[hook];
+}
+
 Module::Module() { }
 CullResult Module::cull()
 {
@@ -108,6 +161,7 @@ ModResult	Module::OnCheckLimit(User*, Channel*) { DetachEvent(I_OnCheckLimit); r
 ModResult	Module::OnCheckChannelBan(User*, Channel*) { DetachEvent(I_OnCheckChannelBan); return MOD_RES_PASSTHRU; }
 ModResult	Module::OnCheckBan(User*, Channel*, const std::string&) { DetachEvent(I_OnCheckBan); return MOD_RES_PASSTHRU; }
 ModResult	Module::OnExtBanCheck(User*, Channel*, char) { DetachEvent(I_OnExtBanCheck); return MOD_RES_PASSTHRU; }
+void		Module::OnGetBanHosts(User*, std::vector<std::string>&) { DetachEvent(I_OnGetBanHosts); }
 ModResult	Module::OnStats(char, User*, string_list&) { DetachEvent(I_OnStats); return MOD_RES_PASSTHRU; }
 ModResult	Module::OnChangeLocalUserHost(LocalUser*, const std::string&) { DetachEvent(I_OnChangeLocalUserHost); return MOD_RES_PASSTHRU; }
 ModResult	Module::OnChangeLocalUserGECOS(LocalUser*, const std::string&) { DetachEvent(I_OnChangeLocalUserGECOS); return MOD_RES_PASSTHRU; }
@@ -439,7 +493,7 @@ void ModuleManager::UnloadAll()
 				DoSafeUnload(me->second);
 			}
 		}
-		ServerInstance->GlobalCulls.Apply();
+		ServerInstance->GlobalCulls.Apply(true);
 	}
 }
 
@@ -453,7 +507,7 @@ namespace
 		{
 			DLLManager* dll = mod->ModuleDLLManager;
 			ServerInstance->Modules->DoSafeUnload(mod);
-			ServerInstance->GlobalCulls.Apply();
+			ServerInstance->GlobalCulls.Apply(true);
 			// In pure static mode this is always NULL
 			delete dll;
 			ServerInstance->GlobalCulls.AddItem(this);
@@ -471,7 +525,7 @@ namespace
 			DLLManager* dll = mod->ModuleDLLManager;
 			std::string name = mod->ModuleSourceFile;
 			ServerInstance->Modules->DoSafeUnload(mod);
-			ServerInstance->GlobalCulls.Apply();
+			ServerInstance->GlobalCulls.Apply(true);
 			delete dll;
 			bool rv = ServerInstance->Modules->Load(name);
 			if (callback)
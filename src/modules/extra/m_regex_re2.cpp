@@ -31,6 +31,7 @@
 #endif
 
 #include <re2/re2.h>
+#include <re2/set.h>
 
 /* $LinkerFlags: -lre2 */
 
@@ -53,14 +54,66 @@ class RE2Regex : public Regex
 	}
 };
 
+class RE2RegexSet : public RegexSet
+{
+	RE2::Set regexes;
+
+ public:
+	RE2RegexSet(const RE2::Options& options) : regexes(options, RE2::ANCHOR_BOTH)
+	{
+	}
+
+	unsigned int Add(const std::string& expr) CXX11_OVERRIDE
+	{
+		std::string error;
+		int pos = regexes.Add(expr, &error);
+		if (pos < 0)
+		{
+			throw RegexException(expr, error);
+		}
+		return pos;
+	}
+
+	void Compile() CXX11_OVERRIDE
+	{
+		if (!regexes.Compile())
+		{
+			throw RegexException("", "Unable to compile the regex set");
+		}
+	}
+
+	bool Match(const std::string& text, std::vector<unsigned int>& matches) CXX11_OVERRIDE
+	{
+		std::vector<int> found;
+		RE2::Set::ErrorInfo error;
+		if ((!regexes.Match(text, &found, &error)) && (error.kind != RE2::Set::kNoError))
+		{
+			// The DFA of a large set can run out of memory on some texts
+			matches.clear();
+			return false;
+		}
+		matches.assign(found.begin(), found.end());
+		return true;
+	}
+};
+
 class RE2Factory : public RegexFactory
 {
  public:
-	RE2Factory(Module* m) : RegexFactory(m, "regex/re2") { }
+	/** Options sets are created with, the memory limit comes from the config
+	 */
+	RE2::Options setoptions;
+
+	RE2Factory(Module* m) : RegexFactory(m, "regex/re2"), setoptions(RE2::Quiet) { }
 	Regex* Create(const std::string& expr) CXX11_OVERRIDE
 	{
 		return new RE2Regex(expr);
 	}
+
+	RegexSet* CreateSet() CXX11_OVERRIDE
+	{
+		return new RE2RegexSet(setoptions);
+	}
 };
 
 class ModuleRegexRE2 : public Module
@@ -72,6 +125,13 @@ class ModuleRegexRE2 : public Module
 	{
 	}
 
+	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE
+	{
+		// A set of every filter needs far more memory for its DFA than RE2's default of 8MB
+		ConfigTag* tag = ServerInstance->Config->ConfValue("re2");
+		ref.setoptions.set_max_mem(tag->getInt("setmaxmem", 64*1024*1024, 8*1024*1024));
+	}
+
 	Version GetVersion() CXX11_OVERRIDE
 	{
 		return Version("Regex Provider Module for RE2", VF_VENDOR);
@@ -41,6 +41,12 @@
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+# define BIO_get_data(BIO) BIO->ptr
+# define BIO_set_data(BIO, VALUE) BIO->ptr = VALUE;
+# define BIO_set_init(BIO, VALUE) BIO->init = VALUE;
+#endif
+
 #ifdef _WIN32
 # pragma comment(lib, "ssleay32.lib")
 # pragma comment(lib, "libeay32.lib")
@@ -54,6 +60,9 @@ enum issl_status { ISSL_NONE, ISSL_HANDSHAKING, ISSL_OPEN };
 static bool SelfSigned = false;
 static int exdataindex;
 
+/** Short buffers at the front of the sendq are merged until they are at least this long before being encrypted */
+static const size_t MinWriteSize = 1024;
+
 char* get_error()
 {
 	return ERR_error_string(ERR_get_error(), NULL);
@@ -338,8 +347,88 @@ namespace OpenSSL
 		const EVP_MD* GetDigest() { return digest; }
 		bool AllowRenegotiation() const { return allowrenego; }
 	};
+
+	/** A BIO that does its I/O through the socket engine rather than on the fd itself,
+	 * so engines which do socket I/O themselves (io_uring) see the data of TLS sockets
+	 */
+	namespace BIOMethod
+	{
+		static int create(BIO* bio)
+		{
+			BIO_set_init(bio, 1);
+			return 1;
+		}
+
+		static int destroy(BIO* bio)
+		{
+			// The socket is owned by the IOHook, not the BIO
+			return 1;
+		}
+
+		static long ctrl(BIO* bio, int cmd, long num, void* ptr)
+		{
+			if (cmd == BIO_CTRL_FLUSH)
+				return 1;
+			if (cmd == BIO_C_GET_FD)
+				return static_cast<StreamSocket*>(BIO_get_data(bio))->GetFd();
+			return 0;
+		}
+
+		static int read(BIO* bio, char* buf, int len)
+		{
+			BIO_clear_retry_flags(bio);
+			StreamSocket* sock = static_cast<StreamSocket*>(BIO_get_data(bio));
+			int ret = SocketEngine::Recv(sock, buf, len, 0);
+			if ((ret < 0) && (SocketEngine::IgnoreError()))
+				BIO_set_retry_read(bio);
+			return ret;
+		}
+
+		static int write(BIO* bio, const char* buf, int len)
+		{
+			BIO_clear_retry_flags(bio);
+			StreamSocket* sock = static_cast<StreamSocket*>(BIO_get_data(bio));
+			int ret = SocketEngine::Send(sock, buf, len, 0);
+			if ((ret < 0) && (SocketEngine::IgnoreError()))
+				BIO_set_retry_write(bio);
+			return ret;
+		}
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+		static BIO_METHOD biomethods = { (100 | BIO_TYPE_SOURCE_SINK), "inspircd", write, read, NULL, NULL, ctrl, create, destroy, NULL };
+
+		BIO_METHOD* alloc()
+		{
+			return &biomethods;
+		}
+
+		void free(BIO_METHOD* meth)
+		{
+		}
+#else
+		BIO_METHOD* alloc()
+		{
+			BIO_METHOD* meth = BIO_meth_new(100 | BIO_TYPE_SOURCE_SINK, "inspircd");
+			if (!meth)
+				return NULL;
+			BIO_meth_set_write(meth, OpenSSL::BIOMethod::write);
+			BIO_meth_set_read(meth, OpenSSL::BIOMethod::read);
+			BIO_meth_set_ctrl(meth, OpenSSL::BIOMethod::ctrl);
+			BIO_meth_set_create(meth, OpenSSL::BIOMethod::create);
+			BIO_meth_set_destroy(meth, OpenSSL::BIOMethod::destroy);
+			return meth;
+		}
+
+		void free(BIO_METHOD* meth)
+		{
+			BIO_meth_free(meth);
+		}
+#endif
+	}
 }
 
+static BIO_METHOD* biomethods = NULL;
+
 static int OnVerify(int preverify_ok, X509_STORE_CTX *ctx)
 {
 	/* XXX: This will allow self signed certificates.
@@ -532,8 +621,11 @@ class OpenSSLIOHook : public SSLIOHook
 	{
 		if (sess == NULL)
 			return;
-		if (SSL_set_fd(sess, sock->GetFd()) == 0)
-			throw ModuleException("Can't set fd with SSL_set_fd: " + ConvToStr(sock->GetFd()));
+		BIO* bio = BIO_new(biomethods);
+		if (!bio)
+			throw ModuleException("Can't create BIO for fd " + ConvToStr(sock->GetFd()));
+		BIO_set_data(bio, sock);
+		SSL_set_bio(sess, bio, bio);
 
 		SSL_set_ex_data(sess, exdataindex, this);
 		sock->AddIOHook(this);
@@ -601,7 +693,7 @@ class OpenSSLIOHook : public SSLIOHook
 		}
 	}
 
-	int OnStreamSocketWrite(StreamSocket* user, std::string& buffer) CXX11_OVERRIDE
+	int OnStreamSocketWrite(StreamSocket* user, StreamSocket::SendQueue& sendq) CXX11_OVERRIDE
 	{
 		// Finish handshake if needed
 		int prepret = PrepareIO(user);
@@ -611,24 +703,28 @@ class OpenSSLIOHook : public SSLIOHook
 		data_to_write = true;
 
 		// Session is ready for transferring application data
+		while (!sendq.empty())
 		{
+			// Hand small lines to SSL_write() together to avoid encrypting them one record at a time
+			sendq.Flatten(MinWriteSize);
+			size_t length;
+			const char* data = sendq.GetData(0, length);
+
 			ERR_clear_error();
-			int ret = SSL_write(sess, buffer.data(), buffer.size());
+			int ret = SSL_write(sess, data, length);
 
 #ifdef INSPIRCD_OPENSSL_ENABLE_RENEGO_DETECTION
 			if (!CheckRenego(user))
 				return -1;
 #endif
 
-			if (ret == (int)buffer.length())
+			if (ret == (int)length)
 			{
-				data_to_write = false;
-				SocketEngine::ChangeEventMask(user, FD_WANT_POLL_READ | FD_WANT_NO_WRITE);
-				return 1;
+				sendq.erase_front(ret);
 			}
 			else if (ret > 0)
 			{
-				buffer.erase(0, ret);
+				sendq.erase_front(ret);
 				SocketEngine::ChangeEventMask(user, FD_WANT_SINGLE_WRITE);
 				return 0;
 			}
@@ -658,6 +754,10 @@ class OpenSSLIOHook : public SSLIOHook
 				}
 			}
 		}
+
+		data_to_write = false;
+		SocketEngine::ChangeEventMask(user, FD_WANT_POLL_READ | FD_WANT_NO_WRITE);
+		return 1;
 	}
 
 	void TellCiphersAndFingerprint(LocalUser* user)
@@ -783,6 +883,12 @@ class ModuleSSLOpenSSL : public Module
 		SSL_load_error_strings();
 	}
 
+	~ModuleSSLOpenSSL()
+	{
+		if (biomethods)
+			OpenSSL::BIOMethod::free(biomethods);
+	}
+
 	void init() CXX11_OVERRIDE
 	{
 		// Register application specific data
@@ -791,6 +897,10 @@ class ModuleSSLOpenSSL : public Module
 		if (exdataindex < 0)
 			throw ModuleException("Failed to register application specific data");
 
+		biomethods = OpenSSL::BIOMethod::alloc();
+		if (!biomethods)
+			throw ModuleException("Failed to allocate BIO methods");
+
 		ReadProfiles();
 	}
 
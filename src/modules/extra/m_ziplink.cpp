@@ -0,0 +1,432 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "inspircd.h"
+#include "iohook.h"
+#include "modules/ziplink.h"
+
+#include <zlib.h>
+
+#ifdef _WIN32
+# pragma comment(lib, "zlib.lib")
+#endif
+
+/* $LinkerFlags: -lz */
+
+/** Both ends of a link start their streams with this dictionary unless another one is configured, so the
+ * first lines of a burst compress as well as later ones. Deflate encodes nearer matches in fewer bits, so
+ * the most common strings come last.
+ */
+static const char DefaultDictionary[] =
+	"SINFO version fullversion SERVER SQUIT ENDBURST ADDLINE DELLINE ENCAP SAVE KILL FHOST FIDENT FNAME "
+	"OPERTYPE AWAY INVITE TOPIC FTOPIC KICK PART QUIT PING PONG NOTICE PRIVMSG METADATA accountname "
+	"ssl_cert FMODE MODE IJOIN FJOIN #:o, :v, :, UID +i +w +x 127.0.0.1 :";
+
+class ZipIOHook;
+
+class ZipHookProvider : public IOHookProvider
+{
+ public:
+	/** Hooks of all sockets that use this provider
+	 */
+	std::set<ZipIOHook*> hooks;
+
+	/** Compression level passed to deflateInit()
+	 */
+	int level;
+
+	/** Dictionary the streams of new hooks start with
+	 */
+	std::string dictionary;
+
+	/** Maximum amount of data one read from the socket may decompress to
+	 */
+	size_t maxread;
+
+	/** Maximum amount of decompressed data waiting in the recvq of a socket
+	 */
+	size_t maxrecvq;
+
+	ZipHookProvider(Module* mod)
+		: IOHookProvider(mod, "zlib", IOHookProvider::IOH_UNKNOWN, true)
+		, level(Z_DEFAULT_COMPRESSION)
+		, dictionary(DefaultDictionary)
+		, maxread(1024 * 1024)
+		, maxrecvq(4 * 1024 * 1024)
+	{
+	}
+
+	/** Links are only compressed after it has been negotiated in CAPAB,
+	 * so this provider is never used for a port or a <link> directly
+	 */
+	void OnAccept(StreamSocket* sock, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* server) CXX11_OVERRIDE
+	{
+	}
+
+	void OnConnect(StreamSocket* sock) CXX11_OVERRIDE
+	{
+	}
+};
+
+class ZipIOHook : public IOHookMiddle
+{
+	/** The socket this hook compresses the data of
+	 */
+	StreamSocket* const sock;
+
+	/** The dictionary the streams start with
+	 */
+	const std::string dictionary;
+
+	z_stream deflater;
+	z_stream inflater;
+
+	/** Compress the data in a sendq into our sendq, the stream is flushed after it so the other
+	 * side can read everything that was sent
+	 * @param sendq The data to compress, it is removed from the queue
+	 * @return True on success, false on error
+	 */
+	bool Compress(StreamSocket::SendQueue& sendq)
+	{
+		const uint64_t start = InspIRCd::GetMonotonicClock();
+		const size_t length = sendq.bytes();
+
+		std::string out;
+		char buffer[16384];
+		for (size_t i = 0; i < sendq.size(); i++)
+		{
+			size_t chunklength;
+			const char* data = sendq.GetData(i, chunklength);
+
+			deflater.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+			deflater.avail_in = chunklength;
+			const int flush = ((i + 1 == sendq.size()) ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+			do
+			{
+				deflater.next_out = reinterpret_cast<Bytef*>(buffer);
+				deflater.avail_out = sizeof(buffer);
+				if (deflate(&deflater, flush) == Z_STREAM_ERROR)
+					return false;
+				out.append(buffer, sizeof(buffer) - deflater.avail_out);
+			} while (deflater.avail_out == 0);
+		}
+		sendq.clear();
+		GetSendQ().push_back(new SharedBuffer(out));
+
+		bytes_out += length;
+		zbytes_out += out.size();
+		time += InspIRCd::GetMonotonicClock() - start;
+		return true;
+	}
+
+	/** Decompress data into a recvq
+	 * @param data The data to decompress
+	 * @param length Length of the data
+	 * @param recvq The recvq to append the decompressed data to
+	 * @return True on success, false on error, the error is set on the socket
+	 */
+	bool Decompress(const char* data, size_t length, std::string& recvq)
+	{
+		const ZipHookProvider* const zipprov = static_cast<ZipHookProvider*>(prov);
+		const uint64_t start = InspIRCd::GetMonotonicClock();
+		const size_t oldsize = recvq.size();
+
+		inflater.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+		inflater.avail_in = length;
+		char buffer[16384];
+		do
+		{
+			inflater.next_out = reinterpret_cast<Bytef*>(buffer);
+			inflater.avail_out = sizeof(buffer);
+			int ret = inflate(&inflater, Z_SYNC_FLUSH);
+			if (ret == Z_NEED_DICT)
+				ret = inflateSetDictionary(&inflater, reinterpret_cast<const Bytef*>(dictionary.data()), dictionary.length());
+			if ((ret != Z_OK) && (ret != Z_BUF_ERROR))
+			{
+				sock->SetError("Invalid compressed data received");
+				return false;
+			}
+
+			// Stop a small amount of compressed data from filling the memory
+			recvq.append(buffer, sizeof(buffer) - inflater.avail_out);
+			if (recvq.size() - oldsize > zipprov->maxread)
+			{
+				sock->SetError("Compressed data expands too much");
+				return false;
+			}
+			if (recvq.size() > zipprov->maxrecvq)
+			{
+				sock->SetError("RecvQ exceeded");
+				return false;
+			}
+		} while ((inflater.avail_in) || (inflater.avail_out == 0));
+
+		zbytes_in += length;
+		bytes_in += recvq.size() - oldsize;
+		time += InspIRCd::GetMonotonicClock() - start;
+		return true;
+	}
+
+ public:
+	/** True once everything written to the socket is compressed
+	 */
+	bool compressing;
+
+	/** True once everything received by the socket is decompressed
+	 */
+	bool decompressing;
+
+	/** Bytes given to and sent by the compressor
+	 */
+	uint64_t bytes_out;
+	uint64_t zbytes_out;
+
+	/** Bytes received by and returned from the decompressor
+	 */
+	uint64_t zbytes_in;
+	uint64_t bytes_in;
+
+	/** Time spent compressing and decompressing in nanoseconds
+	 */
+	uint64_t time;
+
+	ZipIOHook(ZipHookProvider* provider, StreamSocket* s)
+		: IOHookMiddle(provider)
+		, sock(s)
+		, dictionary(provider->dictionary)
+		, compressing(false)
+		, decompressing(false)
+		, bytes_out(0)
+		, zbytes_out(0)
+		, zbytes_in(0)
+		, bytes_in(0)
+		, time(0)
+	{
+		memset(&deflater, 0, sizeof(deflater));
+		memset(&inflater, 0, sizeof(inflater));
+		if ((deflateInit(&deflater, provider->level) != Z_OK) || (inflateInit(&inflater) != Z_OK))
+			throw ModuleException("Unable to initialise zlib");
+		deflateSetDictionary(&deflater, reinterpret_cast<const Bytef*>(dictionary.data()), dictionary.length());
+
+		provider->hooks.insert(this);
+		sock->AddIOHook(this);
+	}
+
+	~ZipIOHook()
+	{
+		deflateEnd(&deflater);
+		inflateEnd(&inflater);
+		static_cast<ZipHookProvider*>(prov)->hooks.erase(this);
+	}
+
+	/** Decompress data which was received before this hook started decompressing
+	 * @param data The data to decompress
+	 * @param recvq The recvq to append the decompressed data to
+	 * @return True on success, false on error
+	 */
+	bool StartDecompression(const std::string& data, std::string& recvq)
+	{
+		decompressing = true;
+		return Decompress(data.data(), data.length(), recvq);
+	}
+
+	/** Get the address of the other end of the socket
+	 * @return The address and port of the remote end
+	 */
+	std::string GetPeer() const
+	{
+		irc::sockets::sockaddrs sa;
+		socklen_t len = sizeof(sa);
+		if (getpeername(sock->GetFd(), &sa.sa, &len))
+			return "*";
+		return sa.str();
+	}
+
+	void OnStreamSocketClose(StreamSocket*) CXX11_OVERRIDE
+	{
+	}
+
+	int OnStreamSocketRead(StreamSocket*, std::string& recvq) CXX11_OVERRIDE
+	{
+		std::string& rq = GetRecvQ();
+		if (rq.empty())
+			return 0;
+
+		if (!decompressing)
+		{
+			recvq.append(rq);
+			rq.clear();
+			return 1;
+		}
+
+		const size_t oldsize = recvq.size();
+		const bool success = Decompress(rq.data(), rq.length(), recvq);
+		rq.clear();
+		if (!success)
+			return -1;
+		return (recvq.size() > oldsize) ? 1 : 0;
+	}
+
+	int OnStreamSocketWrite(StreamSocket*, StreamSocket::SendQueue& sendq) CXX11_OVERRIDE
+	{
+		if (sendq.empty())
+			return 1;
+
+		if (compressing)
+		{
+			// Everything written in one batch is compressed together and flushed once
+			if (!Compress(sendq))
+			{
+				sock->SetError("Compression error");
+				return -1;
+			}
+			return 1;
+		}
+
+		std::string data;
+		data.reserve(sendq.bytes());
+		for (size_t i = 0; i < sendq.size(); i++)
+		{
+			size_t length;
+			const char* chunk = sendq.GetData(i, length);
+			data.append(chunk, length);
+		}
+		sendq.clear();
+		GetSendQ().push_back(new SharedBuffer(data));
+		return 1;
+	}
+};
+
+class ZipLinkProvider : public ZipLink::Provider
+{
+	ZipHookProvider& hookprov;
+
+	/** The ZIPLINK capability, it identifies the dictionary
+	 */
+	std::string capability;
+
+	/** Get the compression hook of a socket, adding one if it has none
+	 * @param sock The socket to get the hook of
+	 * @return The hook of the socket
+	 */
+	ZipIOHook* GetHook(StreamSocket* sock)
+	{
+		IOHook* hook = sock->GetModHook(creator);
+		if (hook)
+			return static_cast<ZipIOHook*>(hook);
+		return new ZipIOHook(&hookprov, sock);
+	}
+
+ public:
+	ZipLinkProvider(Module* mod, ZipHookProvider& hp)
+		: ZipLink::Provider(mod)
+		, hookprov(hp)
+	{
+	}
+
+	/** Set the dictionary advertised in the capability
+	 * @param dictionary The dictionary new streams start with
+	 */
+	void SetDictionary(const std::string& dictionary)
+	{
+		const uLong id = adler32(adler32(0, NULL, 0), reinterpret_cast<const Bytef*>(dictionary.data()), dictionary.length());
+		capability = InspIRCd::Format("zlib-%08lx", static_cast<unsigned long>(id));
+	}
+
+	const std::string& GetCapability() const CXX11_OVERRIDE
+	{
+		return capability;
+	}
+
+	void StartCompression(StreamSocket* sock) CXX11_OVERRIDE
+	{
+		ZipIOHook* hook = GetHook(sock);
+		if (hook->compressing)
+			return;
+
+		// Data written before this point is sent as it is
+		sock->DoWrite();
+		hook->compressing = true;
+	}
+
+	bool StartDecompression(StreamSocket* sock, const std::string& data, std::string& recvq) CXX11_OVERRIDE
+	{
+		ZipIOHook* hook = GetHook(sock);
+		if (hook->decompressing)
+			return true;
+		return hook->StartDecompression(data, recvq);
+	}
+};
+
+class ModuleZipLink : public Module
+{
+	ZipHookProvider hookprov;
+	ZipLinkProvider zipprov;
+
+ public:
+	ModuleZipLink()
+		: hookprov(this)
+		, zipprov(this, hookprov)
+	{
+	}
+
+	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE
+	{
+		ConfigTag* tag = ServerInstance->Config->ConfValue("ziplink");
+		hookprov.level = tag->getInt("level", Z_DEFAULT_COMPRESSION, Z_DEFAULT_COMPRESSION, Z_BEST_COMPRESSION);
+		hookprov.maxread = tag->getInt("maxread", 1024 * 1024, 65536);
+		hookprov.maxrecvq = tag->getInt("maxrecvq", 4 * 1024 * 1024, 65536);
+
+		std::string dictionary = DefaultDictionary;
+		const std::string dictfile = tag->getString("dictionary");
+		if (!dictfile.empty())
+		{
+			// Deflate only uses the last 32K of the dictionary
+			FileReader reader(dictfile);
+			dictionary = reader.GetString();
+			if (dictionary.length() > 32768)
+				dictionary.erase(0, dictionary.length() - 32768);
+		}
+		hookprov.dictionary = dictionary;
+		zipprov.SetDictionary(dictionary);
+	}
+
+	ModResult OnStats(char symbol, User* user, string_list& results) CXX11_OVERRIDE
+	{
+		if (symbol != 'z')
+			return MOD_RES_PASSTHRU;
+
+		for (std::set<ZipIOHook*>::const_iterator i = hookprov.hooks.begin(); i != hookprov.hooks.end(); ++i)
+		{
+			const ZipIOHook* hook = *i;
+			results.push_back(InspIRCd::Format("304 %s :ZIPSTATS %s sent %lu bytes as %lu (%.1f%%), received %lu bytes as %lu (%.1f%%), %lu ms spent compressing",
+				user->nick.c_str(), hook->GetPeer().c_str(),
+				static_cast<unsigned long>(hook->bytes_out), static_cast<unsigned long>(hook->zbytes_out), hook->bytes_out ? hook->zbytes_out * 100.0 / hook->bytes_out : 100.0,
+				static_cast<unsigned long>(hook->bytes_in), static_cast<unsigned long>(hook->zbytes_in), hook->bytes_in ? hook->zbytes_in * 100.0 / hook->bytes_in : 100.0,
+				static_cast<unsigned long>(hook->time / 1000000)));
+		}
+		return MOD_RES_PASSTHRU;
+	}
+
+	Version GetVersion() CXX11_OVERRIDE
+	{
+		return Version("Provides zlib compression for server links", VF_VENDOR);
+	}
+};
+
+MODULE_INIT(ModuleZipLink)
@@ -92,21 +92,27 @@ class CommandClearChan : public Command
 		ServerInstance->Modules->Attach(hook, creator);
 
 		std::string mask;
-		// Now remove all local non-opers from the channel
-		Channel::MemberMap& users = chan->userlist;
-		for (Channel::MemberMap::iterator i = users.begin(); i != users.end(); )
+		// Now remove all local non-opers from the channel. Removing members reorders
+		// the member list so find them first.
+		std::vector<User*> victims;
+		const Channel::MemberMap& users = chan->GetUsers();
+		for (Channel::MemberMap::const_iterator i = users.begin(); i != users.end(); ++i)
 		{
 			User* curr = i->first;
-			const Channel::MemberMap::iterator currit = i;
-			++i;
+			if (IS_LOCAL(curr) && !curr->IsOper())
+				victims.push_back(curr);
+		}
 
-			if (!IS_LOCAL(curr) || curr->IsOper())
+		for (std::vector<User*>::const_iterator i = victims.begin(); i != victims.end(); ++i)
+		{
+			User* curr = *i;
+			if (curr->quitting)
 				continue;
 
 			// If kicking users, remove them and skip the QuitUser()
 			if (kick)
 			{
-				chan->KickUser(ServerInstance->FakeClient, currit, reason);
+				chan->KickUser(ServerInstance->FakeClient, curr, reason);
 				continue;
 			}
 
@@ -270,28 +270,17 @@ class ModuleCloaking : public Module
 		return rv;
 	}
 
-	ModResult OnCheckBan(User* user, Channel* chan, const std::string& mask) CXX11_OVERRIDE
+	void OnGetBanHosts(User* user, std::vector<std::string>& hosts) CXX11_OVERRIDE
 	{
 		LocalUser* lu = IS_LOCAL(user);
 		if (!lu)
-			return MOD_RES_PASSTHRU;
+			return;
 
 		OnUserConnect(lu);
 		std::string* cloak = cu.ext.get(user);
-		/* Check if they have a cloaked host, but are not using it */
+		/* Bans on the cloaked host also match users who are not using it */
 		if (cloak && *cloak != user->dhost)
-		{
-			const std::string cloakMask = user->nick + "!" + user->ident + "@" + *cloak;
-			if (InspIRCd::Match(cloakMask, mask))
-				return MOD_RES_DENY;
-		}
-		return MOD_RES_PASSTHRU;
-	}
-
-	void Prioritize()
-	{
-		/* Needs to be after m_banexception etc. */
-		ServerInstance->Modules->SetPriority(this, I_OnCheckBan, PRIORITY_LAST);
+			hosts.push_back(*cloak);
 	}
 
 	// this unsets umode +x on every host change. If we are actually doing a +x
@@ -57,6 +57,10 @@ class FilterResult
 	bool flag_notice;
 	bool flag_strip_color;
 
+	/** Id of the filter in the index for its flag_strip_color, unique among the filters
+	 */
+	unsigned int id;
+
 	FilterResult(dynamic_reference<RegexFactory>& RegexEngine, const std::string& free, const std::string& rea, FilterAction act, long gt, const std::string& fla)
 		: freeform(free), reason(rea), action(act), gline_time(gt)
 	{
@@ -137,6 +141,384 @@ class FilterResult
 	}
 };
 
+/** Finds the filters which may match a text with one pass over it, so only those have to be run.
+ * Filters whose regex has a required literal are found by searching the text for all of those
+ * literals at once with an Aho-Corasick automaton, other filters are matched together with a
+ * RegexSet when the regex engine provides one. Any remaining filters are always candidates.
+ *
+ * Filters are added and removed one at a time. Adding a literal inserts it into the automaton
+ * and only the links between the nodes are set again before the next scan; removing one only
+ * removes the filter from the node its literal ends at. The set can not be changed after it
+ * is compiled so it is built again before the next scan when a filter in it changes.
+ */
+class FilterIndex
+{
+	/** A node of the automaton, node 0 is the root
+	 */
+	struct Node
+	{
+		/** Children of the node and the (case mapped) character leading to them, unsorted
+		 */
+		std::vector<std::pair<unsigned char, unsigned int> > next;
+
+		/** The node for the longest proper suffix of this node which is also in the automaton
+		 */
+		unsigned int fail;
+
+		/** The nearest node reached through fail links which ends a literal, 0 if none
+		 */
+		unsigned int output;
+
+		/** Ids of the filters whose literal ends at this node
+		 */
+		std::vector<unsigned int> filters;
+
+		Node() : fail(0), output(0) { }
+	};
+
+	/** How a filter is found by the index
+	 */
+	enum EntryType
+	{
+		/** The filter is not in the index and is always a candidate */
+		ENTRY_NONE,
+
+		/** The filter is found by the literal ending at node */
+		ENTRY_LITERAL,
+
+		/** The filter is found by matching regexset */
+		ENTRY_SET
+	};
+
+	struct Entry
+	{
+		EntryType type;
+
+		/** The node the literal of the filter ends at if type is ENTRY_LITERAL
+		 */
+		unsigned int node;
+
+		/** The value of generation when Scan() last marked the filter as a candidate
+		 */
+		unsigned long found;
+
+		Entry() : type(ENTRY_NONE), node(0), found(0) { }
+	};
+
+	std::vector<Node> nodes;
+
+	/** Children of the root indexed by character, the root usually has the most children
+	 */
+	unsigned int rootnext[256];
+
+	/** The case map the literals were folded with
+	 */
+	unsigned char casemap[256];
+
+	/** False if literals were added since the fail and output links were set
+	 */
+	bool linked;
+
+	/** Per filter id, how the filter is found
+	 */
+	std::vector<Entry> entries;
+	unsigned long generation;
+
+	/** The engine which creates regexset, NULL if no filter was added yet
+	 */
+	RegexFactory* factory;
+
+	/** Set matching the filters without a literal, NULL if there are none or the engine has no sets
+	 */
+	RegexSet* regexset;
+
+	/** Ids and regexes of the filters to match with regexset, in the order they are in the set
+	 */
+	std::vector<std::pair<unsigned int, Regex*> > setfilters;
+
+	/** True if setfilters changed since regexset was built
+	 */
+	bool setstale;
+
+	/** Reused storage for the matches of regexset
+	 */
+	std::vector<unsigned int> setmatches;
+
+	unsigned int Find(unsigned int node, unsigned char chr) const
+	{
+		if (!node)
+			return rootnext[chr];
+
+		const std::vector<std::pair<unsigned char, unsigned int> >& next = nodes[node].next;
+		for (std::vector<std::pair<unsigned char, unsigned int> >::const_iterator i = next.begin(); i != next.end(); ++i)
+		{
+			if (i->first == chr)
+				return i->second;
+		}
+		return 0;
+	}
+
+	unsigned int AddLiteral(const std::string& literal, unsigned int filter)
+	{
+		unsigned int node = 0;
+		for (std::string::const_iterator i = literal.begin(); i != literal.end(); ++i)
+		{
+			const unsigned char chr = casemap[static_cast<unsigned char>(*i)];
+			unsigned int child = Find(node, chr);
+			if (!child)
+			{
+				child = nodes.size();
+				nodes.push_back(Node());
+				if (node)
+					nodes[node].next.push_back(std::make_pair(chr, child));
+				else
+					rootnext[chr] = child;
+				linked = false;
+			}
+			node = child;
+		}
+
+		// A node which did not end a literal before changes the output links of the nodes below it
+		if (nodes[node].filters.empty())
+			linked = false;
+		nodes[node].filters.push_back(filter);
+		return node;
+	}
+
+	/** Set the fail and output links of every node, breadth first
+	 */
+	void Link()
+	{
+		std::vector<unsigned int> queue;
+		for (unsigned int chr = 0; chr < 256; ++chr)
+		{
+			if (rootnext[chr])
+				queue.push_back(rootnext[chr]);
+		}
+
+		for (size_t pos = 0; pos < queue.size(); ++pos)
+		{
+			const unsigned int node = queue[pos];
+			for (size_t i = 0; i < nodes[node].next.size(); ++i)
+			{
+				const unsigned char chr = nodes[node].next[i].first;
+				const unsigned int child = nodes[node].next[i].second;
+
+				unsigned int fail = nodes[node].fail;
+				while ((fail) && (!Find(fail, chr)))
+					fail = nodes[fail].fail;
+				fail = Find(fail, chr);
+
+				nodes[child].fail = fail;
+				nodes[child].output = nodes[fail].filters.empty() ? nodes[fail].output : fail;
+				queue.push_back(child);
+			}
+		}
+		linked = true;
+	}
+
+	/** Build regexset from setfilters, filters which can not be put in the set become candidates for every text
+	 */
+	void BuildSet()
+	{
+		delete regexset;
+		regexset = NULL;
+		setstale = false;
+
+		if ((setfilters.empty()) || (!factory) || (!(regexset = factory->CreateSet())))
+		{
+			for (std::vector<std::pair<unsigned int, Regex*> >::const_iterator i = setfilters.begin(); i != setfilters.end(); ++i)
+				entries[i->first].type = ENTRY_NONE;
+			setfilters.clear();
+			return;
+		}
+
+		for (std::vector<std::pair<unsigned int, Regex*> >::iterator i = setfilters.begin(); i != setfilters.end(); )
+		{
+			try
+			{
+				regexset->Add(i->second->GetRegexString());
+				++i;
+			}
+			catch (ModuleException& e)
+			{
+				// The regex compiled on its own so the set should not reject it, but never lose a filter over it
+				ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Unable to add '%s' to the regex set: %s", i->second->GetRegexString().c_str(), e.GetReason().c_str());
+				entries[i->first].type = ENTRY_NONE;
+				i = setfilters.erase(i);
+			}
+		}
+
+		try
+		{
+			if (!setfilters.empty())
+				regexset->Compile();
+		}
+		catch (ModuleException& e)
+		{
+			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Unable to build the regex set: %s", e.GetReason().c_str());
+			for (std::vector<std::pair<unsigned int, Regex*> >::const_iterator i = setfilters.begin(); i != setfilters.end(); ++i)
+				entries[i->first].type = ENTRY_NONE;
+			setfilters.clear();
+		}
+
+		if (setfilters.empty())
+		{
+			delete regexset;
+			regexset = NULL;
+		}
+	}
+
+ public:
+	FilterIndex() : generation(0), regexset(NULL)
+	{
+		Clear();
+	}
+
+	~FilterIndex()
+	{
+		delete regexset;
+	}
+
+	/** Forget all filters, this must be called before the regex engine which created the set is unloaded
+	 */
+	void Clear()
+	{
+		nodes.assign(1, Node());
+		memset(rootnext, 0, sizeof(rootnext));
+		memcpy(casemap, national_case_insensitive_map, sizeof(casemap));
+		linked = true;
+		entries.clear();
+		factory = NULL;
+		delete regexset;
+		regexset = NULL;
+		setfilters.clear();
+		setstale = false;
+	}
+
+	/** Check whether the case map the literals were folded with is still the national case map
+	 */
+	bool IsCurrent() const
+	{
+		return !memcmp(casemap, national_case_insensitive_map, sizeof(casemap));
+	}
+
+	/** Add a filter to the index
+	 * @param id The id of the filter, which must not be in the index
+	 * @param regex The regex of the filter
+	 * @param engine The regex engine, used to create a set
+	 */
+	void Add(unsigned int id, Regex* regex, RegexFactory* engine)
+	{
+		if (id >= entries.size())
+			entries.resize(id + 1);
+
+		Entry& entry = entries[id];
+		std::string literal;
+		if (regex->GetRequiredLiteral(literal))
+		{
+			entry.type = ENTRY_LITERAL;
+			entry.node = AddLiteral(literal, id);
+		}
+		else if (engine)
+		{
+			entry.type = ENTRY_SET;
+			factory = engine;
+			setfilters.push_back(std::make_pair(id, regex));
+			setstale = true;
+		}
+		else
+		{
+			entry.type = ENTRY_NONE;
+		}
+	}
+
+	/** Remove a filter from the index
+	 * @param id The id of the filter
+	 */
+	void Remove(unsigned int id)
+	{
+		if (id >= entries.size())
+			return;
+
+		Entry& entry = entries[id];
+		if (entry.type == ENTRY_LITERAL)
+		{
+			// The node stays in the automaton, output links to it are skipped over by Scan() once it ends no literal
+			stdalgo::erase(nodes[entry.node].filters, id);
+		}
+		else if (entry.type == ENTRY_SET)
+		{
+			for (std::vector<std::pair<unsigned int, Regex*> >::iterator i = setfilters.begin(); i != setfilters.end(); ++i)
+			{
+				if (i->first == id)
+				{
+					setfilters.erase(i);
+					setstale = true;
+					break;
+				}
+			}
+		}
+		entry = Entry();
+	}
+
+	/** Find the candidate filters for a text
+	 * @param text The text to scan
+	 */
+	void Scan(const std::string& text)
+	{
+		if (!linked)
+			Link();
+		if (setstale)
+			BuildSet();
+
+		generation++;
+
+		unsigned int state = 0;
+		for (std::string::const_iterator i = text.begin(); i != text.end(); ++i)
+		{
+			const unsigned char chr = national_case_insensitive_map[static_cast<unsigned char>(*i)];
+			unsigned int next;
+			while ((!(next = Find(state, chr))) && (state))
+				state = nodes[state].fail;
+			state = next;
+
+			for (unsigned int out = nodes[state].filters.empty() ? nodes[state].output : state; out; out = nodes[out].output)
+			{
+				const std::vector<unsigned int>& filters = nodes[out].filters;
+				for (std::vector<unsigned int>::const_iterator f = filters.begin(); f != filters.end(); ++f)
+					entries[*f].found = generation;
+			}
+		}
+
+		if (regexset)
+		{
+			// If the set can not tell which regexes match, every filter in it has to be run
+			const bool matched = regexset->Match(text, setmatches);
+			if (matched)
+			{
+				for (std::vector<unsigned int>::const_iterator i = setmatches.begin(); i != setmatches.end(); ++i)
+					entries[setfilters[*i].first].found = generation;
+			}
+			else
+			{
+				for (std::vector<std::pair<unsigned int, Regex*> >::const_iterator i = setfilters.begin(); i != setfilters.end(); ++i)
+					entries[i->first].found = generation;
+			}
+		}
+	}
+
+	/** Check whether a filter may match the text given to the last Scan()
+	 * @param id The id of the filter
+	 * @return True if the filter has to be run, false if it can not match
+	 */
+	bool MayMatch(unsigned int id) const
+	{
+		const Entry& entry = entries[id];
+		return ((entry.type == ENTRY_NONE) || (entry.found == generation));
+	}
+};
+
 class CommandFilter : public Command
 {
  public:
@@ -160,7 +542,20 @@ class ModuleFilter : public Module
 
 	bool initing;
 	RegexFactory* factory;
+
+	/** Indexes of the filters for messages as sent and with colours stripped, by flag_strip_color
+	 */
+	FilterIndex indexes[2];
+
+	/** Ids of removed filters, reused before new ids are allocated from nextid
+	 */
+	std::vector<unsigned int> freeids;
+	unsigned int nextid;
+
 	void FreeFilters();
+	void BuildIndexes();
+	void IndexFilter(FilterResult& filter);
+	void UnindexFilter(const FilterResult& filter);
 
  public:
 	CommandFilter filtcommand;
@@ -292,7 +687,7 @@ bool ModuleFilter::AppliesToMe(User* user, FilterResult* filter, int iflags)
 }
 
 ModuleFilter::ModuleFilter()
-	: initing(true), filtcommand(this), RegexEngine(this, "regex")
+	: initing(true), nextid(0), filtcommand(this), RegexEngine(this, "regex")
 {
 }
 
@@ -308,6 +703,41 @@ void ModuleFilter::FreeFilters()
 		delete i->regex;
 
 	filters.clear();
+	indexes[0].Clear();
+	indexes[1].Clear();
+	freeids.clear();
+	nextid = 0;
+}
+
+void ModuleFilter::BuildIndexes()
+{
+	RegexFactory* engine = RegexEngine ? RegexEngine.operator->() : NULL;
+	indexes[0].Clear();
+	indexes[1].Clear();
+	for (std::vector<FilterResult>::const_iterator i = filters.begin(); i != filters.end(); ++i)
+		indexes[i->flag_strip_color].Add(i->id, i->regex, engine);
+}
+
+void ModuleFilter::IndexFilter(FilterResult& filter)
+{
+	if (freeids.empty())
+	{
+		filter.id = nextid++;
+	}
+	else
+	{
+		filter.id = freeids.back();
+		freeids.pop_back();
+	}
+
+	RegexFactory* engine = RegexEngine ? RegexEngine.operator->() : NULL;
+	indexes[filter.flag_strip_color].Add(filter.id, filter.regex, engine);
+}
+
+void ModuleFilter::UnindexFilter(const FilterResult& filter)
+{
+	indexes[filter.flag_strip_color].Remove(filter.id);
+	freeids.push_back(filter.id);
 }
 
 ModResult ModuleFilter::OnUserPreMessage(User* user, void* dest, int target_type, std::string& text, char status, CUList& exempt_list, MessageType msgtype)
@@ -574,6 +1004,12 @@ FilterResult* ModuleFilter::FilterMatch(User* user, const std::string &text, int
 	static std::string stripped_text;
 	stripped_text.clear();
 
+	// Both indexes are built at the same time so checking one is enough
+	if (!indexes[0].IsCurrent())
+		BuildIndexes();
+
+	// Each text is scanned for candidates the first time a filter which applies needs it
+	bool scanned[2] = { false, false };
 	for (std::vector<FilterResult>::iterator i = filters.begin(); i != filters.end(); ++i)
 	{
 		FilterResult* filter = &*i;
@@ -588,7 +1024,18 @@ FilterResult* ModuleFilter::FilterMatch(User* user, const std::string &text, int
 			InspIRCd::StripColor(stripped_text);
 		}
 
-		if (filter->regex->Matches(filter->flag_strip_color ? stripped_text : text))
+		const std::string& subject = filter->flag_strip_color ? stripped_text : text;
+		FilterIndex& index = indexes[filter->flag_strip_color];
+		if (!scanned[filter->flag_strip_color])
+		{
+			index.Scan(subject);
+			scanned[filter->flag_strip_color] = true;
+		}
+
+		if (!index.MayMatch(filter->id))
+			continue;
+
+		if (filter->regex->Matches(subject))
 			return filter;
 	}
 	return NULL;
@@ -600,6 +1047,7 @@ bool ModuleFilter::DeleteFilter(const std::string &freeform)
 	{
 		if (i->freeform == freeform)
 		{
+			UnindexFilter(*i);
 			delete i->regex;
 			filters.erase(i);
 			return true;
@@ -621,6 +1069,7 @@ std::pair<bool, std::string> ModuleFilter::AddFilter(const std::string &freeform
 	try
 	{
 		filters.push_back(FilterResult(RegexEngine, freeform, reason, type, duration, flgs));
+		IndexFilter(filters.back());
 	}
 	catch (ModuleException &e)
 	{
@@ -684,6 +1133,7 @@ void ModuleFilter::ReadFilters()
 		try
 		{
 			filters.push_back(FilterResult(RegexEngine, pattern, reason, fa, gline_time, flgs));
+			IndexFilter(filters.back());
 			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Regular expression %s loaded.", pattern.c_str());
 		}
 		catch (ModuleException &e)
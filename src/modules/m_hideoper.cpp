@@ -71,8 +71,8 @@ class ModuleHideOper : public Module
 			std::string::size_type pos = line.find("*");
 			if (pos != std::string::npos)
 				line.erase(pos, 1);
-			// hide the line completely if doing a "/who * o" query
-			if (params.size() > 1 && params[1].find('o') != std::string::npos)
+			// hide the line completely if doing a "/who * o" query, WHOX fields after a '%' are not flags
+			if (params.size() > 1 && params[1].find('o') < params[1].find('%'))
 				line.clear();
 		}
 	}
@@ -140,7 +140,23 @@ class ModuleHttpStats : public Module, public HTTPRequestEventListener
 					Version v = i->second->GetVersion();
 					data << "<module><name>" << i->first << "</name><description>" << Sanitize(v.description) << "</description></module>";
 				}
-				data << "</modulelist><channellist>";
+				data << "</modulelist><hookprofile>";
+
+				for (ModuleManager::ModuleMap::const_iterator i = mods.begin(); i != mods.end(); ++i)
+				{
+					const std::vector<HookProfile>& profiles = i->second->HookProfiles;
+					for (size_t hook = 0; hook < profiles.size(); ++hook)
+					{
+						const HookProfile& profile = profiles[hook];
+						if (!profile.calls)
+							continue;
+
+						data << "<hook><module>" << i->first << "</module><name>" << HookProfile::GetHookName(static_cast<Implementation>(hook))
+							<< "</name><calls>" << profile.calls << "</calls><time>" << profile.time / 1000
+							<< "</time><maxtime>" << profile.maxtime / 1000 << "</maxtime></hook>";
+					}
+				}
+				data << "</hookprofile><channellist>";
 
 				const chan_hash& chans = ServerInstance->GetChans();
 				for (chan_hash::const_iterator i = chans.begin(); i != chans.end(); ++i)
@@ -46,7 +46,10 @@ class ModuleIRCv3 : public Module, public AccountEventListener
 	GenericCap cap_awaynotify;
 	GenericCap cap_extendedjoin;
 
-	CUList last_excepts;
+	/** Users who don't see the JOIN of an away user because of other modules, by membership. Several users
+	 * can join before OnPostJoin() is called for them when a server sends them in one FJOIN.
+	 */
+	std::map<Membership*, CUList> away_excepts;
 
  public:
 	ModuleIRCv3()
@@ -83,7 +86,7 @@ class ModuleIRCv3 : public Module, public AccountEventListener
 	{
 		// Remember who is not going to see the JOIN because of other modules
 		if ((cap_awaynotify.IsActive()) && (memb->user->IsAway()))
-			last_excepts = excepts;
+			away_excepts[memb] = excepts;
 
 		if (!cap_extendedjoin.IsActive())
 			return;
@@ -169,6 +172,14 @@ class ModuleIRCv3 : public Module, public AccountEventListener
 
 	void OnPostJoin(Membership *memb) CXX11_OVERRIDE
 	{
+		std::map<Membership*, CUList>::iterator exc = away_excepts.find(memb);
+		if (exc == away_excepts.end())
+			return;
+
+		CUList excepts;
+		excepts.swap(exc->second);
+		away_excepts.erase(exc);
+
 		if ((!cap_awaynotify.IsActive()) || (!memb->user->IsAway()))
 			return;
 
@@ -179,13 +190,11 @@ class ModuleIRCv3 : public Module, public AccountEventListener
 		{
 			// Send the away notify line if the current member is local, has the away-notify cap and isn't excepted
 			User* member = IS_LOCAL(it->first);
-			if ((member) && (cap_awaynotify.ext.get(member)) && (last_excepts.find(member) == last_excepts.end()))
+			if ((member) && (cap_awaynotify.ext.get(member)) && (excepts.find(member) == excepts.end()))
 			{
 				member->Write(line);
 			}
 		}
-
-		last_excepts.clear();
 	}
 
 	void Prioritize()
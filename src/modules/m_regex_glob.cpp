@@ -23,14 +23,33 @@
 
 class GlobRegex : public Regex
 {
+	CompiledMask mask;
+
 public:
-	GlobRegex(const std::string& rx) : Regex(rx)
+	GlobRegex(const std::string& rx) : Regex(rx), mask(rx)
 	{
 	}
 
 	bool Matches(const std::string& text) CXX11_OVERRIDE
 	{
-		return InspIRCd::Match(text, this->regex_string);
+		return mask.Match(text);
+	}
+
+	bool GetRequiredLiteral(std::string& literal) const CXX11_OVERRIDE
+	{
+		// Every match contains the longest run of the mask without wildcards
+		literal.clear();
+		std::string::size_type start = 0;
+		while (start < regex_string.length())
+		{
+			std::string::size_type end = regex_string.find_first_of("*?", start);
+			if (end == std::string::npos)
+				end = regex_string.length();
+			if (end - start > literal.length())
+				literal.assign(regex_string, start, end - start);
+			start = end + 1;
+		}
+		return !literal.empty();
 	}
 };
 
@@ -19,6 +19,11 @@
 
 #include "inspircd.h"
 
+#ifdef INSPIRCD_ENABLE_TESTSUITE
+#include <iomanip>
+#include <iostream>
+#endif
+
 class ChannelSettings
 {
  public:
@@ -64,7 +69,8 @@ class RepeatMode : public ParamMode<RepeatMode, SimpleExtItem<ChannelSettings> >
 	{
 		time_t ts;
 		std::string line;
-		RepeatItem(time_t TS, const std::string& Line) : ts(TS), line(Line) { }
+		size_t hash;
+		RepeatItem(time_t TS, const std::string& Line, size_t Hash) : ts(TS), line(Line), hash(Hash) { }
 	};
 
 	typedef std::deque<RepeatItem> RepeatItemList;
@@ -89,32 +95,157 @@ class RepeatMode : public ParamMode<RepeatMode, SimpleExtItem<ChannelSettings> >
 	std::vector<unsigned int> mx[2];
 	ModuleSettings ms;
 
-	bool CompareLines(const std::string& message, const std::string& historyline, unsigned int trigger)
+	/** The bits of each character of a line of at most 64 characters for MyersDistance(), only
+	 * calculated when a line has to be compared that is not identical
+	 */
+	class MatchVectors
 	{
-		if (message == historyline)
+		const std::string& line;
+		bool built;
+		uint64_t peq[256];
+
+	 public:
+		MatchVectors(const std::string& Line) : line(Line), built(false) { }
+
+		const uint64_t* Get()
+		{
+			if (!built)
+			{
+				memset(peq, 0, sizeof(peq));
+				for (std::string::size_type i = 0; i < line.size(); ++i)
+					peq[static_cast<unsigned char>(line[i])] |= static_cast<uint64_t>(1) << i;
+				built = true;
+			}
+			return peq;
+		}
+	};
+
+	/** Check whether a line is the same as, or within trigger edits of, a line in the backlog
+	 * @param message The new line
+	 * @param hash Hash of message
+	 * @param vectors Match vectors of message for MyersDistance(), or NULL if it is too long for them
+	 * @param item The line in the backlog
+	 * @param trigger Maximum edit distance, 0 to only match identical lines
+	 */
+	bool CompareLines(const std::string& message, size_t hash, MatchVectors* vectors, const RepeatItem& item, unsigned int trigger)
+	{
+		if ((item.hash == hash) && (item.line == message))
 			return true;
-		else if (trigger)
-			return (Levenshtein(message, historyline) <= trigger);
 
-		return false;
+		if (!trigger)
+			return false;
+
+		// Every character one line has over the other costs an edit
+		const std::string::size_type l1 = message.size();
+		const std::string::size_type l2 = item.line.size();
+		if (std::max(l1, l2) - std::min(l1, l2) > trigger)
+			return false;
+
+		if (vectors)
+			return (MyersDistance(vectors->Get(), l1, item.line, trigger) <= trigger);
+		return (BandedLevenshtein(message, item.line, trigger) <= trigger);
 	}
 
-	unsigned int Levenshtein(const std::string& s1, const std::string& s2)
+	/** Calculate the edit distance between a line of at most 64 characters and another line,
+	 * using the bit-parallel algorithm by Myers in the form given by Hyyrö for whole strings
+	 * @param peq For every character, the positions in the first line where it occurs as bits
+	 * @param length Length of the first line
+	 * @param text The other line
+	 * @param limit Distance to stop at, once the distance is known to be over it
+	 * @return The edit distance, or a number over limit if it is over limit
+	 */
+	static unsigned int MyersDistance(const uint64_t* peq, unsigned int length, const std::string& text, unsigned int limit)
 	{
-		unsigned int l1 = s1.size();
-		unsigned int l2 = s2.size();
+		if (!length)
+			return text.size();
+
+		const uint64_t last = static_cast<uint64_t>(1) << (length - 1);
+		uint64_t pv = ~static_cast<uint64_t>(0);
+		uint64_t mv = 0;
+		unsigned int score = length;
+		unsigned int remaining = text.size();
+		for (std::string::const_iterator i = text.begin(); i != text.end(); ++i)
+		{
+			const uint64_t eq = peq[static_cast<unsigned char>(*i)];
+			const uint64_t xv = eq | mv;
+			const uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+			uint64_t ph = mv | ~(xh | pv);
+			uint64_t mh = pv & xh;
+			if (ph & last)
+				score++;
+			else if (mh & last)
+				score--;
+
+			ph = (ph << 1) | 1;
+			mh <<= 1;
+			pv = mh | ~(xv | ph);
+			mv = ph & xv;
+
+			// Every remaining character can lower the distance by one at most
+			if (score > limit + --remaining)
+				return score - remaining;
+		}
+		return score;
+	}
 
-		for (unsigned int i = 0; i < l2; i++)
-			mx[0][i] = i;
-		for (unsigned int i = 0; i < l1; i++)
+	/** Calculate the edit distance between two lines, only looking at the cells of the matrix which
+	 * a path of at most limit edits can pass through (Ukkonen)
+	 * @param s1 The first line
+	 * @param s2 The second line, its length must be within limit of the length of s1
+	 * @param limit Distance to stop at, once the distance is known to be over it
+	 * @return The edit distance, or limit + 1 if it is over limit
+	 */
+	unsigned int BandedLevenshtein(const std::string& s1, const std::string& s2, unsigned int limit)
+	{
+		const int l1 = s1.size();
+		const int l2 = s2.size();
+		const unsigned int over = limit + 1;
+
+		// Passing through cell (i, j) costs at least |j - i| edits to get there and |d - (j - i)|
+		// edits from there to the end, so only cells with j - i in [lowoff, highoff] can be on a
+		// path of at most limit edits
+		const int d = l2 - l1;
+		const int slack = (static_cast<int>(limit) - std::abs(d)) / 2;
+		const int lowoff = std::min(0, d) - slack;
+		const int highoff = std::max(0, d) + slack;
+
+		// Cells just outside the band hold over, so they never lower a distance inside it
+		unsigned int* prev = &mx[0][0];
+		unsigned int* cur = &mx[1][0];
+		const int first = std::min(l2, highoff);
+		for (int j = 0; j <= first; j++)
+			prev[j] = j;
+		if (first < l2)
+			prev[first + 1] = over;
+
+		for (int i = 1; i <= l1; i++)
 		{
-			mx[1][0] = i + 1;
-			for (unsigned int j = 0; j < l2; j++)
-	            mx[1][j + 1] = std::min(std::min(mx[1][j] + 1, mx[0][j + 1] + 1), mx[0][j] + ((s1[i] == s2[j]) ? 0 : 1));
+			const int lo = std::max(1, i + lowoff);
+			const int hi = std::min(l2, i + highoff);
+			const char chr = s1[i - 1];
+
+			unsigned int left = (lo == 1) ? i : over;
+			unsigned int bound = (lo == 1) ? i + std::abs(d + i) : over;
+			cur[lo - 1] = left;
+			for (int j = lo; j <= hi; j++)
+			{
+				unsigned int cell = prev[j - 1] + ((chr == s2[j - 1]) ? 0 : 1);
+				cell = std::min(cell, left + 1);
+				cell = std::min(cell, prev[j] + 1);
+				cell = std::min(cell, over);
+				cur[j] = left = cell;
+				bound = std::min(bound, cell + std::abs(d - (j - i)));
+			}
+			if (hi < l2)
+				cur[hi + 1] = over;
 
-			mx[0].swap(mx[1]);
+			// Every path passes through this row, stop once none of them can stay within limit
+			if (bound > limit)
+				return over;
+
+			std::swap(prev, cur);
 		}
-		return mx[0][l2];
+		return prev[l2];
 	}
 
  public:
@@ -181,6 +312,11 @@ class RepeatMode : public ParamMode<RepeatMode, SimpleExtItem<ChannelSettings> >
 		const time_t now = ServerInstance->Time();
 
 		std::transform(message.begin(), message.end(), message.begin(), ::tolower);
+		const size_t hash = TR1NS::hash<std::string>()(message);
+
+		// Lines of up to 64 characters are compared with MyersDistance()
+		MatchVectors vectors(message);
+		MatchVectors* const bitparallel = (message.size() <= 64) ? &vectors : NULL;
 
 		for (std::deque<RepeatItem>::iterator it = items.begin(); it != items.end(); ++it)
 		{
@@ -191,7 +327,7 @@ class RepeatMode : public ParamMode<RepeatMode, SimpleExtItem<ChannelSettings> >
 				break;
 			}
 
-			if (CompareLines(message, it->line, trigger))
+			if (CompareLines(message, hash, bitparallel, *it, trigger))
 			{
 				if (++matches >= rs->Lines)
 				{
@@ -212,7 +348,7 @@ class RepeatMode : public ParamMode<RepeatMode, SimpleExtItem<ChannelSettings> >
 		if (items.size() >= max_items)
 			items.pop_back();
 
-		items.push_front(RepeatItem(now + rs->Seconds, message));
+		items.push_front(RepeatItem(now + rs->Seconds, message, hash));
 		rp->Counter = matches;
 		return false;
 	}
@@ -335,6 +471,164 @@ class RepeatMode : public ParamMode<RepeatMode, SimpleExtItem<ChannelSettings> >
 
 		return true;
 	}
+
+#ifdef INSPIRCD_ENABLE_TESTSUITE
+ public:
+	/** Edit distance over the whole matrix, used to check the faster functions against
+	 */
+	unsigned int FullLevenshtein(const std::string& s1, const std::string& s2)
+	{
+		unsigned int l1 = s1.size();
+		unsigned int l2 = s2.size();
+
+		for (unsigned int i = 0; i <= l2; i++)
+			mx[0][i] = i;
+		for (unsigned int i = 0; i < l1; i++)
+		{
+			mx[1][0] = i + 1;
+			for (unsigned int j = 0; j < l2; j++)
+				mx[1][j + 1] = std::min(std::min(mx[1][j] + 1, mx[0][j + 1] + 1), mx[0][j] + ((s1[i] == s2[j]) ? 0 : 1));
+
+			mx[0].swap(mx[1]);
+		}
+		return mx[0][l2];
+	}
+
+	static std::string RandomLine(unsigned int length)
+	{
+		static const char chars[] = "abcdefghij klmnop";
+		std::string line;
+		for (unsigned int i = 0; i < length; i++)
+			line.push_back(chars[ServerInstance->GenRandomInt(sizeof(chars) - 1)]);
+		return line;
+	}
+
+	static std::string Mutate(std::string line, unsigned int edits, unsigned int maxlength)
+	{
+		for (unsigned int i = 0; i < edits; i++)
+		{
+			const unsigned long pos = ServerInstance->GenRandomInt(line.size() + 1);
+			const unsigned long op = ServerInstance->GenRandomInt(3);
+			if ((op == 0) && (line.size() < maxlength))
+				line.insert(pos, 1, 'x');
+			else if (pos < line.size())
+			{
+				if (op == 1)
+					line.erase(pos, 1);
+				else
+					line[pos] = 'y';
+			}
+		}
+		return line;
+	}
+
+	bool CheckDistance(const std::string& s1, const std::string& s2, unsigned int limit)
+	{
+		const unsigned int full = FullLevenshtein(s1, s2);
+		const unsigned int l1 = s1.size();
+		const unsigned int l2 = s2.size();
+		if (std::max(l1, l2) - std::min(l1, l2) <= limit)
+		{
+			const unsigned int banded = BandedLevenshtein(s1, s2, limit);
+			if ((full <= limit) ? (banded != full) : (banded <= limit))
+				return false;
+		}
+
+		if (l1 <= 64)
+		{
+			MatchVectors vectors(s1);
+			const unsigned int myers = MyersDistance(vectors.Get(), l1, s2, limit);
+			if ((full <= limit) ? (myers != full) : (myers <= limit))
+				return false;
+		}
+		return true;
+	}
+
+	void RunTestSuite()
+	{
+		bool passed = true;
+		for (unsigned int i = 0; (i < 100000) && (passed); i++)
+		{
+			const std::string s1 = RandomLine(ServerInstance->GenRandomInt(90));
+			const std::string s2 = (i % 2) ? Mutate(s1, ServerInstance->GenRandomInt(12), ms.MaxMessageSize) : RandomLine(ServerInstance->GenRandomInt(90));
+			passed = CheckDistance(s1, s2, ServerInstance->GenRandomInt(25));
+		}
+		std::cout << "REPEAT: edit distance against the full matrix " << (passed ? "SUCCESS" : "FAILURE") << std::endl;
+
+		struct Load
+		{
+			const char* name;
+			unsigned int length;
+			unsigned int edits;
+			unsigned int diff;
+			bool related;
+		};
+
+		static const Load loads[] = {
+			{ "identical spam, 40 chars, 20% distance", 40, 0, 20, true },
+			{ "changed spam, 40 chars, 20% distance", 40, 4, 20, true },
+			{ "changed spam, 300 chars, 10% distance", 300, 15, 10, true },
+			{ "unrelated chat, 60 chars, 50% distance", 60, 0, 50, false },
+			{ "unrelated chat, 300 chars, 50% distance", 300, 0, 50, false }
+		};
+
+		const unsigned int backlog = 20;
+		const unsigned int messages = 100;
+		for (unsigned int l = 0; l < sizeof(loads) / sizeof(loads[0]); l++)
+		{
+			const Load& load = loads[l];
+			const std::string base = RandomLine(load.length);
+			std::vector<std::string> lines;
+			for (unsigned int i = 0; i < backlog + messages; i++)
+			{
+				if (load.related)
+					lines.push_back(Mutate(base, ServerInstance->GenRandomInt(load.edits + 1), ms.MaxMessageSize));
+				else
+					lines.push_back(RandomLine(load.length * 4 / 5 + ServerInstance->GenRandomInt(load.length * 2 / 5)));
+			}
+
+			std::deque<RepeatItem> items;
+			for (unsigned int i = 0; i < backlog; i++)
+				items.push_back(RepeatItem(0, lines[i], TR1NS::hash<std::string>()(lines[i])));
+
+			unsigned int fullmatches = 0;
+			uint64_t start = InspIRCd::GetMonotonicClock();
+			for (unsigned int m = backlog; m < lines.size(); m++)
+			{
+				const std::string& message = lines[m];
+				const unsigned int trigger = message.size() * load.diff / 100;
+				for (std::deque<RepeatItem>::const_iterator i = items.begin(); i != items.end(); ++i)
+				{
+					if ((message == i->line) || ((trigger) && (FullLevenshtein(message, i->line) <= trigger)))
+						fullmatches++;
+				}
+			}
+			const uint64_t full = InspIRCd::GetMonotonicClock() - start;
+
+			unsigned int matches = 0;
+			start = InspIRCd::GetMonotonicClock();
+			for (unsigned int m = backlog; m < lines.size(); m++)
+			{
+				const std::string& message = lines[m];
+				const unsigned int trigger = message.size() * load.diff / 100;
+				const size_t hash = TR1NS::hash<std::string>()(message);
+				MatchVectors vectors(message);
+				MatchVectors* const bitparallel = (message.size() <= 64) ? &vectors : NULL;
+				for (std::deque<RepeatItem>::const_iterator i = items.begin(); i != items.end(); ++i)
+				{
+					if (CompareLines(message, hash, bitparallel, *i, trigger))
+						matches++;
+				}
+			}
+			const uint64_t fast = InspIRCd::GetMonotonicClock() - start;
+
+			const double comparisons = double(messages) * backlog;
+			std::cout << std::fixed << std::setprecision(1) << "REPEAT: " << load.name << ": " << matches << " of "
+				<< messages * backlog << " lines match, " << full / comparisons << "ns per line with the full matrix, "
+				<< fast / comparisons << "ns now" << (matches == fullmatches ? "" : " FAILURE") << std::endl;
+		}
+	}
+#endif
 };
 
 class RepeatModule : public Module
@@ -392,6 +686,13 @@ class RepeatModule : public Module
 		ServerInstance->Modules->SetPriority(this, I_OnUserPreMessage, PRIORITY_LAST);
 	}
 
+#ifdef INSPIRCD_ENABLE_TESTSUITE
+	void OnRunTestSuite() CXX11_OVERRIDE
+	{
+		rm.RunTestSuite();
+	}
+#endif
+
 	Version GetVersion() CXX11_OVERRIDE
 	{
 		return Version("Provides the +E channel mode - for blocking of similiar messages", VF_COMMON|VF_VENDOR, rm.GetModuleSettings());
@@ -23,6 +23,7 @@
 
 #include "treeserver.h"
 #include "utils.h"
+#include "packed.h"
 #include "link.h"
 #include "main.h"
 
@@ -144,6 +145,12 @@ void TreeSocket::SendCapabilities(int phase)
 	if (proto_version == 1202)
 		extra.append(" PROTOCOL="+ConvToStr(ProtocolVersion));
 
+	if (Utils->PackedLinks)
+		extra.append(" PACKED="+ConvToStr(PackedProtocol::Version));
+
+	if (Utils->Creator->ZipLink)
+		extra.append(" ZIPLINK="+Utils->Creator->ZipLink->GetCapability());
+
 	this->WriteLine("CAPAB CAPABILITIES " /* Preprocessor does this one. */
 			":NICKMAX="+ConvToStr(ServerInstance->Config->Limits.NickMax)+
 			" CHANMAX="+ConvToStr(ServerInstance->Config->Limits.ChanMax)+
@@ -348,6 +355,17 @@ bool TreeSocket::Capab(const parameterlist &params)
 			this->SendError("CAPAB negotiation failed: "+reason);
 			return false;
 		}
+
+		// Lines sent to the server are translated if it uses an older protocol version
+		compat = GetCompatTable(proto_version);
+
+		// Switch to the packed protocol after BURST if both servers support the same version of it
+		n = this->capab->CapKeys.find("PACKED");
+		packed = ((Utils->PackedLinks) && (proto_version == ProtocolVersion) && (n != this->capab->CapKeys.end()) && (n->second == ConvToStr(PackedProtocol::Version)));
+
+		// Compress what is sent after BURST if both servers support the same compression
+		n = this->capab->CapKeys.find("ZIPLINK");
+		zip = ((Utils->Creator->ZipLink) && (n != this->capab->CapKeys.end()) && (n->second == Utils->Creator->ZipLink->GetCapability()));
 	}
 	else if ((params[0] == "MODULES") && (params.size() == 2))
 	{
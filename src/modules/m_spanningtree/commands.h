@@ -114,7 +114,6 @@ class CommandOpertype : public UserOnlyServerCommand<CommandOpertype>
 };
 
 class TreeSocket;
-class FwdFJoinBuilder;
 class CommandFJoin : public ServerCommand
 {
 	/** Remove all modes from a channel, including statusmodes (+qaovh etc), simplemodes, parameter modes.
@@ -130,7 +129,13 @@ class CommandFJoin : public ServerCommand
 	 * @param newname The new name of the channel; must be the same or a case change of the current name
 	 */
 	static void LowerTS(Channel* chan, time_t TS, const std::string& newname);
-	void ProcessModeUUIDPair(const std::string& item, TreeServer* sourceserver, Channel* chan, Modes::ChangeList* modechangelist, FwdFJoinBuilder& fwdfjoin);
+	/** Find the user of a member in an FJOIN and add their prefix modes to the mode change list
+	 * @param item The member, [[<modes>,]<uuid>[:<membid>]
+	 * @param sourceserver The server the FJOIN came from
+	 * @param modechangelist The list to add the prefix modes to, NULL if they are not applied
+	 * @return The user, or NULL if they do not exist or are not behind sourceserver
+	 */
+	User* ProcessModeUUIDPair(const std::string& item, TreeServer* sourceserver, Modes::ChangeList* modechangelist);
  public:
 	CommandFJoin(Module* Creator) : ServerCommand(Creator, "FJOIN", 3) { }
 	CmdResult Handle(User* user, std::vector<std::string>& params);
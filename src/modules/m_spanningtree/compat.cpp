@@ -21,12 +21,22 @@
 #include "main.h"
 #include "treesocket.h"
 #include "treeserver.h"
+#include "packed.h"
 
 static std::string newline("\n");
 
 void TreeSocket::WriteLineNoCompat(const std::string& line)
 {
 	ServerInstance->Logs->Log(MODNAME, LOG_RAWIO, "S[%d] O %s", this->GetFd(), line.c_str());
+	if (packedout)
+	{
+		// Reuse the buffer so encoding a frame does not have to grow a new string every time
+		static std::string frame;
+		frame.clear();
+		PackedProtocol::Serialize(line, frame);
+		this->WriteData(frame);
+		return;
+	}
 	this->WriteData(line);
 	this->WriteData(newline);
 }
@@ -41,264 +51,326 @@ void TreeSocket::WriteLine(const std::string& original_line)
 			WriteLine(":" + ServerInstance->Config->GetSID() + " " + original_line);
 			return;
 		}
-		if (proto_version != ProtocolVersion)
+		if (compat)
 		{
-			std::string line = original_line;
-			std::string::size_type a = line.find(' ');
-			std::string::size_type b = line.find(' ', a + 1);
-			std::string command(line, a + 1, b-a-1);
-			// now try to find a translation entry
-			// TODO a more efficient lookup method will be needed later
-			if (proto_version < 1205)
+			// Only lines with a command that has to be translated are copied
+			const std::string::size_type a = original_line.find(' ');
+			const std::string::size_type b = original_line.find(' ', a + 1);
+			CompatTable::const_iterator i = compat->find(original_line.substr(a + 1, b-a-1));
+			if (i != compat->end())
 			{
-				if (command == "IJOIN")
-				{
-					// Convert
-					// :<uid> IJOIN <chan> <membid> [<ts> [<flags>]]
-					// to
-					// :<sid> FJOIN <chan> <ts> + [<flags>],<uuid>
-					std::string::size_type c = line.find(' ', b + 1);
-					if (c == std::string::npos)
-						return;
-
-					std::string::size_type d = line.find(' ', c + 1);
-					// Erase membership id first
-					line.erase(c, d-c);
-					if (d == std::string::npos)
-					{
-						// No TS or modes in the command
-						// :22DAAAAAB IJOIN #chan
-						const std::string channame(line, b+1, c-b-1);
-						Channel* chan = ServerInstance->FindChan(channame);
-						if (!chan)
-							return;
-
-						line.push_back(' ');
-						line.append(ConvToStr(chan->age));
-						line.append(" + ,");
-					}
-					else
-					{
-						d = line.find(' ', c + 1);
-						if (d == std::string::npos)
-						{
-							// TS present, no modes
-							// :22DAAAAAC IJOIN #chan 12345
-							line.append(" + ,");
-						}
-						else
-						{
-							// Both TS and modes are present
-							// :22DAAAAAC IJOIN #chan 12345 ov
-							std::string::size_type e = line.find(' ', d + 1);
-							if (e != std::string::npos)
-								line.erase(e);
-
-							line.insert(d, " +");
-							line.push_back(',');
-						}
-					}
-
-					// Move the uuid to the end and replace the I with an F
-					line.append(line.substr(1, 9));
-					line.erase(4, 6);
-					line[5] = 'F';
-				}
-				else if (command == "RESYNC")
-					return;
-				else if (command == "METADATA")
-				{
-					// Drop TS for channel METADATA, translate METADATA operquit into an OPERQUIT command
-					// :sid METADATA #target TS extname ...
-					//     A        B       C  D
-					if (b == std::string::npos)
-						return;
-
-					std::string::size_type c = line.find(' ', b + 1);
-					if (c == std::string::npos)
-						return;
-
-					std::string::size_type d = line.find(' ', c + 1);
-					if (d == std::string::npos)
-						return;
-
-					if (line[b + 1] == '#')
-					{
-						// We're sending channel metadata
-						line.erase(c, d-c);
-					}
-					else if (!line.compare(c, d-c, " operquit", 9))
-					{
-						// ":22D METADATA 22DAAAAAX operquit :message" -> ":22DAAAAAX OPERQUIT :message"
-						line = ":" + line.substr(b+1, c-b) + "OPERQUIT" + line.substr(d);
-					}
-				}
-				else if (command == "FTOPIC")
-				{
-					// Drop channel TS for FTOPIC
-					// :sid FTOPIC #target TS TopicTS setter :newtopic
-					//     A      B       C  D       E      F
-					// :uid FTOPIC #target TS TopicTS :newtopic
-					//     A      B       C  D       E
-					if (b == std::string::npos)
-						return;
-
-					std::string::size_type c = line.find(' ', b + 1);
-					if (c == std::string::npos)
-						return;
-
-					std::string::size_type d = line.find(' ', c + 1);
-					if (d == std::string::npos)
-						return;
-
-					std::string::size_type e = line.find(' ', d + 1);
-					if (line[e+1] == ':')
-					{
-						line.erase(c, e-c);
-						line.erase(a+1, 1);
-					}
-					else
-						line.erase(c, d-c);
-				}
-				else if ((command == "PING") || (command == "PONG"))
-				{
-					// :22D PING 20D
-					if (line.length() < 13)
-						return;
-
-					// Insert the source SID (and a space) between the command and the first parameter
-					line.insert(10, line.substr(1, 4));
-				}
-				else if (command == "OPERTYPE")
-				{
-					std::string::size_type colon = line.find(':', b);
-					if (colon != std::string::npos)
-					{
-						for (std::string::iterator i = line.begin()+colon; i != line.end(); ++i)
-						{
-							if (*i == ' ')
-								*i = '_';
-						}
-						line.erase(colon, 1);
-					}
-				}
-				else if (command == "INVITE")
-				{
-					// :22D INVITE 22DAAAAAN #chan TS ExpirationTime
-					//     A      B         C     D  E
-					if (b == std::string::npos)
-						return;
-
-					std::string::size_type c = line.find(' ', b + 1);
-					if (c == std::string::npos)
-						return;
-
-					std::string::size_type d = line.find(' ', c + 1);
-					if (d == std::string::npos)
-						return;
-
-					std::string::size_type e = line.find(' ', d + 1);
-					// If there is no expiration time then everything will be erased from 'd'
-					line.erase(d, e-d);
-				}
-				else if (command == "FJOIN")
-				{
-					// Strip membership ids
-					// :22D FJOIN #chan 1234 +f 4:3 :o,22DAAAAAB:15 o,22DAAAAAA:15
-					// :22D FJOIN #chan 1234 +f 4:3 o,22DAAAAAB:15
-					// :22D FJOIN #chan 1234 +Pf 4:3 :
-
-					// If the last parameter is prefixed by a colon then it's a userlist which may have 0 or more users;
-					// if it isn't, then it is a single member
-					std::string::size_type spcolon = line.find(" :");
-					if (spcolon != std::string::npos)
-					{
-						spcolon++;
-						// Loop while there is a ':' in the userlist, this is never true if the channel is empty
-						std::string::size_type pos = std::string::npos;
-						while ((pos = line.rfind(':', pos-1)) > spcolon)
-						{
-							// Find the next space after the ':'
-							std::string::size_type sp = line.find(' ', pos);
-							// Erase characters between the ':' and the next space after it, including the ':' but not the space;
-							// if there is no next space, everything will be erased between pos and the end of the line
-							line.erase(pos, sp-pos);
-						}
-					}
-					else
-					{
-						// Last parameter is a single member
-						std::string::size_type sp = line.rfind(' ');
-						std::string::size_type colon = line.find(':', sp);
-						line.erase(colon);
-					}
-				}
-				else if (command == "KICK")
-				{
-					// Strip membership id if the KICK has one
-					if (b == std::string::npos)
-						return;
-
-					std::string::size_type c = line.find(' ', b + 1);
-					if (c == std::string::npos)
-						return;
-
-					std::string::size_type d = line.find(' ', c + 1);
-					if ((d < line.size()-1) && (original_line[d+1] != ':'))
-					{
-						// There is a third parameter which doesn't begin with a colon, erase it
-						std::string::size_type e = line.find(' ', d + 1);
-						line.erase(d, e-d);
-					}
-				}
-				else if (command == "SINFO")
-				{
-					// :22D SINFO version :InspIRCd-2.2
-					//     A     B       C
-					std::string::size_type c = line.find(' ', b + 1);
-					if (c == std::string::npos)
-						return;
-
-					// Only translating SINFO version, discard everything else
-					if (line.compare(b, 9, " version ", 9))
-						return;
-
-					line = line.substr(0, 5) + "VERSION" + line.substr(c);
-				}
-				else if (command == "SERVER")
-				{
-					// :001 SERVER inspircd.test 002 [<anything> ...] :gecos
-					//     A      B             C
-					std::string::size_type c = line.find(' ', b + 1);
-					if (c == std::string::npos)
-						return;
-
-					std::string::size_type d = c + 4;
-					std::string::size_type spcolon = line.find(" :", d);
-					if (spcolon == std::string::npos)
-						return;
-
-					line.erase(d, spcolon-d);
-					line.insert(c, " * 0");
-
-					if (burstsent)
-					{
-						WriteLineNoCompat(line);
-
-						// Synthesize a :<newserver> BURST <time> message
-						spcolon = line.find(" :");
-						line = CmdBuilder(line.substr(spcolon-3, 3), "BURST").push_int(ServerInstance->Time()).str();
-					}
-				}
+				std::string line = original_line;
+				if ((this->*(i->second))(line, a, b))
+					WriteLineNoCompat(line);
+				return;
 			}
-			WriteLineNoCompat(line);
-			return;
 		}
 	}
 
 	WriteLineNoCompat(original_line);
 }
 
+void TreeSocket::WriteLine(const std::string& line, std::string& packedline)
+{
+	// Servers using the packed protocol never need translation and every broadcast line has a source
+	if ((!packedout) || (line.empty()) || (line[0] != ':'))
+	{
+		WriteLine(line);
+		return;
+	}
+
+	ServerInstance->Logs->Log(MODNAME, LOG_RAWIO, "S[%d] O %s", this->GetFd(), line.c_str());
+	if (packedline.empty())
+		PackedProtocol::Serialize(line, packedline);
+	this->WriteData(packedline);
+}
+
+const TreeSocket::CompatTable* TreeSocket::GetCompatTable(int version)
+{
+	if (version >= 1205)
+		return NULL;
+
+	static CompatTable table;
+	if (table.empty())
+	{
+		table["IJOIN"] = &TreeSocket::TranslateIJOIN;
+		table["RESYNC"] = &TreeSocket::DropLine;
+		table["METADATA"] = &TreeSocket::TranslateMETADATA;
+		table["FTOPIC"] = &TreeSocket::TranslateFTOPIC;
+		table["PING"] = &TreeSocket::TranslatePING;
+		table["PONG"] = &TreeSocket::TranslatePING;
+		table["OPERTYPE"] = &TreeSocket::TranslateOPERTYPE;
+		table["INVITE"] = &TreeSocket::TranslateINVITE;
+		table["FJOIN"] = &TreeSocket::TranslateFJOIN;
+		table["KICK"] = &TreeSocket::TranslateKICK;
+		table["SINFO"] = &TreeSocket::TranslateSINFO;
+		table["SERVER"] = &TreeSocket::TranslateSERVER;
+	}
+	return &table;
+}
+
+bool TreeSocket::TranslateIJOIN(std::string& line, std::string::size_type a, std::string::size_type b)
+{
+	// Convert
+	// :<uid> IJOIN <chan> <membid> [<ts> [<flags>]]
+	// to
+	// :<sid> FJOIN <chan> <ts> + [<flags>],<uuid>
+	std::string::size_type c = line.find(' ', b + 1);
+	if (c == std::string::npos)
+		return false;
+
+	std::string::size_type d = line.find(' ', c + 1);
+	// Erase membership id first
+	line.erase(c, d-c);
+	if (d == std::string::npos)
+	{
+		// No TS or modes in the command
+		// :22DAAAAAB IJOIN #chan
+		const std::string channame(line, b+1, c-b-1);
+		Channel* chan = ServerInstance->FindChan(channame);
+		if (!chan)
+			return false;
+
+		line.push_back(' ');
+		line.append(ConvToStr(chan->age));
+		line.append(" + ,");
+	}
+	else
+	{
+		d = line.find(' ', c + 1);
+		if (d == std::string::npos)
+		{
+			// TS present, no modes
+			// :22DAAAAAC IJOIN #chan 12345
+			line.append(" + ,");
+		}
+		else
+		{
+			// Both TS and modes are present
+			// :22DAAAAAC IJOIN #chan 12345 ov
+			std::string::size_type e = line.find(' ', d + 1);
+			if (e != std::string::npos)
+				line.erase(e);
+
+			line.insert(d, " +");
+			line.push_back(',');
+		}
+	}
+
+	// Move the uuid to the end and replace the I with an F
+	line.append(line.substr(1, 9));
+	line.erase(4, 6);
+	line[5] = 'F';
+	return true;
+}
+
+bool TreeSocket::TranslateMETADATA(std::string& line, std::string::size_type a, std::string::size_type b)
+{
+	// Drop TS for channel METADATA, translate METADATA operquit into an OPERQUIT command
+	// :sid METADATA #target TS extname ...
+	//     A        B       C  D
+	if (b == std::string::npos)
+		return false;
+
+	std::string::size_type c = line.find(' ', b + 1);
+	if (c == std::string::npos)
+		return false;
+
+	std::string::size_type d = line.find(' ', c + 1);
+	if (d == std::string::npos)
+		return false;
+
+	if (line[b + 1] == '#')
+	{
+		// We're sending channel metadata
+		line.erase(c, d-c);
+	}
+	else if (!line.compare(c, d-c, " operquit", 9))
+	{
+		// ":22D METADATA 22DAAAAAX operquit :message" -> ":22DAAAAAX OPERQUIT :message"
+		line = ":" + line.substr(b+1, c-b) + "OPERQUIT" + line.substr(d);
+	}
+	return true;
+}
+
+bool TreeSocket::TranslateFTOPIC(std::string& line, std::string::size_type a, std::string::size_type b)
+{
+	// Drop channel TS for FTOPIC
+	// :sid FTOPIC #target TS TopicTS setter :newtopic
+	//     A      B       C  D       E      F
+	// :uid FTOPIC #target TS TopicTS :newtopic
+	//     A      B       C  D       E
+	if (b == std::string::npos)
+		return false;
+
+	std::string::size_type c = line.find(' ', b + 1);
+	if (c == std::string::npos)
+		return false;
+
+	std::string::size_type d = line.find(' ', c + 1);
+	if (d == std::string::npos)
+		return false;
+
+	std::string::size_type e = line.find(' ', d + 1);
+	if (line[e+1] == ':')
+	{
+		line.erase(c, e-c);
+		line.erase(a+1, 1);
+	}
+	else
+		line.erase(c, d-c);
+	return true;
+}
+
+bool TreeSocket::TranslatePING(std::string& line, std::string::size_type a, std::string::size_type b)
+{
+	// :22D PING 20D
+	if (line.length() < 13)
+		return false;
+
+	// Insert the source SID (and a space) between the command and the first parameter
+	line.insert(10, line.substr(1, 4));
+	return true;
+}
+
+bool TreeSocket::TranslateOPERTYPE(std::string& line, std::string::size_type a, std::string::size_type b)
+{
+	std::string::size_type colon = line.find(':', b);
+	if (colon != std::string::npos)
+	{
+		for (std::string::iterator i = line.begin()+colon; i != line.end(); ++i)
+		{
+			if (*i == ' ')
+				*i = '_';
+		}
+		line.erase(colon, 1);
+	}
+	return true;
+}
+
+bool TreeSocket::TranslateINVITE(std::string& line, std::string::size_type a, std::string::size_type b)
+{
+	// :22D INVITE 22DAAAAAN #chan TS ExpirationTime
+	//     A      B         C     D  E
+	if (b == std::string::npos)
+		return false;
+
+	std::string::size_type c = line.find(' ', b + 1);
+	if (c == std::string::npos)
+		return false;
+
+	std::string::size_type d = line.find(' ', c + 1);
+	if (d == std::string::npos)
+		return false;
+
+	std::string::size_type e = line.find(' ', d + 1);
+	// If there is no expiration time then everything will be erased from 'd'
+	line.erase(d, e-d);
+	return true;
+}
+
+bool TreeSocket::TranslateFJOIN(std::string& line, std::string::size_type a, std::string::size_type b)
+{
+	// Strip membership ids
+	// :22D FJOIN #chan 1234 +f 4:3 :o,22DAAAAAB:15 o,22DAAAAAA:15
+	// :22D FJOIN #chan 1234 +f 4:3 o,22DAAAAAB:15
+	// :22D FJOIN #chan 1234 +Pf 4:3 :
+
+	// If the last parameter is prefixed by a colon then it's a userlist which may have 0 or more users;
+	// if it isn't, then it is a single member
+	std::string::size_type spcolon = line.find(" :");
+	if (spcolon != std::string::npos)
+	{
+		spcolon++;
+		// Loop while there is a ':' in the userlist, this is never true if the channel is empty
+		std::string::size_type pos = std::string::npos;
+		while ((pos = line.rfind(':', pos-1)) > spcolon)
+		{
+			// Find the next space after the ':'
+			std::string::size_type sp = line.find(' ', pos);
+			// Erase characters between the ':' and the next space after it, including the ':' but not the space;
+			// if there is no next space, everything will be erased between pos and the end of the line
+			line.erase(pos, sp-pos);
+		}
+	}
+	else
+	{
+		// Last parameter is a single member
+		std::string::size_type sp = line.rfind(' ');
+		std::string::size_type colon = line.find(':', sp);
+		line.erase(colon);
+	}
+	return true;
+}
+
+bool TreeSocket::TranslateKICK(std::string& line, std::string::size_type a, std::string::size_type b)
+{
+	// Strip membership id if the KICK has one
+	if (b == std::string::npos)
+		return false;
+
+	std::string::size_type c = line.find(' ', b + 1);
+	if (c == std::string::npos)
+		return false;
+
+	std::string::size_type d = line.find(' ', c + 1);
+	if ((d < line.size()-1) && (line[d+1] != ':'))
+	{
+		// There is a third parameter which doesn't begin with a colon, erase it
+		std::string::size_type e = line.find(' ', d + 1);
+		line.erase(d, e-d);
+	}
+	return true;
+}
+
+bool TreeSocket::TranslateSINFO(std::string& line, std::string::size_type a, std::string::size_type b)
+{
+	// :22D SINFO version :InspIRCd-2.2
+	//     A     B       C
+	std::string::size_type c = line.find(' ', b + 1);
+	if (c == std::string::npos)
+		return false;
+
+	// Only translating SINFO version, discard everything else
+	if (line.compare(b, 9, " version ", 9))
+		return false;
+
+	line = line.substr(0, 5) + "VERSION" + line.substr(c);
+	return true;
+}
+
+bool TreeSocket::TranslateSERVER(std::string& line, std::string::size_type a, std::string::size_type b)
+{
+	// :001 SERVER inspircd.test 002 [<anything> ...] :gecos
+	//     A      B             C
+	std::string::size_type c = line.find(' ', b + 1);
+	if (c == std::string::npos)
+		return false;
+
+	std::string::size_type d = c + 4;
+	std::string::size_type spcolon = line.find(" :", d);
+	if (spcolon == std::string::npos)
+		return false;
+
+	line.erase(d, spcolon-d);
+	line.insert(c, " * 0");
+
+	if (burstsent)
+	{
+		WriteLineNoCompat(line);
+
+		// Synthesize a :<newserver> BURST <time> message
+		spcolon = line.find(" :");
+		line = CmdBuilder(line.substr(spcolon-3, 3), "BURST").push_int(ServerInstance->Time()).str();
+	}
+	return true;
+}
+
+bool TreeSocket::DropLine(std::string& line, std::string::size_type a, std::string::size_type b)
+{
+	return false;
+}
+
 namespace
 {
 	bool InsertCurrentChannelTS(std::vector<std::string>& params, unsigned int chanindex = 0, unsigned int pos = 1)
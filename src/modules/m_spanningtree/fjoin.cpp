@@ -172,9 +172,51 @@ CmdResult CommandFJoin::Handle(User* srcuser, std::vector<std::string>& params)
 	irc::tokenstream users(params.back());
 	std::string item;
 	Modes::ChangeList* modechangelistptr = (apply_other_sides_modes ? &modechangelist : NULL);
+	std::vector<std::string> items;
+	std::vector<User*> joiners;
 	while (users.GetToken(item))
 	{
-		ProcessModeUUIDPair(item, sourceserver, chan, modechangelistptr, fwdfjoin);
+		User* who = ProcessModeUUIDPair(item, sourceserver, modechangelistptr);
+		if (who)
+		{
+			items.push_back(item);
+			joiners.push_back(who);
+		}
+	}
+
+	// Join all users at once so local members get all JOINs in one write
+	std::vector<Membership*> joined;
+	chan->ForceJoinUsers(joiners, sourceserver->IsBursting(), joined);
+
+	for (size_t i = 0; i < items.size(); i++)
+	{
+		const std::string& member = items[i];
+		Membership* memb = joined[i];
+
+		// End of the "ov" mode string, prefix modes are only forwarded if their side won
+		std::string::const_iterator modeendit = member.begin();
+		const std::string::size_type comma = member.find(',');
+		if ((modechangelistptr) && (comma != std::string::npos))
+			modeendit += comma;
+
+		if (!memb)
+		{
+			// User was already on the channel, forward because of the modes they potentially got
+			memb = chan->GetUser(joiners[i]);
+			if (memb)
+				fwdfjoin.add(memb, member.begin(), modeendit);
+			continue;
+		}
+
+		// Assign the id to the new Membership
+		Membership::Id membid = 0;
+		const std::string::size_type colon = member.rfind(':');
+		if (colon != std::string::npos)
+			membid = Membership::IdFromString(member.substr(colon+1));
+		memb->id = membid;
+
+		// Add member to fwdfjoin with prefix modes
+		fwdfjoin.add(memb, member.begin(), modeendit);
 	}
 
 	fwdfjoin.finalize();
@@ -187,7 +229,7 @@ CmdResult CommandFJoin::Handle(User* srcuser, std::vector<std::string>& params)
 	return CMD_SUCCESS;
 }
 
-void CommandFJoin::ProcessModeUUIDPair(const std::string& item, TreeServer* sourceserver, Channel* chan, Modes::ChangeList* modechangelist, FwdFJoinBuilder& fwdfjoin)
+User* CommandFJoin::ProcessModeUUIDPair(const std::string& item, TreeServer* sourceserver, Modes::ChangeList* modechangelist)
 {
 	std::string::size_type comma = item.find(',');
 
@@ -198,7 +240,7 @@ void CommandFJoin::ProcessModeUUIDPair(const std::string& item, TreeServer* sour
 	if (!who)
 	{
 		// Probably KILLed, ignore
-		return;
+		return NULL;
 	}
 
 	TreeSocket* src_socket = sourceserver->GetSocket();
@@ -206,16 +248,14 @@ void CommandFJoin::ProcessModeUUIDPair(const std::string& item, TreeServer* sour
 	TreeServer* route_back_again = TreeServer::Get(who);
 	if (route_back_again->GetSocket() != src_socket)
 	{
-		return;
+		return NULL;
 	}
 
-	std::string::const_iterator modeendit = item.begin(); // End of the "ov" mode string
 	/* Check if the user received at least one mode */
 	if ((modechangelist) && (comma != std::string::npos))
 	{
-		modeendit += comma;
 		/* Iterate through the modes and see if they are valid here, if so, apply */
-		for (std::string::const_iterator i = item.begin(); i != modeendit; ++i)
+		for (std::string::const_iterator i = item.begin(); i != item.begin() + comma; ++i)
 		{
 			ModeHandler* mh = ServerInstance->Modes->FindMode(*i, MODETYPE_CHANNEL);
 			if (!mh)
@@ -226,25 +266,7 @@ void CommandFJoin::ProcessModeUUIDPair(const std::string& item, TreeServer* sour
 		}
 	}
 
-	Membership* memb = chan->ForceJoin(who, NULL, sourceserver->IsBursting());
-	if (!memb)
-	{
-		// User was already on the channel, forward because of the modes they potentially got
-		memb = chan->GetUser(who);
-		if (memb)
-			fwdfjoin.add(memb, item.begin(), modeendit);
-		return;
-	}
-
-	// Assign the id to the new Membership
-	Membership::Id membid = 0;
-	const std::string::size_type colon = item.rfind(':');
-	if (colon != std::string::npos)
-		membid = Membership::IdFromString(item.substr(colon+1));
-	memb->id = membid;
-
-	// Add member to fwdfjoin with prefix modes
-	fwdfjoin.add(memb, item.begin(), modeendit);
+	return who;
 }
 
 void CommandFJoin::RemoveStatus(Channel* c)
@@ -34,13 +34,16 @@
 #include "treesocket.h"
 #include "commands.h"
 #include "translate.h"
+#include "packed.h"
 
 ModuleSpanningTree::ModuleSpanningTree()
 	: rconnect(this), rsquit(this), map(this)
 	, commands(NULL)
 	, currmembid(0)
 	, eventprov(this, "event/spanningtree")
+	, channelroutes("channelroutes", ExtensionItem::EXT_CHANNEL, this)
 	, DNS(this, "DNS")
+	, ZipLink(this, "ziplink")
 	, loopCall(false)
 {
 }
@@ -442,7 +445,10 @@ void ModuleSpanningTree::OnUserJoin(Membership* memb, bool sync, bool created_by
 {
 	// Only do this for local users
 	if (!IS_LOCAL(memb->user))
+	{
+		Utils->AddChannelRoute(memb);
 		return;
+	}
 
 	// Assign the current membership id to the new Membership and increase it
 	memb->id = currmembid++;
@@ -502,6 +508,8 @@ void ModuleSpanningTree::OnUserPart(Membership* memb, std::string &partmessage,
 			params.push_last(partmessage);
 		params.Broadcast();
 	}
+	else
+		Utils->DelChannelRoute(memb);
 }
 
 void ModuleSpanningTree::OnUserQuit(User* user, const std::string &reason, const std::string &oper_message)
@@ -515,6 +523,9 @@ void ModuleSpanningTree::OnUserQuit(User* user, const std::string &reason, const
 	}
 	else
 	{
+		for (User::ChanList::iterator i = user->chans.begin(); i != user->chans.end(); ++i)
+			Utils->DelChannelRoute(*i);
+
 		// Hide the message if one of the following is true:
 		// - User is being quit due to a netsplit and quietbursts is on
 		// - Server is a silent uline
@@ -549,6 +560,9 @@ void ModuleSpanningTree::OnUserPostNick(User* user, const std::string &oldnick)
 
 void ModuleSpanningTree::OnUserKick(User* source, Membership* memb, const std::string &reason, CUList& excepts)
 {
+	if (!IS_LOCAL(memb->user))
+		Utils->DelChannelRoute(memb);
+
 	if ((!IS_LOCAL(source)) && (source != ServerInstance->FakeClient))
 		return;
 
@@ -634,7 +648,7 @@ restart:
 	for (TreeServer::ChildServers::const_iterator i = list.begin(); i != list.end(); ++i)
 	{
 		TreeSocket* sock = (*i)->GetSocket();
-		if (sock->GetIOHook() && sock->GetIOHook()->prov->creator == mod)
+		if (sock->GetModHook(mod))
 		{
 			sock->SendError("SSL module unloaded");
 			sock->Close();
@@ -646,7 +660,7 @@ restart:
 	for (SpanningTreeUtilities::TimeoutList::const_iterator i = Utils->timeoutlist.begin(); i != Utils->timeoutlist.end(); ++i)
 	{
 		TreeSocket* sock = i->first;
-		if (sock->GetIOHook() && sock->GetIOHook()->prov->creator == mod)
+		if (sock->GetModHook(mod))
 			sock->Close();
 	}
 }
@@ -741,6 +755,13 @@ ModuleSpanningTree::~ModuleSpanningTree()
 	delete commands;
 }
 
+#ifdef INSPIRCD_ENABLE_TESTSUITE
+void ModuleSpanningTree::OnRunTestSuite()
+{
+	PackedProtocol::RunTestSuite();
+}
+#endif
+
 Version ModuleSpanningTree::GetVersion()
 {
 	return Version("Allows servers to be linked", VF_VENDOR);
@@ -26,6 +26,7 @@
 #include "inspircd.h"
 #include "event.h"
 #include "modules/dns.h"
+#include "modules/ziplink.h"
 #include "servercommand.h"
 #include "commands.h"
 #include "protocolinterface.h"
@@ -51,6 +52,39 @@ class TreeServer;
 class Link;
 class Autoconnect;
 
+/** Number of remote members of a channel behind each directly linked server.
+ * Kept up to date on joins, parts, kicks and quits so routing a channel message
+ * does not have to look at every member of the channel.
+ */
+class ChannelRoutes
+{
+ public:
+	typedef std::vector<std::pair<TreeServer*, unsigned int> > RouteList;
+
+ private:
+	RouteList routes;
+
+ public:
+	/** Count a new member behind a route
+	 * @param route Directly linked server the member is behind
+	 */
+	void Add(TreeServer* route);
+
+	/** Stop counting a member behind a route
+	 * @param route Directly linked server the member is behind
+	 * @return True if there are no remote members left on the channel
+	 */
+	bool Remove(TreeServer* route);
+
+	/** Forget all members behind a route
+	 * @param route Directly linked server that has split
+	 * @return Number of members that were still counted behind the route
+	 */
+	unsigned int Purge(TreeServer* route);
+
+	const RouteList& GetRoutes() const { return routes; }
+};
+
 /** This is the main class for the spanningtree module
  */
 class ModuleSpanningTree : public Module
@@ -78,8 +112,16 @@ class ModuleSpanningTree : public Module
 	Events::ModuleEventProvider eventprov;
 
  public:
+	/** Remote members of each channel grouped by the directly linked server they are behind
+	 */
+	SimpleExtItem<ChannelRoutes> channelroutes;
+
 	dynamic_reference<DNS::Manager> DNS;
 
+	/** Compresses links to servers which support the same compression
+	 */
+	dynamic_reference<ZipLink::Provider> ZipLink;
+
 	ServerCommandManager CmdManager;
 
 	/** Set to true if inside a spanningtree call, to prevent sending
@@ -172,6 +214,9 @@ class ModuleSpanningTree : public Module
 	void OnUnloadModule(Module* mod) CXX11_OVERRIDE;
 	ModResult OnAcceptConnection(int newsock, ListenSocket* from, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* server) CXX11_OVERRIDE;
 	void OnMode(User* source, User* u, Channel* c, const Modes::ChangeList& modes, ModeParser::ModeProcessFlag processflags, const std::string& output_mode) CXX11_OVERRIDE;
+#ifdef INSPIRCD_ENABLE_TESTSUITE
+	void OnRunTestSuite() CXX11_OVERRIDE;
+#endif
 	CullResult cull();
 	~ModuleSpanningTree();
 	Version GetVersion() CXX11_OVERRIDE;
@@ -92,13 +92,25 @@ class FModeBuilder : public CmdBuilder
 struct TreeSocket::BurstState
 {
 	SpanningTreeProtocolInterface::Server server;
-	BurstState(TreeSocket* sock) : server(sock) { }
+
+	/** Uuids of the users or names of the channels that are still to be sent, sent from the back
+	 */
+	std::vector<std::string> pending;
+
+	/** True if pending holds channels, false if it holds users
+	 */
+	bool sendingchans;
+
+	BurstState(TreeSocket* sock) : server(sock), sendingchans(false) { }
 };
 
 /** This function is called when we want to send a netburst to a local
  * server. There is a set order we must do this, because for example
  * users require their servers to exist, and channels require their
  * users to exist. You get the idea.
+ *
+ * Only the server tree is sent right away, users and channels are sent
+ * by ContinueBurst() whenever the sendq of the link drains.
  */
 void TreeSocket::DoBurst(TreeServer* s)
 {
@@ -108,23 +120,80 @@ void TreeSocket::DoBurst(TreeServer* s)
 		capab->auth_challenge ? "challenge-response" : "plaintext password");
 	this->CleanNegotiationInfo();
 	this->WriteLine(CmdBuilder("BURST").push_int(ServerInstance->Time()));
+	packedout = packed;
+	if (zip)
+		StartCompression();
 	/* Send server tree */
 	this->SendServers(Utils->TreeRoot, s);
 
-	BurstState bs(this);
-	/* Send users and their oper status */
-	this->SendUsers(bs);
+	// Servers introduced from now on are new to the other side
+	this->burstsent = true;
 
-	const chan_hash& chans = ServerInstance->GetChans();
-	for (chan_hash::const_iterator i = chans.begin(); i != chans.end(); ++i)
-		SyncChannel(i->second, bs);
+	// Users and channels that are created while the burst is in progress are propagated like
+	// on a fully linked network, so only the ones that exist now have to be sent as part of it
+	burst = new BurstState(this);
+	const user_hash& users = ServerInstance->Users->GetUsers();
+	burst->pending.reserve(users.size());
+	for (user_hash::const_iterator i = users.begin(); i != users.end(); ++i)
+	{
+		if (i->second->registered == REG_ALL)
+			burst->pending.push_back(i->second->uuid);
+	}
 
-	this->SendXLines();
-	FOREACH_MOD(OnSyncNetwork, (bs.server));
-	this->WriteLine(CmdBuilder("ENDBURST"));
-	ServerInstance->SNO->WriteToSnoMask('l',"Finished bursting to \2"+ s->GetName()+"\2.");
+	ContinueBurst();
+}
 
-	this->burstsent = true;
+void TreeSocket::ContinueBurst()
+{
+	while ((burst) && (getSendQSize() < Utils->BurstSendQ))
+	{
+		if (!burst->pending.empty())
+		{
+			if (burst->sendingchans)
+			{
+				Channel* chan = ServerInstance->FindChan(burst->pending.back());
+				if (chan)
+					SyncChannel(chan, *burst);
+			}
+			else
+			{
+				User* user = ServerInstance->FindUUID(burst->pending.back());
+				if (user)
+					SendUser(user, *burst);
+			}
+			burst->pending.pop_back();
+		}
+		else if (!burst->sendingchans)
+		{
+			// All users are known to the other side now, send the channels that exist at this point,
+			// members of channels created later join them after this
+			burst->sendingchans = true;
+			const chan_hash& chans = ServerInstance->GetChans();
+			burst->pending.reserve(chans.size());
+			for (chan_hash::const_iterator i = chans.begin(); i != chans.end(); ++i)
+				burst->pending.push_back(i->second->name);
+		}
+		else
+		{
+			this->SendXLines();
+			FOREACH_MOD(OnSyncNetwork, (burst->server));
+			this->WriteLine(CmdBuilder("ENDBURST"));
+			ServerInstance->SNO->WriteToSnoMask('l',"Finished bursting to \2"+ MyRoot->GetName()+"\2.");
+
+			StopBurst();
+		}
+	}
+}
+
+void TreeSocket::StopBurst()
+{
+	delete burst;
+	burst = NULL;
+}
+
+void TreeSocket::OnDataWritten()
+{
+	ContinueBurst();
 }
 
 void TreeSocket::SendServerInfo(TreeServer* from)
@@ -271,35 +340,25 @@ void TreeSocket::SyncChannel(Channel* chan)
 	SyncChannel(chan, bs);
 }
 
-/** send all users and their oper state/modes */
-void TreeSocket::SendUsers(BurstState& bs)
+/** send a user and their oper state/modes */
+void TreeSocket::SendUser(User* user, BurstState& bs)
 {
-	ProtocolInterface::Server& piserver = bs.server;
-
-	const user_hash& users = ServerInstance->Users->GetUsers();
-	for (user_hash::const_iterator u = users.begin(); u != users.end(); ++u)
-	{
-		User* user = u->second;
-		if (user->registered != REG_ALL)
-			continue;
+	this->WriteLine(CommandUID::Builder(user));
 
-		this->WriteLine(CommandUID::Builder(user));
+	if (user->IsOper())
+		this->WriteLine(CommandOpertype::Builder(user));
 
-		if (user->IsOper())
-			this->WriteLine(CommandOpertype::Builder(user));
+	if (user->IsAway())
+		this->WriteLine(CommandAway::Builder(user));
 
-		if (user->IsAway())
-			this->WriteLine(CommandAway::Builder(user));
-
-		const Extensible::ExtensibleStore& exts = user->GetExtList();
-		for (Extensible::ExtensibleStore::const_iterator i = exts.begin(); i != exts.end(); ++i)
-		{
-			ExtensionItem* item = i->first;
-			std::string value = item->serialize(FORMAT_NETWORK, u->second, i->second);
-			if (!value.empty())
-				this->WriteLine(CommandMetadata::Builder(user, item->name, value));
-		}
-
-		FOREACH_MOD(OnSyncUser, (user, piserver));
+	const Extensible::ExtensibleStore& exts = user->GetExtList();
+	for (Extensible::ExtensibleStore::const_iterator i = exts.begin(); i != exts.end(); ++i)
+	{
+		ExtensionItem* item = i->first;
+		std::string value = item->serialize(FORMAT_NETWORK, user, i->second);
+		if (!value.empty())
+			this->WriteLine(CommandMetadata::Builder(user, item->name, value));
 	}
+
+	FOREACH_MOD(OnSyncUser, (user, bs.server));
 }
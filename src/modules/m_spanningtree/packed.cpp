@@ -0,0 +1,457 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "inspircd.h"
+
+#include "servercommand.h"
+#include "packed.h"
+
+#ifdef INSPIRCD_ENABLE_TESTSUITE
+#include <iomanip>
+#include <iostream>
+#endif
+
+namespace
+{
+	/** Commands that are sent as a number, the number of a command is its position plus one.
+	 * Changing this table requires a new PackedProtocol::Version.
+	 */
+	const char* const CommandTable[] = {
+		"UID", "FJOIN", "IJOIN", "FMODE", "MODE", "PRIVMSG", "NOTICE", "QUIT", "PART", "KICK",
+		"NICK", "FTOPIC", "TOPIC", "METADATA", "OPERTYPE", "AWAY", "FHOST", "FIDENT", "FNAME", "PING",
+		"PONG", "SERVER", "SQUIT", "SINFO", "ENDBURST", "ADDLINE", "DELLINE", "ENCAP", "KILL", "SAVE",
+		"INVITE", "IDLE", "PUSH", "SVSNICK", "SVSJOIN", "SVSPART", "RSQUIT", "RCONNECT", "ERROR", "SNONOTICE",
+		NULL
+	};
+
+	const unsigned int CommandTableSize = sizeof(CommandTable) / sizeof(CommandTable[0]) - 1;
+
+	/** Item types, stored in the lowest two bits of the first varint of an item
+	 */
+	enum ItemType
+	{
+		ITEM_STRING = 0,
+		ITEM_SID = 1,
+		ITEM_UUID = 2
+	};
+
+	const size_t SIDLength = 3;
+	const uint64_t SIDLimit = 36ULL * 36 * 36;
+	const uint64_t UUIDLimit = SIDLimit * 36 * 36 * 36 * 36 * 36 * 36;
+
+	typedef insp::flat_map<std::string, unsigned int> CommandMap;
+
+	const CommandMap& GetCommandMap()
+	{
+		static CommandMap commands;
+		if (commands.empty())
+		{
+			for (unsigned int i = 0; i < CommandTableSize; i++)
+				commands[CommandTable[i]] = i + 1;
+		}
+		return commands;
+	}
+
+	void PutVarint(std::string& out, uint64_t value)
+	{
+		while (value >= 0x80)
+		{
+			out.push_back(static_cast<char>((value & 0x7F) | 0x80));
+			value >>= 7;
+		}
+		out.push_back(static_cast<char>(value));
+	}
+
+	/** Read a varint
+	 * @return True if the varint was read, false if the data ends before it does
+	 */
+	bool GetVarint(const char* data, size_t end, size_t& pos, uint64_t& value)
+	{
+		value = 0;
+		for (unsigned int shift = 0; pos < end; shift += 7)
+		{
+			if (shift > 56)
+				throw ProtocolException("Malformed number in packed message");
+
+			const unsigned char c = data[pos++];
+			value |= static_cast<uint64_t>(c & 0x7F) << shift;
+			if (!(c & 0x80))
+				return true;
+		}
+		return false;
+	}
+
+	int Base36Digit(char c)
+	{
+		if ((c >= '0') && (c <= '9'))
+			return c - '0';
+		if ((c >= 'A') && (c <= 'Z'))
+			return c - 'A' + 10;
+		return -1;
+	}
+
+	void PutItem(std::string& out, const char* str, size_t length)
+	{
+		// Anything that looks like a SID or a UUID is sent as a number, these decode to the same string
+		if (((length == SIDLength) || (length == UIDGenerator::UUID_LENGTH)) && (str[0] >= '0') && (str[0] <= '9'))
+		{
+			uint64_t value = 0;
+			size_t i = 0;
+			for (; i < length; i++)
+			{
+				const int digit = Base36Digit(str[i]);
+				if (digit < 0)
+					break;
+				value = value * 36 + digit;
+			}
+
+			if (i == length)
+			{
+				PutVarint(out, (value << 2) | (length == SIDLength ? ITEM_SID : ITEM_UUID));
+				return;
+			}
+		}
+
+		PutVarint(out, static_cast<uint64_t>(length) << 2);
+		out.append(str, length);
+	}
+
+	void GetItem(const char* data, size_t end, size_t& pos, std::string& item)
+	{
+		uint64_t header;
+		if (!GetVarint(data, end, pos, header))
+			throw ProtocolException("Truncated packed message");
+
+		uint64_t value = header >> 2;
+		switch (header & 3)
+		{
+			case ITEM_STRING:
+				if (value > end - pos)
+					throw ProtocolException("Truncated packed message");
+				item.assign(data + pos, value);
+				pos += value;
+				return;
+
+			case ITEM_SID:
+			case ITEM_UUID:
+			{
+				const bool sid = ((header & 3) == ITEM_SID);
+				const uint64_t limit = (sid ? SIDLimit : UUIDLimit);
+				// The first character must be a digit
+				if (value >= limit / 36 * 10)
+					throw ProtocolException("Invalid ID in packed message");
+
+				item.resize(sid ? SIDLength : UIDGenerator::UUID_LENGTH);
+				for (std::string::reverse_iterator i = item.rbegin(); i != item.rend(); ++i)
+				{
+					const unsigned int digit = value % 36;
+					*i = (digit < 10) ? ('0' + digit) : ('A' + digit - 10);
+					value /= 36;
+				}
+				return;
+			}
+		}
+
+		throw ProtocolException("Unknown item type in packed message");
+	}
+
+	/** Find the end of the token starting at the given position of a text line
+	 */
+	const char* TokenEnd(const char* pos, const char* end)
+	{
+		const char* space = static_cast<const char*>(memchr(pos, ' ', end - pos));
+		return space ? space : end;
+	}
+
+	const char* SkipSpaces(const char* pos, const char* end)
+	{
+		while ((pos != end) && (*pos == ' '))
+			pos++;
+		return pos;
+	}
+}
+
+bool PackedProtocol::Encode(const std::string& line, std::string& out)
+{
+	static std::string command;
+
+	// The length of the frame is filled in once the rest of it is written, it always takes three bytes
+	const size_t start = out.length();
+	out.append(3, '\x80');
+
+	// Tokenize the line exactly like irc::linetokenizer does
+	const char* const end = line.data() + line.length();
+	const char* pos = SkipSpaces(line.data(), end);
+
+	const bool hasprefix = ((pos != end) && (*pos == ':'));
+	if (hasprefix)
+	{
+		const char* const tokenend = TokenEnd(pos, end);
+		PutItem(out, pos + 1, tokenend - pos - 1);
+		pos = SkipSpaces(tokenend, end);
+	}
+	else
+		PutItem(out, pos, 0);
+
+	// After a prefix a command starting with a colon is the rest of the line, like any other last parameter
+	const char* commandend;
+	if ((hasprefix) && (pos != end) && (*pos == ':'))
+	{
+		commandend = end;
+		command.assign(pos + 1, end);
+	}
+	else
+	{
+		commandend = TokenEnd(pos, end);
+		command.assign(pos, commandend);
+	}
+
+	const CommandMap& commands = GetCommandMap();
+	CommandMap::const_iterator it = commands.find(command);
+	if (it != commands.end())
+		PutVarint(out, it->second);
+	else
+	{
+		PutVarint(out, 0);
+		PutItem(out, command.data(), command.length());
+	}
+
+	pos = SkipSpaces(commandend, end);
+	while (pos != end)
+	{
+		if (*pos == ':')
+		{
+			PutItem(out, pos + 1, end - pos - 1);
+			break;
+		}
+
+		const char* const tokenend = TokenEnd(pos, end);
+		PutItem(out, pos, tokenend - pos);
+		pos = SkipSpaces(tokenend, end);
+	}
+
+	// The receiver rejects longer frames, and the length has to fit in three bytes
+	const size_t length = out.length() - start - 3;
+	if (length > MaxFrameLength)
+	{
+		out.erase(start);
+		return false;
+	}
+
+	out[start] = static_cast<char>((length & 0x7F) | 0x80);
+	out[start + 1] = static_cast<char>(((length >> 7) & 0x7F) | 0x80);
+	out[start + 2] = static_cast<char>((length >> 14) & 0x7F);
+	return true;
+}
+
+void PackedProtocol::Serialize(const std::string& line, std::string& out)
+{
+	if (!Encode(line, out))
+		out.append(line).push_back('\n');
+}
+
+size_t PackedProtocol::Decode(const char* data, size_t length, std::string& prefix, std::string& command, parameterlist& params)
+{
+	size_t pos = 0;
+	uint64_t framelength;
+	if (!GetVarint(data, length, pos, framelength))
+		return 0;
+	if (framelength > MaxFrameLength)
+		throw ProtocolException("Packed message too long");
+	if (framelength > length - pos)
+		return 0;
+
+	const size_t end = pos + framelength;
+	GetItem(data, end, pos, prefix);
+
+	uint64_t commandnum;
+	if (!GetVarint(data, end, pos, commandnum))
+		throw ProtocolException("Truncated packed message");
+	if (commandnum > CommandTableSize)
+		throw ProtocolException("Unknown command number in packed message");
+	if (commandnum)
+		command.assign(CommandTable[commandnum - 1]);
+	else
+		GetItem(data, end, pos, command);
+
+	parameterlist::size_type count = 0;
+	for (; pos < end; count++)
+	{
+		if (count == params.size())
+			params.resize(count + 1);
+		GetItem(data, end, pos, params[count]);
+	}
+	params.resize(count);
+	return end;
+}
+
+std::string PackedProtocol::ToText(const std::string& prefix, const std::string& command, const parameterlist& params)
+{
+	std::string line;
+	if (!prefix.empty())
+		line.append(1, ':').append(prefix).push_back(' ');
+	line.append(command);
+	for (parameterlist::const_iterator i = params.begin(); i != params.end(); ++i)
+	{
+		line.push_back(' ');
+		if (i + 1 == params.end())
+			line.push_back(':');
+		line.append(*i);
+	}
+	return line;
+}
+
+#ifdef INSPIRCD_ENABLE_TESTSUITE
+namespace
+{
+	/** Split a line the way TreeSocket::Split() does
+	 */
+	void SplitText(const std::string& line, std::string& prefix, std::string& command, parameterlist& params)
+	{
+		irc::linetokenizer tokens(line);
+		tokens.GetToken(prefix);
+		if ((!prefix.empty()) && (prefix[0] == ':'))
+		{
+			prefix.erase(prefix.begin());
+			tokens.GetToken(command);
+		}
+		else
+		{
+			command.swap(prefix);
+			prefix.clear();
+		}
+		tokens.GetTokens(params);
+	}
+
+	std::string RandomToken(unsigned int maxlength)
+	{
+		static const char chars[] = "0123456789ABCDEFXYZabcxyz#:,+-";
+		std::string token;
+		const unsigned long length = ServerInstance->GenRandomInt(maxlength + 1);
+		for (unsigned long i = 0; i < length; i++)
+			token.push_back(chars[ServerInstance->GenRandomInt(sizeof(chars) - 1)]);
+		return token;
+	}
+}
+
+void PackedProtocol::RunTestSuite()
+{
+	// Random lines must decode to what the text tokenizer makes of them
+	bool passed = true;
+	std::string frame;
+	std::string prefix, command, textprefix, textcommand;
+	parameterlist params, textparams;
+	for (unsigned int i = 0; (i < 100000) && (passed); i++)
+	{
+		std::string line;
+		const unsigned long tokens = ServerInstance->GenRandomInt(8);
+		for (unsigned long t = 0; t < tokens; t++)
+			line.append(RandomToken(12)).append(ServerInstance->GenRandomInt(4) ? " " : "  ");
+		if (line.empty())
+			continue;
+
+		SplitText(line, textprefix, textcommand, textparams);
+		frame.clear();
+		Encode(line, frame);
+		const size_t used = Decode(frame.data(), frame.length(), prefix, command, params);
+		passed = ((used == frame.length()) && (prefix == textprefix) && (command == textcommand) && (params == textparams));
+		if (!passed)
+			std::cout << "PACKED: \"" << line << "\" decoded to \"" << ToText(prefix, command, params) << "\"" << std::endl;
+	}
+	std::cout << "PACKED: random lines " << (passed ? "SUCCESS" : "FAILURE") << std::endl;
+
+	// A line too long for a frame must not be encoded, it is sent as text instead
+	const std::string longline = ":" + ServerInstance->Config->GetSID() + " METADATA * key :" + std::string(MaxFrameLength, 'x');
+	frame = "previous";
+	const bool encoded = Encode(longline, frame);
+	passed = ((!encoded) && (frame == "previous"));
+	frame.clear();
+	Serialize(longline, frame);
+	passed = ((passed) && (frame == longline + "\n"));
+	std::cout << "PACKED: long lines " << (passed ? "SUCCESS" : "FAILURE") << std::endl;
+
+	// Build a burst of a server with 5000 users in 500 channels followed by channel traffic
+	const std::string sid = ServerInstance->Config->GetSID();
+	UIDGenerator uids;
+	uids.init(sid);
+	std::vector<std::string> users;
+	std::vector<std::string> lines;
+	for (unsigned int i = 0; i < 5000; i++)
+	{
+		users.push_back(uids.GetUID());
+		lines.push_back(":" + sid + " UID " + users.back() + " 1500000000 user" + ConvToStr(i) + " host" + ConvToStr(i) + ".example.com "
+			"cloak" + ConvToStr(i) + ".example.com ident 192.0.2." + ConvToStr(i % 250) + " 1500000000 +iwx :Real Name " + ConvToStr(i));
+		if (i % 10 == 0)
+			lines.push_back(":" + users.back() + " METADATA " + users.back() + " accountname :account" + ConvToStr(i));
+	}
+	for (unsigned int c = 0; c < 500; c++)
+	{
+		std::string line = ":" + sid + " FJOIN #channel" + ConvToStr(c) + " 1500000000 +nt :";
+		for (unsigned int m = 0; m < 30; m++)
+			line.append(m ? " " : "o,").append(users[(c * 30 + m) % users.size()]).append(":1");
+		lines.push_back(line);
+	}
+	const size_t burstlines = lines.size();
+	for (unsigned int i = 0; i < 20000; i++)
+		lines.push_back(":" + users[i % users.size()] + " PRIVMSG #channel" + ConvToStr(i % 500) + " :some message text number " + ConvToStr(i));
+
+	const struct { const char* name; size_t begin; size_t end; } loads[] = {
+		{ "burst", 0, burstlines },
+		{ "channel messages", burstlines, lines.size() }
+	};
+
+	for (unsigned int l = 0; l < sizeof(loads) / sizeof(loads[0]); l++)
+	{
+		const size_t begin = loads[l].begin;
+		const size_t end = loads[l].end;
+
+		size_t textbytes = 0;
+		uint64_t start = InspIRCd::GetMonotonicClock();
+		for (size_t i = begin; i < end; i++)
+		{
+			SplitText(lines[i], prefix, command, params);
+			textbytes += lines[i].length() + 1;
+		}
+		const uint64_t textparse = InspIRCd::GetMonotonicClock() - start;
+
+		// Encode like TreeSocket::WriteLine does, into a reused buffer that is then written out.
+		// Frames are about as long as their lines, reserve enough so growing the output is not timed.
+		std::string frames;
+		frames.reserve(textbytes * 2);
+		std::string frame;
+		start = InspIRCd::GetMonotonicClock();
+		for (size_t i = begin; i < end; i++)
+		{
+			frame.clear();
+			Encode(lines[i], frame);
+			frames.append(frame);
+		}
+		const uint64_t encode = InspIRCd::GetMonotonicClock() - start;
+
+		start = InspIRCd::GetMonotonicClock();
+		for (size_t pos = 0; pos < frames.length(); )
+			pos += Decode(frames.data() + pos, frames.length() - pos, prefix, command, params);
+		const uint64_t decode = InspIRCd::GetMonotonicClock() - start;
+
+		const double count = end - begin;
+		std::cout << std::fixed << std::setprecision(1) << "PACKED: " << loads[l].name << ", " << end - begin << " messages: text "
+			<< textbytes << " bytes, " << textparse / count << "ns per message to parse; packed " << frames.length() << " bytes, "
+			<< decode / count << "ns per message to parse, " << encode / count << "ns to encode from text" << std::endl;
+	}
+}
+#endif
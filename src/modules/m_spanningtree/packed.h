@@ -0,0 +1,88 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+/** The packed protocol is a binary encoding of server to server messages. It is used instead of text lines
+ * for everything after BURST if both servers advertise the same PACKED version in CAPAB CAPABILITIES.
+ *
+ * Numbers are sent as varints: 7 bits per byte starting with the lowest ones, the high bit is set on every
+ * byte except the last. Every message is a frame which starts with the length of the rest of the frame
+ * (always sent in three bytes, so a frame can be written before its length is known) followed by the source of the message as an item, the number of the command in the command table plus
+ * one (or 0 and the name of the command as an item) and the parameters as items.
+ * An item starts with a varint whose lowest two bits are its type and whose remaining bits are:
+ *  0 - a string, the length of the string followed by the string itself
+ *  1 - a SID, the value of the SID in base 36
+ *  2 - a UUID, the value of the UUID in base 36
+ * A message without a source has an empty string as its source.
+ *
+ * A message too long for a frame is sent as a text line ending in a new line character instead. Frames
+ * always start with a byte which has the high bit set, text lines start with ':' which does not.
+ */
+namespace PackedProtocol
+{
+	/** Version of the encoding and the command table, a server only uses the packed protocol with
+	 * servers that advertise the same version
+	 */
+	static const unsigned int Version = 2;
+
+	/** Frames longer than this are rejected, it must fit in the three bytes the length of a frame is sent in
+	 */
+	static const size_t MaxFrameLength = 65536;
+
+	/** Convert a line of the text protocol to a frame
+	 * @param line The line to convert
+	 * @param out String to append the frame to
+	 * @return True if the frame was appended, false if it would be longer than MaxFrameLength
+	 * in which case out is unchanged
+	 */
+	bool Encode(const std::string& line, std::string& out);
+
+	/** Convert a line of the text protocol to what is sent on a link using the packed protocol:
+	 * a frame, or the line followed by a new line character if it is too long for a frame
+	 * @param line The line to convert, it must start with ':'
+	 * @param out String to append the data to
+	 */
+	void Serialize(const std::string& line, std::string& out);
+
+	/** Decode the frame at the start of the given data
+	 * @param data Data received from a server
+	 * @param length Length of the data
+	 * @param prefix Set to the source of the message, or to an empty string if it has none
+	 * @param command Set to the command
+	 * @param params Set to the parameters, strings which are already in the list are reused
+	 * @return Length of the frame, or 0 if the data does not contain an entire frame yet
+	 * @throw ProtocolException if the frame is malformed
+	 */
+	size_t Decode(const char* data, size_t length, std::string& prefix, std::string& command, parameterlist& params);
+
+	/** Convert a decoded message back to a line of the text protocol, for logging
+	 * @param prefix Source of the message, can be empty
+	 * @param command The command
+	 * @param params The parameters
+	 * @return The message as a text line
+	 */
+	std::string ToText(const std::string& prefix, const std::string& command, const parameterlist& params);
+
+#ifdef INSPIRCD_ENABLE_TESTSUITE
+	/** Check that frames decode to what the text tokenizer makes of the same lines, and compare the
+	 * time it takes to parse a burst and channel messages in the text and the packed protocol
+	 */
+	void RunTestSuite();
+#endif
+}
@@ -178,6 +178,8 @@ void TreeServer::SQuitChild(TreeServer* server, const std::string& reason)
 
 	const std::string quitreason = GetName() + " " + server->GetName();
 	unsigned int num_lost_users = QuitUsers(quitreason);
+	if (IsRoot())
+		Utils->PurgeChannelRoutes(server);
 
 	ServerInstance->SNO->WriteToSnoMask(IsRoot() ? 'l' : 'L', "Netsplit complete, lost \002%u\002 user%s on \002%u\002 server%s.",
 		num_lost_users, num_lost_users != 1 ? "s" : "", num_lost_servers, num_lost_servers != 1 ? "s" : "");
@@ -210,17 +212,19 @@ unsigned int TreeServer::QuitUsers(const std::string& reason)
 {
 	std::string publicreason = ServerInstance->Config->HideSplits ? "*.net *.split" : reason;
 
+	// Quit all users of the lost servers together so each local user gets all their QUITs in one go
+	std::vector<User*> quitting;
 	const user_hash& users = ServerInstance->Users->GetUsers();
-	unsigned int original_size = users.size();
-	for (user_hash::const_iterator i = users.begin(); i != users.end(); )
+	for (user_hash::const_iterator i = users.begin(); i != users.end(); ++i)
 	{
 		User* user = i->second;
-		// Increment the iterator now because QuitUser() removes the user from the container
-		++i;
 		TreeServer* server = TreeServer::Get(user);
 		if (server->IsDead())
-			ServerInstance->Users->QuitUser(user, publicreason, &reason);
+			quitting.push_back(user);
 	}
+
+	unsigned int original_size = users.size();
+	ServerInstance->Users->QuitUsers(quitting, publicreason, &reason);
 	return original_size - users.size();
 }
 
@@ -288,6 +292,7 @@ void TreeServer::RemoveHash()
 	// XXX: Erase server from UserManager::uuidlist now, to allow sid reuse in the current main loop
 	// iteration, before the cull list is applied
 	ServerInstance->Users->uuidlist.erase(sid);
+	ServerInstance->Users->uuidindex.Remove(UIDGenerator::Pack(sid));
 
 	Utils->sidlist.erase(sid);
 	Utils->serverlist.erase(GetName());
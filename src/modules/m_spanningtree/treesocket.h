@@ -97,12 +97,36 @@ class TreeSocket : public BufferedSocket
 	TreeServer* MyRoot;			/* The server we are talking to */
 	int proto_version;			/* Remote protocol version */
 
-	/** True if we've sent our burst.
+	/** The part of our burst that is still to be sent, NULL if there is none
+	 */
+	BurstState* burst;
+
+	/** True if we've sent our burst of the server tree.
 	 * This only changes the behavior of message translation for 1202 protocol servers and it can be
 	 * removed once 1202 support is dropped.
 	 */
 	bool burstsent;
 
+	/** True if both servers support the packed protocol, it is used for everything sent after BURST
+	 */
+	bool packed;
+
+	/** True if we have sent BURST and use the packed protocol for what we send
+	 */
+	bool packedout;
+
+	/** True if we have received BURST and use the packed protocol for what we receive
+	 */
+	bool packedin;
+
+	/** True if both servers support the same compression, everything sent after BURST is compressed
+	 */
+	bool zip;
+
+	/** True if we have received BURST and decompress what we receive
+	 */
+	bool zipin;
+
 	/** Checks if the given servername and sid are both free
 	 */
 	bool CheckDuplicate(const std::string& servername, const std::string& sid);
@@ -114,8 +138,14 @@ class TreeSocket : public BufferedSocket
 	/** Send all known information about a channel */
 	void SyncChannel(Channel* chan, BurstState& bs);
 
-	/** Send all users and their oper state, away state and metadata */
-	void SendUsers(BurstState& bs);
+	/** Send a user and their oper state, away state and metadata */
+	void SendUser(User* user, BurstState& bs);
+
+	/** Send more of the burst until it is complete or the sendq reaches the burst sendq limit */
+	void ContinueBurst();
+
+	/** Discard the part of the burst that has not been sent yet */
+	void StopBurst();
 
 	/** Send all additional info about the given server to this server */
 	void SendServerInfo(TreeServer* from);
@@ -156,6 +186,39 @@ class TreeSocket : public BufferedSocket
 	 */
 	void WriteLineNoCompat(const std::string& line);
 
+	/** Translate a line in place for a server that uses an older protocol version
+	 * @param line Line to translate, a copy of the line that is being sent
+	 * @param a Position of the space before the command
+	 * @param b Position of the space after the command, std::string::npos if the line has no parameters
+	 * @return True to send the translated line, false to drop it
+	 */
+	typedef bool (TreeSocket::*CompatTranslator)(std::string& line, std::string::size_type a, std::string::size_type b);
+	typedef insp::flat_map<std::string, CompatTranslator> CompatTable;
+
+	/** Translations for the commands that have to be changed for the protocol version of the remote server,
+	 * chosen at CAPAB END. NULL if the server uses our protocol version and lines are sent unchanged.
+	 */
+	const CompatTable* compat;
+
+	/** Get the translations for the commands that have to be changed for the given protocol version
+	 * @param version Protocol version of the remote server
+	 * @return Table of translations, or NULL if the version needs none
+	 */
+	static const CompatTable* GetCompatTable(int version);
+
+	/** Translators for lines sent to 1202-1204 servers, see CompatTranslator */
+	bool TranslateIJOIN(std::string& line, std::string::size_type a, std::string::size_type b);
+	bool TranslateMETADATA(std::string& line, std::string::size_type a, std::string::size_type b);
+	bool TranslateFTOPIC(std::string& line, std::string::size_type a, std::string::size_type b);
+	bool TranslatePING(std::string& line, std::string::size_type a, std::string::size_type b);
+	bool TranslateOPERTYPE(std::string& line, std::string::size_type a, std::string::size_type b);
+	bool TranslateINVITE(std::string& line, std::string::size_type a, std::string::size_type b);
+	bool TranslateFJOIN(std::string& line, std::string::size_type a, std::string::size_type b);
+	bool TranslateKICK(std::string& line, std::string::size_type a, std::string::size_type b);
+	bool TranslateSINFO(std::string& line, std::string::size_type a, std::string::size_type b);
+	bool TranslateSERVER(std::string& line, std::string::size_type a, std::string::size_type b);
+	bool DropLine(std::string& line, std::string::size_type a, std::string::size_type b);
+
  public:
 	const time_t age;
 
@@ -272,10 +335,21 @@ class TreeSocket : public BufferedSocket
 	 */
 	void OnDataReady();
 
+	/** Continue the burst once data was written to the remote server
+	 */
+	void OnDataWritten() CXX11_OVERRIDE;
+
 	/** Send one or more complete lines down the socket
 	 */
 	void WriteLine(const std::string& line);
 
+	/** Send a line which is also sent to other servers, so it is only encoded once for all of them
+	 * @param line The line to send
+	 * @param packedline The line as sent using the packed protocol, set by the first server which
+	 * uses the packed protocol the line is sent to; it must be empty before the line is sent to any server
+	 */
+	void WriteLine(const std::string& line, std::string& packedline);
+
 	/** Handle ERROR command */
 	void Error(parameterlist &params);
 
@@ -295,6 +369,23 @@ class TreeSocket : public BufferedSocket
 	 */
 	void ProcessLine(std::string &line);
 
+	/** Process all complete frames of the packed protocol in the recvq
+	 */
+	void ProcessFrames();
+
+	/** Compress everything sent to the server from now on
+	 */
+	void StartCompression();
+
+	/** Decompress everything received from the server from now on, including what is left in the recvq
+	 * @return True on success, false if the link has been closed with an error
+	 */
+	bool StartDecompression();
+
+	/** Process a message received in the text or the packed protocol
+	 */
+	void ProcessMessage(std::string& prefix, std::string& command, parameterlist& params);
+
 	void ProcessConnectedLine(std::string& prefix, std::string& command, parameterlist& params);
 
 	/** Handle socket timeout from connect()
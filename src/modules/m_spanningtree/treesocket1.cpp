@@ -38,7 +38,7 @@
  */
 TreeSocket::TreeSocket(Link* link, Autoconnect* myac, const std::string& ipaddr)
 	: linkID(assign(link->Name)), LinkState(CONNECTING), MyRoot(NULL), proto_version(0)
-	, burstsent(false), age(ServerInstance->Time())
+	, burst(NULL), burstsent(false), packed(false), packedout(false), packedin(false), zip(false), zipin(false), compat(NULL), age(ServerInstance->Time())
 {
 	capab = new CapabData;
 	capab->link = link;
@@ -57,7 +57,7 @@ TreeSocket::TreeSocket(Link* link, Autoconnect* myac, const std::string& ipaddr)
 TreeSocket::TreeSocket(int newfd, ListenSocket* via, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* server)
 	: BufferedSocket(newfd)
 	, linkID("inbound from " + client->addr()), LinkState(WAIT_AUTH_1), MyRoot(NULL), proto_version(0)
-	, burstsent(false), age(ServerInstance->Time())
+	, burst(NULL), burstsent(false), packed(false), packedout(false), packedin(false), zip(false), zipin(false), compat(NULL), age(ServerInstance->Time())
 {
 	capab = new CapabData;
 	capab->capab_phase = 0;
@@ -89,6 +89,7 @@ CullResult TreeSocket::cull()
 TreeSocket::~TreeSocket()
 {
 	delete capab;
+	StopBurst();
 }
 
 /** When an outbound connection finishes connecting, we receive
@@ -103,7 +104,7 @@ void TreeSocket::OnConnected()
 	{
 		if (!capab->link->Hook.empty())
 		{
-			ServiceProvider* prov = ServerInstance->Modules->FindService(SERVICE_IOHOOK, capab->link->Hook);
+			ServiceProvider* prov = ServerInstance->Modules->FindService(SERVICE_IOHOOK, "ssl/" + capab->link->Hook);
 			if (!prov)
 			{
 				SetError("Could not find hook '" + capab->link->Hook + "' for connection to " + linkID);
@@ -168,7 +169,8 @@ void TreeSocket::OnDataReady()
 {
 	Utils->Creator->loopCall = true;
 	std::string line;
-	while (GetNextLine(line))
+	// Lines stop when BURST switches the link to the packed protocol
+	while ((!packedin) && (GetNextLine(line)))
 	{
 		std::string::size_type rline = line.find('\r');
 		if (rline != std::string::npos)
@@ -193,7 +195,9 @@ void TreeSocket::OnDataReady()
 		if (!getError().empty())
 			break;
 	}
-	if (LinkState != CONNECTED && recvq.length() > 4096)
+	if ((packedin) && (getError().empty()))
+		ProcessFrames();
+	if (LinkState != CONNECTED && GetRecvQSize() > 4096)
 		SendError("RecvQ overrun (line too long)");
 	Utils->Creator->loopCall = false;
 }
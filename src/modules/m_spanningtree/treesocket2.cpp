@@ -30,6 +30,7 @@
 #include "treesocket.h"
 #include "resolvers.h"
 #include "commands.h"
+#include "packed.h"
 
 /* Handle ERROR command */
 void TreeSocket::Error(parameterlist &params)
@@ -40,7 +41,7 @@ void TreeSocket::Error(parameterlist &params)
 
 void TreeSocket::Split(const std::string& line, std::string& prefix, std::string& command, parameterlist& params)
 {
-	irc::tokenstream tokens(line);
+	irc::linetokenizer tokens(line);
 
 	if (!tokens.GetToken(prefix))
 		return;
@@ -62,17 +63,13 @@ void TreeSocket::Split(const std::string& line, std::string& prefix, std::string
 	}
 	else
 	{
-		command = prefix;
+		command.swap(prefix);
 		prefix.clear();
 	}
 	if (command.empty())
 		this->SendError("BUG (?) Empty command received: " + line);
 
-	std::string param;
-	while (tokens.GetToken(param))
-	{
-		params.push_back(param);
-	}
+	tokens.GetTokens(params);
 }
 
 void TreeSocket::ProcessLine(std::string &line)
@@ -84,7 +81,115 @@ void TreeSocket::ProcessLine(std::string &line)
 	ServerInstance->Logs->Log(MODNAME, LOG_RAWIO, "S[%d] I %s", this->GetFd(), line.c_str());
 
 	Split(line, prefix, command, params);
+	ProcessMessage(prefix, command, params);
+}
+
+void TreeSocket::StartCompression()
+{
+	// The other side expects everything after BURST to be compressed
+	if (!Utils->Creator->ZipLink)
+	{
+		SendError("Compression is no longer available");
+		return;
+	}
+	Utils->Creator->ZipLink->StartCompression(this);
+}
+
+bool TreeSocket::StartDecompression()
+{
+	zipin = true;
+	if (!Utils->Creator->ZipLink)
+	{
+		SendError("Compression is no longer available");
+		return false;
+	}
+
+	// What was received after BURST is compressed, replace it with the decompressed data
+	size_t length;
+	const char* data = PeekRecvQ(length);
+	const std::string compressed(data, length);
+	ConsumeRecvQ(length);
+	return Utils->Creator->ZipLink->StartDecompression(this, compressed, recvq);
+}
+
+void TreeSocket::ProcessFrames()
+{
+	std::string prefix;
+	std::string command;
+	parameterlist params;
+
+	size_t length;
+	const char* data = PeekRecvQ(length);
+	while ((getError().empty()) && (length))
+	{
+		if (!(static_cast<unsigned char>(*data) & 0x80))
+		{
+			// A line too long for a frame
+			const char* const newline = static_cast<const char*>(memchr(data, '\n', length));
+			if (!newline)
+				break;
+
+			std::string line(data, newline - data);
+			const size_t used = newline - data + 1;
+			data += used;
+			length -= used;
+			ConsumeRecvQ(used);
+
+			if (line.find('\0') != std::string::npos)
+			{
+				SendError("Read null character from socket");
+				break;
+			}
+
+			try
+			{
+				ProcessLine(line);
+			}
+			catch (CoreException& ex)
+			{
+				ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Error while processing: " + line);
+				ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, ex.GetReason());
+				SendError(ex.GetReason() + " - check the log file for details");
+			}
+			continue;
+		}
+
+		size_t used;
+		try
+		{
+			used = PackedProtocol::Decode(data, length, prefix, command, params);
+		}
+		catch (CoreException& ex)
+		{
+			SendError(ex.GetReason());
+			break;
+		}
+
+		if (!used)
+			break;
+
+		data += used;
+		length -= used;
+		ConsumeRecvQ(used);
+
+		if (ServerInstance->Config->RawLog)
+			ServerInstance->Logs->Log(MODNAME, LOG_RAWIO, "S[%d] I %s", this->GetFd(), PackedProtocol::ToText(prefix, command, params).c_str());
 
+		try
+		{
+			ProcessMessage(prefix, command, params);
+		}
+		catch (CoreException& ex)
+		{
+			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Error while processing: " + PackedProtocol::ToText(prefix, command, params));
+			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, ex.GetReason());
+			SendError(ex.GetReason() + " - check the log file for details");
+		}
+	}
+}
+
+void TreeSocket::ProcessMessage(std::string& prefix, std::string& command, parameterlist& params)
+{
 	if (command.empty())
 		return;
 
@@ -168,6 +273,10 @@ void TreeSocket::ProcessLine(std::string &line)
 				if (!CheckDuplicate(capab->name, capab->sid))
 					return;
 
+				// BURST is the last line they send in the text protocol and without compression
+				packedin = packed;
+				if ((zip) && (!zipin) && (!StartDecompression()))
+					return;
 				FinishAuth(capab->name, capab->sid, capab->description, capab->hidden);
 			}
 			else if (command == "ERROR")
@@ -306,6 +415,15 @@ void TreeSocket::ProcessConnectedLine(std::string& prefix, std::string& command,
 				this->Error(params);
 				return;
 			}
+			else if (command == "BURST")
+			{
+				// The side that connected is already bursting when the other side sends BURST,
+				// it is the last line they send in the text protocol and without compression
+				packedin = packed;
+				if ((zip) && (!zipin))
+					StartDecompression();
+				return;
+			}
 
 			throw ProtocolException("Unknown command");
 		}
@@ -155,6 +155,84 @@ SpanningTreeUtilities::~SpanningTreeUtilities()
 	delete TreeRoot;
 }
 
+void ChannelRoutes::Add(TreeServer* route)
+{
+	for (RouteList::iterator i = routes.begin(); i != routes.end(); ++i)
+	{
+		if (i->first == route)
+		{
+			i->second++;
+			return;
+		}
+	}
+	routes.push_back(std::make_pair(route, 1));
+}
+
+bool ChannelRoutes::Remove(TreeServer* route)
+{
+	for (RouteList::iterator i = routes.begin(); i != routes.end(); ++i)
+	{
+		if (i->first == route)
+		{
+			if (--i->second == 0)
+				routes.erase(i);
+			break;
+		}
+	}
+	return routes.empty();
+}
+
+unsigned int ChannelRoutes::Purge(TreeServer* route)
+{
+	for (RouteList::iterator i = routes.begin(); i != routes.end(); ++i)
+	{
+		if (i->first == route)
+		{
+			const unsigned int count = i->second;
+			routes.erase(i);
+			return count;
+		}
+	}
+	return 0;
+}
+
+void SpanningTreeUtilities::AddChannelRoute(Membership* memb)
+{
+	ChannelRoutes* routes = Creator->channelroutes.get(memb->chan);
+	if (!routes)
+	{
+		routes = new ChannelRoutes;
+		Creator->channelroutes.set(memb->chan, routes);
+	}
+	routes->Add(TreeServer::Get(memb->user)->GetRoute());
+}
+
+void SpanningTreeUtilities::DelChannelRoute(Membership* memb)
+{
+	ChannelRoutes* routes = Creator->channelroutes.get(memb->chan);
+	if ((routes) && (routes->Remove(TreeServer::Get(memb->user)->GetRoute())))
+		Creator->channelroutes.unset(memb->chan);
+}
+
+void SpanningTreeUtilities::PurgeChannelRoutes(TreeServer* route)
+{
+	// Every user behind the route has quit by now so this should find nothing
+	const chan_hash& chans = ServerInstance->GetChans();
+	for (chan_hash::const_iterator i = chans.begin(); i != chans.end(); ++i)
+	{
+		Channel* chan = i->second;
+		ChannelRoutes* routes = Creator->channelroutes.get(chan);
+		if (!routes)
+			continue;
+
+		const unsigned int count = routes->Purge(route);
+		if (count)
+			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "BUG: %u members of %s were still routed through %s after it split", count, chan->name.c_str(), route->GetName().c_str());
+		if (routes->GetRoutes().empty())
+			Creator->channelroutes.unset(chan);
+	}
+}
+
 /* returns a list of DIRECT servernames for a specific channel */
 void SpanningTreeUtilities::GetListOfServersForChannel(Channel* c, TreeSocketSet& list, char status, const CUList& exempt_list)
 {
@@ -166,6 +244,39 @@ void SpanningTreeUtilities::GetListOfServersForChannel(Channel* c, TreeSocketSet
 			minrank = mh->GetPrefixRank();
 	}
 
+	if (!minrank)
+	{
+		// Every remote member gets the message so the member counts of the routes are enough
+		ChannelRoutes* routes = Creator->channelroutes.get(c);
+		if (!routes)
+			return;
+
+		ChannelRoutes::RouteList counts = routes->GetRoutes();
+		for (CUList::const_iterator i = exempt_list.begin(); i != exempt_list.end(); ++i)
+		{
+			User* exempt = *i;
+			if ((IS_LOCAL(exempt)) || (!c->HasUser(exempt)))
+				continue;
+
+			TreeServer* route = TreeServer::Get(exempt)->GetRoute();
+			for (ChannelRoutes::RouteList::iterator j = counts.begin(); j != counts.end(); ++j)
+			{
+				if (j->first == route)
+				{
+					j->second--;
+					break;
+				}
+			}
+		}
+
+		for (ChannelRoutes::RouteList::const_iterator i = counts.begin(); i != counts.end(); ++i)
+		{
+			if (i->second)
+				list.insert(i->first->GetSocket());
+		}
+		return;
+	}
+
 	const Channel::MemberMap& ulist = c->GetUsers();
 	for (Channel::MemberMap::const_iterator i = ulist.begin(); i != ulist.end(); ++i)
 	{
@@ -187,6 +298,7 @@ void SpanningTreeUtilities::GetListOfServersForChannel(Channel* c, TreeSocketSet
 void SpanningTreeUtilities::DoOneToAllButSender(const CmdBuilder& params, TreeServer* omitroute)
 {
 	const std::string& FullLine = params.str();
+	std::string packedline;
 
 	const TreeServer::ChildServers& children = TreeRoot->GetChildren();
 	for (TreeServer::ChildServers::const_iterator i = children.begin(); i != children.end(); ++i)
@@ -195,7 +307,7 @@ void SpanningTreeUtilities::DoOneToAllButSender(const CmdBuilder& params, TreeSe
 		// Send the line if the route isn't the path to the one to be omitted
 		if (Route != omitroute)
 		{
-			Route->GetSocket()->WriteLine(FullLine);
+			Route->GetSocket()->WriteLine(FullLine, packedline);
 		}
 	}
 }
@@ -260,7 +372,10 @@ void SpanningTreeUtilities::ReadConfiguration()
 	HideULines = security->getBool("hideulines");
 	AnnounceTSChange = options->getBool("announcets");
 	AllowOptCommon = options->getBool("allowmismatch");
-	quiet_bursts = ServerInstance->Config->ConfValue("performance")->getBool("quietbursts");
+	ConfigTag* performance = ServerInstance->Config->ConfValue("performance");
+	quiet_bursts = performance->getBool("quietbursts");
+	BurstSendQ = performance->getInt("burstsendq", 65536, 4096);
+	PackedLinks = performance->getBool("packedlinks", true);
 	PingWarnTime = options->getInt("pingwarning");
 	PingFreq = options->getInt("serverpingfreq");
 
@@ -381,10 +496,11 @@ void SpanningTreeUtilities::SendChannelMessage(const std::string& prefix, Channe
 
 	TreeSocketSet list;
 	this->GetListOfServersForChannel(target, list, status, exempt_list);
+	std::string packedline;
 	for (TreeSocketSet::iterator i = list.begin(); i != list.end(); ++i)
 	{
 		TreeSocket* Sock = *i;
 		if (Sock != omit)
-			Sock->WriteLine(msg);
+			Sock->WriteLine(msg.str(), packedline);
 	}
 }
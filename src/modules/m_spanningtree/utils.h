@@ -74,6 +74,14 @@ class SpanningTreeUtilities : public classbase
 	 */
 	bool quiet_bursts;
 
+	/** Sendq size up to which more of a burst is queued on a link
+	 */
+	size_t BurstSendQ;
+
+	/** Whether to use the packed protocol with servers that support it
+	 */
+	bool PackedLinks;
+
 	/* Number of seconds that a server can go without ping
 	 * before opers are warned of high latency.
 	 */
@@ -143,6 +151,21 @@ class SpanningTreeUtilities : public classbase
 	 */
 	void GetListOfServersForChannel(Channel* c, TreeSocketSet& list, char status, const CUList& exempt_list);
 
+	/** Count a remote member in the routes of its channel
+	 * @param memb Membership of a remote user that has joined
+	 */
+	void AddChannelRoute(Membership* memb);
+
+	/** Stop counting a remote member in the routes of its channel
+	 * @param memb Membership of a remote user that is leaving
+	 */
+	void DelChannelRoute(Membership* memb);
+
+	/** Remove a directly linked server that has split from the routes of all channels
+	 * @param route The server that has split
+	 */
+	void PurgeChannelRoutes(TreeServer* route);
+
 	/** Find a server by name
 	 */
 	TreeServer* FindServer(const std::string &ServerName);
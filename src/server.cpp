@@ -135,6 +135,115 @@ void UIDGenerator::init(const std::string& sid)
 	current_uid[2] = sid[2];
 }
 
+namespace
+{
+	/** Get the value of a character in a packed SID or UUID
+	 * @param chr The character to pack
+	 * @return 1-10 for digits, 11-36 for letters, 0 for anything else
+	 */
+	uint64_t PackChar(unsigned char chr)
+	{
+		if ((chr >= '0') && (chr <= '9'))
+			return chr - '0' + 1;
+		if ((chr >= 'A') && (chr <= 'Z'))
+			return chr - 'A' + 11;
+		if ((chr >= 'a') && (chr <= 'z'))
+			return chr - 'a' + 11;
+		return 0;
+	}
+}
+
+uint64_t UIDGenerator::Pack(const std::string& uid)
+{
+	if ((uid.length() != 3) && (uid.length() != UUID_LENGTH))
+		return 0;
+
+	uint64_t packed = 0;
+	for (std::string::const_iterator i = uid.begin(); i != uid.end(); ++i)
+	{
+		const uint64_t value = PackChar(*i);
+		if (!value)
+			return 0;
+		packed = (packed << 6) | value;
+	}
+	return packed;
+}
+
+UIDIndex::UIDIndex()
+	: slots(64)
+	, count(0)
+	, shift(64 - 6)
+{
+}
+
+void UIDIndex::Grow()
+{
+	std::vector<Slot> oldslots(slots.size() * 2);
+	oldslots.swap(slots);
+	shift--;
+
+	const size_t mask = slots.size() - 1;
+	for (std::vector<Slot>::const_iterator i = oldslots.begin(); i != oldslots.end(); ++i)
+	{
+		if (!i->key)
+			continue;
+
+		size_t pos = GetHome(i->key);
+		while (slots[pos].key)
+			pos = (pos + 1) & mask;
+		slots[pos] = *i;
+	}
+}
+
+bool UIDIndex::Add(uint64_t key, User* user)
+{
+	if ((count + 1) * 2 > slots.size())
+		Grow();
+
+	const size_t mask = slots.size() - 1;
+	size_t pos = GetHome(key);
+	for (; slots[pos].key; pos = (pos + 1) & mask)
+	{
+		if (slots[pos].key == key)
+			return false;
+	}
+
+	slots[pos].key = key;
+	slots[pos].user = user;
+	count++;
+	return true;
+}
+
+void UIDIndex::Remove(uint64_t key)
+{
+	if (!key)
+		return;
+
+	const size_t mask = slots.size() - 1;
+	size_t hole = GetHome(key);
+	for (; slots[hole].key != key; hole = (hole + 1) & mask)
+	{
+		if (!slots[hole].key)
+			return;
+	}
+
+	// Move the entries after the removed one back into the hole if their search starts at or before it,
+	// this keeps every entry reachable from its home slot without leaving a marker in the hole
+	for (size_t pos = (hole + 1) & mask; slots[pos].key; pos = (pos + 1) & mask)
+	{
+		const size_t home = GetHome(slots[pos].key);
+		if (((pos - home) & mask) >= ((pos - hole) & mask))
+		{
+			slots[hole] = slots[pos];
+			hole = pos;
+		}
+	}
+
+	slots[hole].key = 0;
+	slots[hole].user = NULL;
+	count--;
+}
+
 /*
  * Retrieve the next valid UUID that is free for this server.
  */
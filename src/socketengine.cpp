@@ -22,6 +22,7 @@
 
 
 #include "inspircd.h"
+#include "xline.h"
 
 
 /** Reference table, contains all current handlers
@@ -76,6 +77,24 @@ void SocketEngine::ChangeEventMask(EventHandler* eh, int change)
 	OnSetEvent(eh, old_m, new_m);
 }
 
+unsigned int SocketEngine::GetTimeout()
+{
+	// Don't wait for events while xlines are being applied in the background
+	if (ServerInstance->XLines->IsApplyingLines())
+		return 0;
+
+	// Nor when a write handler queued more data for a trial write
+	if (!trials.empty())
+		return 0;
+
+	// Nor while users that were quit together are being deleted a few at a time
+	if (ServerInstance->GlobalCulls.HasDeferredItems())
+		return 0;
+
+	const unsigned int nextsecond = 1000 - ServerInstance->Time_ns() / 1000000;
+	return ServerInstance->Timers.GetNextTimeout(nextsecond);
+}
+
 void SocketEngine::DispatchTrialWrites()
 {
 	std::vector<int> working_list;
@@ -142,10 +161,12 @@ bool SocketEngine::BoundsCheckFd(EventHandler* eh)
 }
 
 
+#ifndef SOCKETENGINE_HAS_IO
 int SocketEngine::Accept(EventHandler* fd, sockaddr *addr, socklen_t *addrlen)
 {
 	return accept(fd->GetFd(), addr, addrlen);
 }
+#endif
 
 int SocketEngine::Close(EventHandler* eh)
 {
@@ -200,6 +221,7 @@ int SocketEngine::RecvFrom(EventHandler* fd, void *buf, size_t len, int flags, s
 	return nbRecvd;
 }
 
+#ifndef SOCKETENGINE_HAS_IO
 int SocketEngine::Send(EventHandler* fd, const void *buf, size_t len, int flags)
 {
 	int nbSent = send(fd->GetFd(), (const char*)buf, len, flags);
@@ -215,6 +237,7 @@ int SocketEngine::Recv(EventHandler* fd, void *buf, size_t len, int flags)
 		stats.Update(nbRecvd, 0);
 	return nbRecvd;
 }
+#endif
 
 int SocketEngine::SendTo(EventHandler* fd, const void *buf, size_t len, int flags, const sockaddr *to, socklen_t tolen)
 {
@@ -224,6 +247,7 @@ int SocketEngine::SendTo(EventHandler* fd, const void *buf, size_t len, int flag
 	return nbSent;
 }
 
+#ifndef SOCKETENGINE_HAS_IO
 int SocketEngine::WriteV(EventHandler* fd, const IOVector* iovec, int count)
 {
 	int sent = writev(fd->GetFd(), iovec, count);
@@ -231,6 +255,7 @@ int SocketEngine::WriteV(EventHandler* fd, const IOVector* iovec, int count)
 		stats.Update(0, sent);
 	return sent;
 }
+#endif
 
 #ifdef _WIN32
 int SocketEngine::WriteV(EventHandler* fd, const iovec* iovec, int count)
@@ -261,10 +286,12 @@ int SocketEngine::Connect(EventHandler* fd, const sockaddr *serv_addr, socklen_t
 	return ret;
 }
 
+#ifndef SOCKETENGINE_HAS_IO
 int SocketEngine::Shutdown(EventHandler* fd, int how)
 {
 	return shutdown(fd->GetFd(), how);
 }
+#endif
 
 int SocketEngine::Bind(int fd, const irc::sockets::sockaddrs& addr)
 {
@@ -0,0 +1,1284 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "inspircd.h"
+#include "exitcodes.h"
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/poll.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <iostream>
+
+/** A specialisation of the SocketEngine class, designed to use the linux io_uring interface.
+ *
+ * This engine does the socket I/O itself instead of only reporting readiness. The first
+ * Recv(), Accept() or WriteV() on a socket is done with a normal system call, after that
+ * the socket is switched to operations running in the ring:
+ *  - reads use a multishot IORING_OP_RECV into a pool of buffers provided to the kernel
+ *    up front, the data is copied into a per socket buffer which Recv() reads from,
+ *  - listeners use a multishot IORING_OP_ACCEPT and Accept() hands out the queued sockets,
+ *  - writes are copied into a per socket buffer and everything written to a socket during
+ *    one loop iteration goes out with a single IORING_OP_SEND.
+ * Sockets which are never read or written through the engine (DNS, the thread engine's
+ * eventfd, database connections) get readiness notifications from IORING_OP_POLL_ADD,
+ * multishot for the edge triggered event masks and one-shot for the level triggered ones.
+ *
+ * All operations queued while handling events are handed to the kernel together with the
+ * wait for new completions in a single io_uring_enter() call per DispatchEvents().
+ */
+namespace
+{
+	/** Number of entries in the submission ring */
+	const unsigned int SQ_ENTRIES = 4096;
+
+	/** Number of entries in the completion ring. Every monitored fd can have a poll or recv
+	 * outstanding so this is much larger than the submission ring.
+	 */
+	const unsigned int CQ_ENTRIES = 65536;
+
+	/** Number and size of the buffers given to the kernel for reads */
+	const unsigned int RECV_BUFFER_COUNT = 1024;
+	const unsigned int RECV_BUFFER_SIZE = 4096;
+	const __u16 RECV_BUFFER_GROUP = 1;
+
+	/** The recv of a socket is stopped when this much received data is waiting to be read by its handler */
+	const size_t RECV_LIMIT = 65536;
+
+	/** Writes to a socket block when this much data is waiting to be sent */
+	const size_t SEND_LIMIT = 65536;
+
+	/** Kinds of per fd operation, stored in the low bits of the user_data */
+	enum OpType
+	{
+		OP_POLL = 1,
+		OP_RECV = 2,
+		OP_ACCEPT = 3
+	};
+
+	/** user_data of per fd operations has this bit set, the user_data of sends is a SendOp pointer */
+	const __u64 FD_OP_FLAG = static_cast<__u64>(1) << 63;
+
+	/** user_data of operations whose completions are not interesting, e.g. cancellations */
+	const __u64 IGNORED_USER_DATA = 0;
+
+	int EngineHandle = -1;
+
+	/** Features which turned out to be unsupported by the kernel are switched off at runtime */
+	bool UseMultishotPoll = true;
+	bool UseRingRecv = true;
+	bool UseRingAccept = true;
+
+	/** Set once a ring operation of the kind succeeded, after that EINVAL is a real error */
+	bool RingRecvWorks = false;
+	bool RingAcceptWorks = false;
+
+	/** Submission ring, mapped from the kernel */
+	struct
+	{
+		void* ring;
+		size_t ringsize;
+		unsigned int* head;
+		unsigned int* tail;
+		unsigned int* mask;
+		unsigned int* array;
+		io_uring_sqe* sqes;
+		size_t sqessize;
+		unsigned int entries;
+	} sq;
+
+	/** Completion ring, mapped from the kernel; may share the mapping with the submission ring */
+	struct
+	{
+		void* ring;
+		size_t ringsize;
+		unsigned int* head;
+		unsigned int* tail;
+		unsigned int* mask;
+		io_uring_cqe* cqes;
+	} cq;
+
+	/** Memory of the buffers given to the kernel for reads */
+	std::vector<char> recvbuffers;
+
+	/** A send in progress, owns the data until the kernel is done with it */
+	struct SendOp
+	{
+		/** Data being sent */
+		std::string data;
+
+		/** How much of data has been sent */
+		size_t sent;
+
+		/** The socket, -1 if it was removed while the send was in progress */
+		int fd;
+	};
+
+	/** Buffers and state of a socket which does its I/O through the ring */
+	struct RingIO
+	{
+		/** True once Recv(), Accept() or WriteV() have switched to the ring */
+		bool ringread;
+		bool ringaccept;
+		bool ringwrite;
+
+		/** True while a multishot recv or accept is outstanding */
+		bool recvarmed;
+		bool acceptarmed;
+
+		/** True if the recv was cancelled because the handler is not reading */
+		bool recvstopping;
+
+		/** Received data not read yet, starting at rxpos */
+		std::string rxbuf;
+		size_t rxpos;
+
+		/** True if the peer closed the connection after the data in rxbuf */
+		bool rxeof;
+
+		/** Error of the recv, returned by Recv() after the data in rxbuf, 0 if none */
+		int rxerror;
+
+		/** Sockets accepted by the multishot accept, handed out by Accept() */
+		std::vector<int> accepted;
+
+		/** Error of the accept, returned by the next Accept(), 0 if none */
+		int accepterror;
+
+		/** The send in progress, NULL if none */
+		SendOp* tx;
+
+		/** Data written while a send is in progress, goes out with the next send */
+		std::string txpending;
+
+		/** True if the fd is in the list of sockets to submit sends for */
+		bool txqueued;
+
+		/** True if the last write did not take all the data it was given */
+		bool txblocked;
+
+		/** Error of the last send, 0 if none */
+		int txerror;
+
+		/** True if txerror was reported to the handler */
+		bool txerrorreported;
+
+		RingIO()
+			: ringread(false), ringaccept(false), ringwrite(false)
+			, recvarmed(false), acceptarmed(false), recvstopping(false)
+			, rxpos(0), rxeof(false), rxerror(0)
+			, accepterror(0)
+			, tx(NULL), txqueued(false), txblocked(false), txerror(0), txerrorreported(false)
+		{
+		}
+
+		size_t GetReadable() const { return rxbuf.size() - rxpos; }
+
+		size_t GetUnsent() const { return txpending.size() + (tx ? tx->data.size() - tx->sent : 0); }
+
+		bool CanRead() const { return (ringread && (GetReadable() || rxeof || rxerror)) || (ringaccept && (!accepted.empty() || accepterror)); }
+
+		bool CanWrite() const { return ringwrite && !txerror && GetUnsent() < SEND_LIMIT; }
+	};
+
+	/** State of a file descriptor */
+	struct FdState
+	{
+		/** Poll events requested by the currently armed poll operation, 0 if none is armed */
+		unsigned int pollevents;
+
+		/** True if the armed poll is multishot */
+		bool pollmulti;
+
+		/** Incremented every time the armed poll changes so completions of old polls can be recognized */
+		unsigned int pollseq;
+
+		/** Incremented when the fd is removed so completions of its recv and accept can be recognized */
+		unsigned int opseq;
+
+		/** Events reported by poll completions which were not dispatched yet, or minus the error */
+		int revents;
+
+		/** True if the fd is in the list of fds to dispatch */
+		bool queued;
+
+		/** Ring I/O state, NULL until the fd does I/O through the engine */
+		RingIO* io;
+
+		FdState() : pollevents(0), pollmulti(false), pollseq(0), opseq(0), revents(0), queued(false), io(NULL) { }
+	};
+
+	/** This vector maps fds to their state
+	 */
+	std::vector<FdState> fdstates(16);
+
+	/** A completion copied out of the completion ring */
+	struct Completion
+	{
+		__u64 user_data;
+		__s32 res;
+		__u32 flags;
+	};
+
+	/** Completions copied out of the completion ring before being dispatched
+	 */
+	std::vector<Completion> events(16);
+
+	/** Fds which have events to dispatch */
+	std::vector<int> readylist;
+
+	/** Fds which have data waiting for a send to be submitted */
+	std::vector<int> sendlist;
+}
+
+static int uring_setup(unsigned int entries, io_uring_params* params)
+{
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(unsigned int to_submit, unsigned int min_complete, unsigned int flags, const void* arg, size_t argsize)
+{
+	return syscall(__NR_io_uring_enter, EngineHandle, to_submit, min_complete, flags, arg, argsize);
+}
+
+/** Returns the number of queued submissions which the kernel has not consumed yet
+ */
+static unsigned int GetPendingSubmissions()
+{
+	return *sq.tail - __atomic_load_n(sq.head, __ATOMIC_ACQUIRE);
+}
+
+static io_uring_sqe* GetSQE()
+{
+	if (GetPendingSubmissions() >= sq.entries)
+	{
+		// The ring is full, hand what we have to the kernel now instead of waiting for DispatchEvents()
+		if (uring_enter(GetPendingSubmissions(), 0, 0, NULL, 0) < 0 || GetPendingSubmissions() >= sq.entries)
+		{
+			ServerInstance->Logs->Log("SOCKET", LOG_DEFAULT, "io_uring submission queue is full: %s", strerror(errno));
+			return NULL;
+		}
+	}
+
+	// Only we write the tail so a plain load is fine, but the kernel must see the filled
+	// entry before it sees the new tail
+	const unsigned int tail = *sq.tail;
+	const unsigned int index = tail & *sq.mask;
+	io_uring_sqe* sqe = &sq.sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sq.array[index] = index;
+	return sqe;
+}
+
+static void CommitSQE()
+{
+	__atomic_store_n(sq.tail, *sq.tail + 1, __ATOMIC_RELEASE);
+}
+
+static __u64 MakeUserData(int fd, OpType type, unsigned int seq)
+{
+	return FD_OP_FLAG | (static_cast<__u64>(fd) << 32) | ((seq & 0x3FFFFFFF) << 2) | type;
+}
+
+static void Cancel(__u64 user_data)
+{
+	io_uring_sqe* sqe = GetSQE();
+	if (!sqe)
+		return;
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = user_data;
+	sqe->user_data = IGNORED_USER_DATA;
+	CommitSQE();
+}
+
+/** Give a read buffer back to the kernel after its data has been copied out
+ */
+static void ProvideBuffer(unsigned int bid)
+{
+	io_uring_sqe* sqe = GetSQE();
+	if (!sqe)
+		return;
+
+	sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+	sqe->fd = 1;
+	sqe->addr = reinterpret_cast<__u64>(&recvbuffers[bid * RECV_BUFFER_SIZE]);
+	sqe->len = RECV_BUFFER_SIZE;
+	sqe->buf_group = RECV_BUFFER_GROUP;
+	sqe->off = bid;
+	sqe->user_data = IGNORED_USER_DATA;
+	CommitSQE();
+}
+
+static unsigned int mask_to_poll(int event_mask, const RingIO* io, bool& level)
+{
+	unsigned int rv = 0;
+	level = false;
+	if ((event_mask & (FD_WANT_POLL_READ | FD_WANT_FAST_READ)) && !(io && (io->ringread || io->ringaccept)))
+	{
+		rv |= POLLIN;
+		level |= (event_mask & FD_WANT_POLL_READ);
+	}
+	if ((event_mask & (FD_WANT_POLL_WRITE | FD_WANT_FAST_WRITE | FD_WANT_SINGLE_WRITE)) && !(io && io->ringwrite))
+	{
+		rv |= POLLOUT;
+		level |= (event_mask & (FD_WANT_POLL_WRITE | FD_WANT_SINGLE_WRITE));
+	}
+	return rv;
+}
+
+/** Make the armed poll for a file descriptor match the given events, removing the old poll if needed
+ */
+static void ArmPoll(int fd, unsigned int newevents, bool multi)
+{
+	FdState& fs = fdstates[fd];
+	multi = multi && UseMultishotPoll;
+	if (fs.pollevents == newevents && (!newevents || fs.pollmulti == multi))
+		return;
+
+	if (fs.pollevents)
+	{
+		io_uring_sqe* sqe = GetSQE();
+		if (sqe)
+		{
+			sqe->opcode = IORING_OP_POLL_REMOVE;
+			sqe->fd = -1;
+			sqe->addr = MakeUserData(fd, OP_POLL, fs.pollseq);
+			sqe->user_data = IGNORED_USER_DATA;
+			CommitSQE();
+		}
+	}
+
+	// Completions of the old poll (if any) will be ignored from now on
+	fs.pollseq++;
+	fs.pollevents = 0;
+
+	if (newevents)
+	{
+		io_uring_sqe* sqe = GetSQE();
+		if (!sqe)
+			return;
+
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = fd;
+		sqe->poll32_events = newevents;
+		if (multi)
+			sqe->len = IORING_POLL_ADD_MULTI;
+		sqe->user_data = MakeUserData(fd, OP_POLL, fs.pollseq);
+		CommitSQE();
+		fs.pollevents = newevents;
+		fs.pollmulti = multi;
+	}
+}
+
+static void ArmRecv(int fd)
+{
+	FdState& fs = fdstates[fd];
+	io_uring_sqe* sqe = GetSQE();
+	if (!sqe)
+		return;
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = RECV_BUFFER_GROUP;
+	sqe->user_data = MakeUserData(fd, OP_RECV, fs.opseq);
+	CommitSQE();
+	fs.io->recvarmed = true;
+}
+
+static void ArmAccept(int fd)
+{
+	FdState& fs = fdstates[fd];
+	io_uring_sqe* sqe = GetSQE();
+	if (!sqe)
+		return;
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = MakeUserData(fd, OP_ACCEPT, fs.opseq);
+	CommitSQE();
+	fs.io->acceptarmed = true;
+}
+
+static void PrepareSend(SendOp* op)
+{
+	io_uring_sqe* sqe = GetSQE();
+	if (!sqe)
+		return;
+
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = op->fd;
+	sqe->addr = reinterpret_cast<__u64>(op->data.data() + op->sent);
+	sqe->len = op->data.size() - op->sent;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = reinterpret_cast<__u64>(op);
+	CommitSQE();
+}
+
+/** Start a send of everything written to a socket if none is in progress
+ */
+static void StartSend(int fd)
+{
+	RingIO* io = fdstates[fd].io;
+	io->txqueued = false;
+	if (io->tx || io->txpending.empty())
+		return;
+
+	SendOp* op = new SendOp;
+	op->data.swap(io->txpending);
+	op->sent = 0;
+	op->fd = fd;
+	io->tx = op;
+	PrepareSend(op);
+}
+
+/** Submit the sends of every socket written to since the last call, so each socket gets one send per loop iteration
+ */
+static void StartSends()
+{
+	for (std::vector<int>::const_iterator i = sendlist.begin(); i != sendlist.end(); ++i)
+	{
+		const FdState& fs = fdstates[*i];
+		if (fs.io && fs.io->txqueued)
+			StartSend(*i);
+	}
+	sendlist.clear();
+}
+
+static void QueueSend(int fd, RingIO* io)
+{
+	if (io->txqueued)
+		return;
+	io->txqueued = true;
+	sendlist.push_back(fd);
+}
+
+static void QueueReady(int fd)
+{
+	FdState& fs = fdstates[fd];
+	if (fs.queued)
+		return;
+	fs.queued = true;
+	readylist.push_back(fd);
+}
+
+/** Returns true if the handler of a socket doing I/O through the ring should get an event now
+ * @param edge True if new data arrived, the mask changed or the socket was queued for any other
+ * reason, false to only consider the level triggered event masks
+ */
+static bool HasRingEvent(const RingIO* io, int mask, bool edge)
+{
+	if (io->txerror && !io->txerrorreported)
+		return true;
+
+	if (io->CanRead() && ((mask & FD_WANT_POLL_READ) || (edge && (mask & FD_WANT_FAST_READ))))
+		return true;
+
+	if (io->CanWrite() && ((mask & (FD_WANT_POLL_WRITE | FD_WANT_SINGLE_WRITE)) || ((mask & FD_WANT_FAST_WRITE) && (edge || io->txblocked))))
+		return true;
+
+	return false;
+}
+
+/** Bring the operations armed for a file descriptor in line with its event mask and I/O state
+ */
+static void Sync(int fd, int mask, bool edge)
+{
+	FdState& fs = fdstates[fd];
+	RingIO* io = fs.io;
+
+	bool level;
+	const unsigned int pollevents = mask_to_poll(mask, io, level);
+	ArmPoll(fd, pollevents, !level);
+
+	if (!io)
+		return;
+
+	if (io->ringread && !io->recvarmed && !io->rxeof && !io->rxerror && io->GetReadable() < RECV_LIMIT)
+		ArmRecv(fd);
+
+	if (io->ringaccept && !io->acceptarmed)
+		ArmAccept(fd);
+
+	if (HasRingEvent(io, mask, edge))
+		QueueReady(fd);
+}
+
+/** Returns the ring I/O state of a socket in the engine, or NULL if it is not in the engine
+ * @param create If true the state is created if the socket has none yet
+ */
+static RingIO* GetRingIO(EventHandler* eh, bool create = true)
+{
+	const int fd = eh->GetFd();
+	if (fd < 0 || static_cast<unsigned int>(fd) >= fdstates.size() || SocketEngine::GetRef(fd) != eh)
+		return NULL;
+
+	FdState& fs = fdstates[fd];
+	if (!fs.io && create)
+		fs.io = new RingIO;
+	return fs.io;
+}
+
+static void OnRecvComplete(int fd, const Completion& cqe)
+{
+	FdState& fs = fdstates[fd];
+	RingIO* io = fs.io;
+
+	if (cqe.flags & IORING_CQE_F_BUFFER)
+	{
+		const unsigned int bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+		if (cqe.res > 0)
+			io->rxbuf.append(&recvbuffers[bid * RECV_BUFFER_SIZE], cqe.res);
+		ProvideBuffer(bid);
+	}
+
+	if (!(cqe.flags & IORING_CQE_F_MORE))
+	{
+		io->recvarmed = false;
+		io->recvstopping = false;
+	}
+
+	if (cqe.res > 0)
+	{
+		RingRecvWorks = true;
+
+		// Stop receiving if the handler is not keeping up, the recv is armed again once it has read the data
+		if (io->recvarmed && !io->recvstopping && io->GetReadable() >= RECV_LIMIT)
+		{
+			Cancel(MakeUserData(fd, OP_RECV, fs.opseq));
+			io->recvstopping = true;
+		}
+	}
+	else if (cqe.res == 0)
+	{
+		io->rxeof = true;
+	}
+	else if (cqe.res == -EINVAL && !RingRecvWorks)
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEFAULT, "io_uring multishot recv is not supported by the kernel, reading with recv()");
+		UseRingRecv = false;
+		io->ringread = false;
+	}
+	else if (cqe.res != -ENOBUFS && cqe.res != -ECANCELED)
+	{
+		// Running out of provided buffers or being stopped only ends the recv, Sync() arms it again
+		io->rxerror = -cqe.res;
+	}
+}
+
+static void OnAcceptComplete(int fd, const Completion& cqe)
+{
+	RingIO* io = fdstates[fd].io;
+	if (!(cqe.flags & IORING_CQE_F_MORE))
+		io->acceptarmed = false;
+
+	if (cqe.res >= 0)
+	{
+		RingAcceptWorks = true;
+		io->accepted.push_back(cqe.res);
+	}
+	else if (cqe.res == -EINVAL && !RingAcceptWorks)
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEFAULT, "io_uring multishot accept is not supported by the kernel, accepting with accept()");
+		UseRingAccept = false;
+		io->ringaccept = false;
+	}
+	else if (cqe.res != -ECANCELED)
+	{
+		io->accepterror = -cqe.res;
+	}
+}
+
+static void OnSendComplete(SendOp* op, const Completion& cqe)
+{
+	if (op->fd < 0)
+	{
+		// The socket was removed while the data was being sent
+		delete op;
+		return;
+	}
+
+	RingIO* io = fdstates[op->fd].io;
+	if (cqe.res > 0)
+	{
+		op->sent += cqe.res;
+		if (op->sent < op->data.size())
+		{
+			PrepareSend(op);
+			return;
+		}
+	}
+	else if (cqe.res == -EAGAIN || cqe.res == -EINTR)
+	{
+		PrepareSend(op);
+		return;
+	}
+	else
+	{
+		io->txerror = cqe.res ? -cqe.res : EPIPE;
+		io->txpending.clear();
+	}
+
+	const int fd = op->fd;
+	io->tx = NULL;
+	if (io->txpending.empty())
+	{
+		// Keep the memory of the sent data for the next writes
+		op->data.clear();
+		io->txpending.swap(op->data);
+	}
+	else
+	{
+		QueueSend(fd, io);
+	}
+	delete op;
+}
+
+static void UnmapRings()
+{
+	if (sq.sqes)
+		munmap(sq.sqes, sq.sqessize);
+	if (cq.ring && cq.ring != sq.ring)
+		munmap(cq.ring, cq.ringsize);
+	if (sq.ring)
+		munmap(sq.ring, sq.ringsize);
+
+	memset(&sq, 0, sizeof(sq));
+	memset(&cq, 0, sizeof(cq));
+}
+
+static bool MapRings(const io_uring_params& params)
+{
+	sq.ringsize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	cq.ringsize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		sq.ringsize = cq.ringsize = std::max(sq.ringsize, cq.ringsize);
+
+	sq.ring = mmap(NULL, sq.ringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, EngineHandle, IORING_OFF_SQ_RING);
+	if (sq.ring == MAP_FAILED)
+	{
+		sq.ring = NULL;
+		return false;
+	}
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		cq.ring = sq.ring;
+	}
+	else
+	{
+		cq.ring = mmap(NULL, cq.ringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, EngineHandle, IORING_OFF_CQ_RING);
+		if (cq.ring == MAP_FAILED)
+		{
+			cq.ring = NULL;
+			return false;
+		}
+	}
+
+	sq.sqessize = params.sq_entries * sizeof(io_uring_sqe);
+	void* sqes = mmap(NULL, sq.sqessize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, EngineHandle, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+		return false;
+
+	char* sqring = static_cast<char*>(sq.ring);
+	sq.head = reinterpret_cast<unsigned int*>(sqring + params.sq_off.head);
+	sq.tail = reinterpret_cast<unsigned int*>(sqring + params.sq_off.tail);
+	sq.mask = reinterpret_cast<unsigned int*>(sqring + params.sq_off.ring_mask);
+	sq.array = reinterpret_cast<unsigned int*>(sqring + params.sq_off.array);
+	sq.sqes = static_cast<io_uring_sqe*>(sqes);
+	sq.entries = params.sq_entries;
+
+	char* cqring = static_cast<char*>(cq.ring);
+	cq.head = reinterpret_cast<unsigned int*>(cqring + params.cq_off.head);
+	cq.tail = reinterpret_cast<unsigned int*>(cqring + params.cq_off.tail);
+	cq.mask = reinterpret_cast<unsigned int*>(cqring + params.cq_off.ring_mask);
+	cq.cqes = reinterpret_cast<io_uring_cqe*>(cqring + params.cq_off.cqes);
+	return true;
+}
+
+/** Give the read buffers to the kernel, waits for the result as the ring is still empty at this point
+ */
+static bool ProvideBuffers()
+{
+	recvbuffers.resize(RECV_BUFFER_COUNT * RECV_BUFFER_SIZE);
+
+	io_uring_sqe* sqe = GetSQE();
+	if (!sqe)
+		return false;
+
+	sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+	sqe->fd = RECV_BUFFER_COUNT;
+	sqe->addr = reinterpret_cast<__u64>(&recvbuffers[0]);
+	sqe->len = RECV_BUFFER_SIZE;
+	sqe->buf_group = RECV_BUFFER_GROUP;
+	sqe->off = 0;
+	sqe->user_data = IGNORED_USER_DATA;
+	CommitSQE();
+
+	if (uring_enter(1, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+		return false;
+
+	const unsigned int head = *cq.head;
+	if (head == __atomic_load_n(cq.tail, __ATOMIC_ACQUIRE))
+		return false;
+
+	const int res = cq.cqes[head & *cq.mask].res;
+	__atomic_store_n(cq.head, head + 1, __ATOMIC_RELEASE);
+	return res >= 0;
+}
+
+void SocketEngine::Init()
+{
+	struct rlimit limits;
+	if (!getrlimit(RLIMIT_NOFILE, &limits))
+	{
+		MAX_DESCRIPTORS = limits.rlim_cur;
+	}
+	else
+	{
+		// MAX_DESCRIPTORS is mainly used for display purposes, it's not a problem that getrlimit() failed
+		MAX_DESCRIPTORS = -1;
+	}
+
+	RecoverFromFork();
+}
+
+void SocketEngine::RecoverFromFork()
+{
+	// Operations started by the parent are cancelled when it exits so set up a fresh ring for this process
+	if (EngineHandle != -1)
+		Deinit();
+
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = CQ_ENTRIES;
+#ifdef IORING_SETUP_DEFER_TASKRUN
+	// Only this thread uses the ring and it always asks for completions in io_uring_enter(), so the
+	// kernel can leave finishing them until then instead of interrupting the process for each one
+	params.flags |= IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+#endif
+
+	EngineHandle = uring_setup(SQ_ENTRIES, &params);
+	if (EngineHandle == -1 && errno == EINVAL)
+	{
+		// Older kernels do not know the flags above
+		memset(&params, 0, sizeof(params));
+		params.flags = IORING_SETUP_CQSIZE;
+		params.cq_entries = CQ_ENTRIES;
+		EngineHandle = uring_setup(SQ_ENTRIES, &params);
+	}
+	if (EngineHandle == -1 || !(params.features & IORING_FEAT_EXT_ARG) || !MapRings(params))
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEFAULT, "ERROR: Could not initialize socket engine: %s", strerror(errno));
+		ServerInstance->Logs->Log("SOCKET", LOG_DEFAULT, "ERROR: Your kernel probably does not have the proper features. This is a fatal error, exiting now.");
+		std::cout << "ERROR: Could not initialize io_uring socket engine: " << strerror(errno) << std::endl;
+		std::cout << "ERROR: Your kernel probably does not have the proper features. This is a fatal error, exiting now." << std::endl;
+		ServerInstance->QuickExit(EXIT_STATUS_SOCKETENGINE);
+	}
+
+	if (UseRingRecv && !ProvideBuffers())
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEFAULT, "io_uring provided buffers are not supported by the kernel, reading with recv()");
+		UseRingRecv = false;
+	}
+
+	// Rearm the operations of any file descriptor added before the ring was recreated
+	for (size_t fd = 0; fd < fdstates.size(); fd++)
+	{
+		FdState& fs = fdstates[fd];
+		fs.pollevents = 0;
+		RingIO* io = fs.io;
+		if (io)
+		{
+			io->recvarmed = io->recvstopping = io->acceptarmed = false;
+			io->ringread = io->ringread && UseRingRecv;
+
+			// The send of the old ring is gone, its memory is left alone as the old ring may still be using it
+			if (io->tx)
+			{
+				io->txpending.insert(0, io->tx->data, io->tx->sent, std::string::npos);
+				io->tx = NULL;
+				QueueSend(fd, io);
+			}
+		}
+
+		EventHandler* eh = GetRef(fd);
+		if (eh)
+			Sync(fd, eh->GetEventMask(), false);
+	}
+}
+
+void SocketEngine::Deinit()
+{
+	UnmapRings();
+	Close(EngineHandle);
+	EngineHandle = -1;
+}
+
+bool SocketEngine::AddFd(EventHandler* eh, int event_mask)
+{
+	int fd = eh->GetFd();
+	if (fd < 0)
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "AddFd out of range: (fd: %d)", fd);
+		return false;
+	}
+
+	if (!SocketEngine::AddFdRef(eh))
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "Attempt to add duplicate fd: %d", fd);
+		return false;
+	}
+
+	while (static_cast<unsigned int>(fd) >= fdstates.size())
+		fdstates.resize(fdstates.size() * 2);
+
+	ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "New file descriptor: %d", fd);
+
+	eh->SetEventMask(event_mask);
+	Sync(fd, event_mask, false);
+	ResizeDouble(events);
+
+	return true;
+}
+
+void SocketEngine::OnSetEvent(EventHandler* eh, int old_mask, int new_mask)
+{
+	int fd = eh->GetFd();
+	if (fd < 0 || static_cast<unsigned int>(fd) >= fdstates.size())
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "SetEvents() on unknown fd: %d", fd);
+		return;
+	}
+
+	// Like an epoll_ctl() MOD, asking for an event which is already possible delivers it
+	const int wanted = FD_WANT_POLL_READ | FD_WANT_FAST_READ | FD_WANT_POLL_WRITE | FD_WANT_FAST_WRITE | FD_WANT_SINGLE_WRITE;
+	const bool added = (new_mask & ~old_mask & wanted);
+
+	// Nothing is sent to the kernel here, the change is submitted with the next DispatchEvents()
+	Sync(fd, new_mask, added);
+}
+
+void SocketEngine::DelFd(EventHandler* eh)
+{
+	int fd = eh->GetFd();
+	if (fd < 0)
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "DelFd out of range: (fd: %d)", fd);
+		return;
+	}
+
+	if (static_cast<unsigned int>(fd) < fdstates.size())
+	{
+		ArmPoll(fd, 0, false);
+
+		FdState& fs = fdstates[fd];
+		fs.revents = 0;
+		RingIO* io = fs.io;
+		if (io)
+		{
+			// Send what was written before the socket is closed, whatever does not fit in
+			// the socket buffer right away is dropped along with the rest of the operations
+			if (io->txqueued)
+				StartSend(fd);
+			if (io->tx)
+			{
+				io->tx->fd = -1;
+				Cancel(reinterpret_cast<__u64>(io->tx));
+			}
+
+			if (io->recvarmed)
+				Cancel(MakeUserData(fd, OP_RECV, fs.opseq));
+			if (io->acceptarmed)
+				Cancel(MakeUserData(fd, OP_ACCEPT, fs.opseq));
+
+			for (std::vector<int>::const_iterator i = io->accepted.begin(); i != io->accepted.end(); ++i)
+				Close(*i);
+
+			delete io;
+			fs.io = NULL;
+			fs.opseq++;
+
+			// The operations hold a reference to the socket so they have to be gone before it is closed
+			uring_enter(GetPendingSubmissions(), 0, 0, NULL, 0);
+		}
+	}
+
+	SocketEngine::DelFdRef(eh);
+
+	ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "Remove file descriptor: %d", fd);
+}
+
+int SocketEngine::DispatchEvents()
+{
+	StartSends();
+
+	// Submit every operation queued since the last call and wait for completions in the same system call,
+	// unless some sockets still have events to dispatch from data the engine has already received
+	const unsigned int waitms = readylist.empty() ? GetTimeout() : 0;
+	struct __kernel_timespec timeout;
+	timeout.tv_sec = waitms / 1000;
+	timeout.tv_nsec = (waitms % 1000) * 1000000;
+
+	io_uring_getevents_arg arg;
+	memset(&arg, 0, sizeof(arg));
+	arg.ts = reinterpret_cast<__u64>(&timeout);
+
+	if (uring_enter(GetPendingSubmissions(), waitms ? 1 : 0, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) < 0 && errno != ETIME && errno != EINTR)
+		ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "io_uring_enter() failed: %s", strerror(errno));
+
+	ServerInstance->UpdateTime();
+
+	// Copy the completions out of the ring before handling them, handlers may queue new
+	// submissions and those may have to be flushed to the kernel if the submission ring fills up
+	unsigned int head = *cq.head;
+	const unsigned int tail = __atomic_load_n(cq.tail, __ATOMIC_ACQUIRE);
+	size_t count = 0;
+	for (; head != tail; head++)
+	{
+		const io_uring_cqe& cqe = cq.cqes[head & *cq.mask];
+		if (cqe.user_data == IGNORED_USER_DATA)
+			continue;
+
+		if (count == events.size())
+			events.resize(events.size() * 2);
+		events[count].user_data = cqe.user_data;
+		events[count].res = cqe.res;
+		events[count].flags = cqe.flags;
+		count++;
+	}
+	__atomic_store_n(cq.head, head, __ATOMIC_RELEASE);
+
+	for (size_t j = 0; j < count; j++)
+	{
+		const Completion& cqe = events[j];
+		if (!(cqe.user_data & FD_OP_FLAG))
+		{
+			SendOp* op = reinterpret_cast<SendOp*>(cqe.user_data);
+			const int fd = op->fd;
+			OnSendComplete(op, cqe);
+
+			EventHandler* eh = (fd < 0 ? NULL : GetRef(fd));
+			if (eh)
+				Sync(fd, eh->GetEventMask(), false);
+			continue;
+		}
+
+		const int fd = static_cast<int>((cqe.user_data >> 32) & 0x7FFFFFFF);
+		const unsigned int seq = static_cast<unsigned int>(cqe.user_data >> 2) & 0x3FFFFFFF;
+		const OpType type = static_cast<OpType>(cqe.user_data & 3);
+		if (static_cast<unsigned int>(fd) >= fdstates.size())
+			continue;
+
+		FdState& fs = fdstates[fd];
+		if (type == OP_POLL)
+		{
+			// Skip completions of polls which have been removed or replaced in the meantime
+			if ((fs.pollseq & 0x3FFFFFFF) != seq || !fs.pollevents)
+				continue;
+
+			// One-shot polls and multishot polls which were terminated are not armed any more
+			if (!(cqe.flags & IORING_CQE_F_MORE))
+				fs.pollevents = 0;
+
+			if (cqe.res == -EINVAL && fs.pollmulti)
+			{
+				ServerInstance->Logs->Log("SOCKET", LOG_DEFAULT, "io_uring multishot poll is not supported by the kernel, using one-shot polls");
+				UseMultishotPoll = false;
+
+				EventHandler* eh = GetRef(fd);
+				if (eh)
+					Sync(fd, eh->GetEventMask(), false);
+				continue;
+			}
+
+			// The poll is armed again (if needed) after the event has been dispatched
+			fs.revents = (cqe.res < 0 ? cqe.res : (fs.revents | cqe.res));
+			QueueReady(fd);
+			continue;
+		}
+		else if (!fs.io || (fs.opseq & 0x3FFFFFFF) != seq)
+		{
+			// The socket was removed, only the buffer has to be given back
+			if (cqe.flags & IORING_CQE_F_BUFFER)
+				ProvideBuffer(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+			continue;
+		}
+		else if (type == OP_RECV)
+		{
+			OnRecvComplete(fd, cqe);
+		}
+		else
+		{
+			OnAcceptComplete(fd, cqe);
+		}
+
+		EventHandler* eh = GetRef(fd);
+		if (eh)
+			Sync(fd, eh->GetEventMask(), true);
+	}
+
+	// Handlers may add fds to the ready list (and resize fdstates) so work on a copy
+	static std::vector<int> dispatchlist;
+	dispatchlist.swap(readylist);
+
+	int i = 0;
+	for (std::vector<int>::const_iterator it = dispatchlist.begin(); it != dispatchlist.end(); ++it)
+	{
+		const int fd = *it;
+		fdstates[fd].queued = false;
+		const int revents = fdstates[fd].revents;
+		fdstates[fd].revents = 0;
+
+		EventHandler* eh = GetRef(fd);
+		if (!eh)
+			continue;
+
+		RingIO* io = fdstates[fd].io;
+		const int mask = eh->GetEventMask();
+
+		i++;
+		stats.TotalEvents++;
+
+		if (revents < 0)
+		{
+			stats.ErrorEvents++;
+			eh->HandleEvent(EVENT_ERROR, -revents);
+		}
+		else if (revents & POLLHUP)
+		{
+			stats.ErrorEvents++;
+			eh->HandleEvent(EVENT_ERROR, 0);
+		}
+		else if (revents & POLLERR)
+		{
+			stats.ErrorEvents++;
+			// Get error number
+			socklen_t codesize = sizeof(int);
+			int errcode;
+			if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &errcode, &codesize) < 0)
+				errcode = errno;
+			eh->HandleEvent(EVENT_ERROR, errcode);
+		}
+		else if (io && io->txerror && !io->txerrorreported)
+		{
+			stats.ErrorEvents++;
+			io->txerrorreported = true;
+			eh->HandleEvent(EVENT_ERROR, io->txerror);
+		}
+		else
+		{
+			const bool canwrite = (revents & POLLOUT) || (io && io->CanWrite() && (mask & (FD_WANT_POLL_WRITE | FD_WANT_FAST_WRITE | FD_WANT_SINGLE_WRITE)));
+			if ((revents & POLLIN) || (io && io->CanRead() && (mask & (FD_WANT_POLL_READ | FD_WANT_FAST_READ))))
+			{
+				stats.ReadEvents++;
+				eh->SetEventMask(eh->GetEventMask() & ~FD_READ_WILL_BLOCK);
+				eh->HandleEvent(EVENT_READ);
+			}
+
+			if (canwrite && eh == GetRef(fd))
+			{
+				stats.WriteEvents++;
+				if (fdstates[fd].io)
+					fdstates[fd].io->txblocked = false;
+				eh->SetEventMask(eh->GetEventMask() & ~(FD_WRITE_WILL_BLOCK | FD_WANT_SINGLE_WRITE));
+				eh->HandleEvent(EVENT_WRITE);
+			}
+		}
+
+		// Rearm the poll and queue level triggered events unless the handler was deleted
+		if (eh == GetRef(fd))
+			Sync(fd, eh->GetEventMask(), false);
+	}
+	dispatchlist.clear();
+
+	return i;
+}
+
+int SocketEngine::Accept(EventHandler* fd, sockaddr *addr, socklen_t *addrlen)
+{
+	RingIO* io = (UseRingAccept ? GetRingIO(fd) : NULL);
+	if (!io || !io->ringaccept)
+	{
+		// Accept the first connection directly, then switch the listener to a multishot accept
+		int ret = accept(fd->GetFd(), addr, addrlen);
+		if (io)
+		{
+			io->ringaccept = true;
+			Sync(fd->GetFd(), fd->GetEventMask(), false);
+		}
+		return ret;
+	}
+
+	if (io->accepted.empty())
+	{
+		errno = (io->accepterror ? io->accepterror : EAGAIN);
+		io->accepterror = 0;
+		return -1;
+	}
+
+	const int newfd = io->accepted.front();
+	io->accepted.erase(io->accepted.begin());
+	Sync(fd->GetFd(), fd->GetEventMask(), false);
+
+	if (addr && getpeername(newfd, addr, addrlen) < 0)
+	{
+		const int err = errno;
+		Close(newfd);
+		errno = err;
+		return -1;
+	}
+	return newfd;
+}
+
+int SocketEngine::Recv(EventHandler* fd, void *buf, size_t len, int flags)
+{
+	RingIO* io = (UseRingRecv ? GetRingIO(fd) : NULL);
+	if (!io || !io->ringread)
+	{
+		// Read directly until the first read which succeeded or would have blocked, then switch to a multishot recv
+		int nbRecvd = recv(fd->GetFd(), (char*)buf, len, flags);
+		if (nbRecvd > 0)
+			stats.Update(nbRecvd, 0);
+		if (io && (nbRecvd > 0 || (nbRecvd < 0 && SocketEngine::IgnoreError())))
+		{
+			io->ringread = true;
+			Sync(fd->GetFd(), fd->GetEventMask(), false);
+		}
+		return nbRecvd;
+	}
+
+	const size_t readable = io->GetReadable();
+	if (!readable)
+	{
+		if (io->rxerror)
+		{
+			errno = io->rxerror;
+			return -1;
+		}
+		if (io->rxeof)
+			return 0;
+
+		errno = EAGAIN;
+		return -1;
+	}
+
+	const size_t nbRecvd = std::min(len, readable);
+	memcpy(buf, io->rxbuf.data() + io->rxpos, nbRecvd);
+	stats.Update(nbRecvd, 0);
+	if (flags & MSG_PEEK)
+		return nbRecvd;
+
+	io->rxpos += nbRecvd;
+	if (io->rxpos == io->rxbuf.size())
+	{
+		io->rxbuf.clear();
+		io->rxpos = 0;
+	}
+	else if (io->rxpos >= RECV_LIMIT)
+	{
+		io->rxbuf.erase(0, io->rxpos);
+		io->rxpos = 0;
+	}
+
+	// Arm the recv again if it was stopped because the data was not being read
+	if (!io->recvarmed)
+		Sync(fd->GetFd(), fd->GetEventMask(), false);
+	return nbRecvd;
+}
+
+int SocketEngine::Send(EventHandler* fd, const void *buf, size_t len, int flags)
+{
+	IOVector iov;
+	iov.iov_base = const_cast<char*>(static_cast<const char*>(buf));
+	iov.iov_len = len;
+	return WriteV(fd, &iov, 1);
+}
+
+int SocketEngine::WriteV(EventHandler* fd, const IOVector* iovec, int count)
+{
+	RingIO* io = GetRingIO(fd);
+	if (!io)
+	{
+		int sent = writev(fd->GetFd(), iovec, count);
+		if (sent > 0)
+			stats.Update(0, sent);
+		return sent;
+	}
+
+	if (!io->ringwrite)
+	{
+		// Nothing written earlier is still in flight so the socket can switch to sends through the ring right away
+		io->ringwrite = true;
+		Sync(fd->GetFd(), fd->GetEventMask(), false);
+	}
+
+	if (io->txerror)
+	{
+		errno = io->txerror;
+		return -1;
+	}
+
+	const size_t unsent = io->GetUnsent();
+	const size_t space = (unsent < SEND_LIMIT ? SEND_LIMIT - unsent : 0);
+	size_t total = 0;
+	size_t sent = 0;
+	for (int i = 0; i < count; i++)
+	{
+		const size_t len = std::min(iovec[i].iov_len, space - sent);
+		io->txpending.append(static_cast<const char*>(iovec[i].iov_base), len);
+		sent += len;
+		total += iovec[i].iov_len;
+	}
+
+	// The handler gets a write event once there is room again
+	if (sent < total)
+		io->txblocked = true;
+
+	if (!sent)
+	{
+		if (!total)
+			return 0;
+
+		errno = EAGAIN;
+		return -1;
+	}
+
+	QueueSend(fd->GetFd(), io);
+	stats.Update(0, sent);
+	return sent;
+}
+
+int SocketEngine::Shutdown(EventHandler* fd, int how)
+{
+	// Send what was written before the shutdown, sends are not submitted until the next DispatchEvents() otherwise
+	RingIO* io = GetRingIO(fd, false);
+	if (io && io->txqueued)
+	{
+		StartSend(fd->GetFd());
+		uring_enter(GetPendingSubmissions(), 0, 0, NULL, 0);
+	}
+
+	return shutdown(fd->GetFd(), how);
+}
@@ -23,6 +23,7 @@
 
 #include "inspircd.h"
 #include "testsuite.h"
+#include <iomanip>
 #include <iostream>
 
 class TestSuiteThread : public Thread
@@ -63,6 +64,8 @@ TestSuite::TestSuite()
 		std::cout << "(6) Comma sepstream tests\n";
 		std::cout << "(7) Space sepstream tests\n";
 		std::cout << "(8) UID generation tests\n";
+		std::cout << "(9) Channel member map tests and benchmarks\n";
+		std::cout << "(A) UID index tests and benchmarks\n";
 
 		std::cout << std::endl << "(X) Exit test suite\n";
 
@@ -110,6 +113,12 @@ TestSuite::TestSuite()
 			case '8':
 				std::cout << (DoGenerateUIDTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
 				break;
+			case '9':
+				std::cout << (DoMemberMapTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
+			case 'A':
+				std::cout << (DoUIDIndexTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
 			case 'X':
 				return;
 				break;
@@ -121,15 +130,77 @@ TestSuite::TestSuite()
 	}
 }
 
-/* Test that x matches y with match() */
-#define WCTEST(x, y) std::cout << "match(\"" << x << "\",\"" << y "\") " << ((passed = (InspIRCd::Match(x, y, NULL))) ? " SUCCESS!\n" : " FAILURE\n")
-/* Test that x does not match y with match() */
-#define WCTESTNOT(x, y) std::cout << "!match(\"" << x << "\",\"" << y "\") " << ((passed = ((!InspIRCd::Match(x, y, NULL)))) ? " SUCCESS!\n" : " FAILURE\n")
+/* Test that x matches y with match() and a CompiledMask */
+#define WCTEST(x, y) std::cout << "match(\"" << x << "\",\"" << y "\") " << ((passed = (InspIRCd::Match(x, y, NULL) && CompiledMask(y).Match(x))) ? " SUCCESS!\n" : " FAILURE\n")
+/* Test that x does not match y with match() and a CompiledMask */
+#define WCTESTNOT(x, y) std::cout << "!match(\"" << x << "\",\"" << y "\") " << ((passed = ((!InspIRCd::Match(x, y, NULL)) && (!CompiledMask(y).Match(x)))) ? " SUCCESS!\n" : " FAILURE\n")
 
 /* Test that x matches y with match() and cidr enabled */
-#define CIDRTEST(x, y) std::cout << "match(\"" << x << "\",\"" << y "\", true) " << ((passed = (InspIRCd::MatchCIDR(x, y, NULL))) ? " SUCCESS!\n" : " FAILURE\n")
+#define CIDRTEST(x, y) std::cout << "match(\"" << x << "\",\"" << y "\", true) " << ((passed = (InspIRCd::MatchCIDR(x, y, NULL) && CompiledMask(y).MatchCIDR(x))) ? " SUCCESS!\n" : " FAILURE\n")
 /* Test that x does not match y with match() and cidr enabled */
-#define CIDRTESTNOT(x, y) std::cout << "!match(\"" << x << "\",\"" << y "\", true) " << ((passed = ((!InspIRCd::MatchCIDR(x, y, NULL)))) ? " SUCCESS!\n" : " FAILURE\n")
+#define CIDRTESTNOT(x, y) std::cout << "!match(\"" << x << "\",\"" << y "\", true) " << ((passed = ((!InspIRCd::MatchCIDR(x, y, NULL)) && (!CompiledMask(y).MatchCIDR(x)))) ? " SUCCESS!\n" : " FAILURE\n")
+
+namespace
+{
+	std::string RandomString(const char* chars, unsigned int maxlength)
+	{
+		std::string str;
+		const unsigned int count = strlen(chars);
+		for (unsigned int length = ServerInstance->GenRandomInt(maxlength + 1); length > 0; --length)
+			str.push_back(chars[ServerInstance->GenRandomInt(count)]);
+		return str;
+	}
+
+	/** Compares CompiledMask against InspIRCd::Match() on random masks and strings
+	 */
+	bool CompareCompiledMasks()
+	{
+		unsigned const char* maps[] = { NULL, ascii_case_insensitive_map, rfc_case_insensitive_map };
+		for (unsigned int i = 0; i < 300000; ++i)
+		{
+			const std::string mask = RandomString("ab[A{?**", 8);
+			const std::string str = RandomString("abAB[{", 10);
+			unsigned const char* map = maps[i % 3];
+			if (InspIRCd::Match(str, mask, map) != CompiledMask(mask, map).Match(str))
+			{
+				std::cout << "COMPILEDMASK: match(\"" << str << "\",\"" << mask << "\") FAILURE" << std::endl;
+				return false;
+			}
+		}
+		std::cout << "COMPILEDMASK: random masks SUCCESS" << std::endl;
+		return true;
+	}
+
+	/** Matches every string against a mask with InspIRCd::Match() and with a CompiledMask, prints the time per match
+	 */
+	bool BenchMatch(const std::string& mask, const std::vector<std::string>& strings, unsigned int rounds)
+	{
+		unsigned int matches = 0;
+		uint64_t start = InspIRCd::GetMonotonicClock();
+		for (unsigned int round = 0; round < rounds; ++round)
+		{
+			for (std::vector<std::string>::const_iterator i = strings.begin(); i != strings.end(); ++i)
+				matches += InspIRCd::Match(*i, mask, NULL);
+		}
+		const uint64_t plain = InspIRCd::GetMonotonicClock() - start;
+
+		const CompiledMask compiled(mask);
+		unsigned int compiledmatches = 0;
+		start = InspIRCd::GetMonotonicClock();
+		for (unsigned int round = 0; round < rounds; ++round)
+		{
+			for (std::vector<std::string>::const_iterator i = strings.begin(); i != strings.end(); ++i)
+				compiledmatches += compiled.Match(*i);
+		}
+		const uint64_t fast = InspIRCd::GetMonotonicClock() - start;
+
+		const double total = double(rounds) * strings.size();
+		std::cout << std::fixed << std::setprecision(1) << "COMPILEDMASK: \"" << mask << "\" (" << matches / rounds << " of "
+			<< strings.size() << " match): " << plain / total << "ns per match with match(), " << fast / total
+			<< "ns compiled" << std::endl;
+		return (matches == compiledmatches);
+	}
+}
 
 bool TestSuite::DoWildTests()
 {
@@ -200,7 +271,26 @@ bool TestSuite::DoWildTests()
 	CIDRTESTNOT("brain@1.2.3.4", "@");
 	CIDRTESTNOT("brain@1.2.3.4", "");
 
-	return true;
+	passed = CompareCompiledMasks();
+
+	std::vector<std::string> hosts;
+	for (unsigned int i = 0; i < 1000; ++i)
+	{
+		const std::string num = ConvToStr(i);
+		if (i % 2)
+			hosts.push_back("nick" + num + "!ident" + num + "@host-" + num + ".dsl.example.net");
+		else
+			hosts.push_back("Guest" + num + "!~webchat@192.168." + ConvToStr(i % 256) + "." + ConvToStr(i / 4));
+	}
+
+	const char* masks[] = { "*", "*!*@*.example.org", "*!*@192.168.1*", "nick1?3*!*@*", "*host*dsl*net", "*!*ident9*@*", "*1*2*3*" };
+	for (unsigned int i = 0; i < sizeof(masks) / sizeof(masks[0]); ++i)
+	{
+		if (!BenchMatch(masks[i], hosts, 2000))
+			passed = false;
+	}
+
+	return passed;
 }
 
 
@@ -295,7 +385,7 @@ bool TestSuite::DoThreadTests()
 		std::cout << "Creation failed, test failure.\n";
 		return false;
 	}
-	std::cout << "Creation success, type " << te->GetName() << "\n";
+	std::cout << "Creation success\n";
 
 	std::cout << "Allocate: new TestSuiteThread...\n";
 	TestSuiteThread* tst = new TestSuiteThread();
@@ -394,6 +484,239 @@ bool TestSuite::DoGenerateUIDTests()
 	return true;
 }
 
+namespace
+{
+	/** Stands in for a User in the member map benchmarks, allocated separately like real users
+	 */
+	struct BenchUser
+	{
+		unsigned long already_sent;
+		char pad[504];
+
+		BenchUser() : already_sent(0) { }
+	};
+
+	typedef insp::dense_map<BenchUser, Membership*> DenseMemberMap;
+	typedef std::map<BenchUser*, insp::aligned_storage<Membership> > TreeMemberMap;
+
+	/** Sends to every member the same way User::ForEachNeighbor does, returns the time taken in ns
+	 */
+	template <typename Map>
+	uint64_t BenchFanOut(const Map& members, unsigned int rounds)
+	{
+		const uint64_t start = InspIRCd::GetMonotonicClock();
+		for (unsigned int round = 1; round <= rounds; ++round)
+		{
+			for (typename Map::const_iterator i = members.begin(); i != members.end(); ++i)
+			{
+				if (i->first->already_sent != round)
+					i->first->already_sent = round;
+			}
+		}
+		return InspIRCd::GetMonotonicClock() - start;
+	}
+
+	/** Joins all users then parts them in a different order, returns the time taken in ns
+	 */
+	template <typename Map, typename Value>
+	uint64_t BenchJoinPart(const std::vector<BenchUser*>& users, const std::vector<BenchUser*>& partorder, unsigned int rounds, const Value& value)
+	{
+		Map members;
+		const uint64_t start = InspIRCd::GetMonotonicClock();
+		for (unsigned int round = 0; round < rounds; ++round)
+		{
+			for (std::vector<BenchUser*>::const_iterator i = users.begin(); i != users.end(); ++i)
+				members.insert(std::make_pair(*i, value));
+			for (std::vector<BenchUser*>::const_iterator i = partorder.begin(); i != partorder.end(); ++i)
+				members.erase(members.find(*i));
+		}
+		return InspIRCd::GetMonotonicClock() - start;
+	}
+}
+
+bool TestSuite::DoMemberMapTests()
+{
+	std::vector<BenchUser*> users;
+	for (unsigned int i = 0; i < 50000; ++i)
+		users.push_back(new BenchUser);
+
+	// Compare against std::map with random joins and parts, crossing the size where the index is built and dropped
+	bool passed = true;
+	DenseMemberMap dense;
+	std::map<BenchUser*, Membership*> reference;
+	for (unsigned int phase = 0; (phase < 10) && (passed); ++phase)
+	{
+		const unsigned int range = (phase % 2) ? 40 : 2000;
+		for (unsigned int i = range; i < 2000; ++i)
+		{
+			if (reference.erase(users[i]))
+				dense.erase(dense.find(users[i]));
+		}
+
+		for (unsigned int i = 0; i < 20000; ++i)
+		{
+			BenchUser* const user = users[ServerInstance->GenRandomInt(range)];
+			DenseMemberMap::iterator it = dense.find(user);
+			if ((it != dense.end()) != (reference.count(user) != 0))
+				passed = false;
+			else if (it != dense.end())
+			{
+				dense.erase(it);
+				reference.erase(user);
+			}
+			else
+			{
+				dense.insert(std::make_pair(user, static_cast<Membership*>(NULL)));
+				reference.insert(std::make_pair(user, static_cast<Membership*>(NULL)));
+			}
+		}
+
+		std::set<BenchUser*> contents;
+		for (DenseMemberMap::const_iterator i = dense.begin(); i != dense.end(); ++i)
+			contents.insert(i->first);
+		if ((contents.size() != dense.size()) || (dense.size() != reference.size()))
+			passed = false;
+		for (std::map<BenchUser*, Membership*>::const_iterator i = reference.begin(); i != reference.end(); ++i)
+		{
+			if (!contents.count(i->first))
+				passed = false;
+		}
+	}
+	std::cout << "MEMBERMAP: random joins and parts " << (passed ? "SUCCESS" : "FAILURE") << std::endl;
+
+	const unsigned int sizes[] = { 10, 1000, 50000 };
+	for (unsigned int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+	{
+		const unsigned int size = sizes[s];
+		const std::vector<BenchUser*> members(users.begin(), users.begin() + size);
+		std::vector<BenchUser*> partorder(members);
+		for (unsigned int i = size - 1; i > 0; --i)
+			std::swap(partorder[i], partorder[ServerInstance->GenRandomInt(i + 1)]);
+
+		const unsigned int rounds = 5000000 / size;
+		TreeMemberMap tree;
+		DenseMemberMap denselist;
+		for (std::vector<BenchUser*>::const_iterator i = members.begin(); i != members.end(); ++i)
+		{
+			tree.insert(std::make_pair(*i, insp::aligned_storage<Membership>()));
+			denselist.insert(std::make_pair(*i, static_cast<Membership*>(NULL)));
+		}
+
+		const uint64_t treefanout = BenchFanOut(tree, rounds);
+		const uint64_t densefanout = BenchFanOut(denselist, rounds);
+		const unsigned int joinrounds = 1000000 / size;
+		const uint64_t treejoinpart = BenchJoinPart<TreeMemberMap>(members, partorder, joinrounds, insp::aligned_storage<Membership>());
+		const uint64_t densejoinpart = BenchJoinPart<DenseMemberMap>(members, partorder, joinrounds, static_cast<Membership*>(NULL));
+
+		std::cout << std::fixed << std::setprecision(1) << "MEMBERMAP: " << size << " members: fan-out "
+			<< double(treefanout) / rounds / size << "ns per member with std::map, "
+			<< double(densefanout) / rounds / size << "ns with dense_map; join and part "
+			<< double(treejoinpart) / joinrounds / size << "ns per member with std::map, "
+			<< double(densejoinpart) / joinrounds / size << "ns with dense_map" << std::endl;
+	}
+
+	stdalgo::delete_all(users);
+	return passed;
+}
+
+bool TestSuite::DoUIDIndexTests()
+{
+	// Packing must tell apart every SID and UUID and reject anything else
+	bool passed = true;
+	if ((UIDGenerator::Pack("001AAAAAB") != UIDGenerator::Pack("001aaaaab")) || (UIDGenerator::Pack("001") == UIDGenerator::Pack("001AAAAAA")) ||
+		(UIDGenerator::Pack("001AAAAAB") == UIDGenerator::Pack("001AAAAAC")) || (UIDGenerator::Pack("00A") == UIDGenerator::Pack("010")) ||
+		(UIDGenerator::Pack("")) || (UIDGenerator::Pack("001AAAAA")) || (UIDGenerator::Pack("001AAAA-B")) || (UIDGenerator::Pack("Nick")))
+		passed = false;
+	std::cout << "UIDINDEX: packing " << (passed ? "SUCCESS" : "FAILURE") << std::endl;
+
+	// Compare against std::map with random additions and removals, the users are never dereferenced
+	std::vector<uint64_t> keys;
+	UIDGenerator uidgen;
+	uidgen.init("0AA");
+	for (unsigned int i = 0; i < 50000; ++i)
+	{
+		uidgen.IncrementUID(UIDGenerator::UUID_LENGTH - 1);
+		keys.push_back(UIDGenerator::Pack(uidgen.current_uid));
+	}
+
+	UIDIndex index;
+	std::map<uint64_t, User*> reference;
+	for (unsigned int i = 0; (i < 500000) && (passed); ++i)
+	{
+		const uint64_t key = keys[ServerInstance->GenRandomInt((i < 250000) ? 20000 : 2000)];
+		User* const user = reinterpret_cast<User*>(static_cast<uintptr_t>(key));
+		if (index.Find(key) != (reference.count(key) ? user : NULL))
+			passed = false;
+		else if (reference.erase(key))
+			index.Remove(key);
+		else if ((!index.Add(key, user)) || (index.Add(key, user)))
+			passed = false;
+		else
+			reference[key] = user;
+
+		if (index.size() != reference.size())
+			passed = false;
+	}
+	for (std::vector<uint64_t>::const_iterator i = keys.begin(); (i != keys.end()) && (passed); ++i)
+	{
+		if ((index.Find(*i) != NULL) != (reference.count(*i) != 0))
+			passed = false;
+	}
+	std::cout << "UIDINDEX: random additions and removals " << (passed ? "SUCCESS" : "FAILURE") << std::endl;
+
+	// Lookups done while receiving a burst: every user is introduced with the SID of its server as the source,
+	// then it is looked up as the target of its METADATA and OPERTYPE, as an FJOIN member and as a message source
+	std::vector<std::string> uids;
+	for (unsigned int i = 0; i < 50000; ++i)
+	{
+		uidgen.IncrementUID(UIDGenerator::UUID_LENGTH - 1);
+		uids.push_back(uidgen.current_uid);
+	}
+	const std::string sid("0AA");
+	const unsigned int lookups = 4;
+	User* const server = reinterpret_cast<User*>(1);
+
+	user_hash hash;
+	size_t found = 0;
+	uint64_t start = InspIRCd::GetMonotonicClock();
+	hash.insert(std::make_pair(sid, server));
+	for (std::vector<std::string>::const_iterator i = uids.begin(); i != uids.end(); ++i)
+	{
+		found += (hash.find(sid) != hash.end());
+		hash.insert(std::make_pair(*i, server));
+	}
+	for (unsigned int round = 0; round < lookups; ++round)
+	{
+		for (std::vector<std::string>::const_iterator i = uids.begin(); i != uids.end(); ++i)
+			found += (hash.find(*i) != hash.end());
+	}
+	const uint64_t hashtime = InspIRCd::GetMonotonicClock() - start;
+
+	UIDIndex packed;
+	start = InspIRCd::GetMonotonicClock();
+	packed.Add(UIDGenerator::Pack(sid), server);
+	for (std::vector<std::string>::const_iterator i = uids.begin(); i != uids.end(); ++i)
+	{
+		found += (packed.Find(UIDGenerator::Pack(sid)) != NULL);
+		packed.Add(UIDGenerator::Pack(*i), server);
+	}
+	for (unsigned int round = 0; round < lookups; ++round)
+	{
+		for (std::vector<std::string>::const_iterator i = uids.begin(); i != uids.end(); ++i)
+			found += (packed.Find(UIDGenerator::Pack(*i)) != NULL);
+	}
+	const uint64_t packedtime = InspIRCd::GetMonotonicClock() - start;
+
+	if (found != 2 * uids.size() * (lookups + 1))
+		passed = false;
+
+	std::cout << std::fixed << std::setprecision(1) << "UIDINDEX: burst of " << uids.size() << " users with " << lookups + 1
+		<< " lookups each: " << double(hashtime) / uids.size() << "ns per user with user_hash, "
+		<< double(packedtime) / uids.size() << "ns with UIDIndex" << std::endl;
+
+	return passed;
+}
+
 TestSuite::~TestSuite()
 {
 	std::cout << "\n\n*** END OF TEST SUITE ***\n";
@@ -22,6 +22,12 @@
 
 #include "inspircd.h"
 
+/** Get the current wall clock time in milliseconds */
+static uint64_t GetRealTime()
+{
+	return static_cast<uint64_t>(ServerInstance->Time()) * 1000 + ServerInstance->Time_ns() / 1000000;
+}
+
 void Timer::SetInterval(time_t newinterval)
 {
 	ServerInstance->Timers.DelTimer(this);
@@ -31,9 +37,10 @@ void Timer::SetInterval(time_t newinterval)
 }
 
 Timer::Timer(unsigned int secs_from_now, bool repeating)
-	: trigger(ServerInstance->Time() + secs_from_now)
+	: trigger(ServerInstance->Timers.GetTime() + static_cast<uint64_t>(secs_from_now) * 1000)
 	, secs(secs_from_now)
 	, repeat(repeating)
+	, slot(-1)
 {
 }
 
@@ -42,42 +49,179 @@ Timer::~Timer()
 	ServerInstance->Timers.DelTimer(this);
 }
 
+time_t Timer::GetTrigger() const
+{
+	const uint64_t now = ServerInstance->Timers.GetTime();
+	if (trigger <= now)
+		return ServerInstance->Time();
+	return ServerInstance->Time() + (trigger - now) / 1000;
+}
+
+void Timer::SetTrigger(time_t nexttrigger)
+{
+	const time_t secs_from_now = std::max<time_t>(nexttrigger - ServerInstance->Time(), 0);
+	trigger = ServerInstance->Timers.GetTime() + static_cast<uint64_t>(secs_from_now) * 1000;
+}
+
+TimerManager::TimerManager()
+	: count(0)
+	, nexttick(0)
+	, now(0)
+	, lastrealtime(0)
+{
+	for (unsigned int i = 0; i < LEVELS; i++)
+		occupied[i] = 0;
+}
+
+void TimerManager::Link(Timer* t)
+{
+	// A timer which is already due goes in the slot that is processed next
+	uint64_t when = std::max(t->trigger, nexttick);
+	const uint64_t delta = when - nexttick;
+
+	unsigned int level = 0;
+	while ((level < LEVELS - 1) && (delta >> (SLOT_BITS * (level + 1))))
+		level++;
+
+	// Timers which are too far away to fit on the top level are put in its last slot for now
+	const uint64_t maxdelta = (static_cast<uint64_t>(1) << (SLOT_BITS * LEVELS)) - 1;
+	if (delta > maxdelta)
+		when = nexttick + maxdelta;
+
+	const unsigned int pos = (when >> (SLOT_BITS * level)) & (SLOTS - 1);
+	t->slot = level * SLOTS + pos;
+	wheel[t->slot].push_front(t);
+	occupied[level] |= static_cast<uint64_t>(1) << pos;
+	count++;
+}
+
+void TimerManager::Unlink(Timer* t)
+{
+	TimerList& list = wheel[t->slot];
+	list.erase(t);
+	if (list.empty())
+		occupied[t->slot / SLOTS] &= ~(static_cast<uint64_t>(1) << (t->slot % SLOTS));
+	t->slot = -1;
+	count--;
+}
+
+void TimerManager::Cascade(unsigned int level, unsigned int pos)
+{
+	TimerList& list = wheel[level * SLOTS + pos];
+	while (!list.empty())
+	{
+		Timer* t = list.front();
+		Unlink(t);
+		Link(t);
+	}
+}
+
 void TimerManager::TickTimers(time_t TIME)
 {
-	for (TimerMap::iterator i = Timers.begin(); i != Timers.end(); )
+	// Only follow the wall clock forwards so a clock going backwards doesn't delay all timers
+	const uint64_t realtime = GetRealTime();
+	if ((lastrealtime) && (realtime > lastrealtime))
+		now += realtime - lastrealtime;
+	lastrealtime = realtime;
+
+	while (nexttick <= now)
 	{
-		Timer* t = i->second;
-		if (t->GetTrigger() > TIME)
+		if (!count)
+		{
+			nexttick = now + 1;
 			break;
+		}
 
-		Timers.erase(i++);
+		const unsigned int pos = nexttick & (SLOTS - 1);
+		if (!pos)
+		{
+			// The bottom level has wrapped around, move the timers in the next slot of the levels above down.
+			// Each level only needs to be looked at if the level below it has wrapped around too.
+			for (unsigned int level = 1; level < LEVELS; level++)
+			{
+				const unsigned int levelpos = (nexttick >> (SLOT_BITS * level)) & (SLOTS - 1);
+				Cascade(level, levelpos);
+				if (levelpos)
+					break;
+			}
+		}
 
-		if (!t->Tick(TIME))
+		if (!(occupied[0] >> pos))
+		{
+			// Nothing left on the bottom level until it wraps around
+			nexttick = std::min((nexttick | (SLOTS - 1)) + 1, now + 1);
 			continue;
+		}
 
-		if (t->GetRepeat())
+		// Timers added while ticking this slot go into later slots, even if they are due already
+		const uint64_t tick = nexttick++;
+		TimerList& list = wheel[pos];
+		while (!list.empty())
 		{
-			t->SetTrigger(TIME + t->GetInterval());
-			AddTimer(t);
+			Timer* t = list.front();
+			Unlink(t);
+
+			// Timers which were set too far in the future to fit in the wheel end up here early
+			if (t->trigger > tick)
+			{
+				Link(t);
+				continue;
+			}
+
+			if (!t->Tick(TIME))
+				continue;
+
+			if ((t->GetRepeat()) && (t->slot < 0))
+			{
+				t->trigger = now + static_cast<uint64_t>(t->GetInterval()) * 1000;
+				Link(t);
+			}
 		}
 	}
 }
 
 void TimerManager::DelTimer(Timer* t)
 {
-	std::pair<TimerMap::iterator, TimerMap::iterator> itpair = Timers.equal_range(t->GetTrigger());
+	if (t->slot >= 0)
+		Unlink(t);
+}
+
+void TimerManager::AddTimer(Timer* t)
+{
+	DelTimer(t);
+	Link(t);
+}
 
-	for (TimerMap::iterator i = itpair.first; i != itpair.second; ++i)
+unsigned int TimerManager::GetNextTimeout(unsigned int maxwait) const
+{
+	uint64_t next = now + maxwait;
+	for (unsigned int level = 0; level < LEVELS; level++)
 	{
-		if (i->second == t)
+		if (!occupied[level])
+			continue;
+
+		// Find the first tick at which a slot on this level is processed (bottom level) or cascaded.
+		// For the bottom level this is when the timers in the slot are due, for the other levels
+		// it is a lower bound.
+		const unsigned int shift = SLOT_BITS * level;
+		const uint64_t block = nexttick >> shift;
+		const unsigned int curpos = block & (SLOTS - 1);
+		const bool started = (level > 0) && (nexttick & ((static_cast<uint64_t>(1) << shift) - 1));
+		for (unsigned int i = 0; i < SLOTS; i++)
 		{
-			Timers.erase(i);
-			break;
+			const unsigned int pos = (curpos + i) & (SLOTS - 1);
+			if (!(occupied[level] & (static_cast<uint64_t>(1) << pos)))
+				continue;
+
+			// The slot at the current position of an upper level has been cascaded already if its block has started
+			const uint64_t distance = ((i == 0) && (started)) ? SLOTS : i;
+			next = std::min(next, (block + distance) << shift);
+			if (distance == i)
+				break;
 		}
 	}
-}
 
-void TimerManager::AddTimer(Timer* t)
-{
-	Timers.insert(std::make_pair(t->GetTrigger(), t));
+	if (next <= now)
+		return 0;
+	return std::min<uint64_t>(next - now, maxwait);
 }
@@ -46,6 +46,20 @@ namespace
 			user->ForEachNeighbor(*this, false);
 		}
 	};
+
+	/** Build a QUIT line ready to be sent to local users
+	 * @param user The user who is quitting
+	 * @param reason The quit reason
+	 * @return The line, cropped to the maximum line length and terminated by CR LF
+	 */
+	std::string MakeQuitLine(User* user, const std::string& reason)
+	{
+		std::string line = ":" + user->GetFullHost() + " QUIT :" + reason;
+		if (line.length() > ServerInstance->Config->Limits.MaxLine - 2)
+			line.erase(ServerInstance->Config->Limits.MaxLine - 2);
+		line.append("\r\n");
+		return line;
+	}
 }
 
 UserManager::UserManager()
@@ -99,6 +113,7 @@ void UserManager::AddUser(int socket, ListenSocket* via, irc::sockets::sockaddrs
 	this->AddClone(New);
 
 	this->local_users.push_front(New);
+	this->AddLocalIP(New);
 
 	if (this->local_users.size() > ServerInstance->Config->SoftLimit)
 	{
@@ -209,6 +224,160 @@ void UserManager::QuitUser(User* user, const std::string& quitreason, const std:
 	else
 		unregistered_count--;
 
+	FinishQuit(user, *operreason);
+}
+
+void UserManager::QuitUsers(const std::vector<User*>& users, const std::string& quitreason, const std::string* operreason)
+{
+	std::string reason;
+	reason.assign(quitreason, 0, ServerInstance->Config->Limits.MaxQuit);
+	if (!operreason)
+		operreason = &reason;
+
+	// The users being quit and their QUIT lines for normal users and for opers
+	std::vector<User*> quitters;
+	std::vector<std::string> lines;
+	std::vector<std::string> operlines;
+	const bool hasoperlines = (*operreason != reason);
+
+	// Channels the users are on along with the indexes of the users on them
+	std::map<Channel*, std::vector<size_t> > quitchans;
+
+	// Local users who see at least one of the users quit and, for the ones that modules made exceptions
+	// for, the indexes of the users they see or don't see regardless of common channels
+	std::vector<LocalUser*> recipients;
+	std::map<LocalUser*, std::vector<std::pair<size_t, bool> > > exceptions;
+	const already_sent_t newid = ++LocalUser::already_sent_id;
+
+	for (std::vector<User*>::const_iterator i = users.begin(); i != users.end(); ++i)
+	{
+		User* user = *i;
+		if (user->quitting)
+		{
+			ServerInstance->Logs->Log("USERS", LOG_DEFAULT, "ERROR: Tried to quit quitting user: " + user->nick);
+			continue;
+		}
+
+		if (IS_SERVER(user))
+		{
+			ServerInstance->Logs->Log("USERS", LOG_DEFAULT, "ERROR: Tried to quit server user: " + user->nick);
+			continue;
+		}
+
+		user->quitting = true;
+
+		ServerInstance->Logs->Log("USERS", LOG_DEBUG, "QuitUsers: %s=%s '%s'", user->uuid.c_str(), user->nick.c_str(), quitreason.c_str());
+		user->Write("ERROR :Closing link: (%s@%s) [%s]", user->ident.c_str(), user->host.c_str(), operreason->c_str());
+
+		ServerInstance->GlobalCulls.AddDeferredItem(user);
+		quitters.push_back(user);
+
+		if (user->registered != REG_ALL)
+		{
+			unregistered_count--;
+			continue;
+		}
+
+		FOREACH_MOD(OnUserQuit, (user, reason, *operreason));
+
+		const size_t index = lines.size();
+		lines.push_back(MakeQuitLine(user, reason));
+		if (hasoperlines)
+			operlines.push_back(MakeQuitLine(user, *operreason));
+
+		IncludeChanList include_chans(user->chans.begin(), user->chans.end());
+		std::map<User*, bool> exceptmap;
+		exceptmap[user] = false;
+		FOREACH_MOD(OnBuildNeighborList, (user, include_chans, exceptmap));
+
+		for (std::map<User*, bool>::const_iterator j = exceptmap.begin(); j != exceptmap.end(); ++j)
+		{
+			LocalUser* curr = IS_LOCAL(j->first);
+			if ((!curr) || (curr->quitting))
+				continue;
+
+			exceptions[curr].push_back(std::make_pair(index, j->second));
+			if (curr->already_sent != newid)
+			{
+				curr->already_sent = newid;
+				recipients.push_back(curr);
+			}
+		}
+
+		for (IncludeChanList::const_iterator j = include_chans.begin(); j != include_chans.end(); ++j)
+		{
+			Channel* chan = (*j)->chan;
+			std::vector<size_t>& indexes = quitchans[chan];
+			if (indexes.empty())
+			{
+				// First time we see this channel, find the local users on it
+				const Channel::MemberMap& userlist = chan->GetUsers();
+				for (Channel::MemberMap::const_iterator k = userlist.begin(); k != userlist.end(); ++k)
+				{
+					LocalUser* curr = IS_LOCAL(k->first);
+					if ((curr) && (!curr->quitting) && (curr->already_sent != newid))
+					{
+						curr->already_sent = newid;
+						recipients.push_back(curr);
+					}
+				}
+			}
+			indexes.push_back(index);
+		}
+	}
+
+	// Send every recipient the QUIT lines of the users they see in one write. The serial number of the
+	// recipient is stored for each user who was already written to them, in case they share more than one channel.
+	std::vector<size_t> seen(lines.size());
+	std::string buffer;
+	for (size_t serial = 1; serial <= recipients.size(); serial++)
+	{
+		LocalUser* curr = recipients[serial - 1];
+		const std::vector<std::string>& userlines = (((hasoperlines) && (curr->IsOper())) ? operlines : lines);
+		unsigned int count = 0;
+		buffer.clear();
+
+		std::map<LocalUser*, std::vector<std::pair<size_t, bool> > >::const_iterator exc = exceptions.find(curr);
+		if (exc != exceptions.end())
+		{
+			for (std::vector<std::pair<size_t, bool> >::const_iterator i = exc->second.begin(); i != exc->second.end(); ++i)
+			{
+				seen[i->first] = serial;
+				if (i->second)
+				{
+					buffer.append(userlines[i->first]);
+					count++;
+				}
+			}
+		}
+
+		for (User::ChanList::const_iterator i = curr->chans.begin(); i != curr->chans.end(); ++i)
+		{
+			std::map<Channel*, std::vector<size_t> >::const_iterator qc = quitchans.find((*i)->chan);
+			if (qc == quitchans.end())
+				continue;
+
+			for (std::vector<size_t>::const_iterator j = qc->second.begin(); j != qc->second.end(); ++j)
+			{
+				if (seen[*j] == serial)
+					continue;
+
+				seen[*j] = serial;
+				buffer.append(userlines[*j]);
+				count++;
+			}
+		}
+
+		if (count)
+			curr->WriteLines(buffer, count);
+	}
+
+	for (std::vector<User*>::const_iterator i = quitters.begin(); i != quitters.end(); ++i)
+		FinishQuit(*i, *operreason);
+}
+
+void UserManager::FinishQuit(User* user, const std::string& operreason)
+{
 	if (IS_LOCAL(user))
 	{
 		LocalUser* lu = IS_LOCAL(user);
@@ -216,14 +385,16 @@ void UserManager::QuitUser(User* user, const std::string& quitreason, const std:
 		lu->eh.Close();
 
 		if (lu->registered == REG_ALL)
-			ServerInstance->SNO->WriteToSnoMask('q',"Client exiting: %s (%s) [%s]", user->GetFullRealHost().c_str(), user->GetIPString().c_str(), operreason->c_str());
+			ServerInstance->SNO->WriteToSnoMask('q',"Client exiting: %s (%s) [%s]", user->GetFullRealHost().c_str(), user->GetIPString().c_str(), operreason.c_str());
 		local_users.erase(lu);
+		RemoveLocalIP(lu);
 	}
 
 	if (!clientlist.erase(user->nick))
 		ServerInstance->Logs->Log("USERS", LOG_DEFAULT, "ERROR: Nick not found in clientlist, cannot remove: " + user->nick);
 
 	uuidlist.erase(user->uuid);
+	uuidindex.Remove(UIDGenerator::Pack(user->uuid));
 	user->PurgeEmptyChannels();
 }
 
@@ -254,6 +425,47 @@ void UserManager::RemoveCloneCounts(User *user)
 	}
 }
 
+void UserManager::AddLocalIP(LocalUser* user)
+{
+	local_ips.insert(std::make_pair(irc::sockets::cidr_mask(user->client_sa, 128), user));
+}
+
+bool UserManager::RemoveLocalIP(LocalUser* user)
+{
+	std::pair<LocalIPMap::iterator, LocalIPMap::iterator> range = local_ips.equal_range(irc::sockets::cidr_mask(user->client_sa, 128));
+	for (LocalIPMap::iterator i = range.first; i != range.second; ++i)
+	{
+		if (i->second == user)
+		{
+			local_ips.erase(i);
+			return true;
+		}
+	}
+	return false;
+}
+
+void UserManager::GetLocalUsersInRange(const irc::sockets::cidr_mask& range, std::vector<LocalUser*>& users) const
+{
+	if ((range.type != AF_INET) && (range.type != AF_INET6))
+		return;
+
+	// The keys are full addresses, the ones in the range follow the first address of the range
+	irc::sockets::cidr_mask first(range);
+	first.length = (range.type == AF_INET) ? 32 : 128;
+
+	const unsigned int bytes = range.length / 8;
+	const unsigned char bitmask = (0xFF00 >> (range.length & 7)) & 0xFF;
+	for (LocalIPMap::const_iterator i = local_ips.lower_bound(first); i != local_ips.end(); ++i)
+	{
+		const irc::sockets::cidr_mask& ip = i->first;
+		if ((ip.type != first.type) || (ip.length != first.length) || (memcmp(ip.bits, range.bits, bytes)))
+			break;
+		if ((bitmask) && ((ip.bits[bytes] & bitmask) != range.bits[bytes]))
+			break;
+		users.push_back(i->second);
+	}
+}
+
 const UserManager::CloneCounts& UserManager::GetCloneCounts(User* user) const
 {
 	CloneMap::const_iterator it = clonemap.find(user->GetCIDRMask());
@@ -298,67 +510,3 @@ bool UserManager::AllModulesReportReady(LocalUser* user)
 	return (res == MOD_RES_PASSTHRU);
 }
 
-/**
- * This function is called once a second from the mainloop.
- * It is intended to do background checking on all the user structs, e.g.
- * stuff like ping checks, registration timeouts, etc.
- */
-void UserManager::DoBackgroundUserStuff()
-{
-	/*
-	 * loop over all local users..
-	 */
-	for (LocalList::iterator i = local_users.begin(); i != local_users.end(); ++i)
-	{
-		LocalUser* curr = *i;
-
-		if (curr->CommandFloodPenalty || curr->eh.getSendQSize())
-		{
-			unsigned int rate = curr->MyClass->GetCommandRate();
-			if (curr->CommandFloodPenalty > rate)
-				curr->CommandFloodPenalty -= rate;
-			else
-				curr->CommandFloodPenalty = 0;
-			curr->eh.OnDataReady();
-		}
-
-		switch (curr->registered)
-		{
-			case REG_ALL:
-				if (ServerInstance->Time() >= curr->nping)
-				{
-					// This user didn't answer the last ping, remove them
-					if (!curr->lastping)
-					{
-						time_t time = ServerInstance->Time() - (curr->nping - curr->MyClass->GetPingTime());
-						const std::string message = "Ping timeout: " + ConvToStr(time) + (time != 1 ? " seconds" : " second");
-						this->QuitUser(curr, message);
-						continue;
-					}
-
-					curr->Write("PING :" + ServerInstance->Config->ServerName);
-					curr->lastping = 0;
-					curr->nping = ServerInstance->Time() + curr->MyClass->GetPingTime();
-				}
-				break;
-			case REG_NICKUSER:
-				if (AllModulesReportReady(curr))
-				{
-					/* User has sent NICK/USER, modules are okay, DNS finished. */
-					curr->FullConnect();
-					continue;
-				}
-				break;
-		}
-
-		if (curr->registered != REG_ALL && (ServerInstance->Time() > (curr->age + curr->MyClass->GetRegTimeout())))
-		{
-			/*
-			 * registration timeout -- didnt send USER/NICK/HOST
-			 * in the time specified in their connection class.
-			 */
-			this->QuitUser(curr, "Registration timeout");
-			continue;
-		}
-	}
-}
@@ -72,17 +72,22 @@ User::User(const std::string& uid, Server* srv, int type)
 	signon = 0;
 	registered = 0;
 	quitting = false;
+	maskgeneration = 0;
 	client_sa.sa.sa_family = AF_UNSPEC;
 
 	ServerInstance->Logs->Log("USERS", LOG_DEBUG, "New UUID for user: %s", uuid.c_str());
 
 	if (!ServerInstance->Users->uuidlist.insert(std::make_pair(uuid, this)).second)
 		throw CoreException("Duplicate UUID "+std::string(uuid)+" in User constructor");
+
+	const uint64_t packed = UIDGenerator::Pack(uuid);
+	if (packed)
+		ServerInstance->Users->uuidindex.Add(packed, this);
 }
 
 LocalUser::LocalUser(int myfd, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* servaddr)
-	: User(ServerInstance->UIDGen.GetUID(), ServerInstance->FakeClient->server, USERTYPE_LOCAL), eh(this),
-	bytes_in(0), bytes_out(0), cmds_in(0), cmds_out(0), nping(0), CommandFloodPenalty(0),
+	: User(ServerInstance->UIDGen.GetUID(), ServerInstance->FakeClient->server, USERTYPE_LOCAL), eh(this), housekeeping(this),
+	bytes_in(0), bytes_out(0), cmds_in(0), cmds_out(0), nping(0), CommandFloodPenalty(0), deferred(NULL),
 	already_sent(0)
 {
 	exempt = quitting_sendq = false;
@@ -233,16 +238,44 @@ bool LocalUser::HasPrivPermission(const std::string &privstr, bool noisy)
 	return false;
 }
 
+/** Remove CRs and replace NULs with spaces in a line read from a client, then crop it to the given length.
+ * This is done in place; the common case of a line which only has a trailing CR is handled without
+ * looking at every character twice.
+ */
+static void CleanLine(std::string& line, std::string::size_type maxlen)
+{
+	if (!line.empty() && line[line.length()-1] == '\r')
+		line.erase(line.length()-1);
+
+	if (memchr(line.data(), '\r', line.length()) || memchr(line.data(), '\0', line.length()))
+	{
+		std::string::iterator out = line.begin();
+		for (std::string::const_iterator i = line.begin(); i != line.end(); ++i)
+		{
+			char c = *i;
+			if (c == '\r')
+				continue;
+			if (c == '\0')
+				c = ' ';
+			*out++ = c;
+		}
+		line.erase(out, line.end());
+	}
+
+	if (line.length() > maxlen)
+		line.erase(maxlen);
+}
+
 void UserIOHandler::OnDataReady()
 {
 	if (user->quitting)
 		return;
 
-	if (recvq.length() > user->MyClass->GetRecvqMax() && !user->HasPrivPermission("users/flood/increased-buffers"))
+	if (GetRecvQSize() > user->MyClass->GetRecvqMax() && !user->HasPrivPermission("users/flood/increased-buffers"))
 	{
 		ServerInstance->Users->QuitUser(user, "RecvQ exceeded");
 		ServerInstance->SNO->WriteToSnoMask('a', "User %s RecvQ of %lu exceeds connect class maximum of %lu",
-			user->nick.c_str(), (unsigned long)recvq.length(), user->MyClass->GetRecvqMax());
+			user->nick.c_str(), (unsigned long)GetRecvQSize(), user->MyClass->GetRecvqMax());
 		return;
 	}
 	unsigned long sendqmax = ULONG_MAX;
@@ -252,62 +285,162 @@ void UserIOHandler::OnDataReady()
 	if (!user->HasPrivPermission("users/flood/no-fakelag"))
 		penaltymax = user->MyClass->GetPenaltyThreshold() * 1000;
 
+	std::string line;
 	while (user->CommandFloodPenalty < penaltymax && getSendQSize() < sendqmax)
 	{
-		std::string line;
-		line.reserve(ServerInstance->Config->Limits.MaxLine);
-		std::string::size_type qpos = 0;
-		while (qpos < recvq.length())
+		// GetNextLine() leaves the lines it returns in the recvq until the recvq runs
+		// out of complete lines, at which point they are all removed at once
+		if (!GetNextLine(line))
 		{
-			char c = recvq[qpos++];
-			switch (c)
-			{
-			case '\0':
-				c = ' ';
-				break;
-			case '\r':
-				continue;
-			case '\n':
-				goto eol_found;
-			}
-			if (line.length() < ServerInstance->Config->Limits.MaxLine - 2)
-				line.push_back(c);
+			// Flood penalty decays once a second
+			if (user->CommandFloodPenalty)
+				user->housekeeping.ScheduleSoon();
+			return;
 		}
-		// if we got here, the recvq ran out before we found a newline
-		return;
-eol_found:
-		// just found a newline. Terminate the string, and pull it out of recvq
-		recvq.erase(0, qpos);
 
-		// TODO should this be moved to when it was inserted in recvq?
+		// Account for the line as it came off the wire, including the newline
+		const std::string::size_type qpos = line.length() + 1;
 		ServerInstance->stats.Recv += qpos;
 		user->bytes_in += qpos;
 		user->cmds_in++;
 
+		CleanLine(line, ServerInstance->Config->Limits.MaxLine - 2);
 		ServerInstance->Parser.ProcessBuffer(line, user);
 		if (user->quitting)
 			return;
 	}
 	if (user->CommandFloodPenalty >= penaltymax && !user->MyClass->fakelag)
 		ServerInstance->Users->QuitUser(user, "Excess Flood");
+	else
+		user->housekeeping.ScheduleSoon(); // Lines are being held back, try again once the penalty has decayed
 }
 
-void UserIOHandler::AddWriteBuf(const std::string &data)
+void UserIOHandler::OnDataWritten()
 {
-	if (user->quitting_sendq)
+	// Add more deferred output once the sendq has drained below the point where commands are held back
+	if (user->quitting || getSendQSize() >= user->MyClass->GetSendqSoftMax())
 		return;
-	if (!user->quitting && getSendQSize() + data.length() > user->MyClass->GetSendqHardMax() &&
+
+	if (user->deferred)
+		user->deferred->Continue(user);
+
+	// Commands held back while the sendq was full can be processed now
+	if (!user->quitting && GetRecvQSize())
+		OnDataReady();
+}
+
+UserHousekeepingTimer::UserHousekeepingTimer(LocalUser* me)
+	: Timer(1, false)
+	, user(me)
+{
+	ServerInstance->Timers.AddTimer(this);
+}
+
+void UserHousekeepingTimer::ScheduleSoon()
+{
+	if (GetTrigger() > ServerInstance->Time() + 1)
+		SetInterval(1);
+}
+
+bool UserHousekeepingTimer::Tick(time_t currenttime)
+{
+	if (user->quitting)
+		return true;
+
+	if (user->CommandFloodPenalty || user->eh.getSendQSize())
+	{
+		unsigned int rate = user->MyClass->GetCommandRate();
+		if (user->CommandFloodPenalty > rate)
+			user->CommandFloodPenalty -= rate;
+		else
+			user->CommandFloodPenalty = 0;
+		user->eh.OnDataReady();
+		if (user->quitting)
+			return true;
+	}
+
+	switch (user->registered)
+	{
+		case REG_ALL:
+			if (currenttime >= user->nping)
+			{
+				// This user didn't answer the last ping, remove them
+				if (!user->lastping)
+				{
+					time_t time = currenttime - (user->nping - user->MyClass->GetPingTime());
+					const std::string message = "Ping timeout: " + ConvToStr(time) + (time != 1 ? " seconds" : " second");
+					ServerInstance->Users->QuitUser(user, message);
+					return true;
+				}
+
+				user->Write("PING :" + ServerInstance->Config->ServerName);
+				user->lastping = 0;
+				user->nping = currenttime + user->MyClass->GetPingTime();
+			}
+			break;
+		case REG_NICKUSER:
+			if (ServerInstance->Users->AllModulesReportReady(user))
+			{
+				/* User has sent NICK/USER, modules are okay, DNS finished. */
+				user->FullConnect();
+				if (user->quitting)
+					return true;
+			}
+			break;
+	}
+
+	if (user->registered != REG_ALL && (currenttime > (user->age + user->MyClass->GetRegTimeout())))
+	{
+		/*
+		 * registration timeout -- didnt send USER/NICK/HOST
+		 * in the time specified in their connection class.
+		 */
+		ServerInstance->Users->QuitUser(user, "Registration timeout");
+		return true;
+	}
+
+	Reschedule(currenttime);
+	return true;
+}
+
+void UserHousekeepingTimer::Reschedule(time_t currenttime)
+{
+	// Unregistered users are checked every second for the registration timeout and for modules
+	// becoming ready, the same goes for users with flood penalty. Otherwise the next thing to do
+	// is to ping the user. Commands from the user push nping back, that is checked when this ticks.
+	if (user->registered != REG_ALL || user->CommandFloodPenalty || user->eh.getSendQSize())
+		SetInterval(1);
+	else
+		SetInterval(std::max<time_t>(user->nping - currenttime, 1));
+}
+
+bool UserIOHandler::CheckSendQ(size_t len)
+{
+	if (user->quitting_sendq)
+		return false;
+	if (!user->quitting && getSendQSize() + len > user->MyClass->GetSendqHardMax() &&
 		!user->HasPrivPermission("users/flood/increased-buffers"))
 	{
 		user->quitting_sendq = true;
 		ServerInstance->GlobalCulls.AddSQItem(user);
-		return;
+		return false;
 	}
 
 	// We still want to append data to the sendq of a quitting user,
 	// e.g. their ERROR message that says 'closing link'
+	return true;
+}
+
+void UserIOHandler::AddWriteBuf(const std::string &data)
+{
+	if (CheckSendQ(data.length()))
+		WriteData(data);
+}
 
-	WriteData(data);
+void UserIOHandler::AddWriteBuf(const reference<SharedBuffer>& data)
+{
+	if (CheckSendQ(data->GetData().length()))
+		WriteData(data);
 }
 
 void UserIOHandler::OnError(BufferedSocketError)
@@ -504,6 +637,9 @@ void LocalUser::CheckClass(bool clone_count)
 	}
 
 	this->nping = ServerInstance->Time() + a->GetPingTime() + ServerInstance->Config->dns_timeout;
+
+	// The timer may be waiting for the ping time of the previous class
+	housekeeping.Reschedule(ServerInstance->Time());
 }
 
 bool LocalUser::CheckLines(bool doZline)
@@ -597,6 +733,7 @@ void LocalUser::FullConnect()
 void User::InvalidateCache()
 {
 	/* Invalidate cache */
+	maskgeneration++;
 	cached_fullhost.clear();
 	cached_hostip.clear();
 	cached_makehost.clear();
@@ -713,6 +850,7 @@ bool User::SetClientIP(const char* sip, bool recheck_eline)
 {
 	cachedip.clear();
 	cached_hostip.clear();
+	maskgeneration++;
 	return irc::sockets::aptosa(sip, 0, client_sa);
 }
 
@@ -720,6 +858,7 @@ void User::SetClientIP(const irc::sockets::sockaddrs& sa, bool recheck_eline)
 {
 	cachedip.clear();
 	cached_hostip.clear();
+	maskgeneration++;
 	memcpy(&client_sa, &sa, sizeof(irc::sockets::sockaddrs));
 }
 
@@ -738,7 +877,10 @@ void LocalUser::SetClientIP(const irc::sockets::sockaddrs& sa, bool recheck_elin
 {
 	if (sa != client_sa)
 	{
+		const bool indexed = ServerInstance->Users->RemoveLocalIP(this);
 		User::SetClientIP(sa);
+		if (indexed)
+			ServerInstance->Users->AddLocalIP(this);
 		if (recheck_eline)
 			this->exempt = (ServerInstance->XLines->MatchesLine("E", this) != NULL);
 
@@ -748,6 +890,16 @@ void LocalUser::SetClientIP(const irc::sockets::sockaddrs& sa, bool recheck_elin
 
 static std::string wide_newline("\r\n");
 
+SharedLine::SharedLine(const std::string& text)
+{
+	// Crop the line at the maximum line length (minus the CR/LF) if needed
+	const std::string::size_type maxlen = ServerInstance->Config->Limits.MaxLine - 2;
+	if (text.length() > maxlen)
+		buffer = new SharedBuffer(text.substr(0, maxlen), wide_newline);
+	else
+		buffer = new SharedBuffer(text, wide_newline);
+}
+
 void User::Write(const std::string& text)
 {
 }
@@ -771,14 +923,58 @@ void LocalUser::Write(const std::string& text)
 
 	ServerInstance->Logs->Log("USEROUTPUT", LOG_RAWIO, "C[%s] O %s", uuid.c_str(), text.c_str());
 
-	eh.AddWriteBuf(text);
-	eh.AddWriteBuf(wide_newline);
+	// The line and its CR/LF go into the sendq as one buffer
+	eh.AddWriteBuf(reference<SharedBuffer>(new SharedBuffer(text, wide_newline)));
 
 	ServerInstance->stats.Sent += text.length() + 2;
 	this->bytes_out += text.length() + 2;
 	this->cmds_out++;
 }
 
+void LocalUser::Write(const SharedLine& line)
+{
+	if (!SocketEngine::BoundsCheckFd(&eh))
+		return;
+
+	const std::string& data = line.GetBuffer()->GetData();
+	ServerInstance->Logs->Log("USEROUTPUT", LOG_RAWIO, "C[%s] O %.*s", uuid.c_str(), (int)data.length() - 2, data.c_str());
+
+	eh.AddWriteBuf(line.GetBuffer());
+
+	ServerInstance->stats.Sent += data.length();
+	this->bytes_out += data.length();
+	this->cmds_out++;
+}
+
+void LocalUser::WriteLines(const std::string& lines, unsigned int count)
+{
+	if (!SocketEngine::BoundsCheckFd(&eh))
+		return;
+
+	ServerInstance->Logs->Log("USEROUTPUT", LOG_RAWIO, "C[%s] O %.*s", uuid.c_str(), (int)lines.length() - 2, lines.c_str());
+
+	eh.AddWriteBuf(lines);
+
+	ServerInstance->stats.Sent += lines.length();
+	this->bytes_out += lines.length();
+	this->cmds_out += count;
+}
+
+void LocalUser::WriteLines(const reference<SharedBuffer>& lines, unsigned int count)
+{
+	if (!SocketEngine::BoundsCheckFd(&eh))
+		return;
+
+	const std::string& data = lines->GetData();
+	ServerInstance->Logs->Log("USEROUTPUT", LOG_RAWIO, "C[%s] O %.*s", uuid.c_str(), (int)data.length() - 2, data.c_str());
+
+	eh.AddWriteBuf(lines);
+
+	ServerInstance->stats.Sent += data.length();
+	this->bytes_out += data.length();
+	this->cmds_out += count;
+}
+
 /** Write()
  */
 void LocalUser::Write(const char *text, ...)
@@ -849,7 +1045,7 @@ namespace
 {
 	class WriteCommonRawHandler : public User::ForEachNeighborHandler
 	{
-		const std::string& msg;
+		const SharedLine msg;
 
 		void Execute(LocalUser* user) CXX11_OVERRIDE
 		{
@@ -976,10 +1172,9 @@ void User::SendText(const std::string& linePrefix, std::stringstream& textStream
  * the first users channels then the second users channels within the outer loop,
  * therefore it was a maximum of x*y iterations (upon returning 0 and checking
  * all possible iterations). However this new function instead checks against the
- * channel's userlist in the inner loop which is a std::map<User*,User*>
+ * channel's userlist in the inner loop which is a hashed map keyed by User*
  * and saves us time as we already know what pointer value we are after.
- * Don't quote me on the maths as i am not a mathematician or computer scientist,
- * but i believe this algorithm is now x+(log y) maximum iterations instead.
+ * This algorithm is now x maximum iterations instead.
  */
 bool User::SharesChannelWith(User *other)
 {
@@ -1102,8 +1297,7 @@ void LocalUser::SetClass(const std::string &explicit_name)
 				continue;
 
 			/* check if host matches.. */
-			if (!InspIRCd::MatchCIDR(this->GetIPString(), c->GetHost(), NULL) &&
-			    !InspIRCd::MatchCIDR(this->host, c->GetHost(), NULL))
+			if (!c->hostmatch.MatchCIDR(this->GetIPString()) && !c->hostmatch.MatchCIDR(this->host))
 			{
 				ServerInstance->Logs->Log("CONNECTCLASS", LOG_DEBUG, "No host match (for %s)", c->GetHost().c_str());
 				continue;
@@ -1182,7 +1376,7 @@ const std::string& FakeUser::GetFullRealHost()
 }
 
 ConnectClass::ConnectClass(ConfigTag* tag, char t, const std::string& mask)
-	: config(tag), type(t), fakelag(true), name("unnamed"), registration_timeout(0), host(mask),
+	: config(tag), type(t), fakelag(true), name("unnamed"), registration_timeout(0), host(mask), hostmatch(mask),
 	pingtime(0), softsendqmax(0), hardsendqmax(0), recvqmax(0),
 	penaltythreshold(0), commandrate(0), maxlocal(0), maxglobal(0), maxconnwarn(true), maxchans(ServerInstance->Config->MaxChans),
 	limit(0), resolvehostnames(true)
@@ -1191,7 +1385,7 @@ ConnectClass::ConnectClass(ConfigTag* tag, char t, const std::string& mask)
 
 ConnectClass::ConnectClass(ConfigTag* tag, char t, const std::string& mask, const ConnectClass& parent)
 	: config(tag), type(t), fakelag(parent.fakelag), name("unnamed"),
-	registration_timeout(parent.registration_timeout), host(mask), pingtime(parent.pingtime),
+	registration_timeout(parent.registration_timeout), host(mask), hostmatch(mask), pingtime(parent.pingtime),
 	softsendqmax(parent.softsendqmax), hardsendqmax(parent.hardsendqmax), recvqmax(parent.recvqmax),
 	penaltythreshold(parent.penaltythreshold), commandrate(parent.commandrate),
 	maxlocal(parent.maxlocal), maxglobal(parent.maxglobal), maxconnwarn(parent.maxconnwarn), maxchans(parent.maxchans),
@@ -1207,6 +1401,7 @@ void ConnectClass::Update(const ConnectClass* src)
 	name = src->name;
 	registration_timeout = src->registration_timeout;
 	host = src->host;
+	hostmatch = src->hostmatch;
 	pingtime = src->pingtime;
 	softsendqmax = src->softsendqmax;
 	hardsendqmax = src->hardsendqmax;
@@ -121,3 +121,166 @@ bool InspIRCd::MatchMask(const std::string& masks, const std::string& hostname,
 	}
 	return false;
 }
+
+namespace
+{
+	/** Check whether a character of a mask can be searched for with memchr(), that is whether no
+	 * other character compares equal to it under the given case map
+	 */
+	bool IsScannable(unsigned char chr, unsigned const char* map)
+	{
+		if (chr == '?')
+			return false;
+
+		// The national case map can be changed in place on rehash so only trust characters which
+		// no case map folds
+		if (!map)
+			return ((chr >= '0') && (chr <= '9')) || (chr == '.') || (chr == '-') || (chr == ':') || (chr == '/') || (chr == '@');
+
+		for (unsigned int other = 0; other < 256; ++other)
+		{
+			if ((other != chr) && (map[other] == map[chr]))
+				return false;
+		}
+		return true;
+	}
+}
+
+CompiledMask::CompiledMask(const std::string& newmask, unsigned const char* map)
+{
+	Compile(newmask, map);
+}
+
+void CompiledMask::Compile(const std::string& newmask, unsigned const char* map)
+{
+	mask = newmask;
+	casemap = map;
+	segments.clear();
+	minlength = 0;
+
+	// A NUL ends the mask for InspIRCd::Match()
+	const std::string::size_type length = std::min(mask.length(), mask.find('\0'));
+	leadingstar = ((length > 0) && (mask[0] == '*'));
+	trailingstar = ((length > 0) && (mask[length - 1] == '*'));
+
+	std::string::size_type start = 0;
+	while (start < length)
+	{
+		std::string::size_type end = std::min(mask.find('*', start), length);
+		if (end > start)
+		{
+			Segment seg;
+			seg.start = start;
+			seg.length = end - start;
+			seg.scannable = IsScannable(mask[start], map);
+			segments.push_back(seg);
+			minlength += seg.length;
+		}
+		start = end + 1;
+	}
+
+	cidr = (mask.find('/') != std::string::npos);
+}
+
+bool CompiledMask::SegmentEquals(const Segment& seg, const unsigned char* str, unsigned const char* map) const
+{
+	const unsigned char* wild = (const unsigned char*)mask.data() + seg.start;
+	for (std::string::size_type i = 0; i < seg.length; ++i)
+	{
+		if ((wild[i] != str[i]) && (wild[i] != '?') && (map[wild[i]] != map[str[i]]))
+			return false;
+	}
+	return true;
+}
+
+std::string::size_type CompiledMask::FindSegment(const Segment& seg, const std::string& str, std::string::size_type from, std::string::size_type to, unsigned const char* map) const
+{
+	if ((to < from) || (to - from < seg.length))
+		return std::string::npos;
+
+	const unsigned char* data = (const unsigned char*)str.data();
+	const unsigned char* pos = data + from;
+	const unsigned char* last = data + to - seg.length;
+	const unsigned char first = mask[seg.start];
+
+	if (seg.scannable)
+	{
+		while (pos <= last)
+		{
+			pos = (const unsigned char*)memchr(pos, first, last - pos + 1);
+			if (!pos)
+				return std::string::npos;
+			if (SegmentEquals(seg, pos, map))
+				return pos - data;
+			pos++;
+		}
+		return std::string::npos;
+	}
+
+	const bool anyfirst = (first == '?');
+	const unsigned char mappedfirst = map[first];
+	for (; pos <= last; ++pos)
+	{
+		if ((!anyfirst) && (*pos != first) && (map[*pos] != mappedfirst))
+			continue;
+		if (SegmentEquals(seg, pos, map))
+			return pos - data;
+	}
+	return std::string::npos;
+}
+
+bool CompiledMask::Match(const std::string& str) const
+{
+	const std::string::size_type length = str.length();
+	if (length < minlength)
+		return false;
+
+	if (segments.empty())
+		return ((leadingstar) || (length == 0));
+
+	unsigned const char* map = casemap ? casemap : national_case_insensitive_map;
+	const unsigned char* data = (const unsigned char*)str.data();
+
+	std::vector<Segment>::const_iterator first = segments.begin();
+	std::vector<Segment>::const_iterator last = segments.end();
+	if ((!leadingstar) && (!trailingstar) && (segments.size() == 1))
+		return ((length == first->length) && (SegmentEquals(*first, data, map)));
+
+	// Reject on the runs anchored to the ends of the string first
+	std::string::size_type begin = 0;
+	std::string::size_type end = length;
+	if (!leadingstar)
+	{
+		if (!SegmentEquals(*first, data, map))
+			return false;
+		begin = first->length;
+		++first;
+	}
+
+	if (!trailingstar)
+	{
+		--last;
+		if (!SegmentEquals(*last, data + length - last->length, map))
+			return false;
+		end = length - last->length;
+	}
+
+	// Finding every remaining run as early as possible leaves the most room for the rest
+	for (; first != last; ++first)
+	{
+		const std::string::size_type pos = FindSegment(*first, str, begin, end, map);
+		if (pos == std::string::npos)
+			return false;
+		begin = pos + first->length;
+	}
+	return true;
+}
+
+bool CompiledMask::MatchCIDR(const std::string& str) const
+{
+	if ((cidr) && (irc::sockets::MatchCIDR(str, mask, true)))
+		return true;
+
+	// Fall back to regular match
+	return Match(str);
+}
@@ -103,6 +103,338 @@ class ZLineFactory : public XLineFactory
 };
 
 
+namespace
+{
+	/** Check whether a mask is a valid CIDR mask according to irc::sockets::MatchCIDR()
+	 */
+	bool IsCIDR(const std::string& mask)
+	{
+		const std::string::size_type per_pos = mask.rfind('/');
+		return ((per_pos != std::string::npos) && (per_pos != mask.length()-1)
+			&& (mask.find_first_not_of("0123456789", per_pos+1) == std::string::npos)
+			&& (mask.find_first_not_of("0123456789abcdefABCDEF.:") >= per_pos));
+	}
+
+	/** A binary trie of lines keyed by the bits of their CIDR mask
+	 */
+	class CIDRTrie
+	{
+		struct Node
+		{
+			unsigned int children[2];
+			std::vector<XLine*> lines;
+
+			Node() { children[0] = children[1] = 0; }
+		};
+
+		/** All nodes of the trie, node 0 is the IPv4 root and node 1 is the IPv6 root
+		 */
+		std::vector<Node> nodes;
+
+		/** Number of lines in the trie
+		 */
+		size_t count;
+
+		static unsigned int GetBit(const irc::sockets::cidr_mask& mask, unsigned int bit)
+		{
+			return (mask.bits[bit / 8] >> (7 - (bit % 8))) & 1;
+		}
+
+		/** Find the node of a mask
+		 * @param create If true, create the node if it does not exist
+		 * @return Position of the node in nodes, or 0 if it does not exist
+		 */
+		unsigned int FindNode(const irc::sockets::cidr_mask& mask, bool create)
+		{
+			unsigned int node = (mask.type == AF_INET) ? 0 : 1;
+			for (unsigned int bit = 0; bit < mask.length; ++bit)
+			{
+				const unsigned int dir = GetBit(mask, bit);
+				if (!nodes[node].children[dir])
+				{
+					if (!create)
+						return 0;
+					nodes[node].children[dir] = nodes.size();
+					nodes.push_back(Node());
+				}
+				node = nodes[node].children[dir];
+			}
+			return node;
+		}
+
+	 public:
+		CIDRTrie() : nodes(2), count(0) { }
+
+		void Add(const irc::sockets::cidr_mask& mask, XLine* line)
+		{
+			nodes[FindNode(mask, true)].lines.push_back(line);
+			count++;
+		}
+
+		void Remove(const irc::sockets::cidr_mask& mask, XLine* line)
+		{
+			const unsigned int node = FindNode(mask, false);
+			if ((!node) && (mask.length))
+				return;
+
+			if (stdalgo::vector::swaperase(nodes[node].lines, line) && (--count == 0))
+				nodes.assign(2, Node());
+		}
+
+		/** Find a line on the path of an address that matches a user
+		 * @param addr The address to look up, with a length of 128 bits
+		 * @param user The user to match the lines against
+		 * @return The first matching line or NULL
+		 */
+		XLine* Match(const irc::sockets::cidr_mask& addr, User* user) const
+		{
+			if ((!count) || ((addr.type != AF_INET) && (addr.type != AF_INET6)))
+				return NULL;
+
+			unsigned int node = (addr.type == AF_INET) ? 0 : 1;
+			for (unsigned int bit = 0; ; ++bit)
+			{
+				const Node& current = nodes[node];
+				for (std::vector<XLine*>::const_iterator i = current.lines.begin(); i != current.lines.end(); ++i)
+				{
+					if ((*i)->Matches(user))
+						return *i;
+				}
+
+				if (bit == addr.length)
+					return NULL;
+
+				node = current.children[GetBit(addr, bit)];
+				if (!node)
+					return NULL;
+			}
+		}
+	};
+}
+
+/** The index of the lines of one type.
+ * Lines without wildcards in their key are found by looking up the host, IP or nick of the user
+ * in a hash map, lines with a valid CIDR mask as their key are found by walking a trie with the IP
+ * of the user and Q-line like lines are found by the literal prefix of their mask. Only the rest of
+ * the lines are matched against every user. Every line found is matched against the user using
+ * XLine::Matches() before it is returned.
+ */
+class XLineIndex
+{
+	typedef TR1NS::unordered_multimap<std::string, XLine*, irc::insensitive, irc::StrHashComp> KeyMap;
+	typedef insp::dense_map<XLine, XLine::IndexKind> LineSet;
+
+	/** INDEX_HOST lines without wildcards, keyed by the host mask
+	 */
+	KeyMap hosts;
+
+	/** INDEX_IP lines without wildcards, keyed by the IP mask
+	 */
+	KeyMap ips;
+
+	/** INDEX_NICK lines keyed by the part of the nick mask before the first wildcard,
+	 * lines with a wildcard as the first character have an empty key
+	 */
+	KeyMap nicks;
+
+	/** Number of keys in nicks by key length
+	 */
+	std::vector<unsigned int> nicklengths;
+
+	/** INDEX_HOST lines with a valid CIDR mask
+	 */
+	CIDRTrie hosttrie;
+
+	/** INDEX_IP lines with a valid CIDR mask
+	 */
+	CIDRTrie iptrie;
+
+	/** Lines that must be matched against every user
+	 */
+	LineSet unindexed;
+
+	/** Lines that must be matched against every pattern, that is all lines except the INDEX_NICK ones
+	 */
+	LineSet patternlines;
+
+	static bool HasWildcards(const std::string& key)
+	{
+		return (key.find_first_of("*?") != std::string::npos);
+	}
+
+	static std::string::size_type GetNickPrefixLength(const std::string& key)
+	{
+		const std::string::size_type pos = key.find_first_of("*?");
+		return (pos == std::string::npos) ? key.length() : pos;
+	}
+
+	/** Check whether a line with a host or IP key can be found by looking up the key
+	 * @param key The key of the line
+	 * @param cidr Set to the CIDR mask of the key if the line should be in the trie
+	 * @return True if the line should be in the hash, false if it must be matched against every user
+	 */
+	static bool IsAddressIndexable(const std::string& key, irc::sockets::cidr_mask& cidr)
+	{
+		// MatchCIDR() matches the part before an '@' separately
+		if ((HasWildcards(key)) || (key.find('@') != std::string::npos))
+			return false;
+
+		if (!IsCIDR(key))
+		{
+			cidr.type = AF_UNSPEC;
+			return true;
+		}
+
+		cidr = irc::sockets::cidr_mask(key);
+		return ((cidr.type == AF_INET) || (cidr.type == AF_INET6));
+	}
+
+	static void RemoveFromMap(KeyMap& map, const std::string& key, XLine* line)
+	{
+		std::pair<KeyMap::iterator, KeyMap::iterator> range = map.equal_range(key);
+		for (KeyMap::iterator i = range.first; i != range.second; ++i)
+		{
+			if (i->second == line)
+			{
+				map.erase(i);
+				return;
+			}
+		}
+	}
+
+	static XLine* MatchMap(const KeyMap& map, const std::string& key, User* user)
+	{
+		std::pair<KeyMap::const_iterator, KeyMap::const_iterator> range = map.equal_range(key);
+		for (KeyMap::const_iterator i = range.first; i != range.second; ++i)
+		{
+			if (i->second->Matches(user))
+				return i->second;
+		}
+		return NULL;
+	}
+
+	template <typename T>
+	XLine* MatchNicks(const std::string& nick, T& what) const
+	{
+		const std::string::size_type maxlen = std::min(nick.length(), nicklengths.size() - 1);
+		for (std::string::size_type len = 0; len <= maxlen; ++len)
+		{
+			if (!nicklengths[len])
+				continue;
+
+			std::pair<KeyMap::const_iterator, KeyMap::const_iterator> range = nicks.equal_range(nick.substr(0, len));
+			for (KeyMap::const_iterator i = range.first; i != range.second; ++i)
+			{
+				if (i->second->Matches(what))
+					return i->second;
+			}
+		}
+		return NULL;
+	}
+
+ public:
+	XLineIndex() : nicklengths(1) { }
+
+	void Add(XLine* line)
+	{
+		std::string key;
+		const XLine::IndexKind kind = line->GetIndexKey(key);
+		irc::sockets::cidr_mask cidr;
+		if (kind == XLine::INDEX_NICK)
+		{
+			const std::string::size_type len = GetNickPrefixLength(key);
+			nicks.insert(std::make_pair(key.substr(0, len), line));
+			if (len >= nicklengths.size())
+				nicklengths.resize(len + 1);
+			nicklengths[len]++;
+			return;
+		}
+
+		patternlines.insert(std::make_pair(line, kind));
+		if ((kind == XLine::INDEX_HOST || kind == XLine::INDEX_IP) && (IsAddressIndexable(key, cidr)))
+		{
+			// A key that is a valid CIDR mask is in the trie, it can match as a plain string
+			// as well but only an equal host or IP which is found in the hash
+			(kind == XLine::INDEX_HOST ? hosts : ips).insert(std::make_pair(key, line));
+			if (cidr.type != AF_UNSPEC)
+				(kind == XLine::INDEX_HOST ? hosttrie : iptrie).Add(cidr, line);
+			return;
+		}
+
+		unindexed.insert(std::make_pair(line, kind));
+	}
+
+	void Remove(XLine* line)
+	{
+		std::string key;
+		const XLine::IndexKind kind = line->GetIndexKey(key);
+		irc::sockets::cidr_mask cidr;
+		if (kind == XLine::INDEX_NICK)
+		{
+			const std::string::size_type len = GetNickPrefixLength(key);
+			RemoveFromMap(nicks, key.substr(0, len), line);
+			nicklengths[len]--;
+			return;
+		}
+
+		patternlines.erase(patternlines.find(line));
+		if ((kind == XLine::INDEX_HOST || kind == XLine::INDEX_IP) && (IsAddressIndexable(key, cidr)))
+		{
+			RemoveFromMap((kind == XLine::INDEX_HOST ? hosts : ips), key, line);
+			if (cidr.type != AF_UNSPEC)
+				(kind == XLine::INDEX_HOST ? hosttrie : iptrie).Remove(cidr, line);
+			return;
+		}
+
+		unindexed.erase(unindexed.find(line));
+	}
+
+	XLine* Match(User* user) const
+	{
+		XLine* line = NULL;
+		const std::string& ip = user->GetIPString();
+		if ((!hosts.empty()) && ((line = MatchMap(hosts, user->host, user)) || (line = MatchMap(hosts, ip, user))))
+			return line;
+
+		if ((!ips.empty()) && (line = MatchMap(ips, ip, user)))
+			return line;
+
+		const irc::sockets::cidr_mask addr(user->client_sa, 128);
+		if ((line = hosttrie.Match(addr, user)) || (line = iptrie.Match(addr, user)))
+			return line;
+
+		// MatchCIDR() is also tried with the host, which can look like an IP too
+		irc::sockets::sockaddrs hostsa;
+		if ((user->host != ip) && (irc::sockets::aptosa(user->host, 0, hostsa)) &&
+			(line = hosttrie.Match(irc::sockets::cidr_mask(hostsa, 128), user)))
+			return line;
+
+		if ((!nicks.empty()) && (line = MatchNicks(user->nick, user)))
+			return line;
+
+		for (LineSet::const_iterator i = unindexed.begin(); i != unindexed.end(); ++i)
+		{
+			if (i->first->Matches(user))
+				return i->first;
+		}
+		return NULL;
+	}
+
+	XLine* Match(const std::string& pattern) const
+	{
+		XLine* line = NULL;
+		if ((!nicks.empty()) && (line = MatchNicks(pattern, pattern)))
+			return line;
+
+		for (LineSet::const_iterator i = patternlines.begin(); i != patternlines.end(); ++i)
+		{
+			if (i->first->Matches(pattern))
+				return i->first;
+		}
+		return NULL;
+	}
+};
+
 /*
  * This is now version 3 of the XLine subsystem, let's see if we can get it as nice and
  * efficient as we can this time so we can close this file and never ever touch it again ..
@@ -125,9 +457,12 @@ class ZLineFactory : public XLineFactory
  *  All lines are (as in v1) stored together -- no seperation of perm and non-perm. They are stored in
  *  a map of maps (first map is line type, second map is for quick lookup on add/delete/etc).
  *
- *  Expiry is *no longer* performed on a timer, and no longer uses a sorted list of any variety. This
- *  is now done by only checking for expiry when a line is accessed, meaning that expiry is no longer
- *  a resource intensive problem.
+ *  Expiry is done by keeping the lines that have a duration in a set ordered by expiry time, so
+ *  finding the lines to expire every second only looks at the lines that actually expire.
+ *
+ *  Checking a user against the lines of a type no longer matches every line either. Each type has
+ *  an XLineIndex which finds the lines that can possibly match a user by looking up its host, IP or
+ *  nick, so only lines with wildcards in the wrong place have to be matched against every user.
  *
  *  Application no longer tries to apply every single line on every single user - instead, now only lines
  *  added since the previous application are applied. This keeps S2S ADDLINE during burst nice and fast,
@@ -160,19 +495,9 @@ void XLineManager::CheckELines()
 	{
 		LocalUser* u = *u2;
 
-		/* This uses safe iteration to ensure that if a line expires here, it doenst trash the iterator */
-		LookupIter safei;
-
-		for (LookupIter i = ELines.begin(); i != ELines.end(); )
-		{
-			safei = i;
-			safei++;
-
-			XLine *e = i->second;
-			u->exempt = e->Matches(u);
-
-			i = safei;
-		}
+		// ELine::Matches() never matches a user who is already exempt
+		u->exempt = false;
+		u->exempt = (MatchesLine("E", u) != NULL);
 	}
 }
 
@@ -184,20 +509,8 @@ XLineLookup* XLineManager::GetAll(const std::string &type)
 	if (n == lookup_lines.end())
 		return NULL;
 
-	LookupIter safei;
-	const time_t current = ServerInstance->Time();
-
 	/* Expire any dead ones, before sending */
-	for (LookupIter x = n->second.begin(); x != n->second.end(); )
-	{
-		safei = x;
-		safei++;
-		if (x->second->duration && current > x->second->expiry)
-		{
-			ExpireLine(n, x);
-		}
-		x = safei;
-	}
+	ExpireLines();
 
 	return &(n->second);
 }
@@ -282,6 +595,7 @@ bool XLineManager::AddLine(XLine* line, User* user)
 		pending_lines.push_back(line);
 
 	lookup_lines[line->type][line->Displayable().c_str()] = line;
+	AddToIndex(line);
 	line->OnAdd();
 
 	FOREACH_MOD(OnAddLine, (user, line));
@@ -310,9 +624,10 @@ bool XLineManager::DelLine(const char* hostmask, const std::string &type, User*
 
 	FOREACH_MOD(OnDelLine, (user, y->second));
 
+	RemoveFromIndex(y->second);
 	y->second->Unset();
 
-	stdalgo::erase(pending_lines, y->second);
+	CancelApply(y->second);
 
 	delete y->second;
 	x->second.erase(y);
@@ -338,71 +653,45 @@ void ELine::Unset()
 
 XLine* XLineManager::MatchesLine(const std::string &type, User* user)
 {
-	ContainerIter x = lookup_lines.find(type);
+	std::map<std::string, XLineIndex*>::const_iterator x = line_index.find(type);
 
-	if (x == lookup_lines.end())
+	if (x == line_index.end())
 		return NULL;
 
-	const time_t current = ServerInstance->Time();
-
-	LookupIter safei;
-
-	for (LookupIter i = x->second.begin(); i != x->second.end(); )
-	{
-		safei = i;
-		safei++;
-
-		if (i->second->duration && current > i->second->expiry)
-		{
-			/* Expire the line, proceed to next one */
-			ExpireLine(x, i);
-			i = safei;
-			continue;
-		}
+	ExpireLines();
 
-		if (i->second->Matches(user))
-		{
-			return i->second;
-		}
-
-		i = safei;
-	}
-	return NULL;
+	return x->second->Match(user);
 }
 
 XLine* XLineManager::MatchesLine(const std::string &type, const std::string &pattern)
 {
-	ContainerIter x = lookup_lines.find(type);
+	std::map<std::string, XLineIndex*>::const_iterator x = line_index.find(type);
 
-	if (x == lookup_lines.end())
+	if (x == line_index.end())
 		return NULL;
 
-	const time_t current = ServerInstance->Time();
+	ExpireLines();
 
-	 LookupIter safei;
+	return x->second->Match(pattern);
+}
 
-	for (LookupIter i = x->second.begin(); i != x->second.end(); )
-	{
-		safei = i;
-		safei++;
+void XLineManager::AddToIndex(XLine* line)
+{
+	XLineIndex*& index = line_index[line->type];
+	if (!index)
+		index = new XLineIndex;
+	index->Add(line);
 
-		if (i->second->Matches(pattern))
-		{
-			if (i->second->duration && current > i->second->expiry)
-			{
-				/* Expire the line, return nothing */
-				ExpireLine(x, i);
-				/* See above */
-				i = safei;
-				continue;
-			}
-			else
-				return i->second;
-		}
+	if (line->duration)
+		expiry_queue.insert(std::make_pair(line->expiry, line));
+}
 
-		i = safei;
-	}
-	return NULL;
+void XLineManager::RemoveFromIndex(XLine* line)
+{
+	line_index[line->type]->Remove(line);
+
+	if (line->duration)
+		expiry_queue.erase(std::make_pair(line->expiry, line));
 }
 
 // removes lines that have expired
@@ -410,68 +699,187 @@ void XLineManager::ExpireLine(ContainerIter container, LookupIter item)
 {
 	FOREACH_MOD(OnExpireLine, (item->second));
 
+	RemoveFromIndex(item->second);
 	item->second->DisplayExpiry();
 	item->second->Unset();
 
+	CancelApply(item->second);
+
+	delete item->second;
+	container->second.erase(item);
+}
+
+void XLineManager::ExpireLines()
+{
+	const time_t current = ServerInstance->Time();
+	while ((!expiry_queue.empty()) && (current > expiry_queue.begin()->first))
+	{
+		XLine* line = expiry_queue.begin()->second;
+		ContainerIter n = lookup_lines.find(line->type);
+		LookupIter i;
+		if ((n == lookup_lines.end()) || ((i = n->second.find(line->Displayable().c_str())) == n->second.end()) || (i->second != line))
+		{
+			ServerInstance->Logs->Log("XLINE", LOG_DEFAULT, "BUG: Expiring %s-line %s which is not in the line list", line->type.c_str(), line->Displayable().c_str());
+			expiry_queue.erase(expiry_queue.begin());
+			continue;
+		}
+		ExpireLine(n, i);
+	}
+}
+
+
+void XLineManager::CancelApply(XLine* line)
+{
 	/* TODO: Can we skip this loop by having a 'pending' field in the XLine class, which is set when a line
 	 * is pending, cleared when it is no longer pending, so we skip over this loop if its not pending?
 	 * -- Brain
 	 */
-	stdalgo::erase(pending_lines, item->second);
+	stdalgo::erase(pending_lines, line);
+	stdalgo::erase(queued_lines, line);
 
-	delete item->second;
-	container->second.erase(item);
+	std::vector<XLine*>::iterator it = std::find(applyjob.lines.begin(), applyjob.lines.end(), line);
+	if (it != applyjob.lines.end())
+	{
+		// The job may be in the middle of applying the lines, so only clear the slot
+		*it = NULL;
+		if (--applyjob.remaining == 0)
+			applyjob.lines.clear();
+	}
 }
 
-
 // applies lines, removing clients and changing nicks etc as applicable
 void XLineManager::ApplyLines()
 {
-	const UserManager::LocalList& list = ServerInstance->Users.GetLocalUsers();
-	for (UserManager::LocalList::const_iterator j = list.begin(); j != list.end(); ++j)
+	for (std::vector<XLine *>::iterator i = pending_lines.begin(); i != pending_lines.end(); i++)
 	{
-		LocalUser* u = *j;
+		XLine *x = *i;
+
+		// Lines keyed by an IP address or a CIDR range can only match the local users with an
+		// IP address in it, assuming that a real host which looks like an IP address is the IP
+		// address of the user
+		std::string key;
+		const XLine::IndexKind kind = x->GetIndexKey(key);
+		if (((kind != XLine::INDEX_HOST) && (kind != XLine::INDEX_IP)) || (key.find_first_of("*?@") != std::string::npos))
+		{
+			queued_lines.push_back(x);
+			continue;
+		}
 
-		// Don't ban people who are exempt.
-		if (u->exempt)
+		const irc::sockets::cidr_mask range(key);
+		if (((key.find('/') != std::string::npos) && (!IsCIDR(key))) || ((range.type != AF_INET) && (range.type != AF_INET6)))
+		{
+			queued_lines.push_back(x);
 			continue;
+		}
 
-		for (std::vector<XLine *>::iterator i = pending_lines.begin(); i != pending_lines.end(); i++)
+		std::vector<LocalUser*> users;
+		ServerInstance->Users->GetLocalUsersInRange(range, users);
+		for (std::vector<LocalUser*>::const_iterator j = users.begin(); j != users.end(); ++j)
 		{
-			XLine *x = *i;
-			if (x->Matches(u))
+			LocalUser* u = *j;
+
+			// Don't ban people who are exempt.
+			if ((!u->exempt) && (!u->quitting) && (x->Matches(u)))
 				x->Apply(u);
 		}
 	}
 
 	pending_lines.clear();
+
+	if ((!queued_lines.empty()) && (!IsApplyingLines()))
+		StartApplyJob();
 }
 
-void XLineManager::InvokeStats(const std::string &type, int numeric, User* user, string_list &results)
+void XLineManager::StartApplyJob()
 {
-	ContainerIter n = lookup_lines.find(type);
+	applyjob.lines.swap(queued_lines);
+	queued_lines.clear();
+	applyjob.remaining = applyjob.lines.size();
 
-	time_t current = ServerInstance->Time();
+	const UserManager::LocalList& list = ServerInstance->Users.GetLocalUsers();
+	applyjob.users.clear();
+	applyjob.users.reserve(list.size());
+	for (UserManager::LocalList::const_iterator i = list.begin(); i != list.end(); ++i)
+		applyjob.users.push_back((*i)->uuid);
+
+	applyjob.pos = 0;
+	applyjob.matches = 0;
+	applyjob.iterations = 0;
+	applyjob.start = InspIRCd::GetMonotonicClock();
+	applyjob.lastreport = ServerInstance->Time();
+
+	// Small jobs are finished in the first iteration, only tell opers about the ones that take a while
+	if (applyjob.users.size() * applyjob.lines.size() > APPLY_SLICE)
+		ServerInstance->SNO->WriteToSnoMask('x', "Applying %lu line(s) to %lu local users in the background",
+			(unsigned long)applyjob.lines.size(), (unsigned long)applyjob.users.size());
+}
 
-	LookupIter safei;
+void XLineManager::ContinueApplyLines()
+{
+	if (!IsApplyingLines())
+		return;
 
-	if (n != lookup_lines.end())
+	applyjob.iterations++;
+	const size_t slice = std::max<size_t>(APPLY_SLICE / applyjob.remaining, 1);
+	const size_t end = std::min(applyjob.pos + slice, applyjob.users.size());
+	for (; (applyjob.pos < end) && (IsApplyingLines()); applyjob.pos++)
 	{
-		XLineLookup& list = n->second;
-		for (LookupIter i = list.begin(); i != list.end(); )
+		LocalUser* u = IS_LOCAL(ServerInstance->FindUUID(applyjob.users[applyjob.pos]));
+
+		// Don't ban people who are exempt, or who have quit since the job started.
+		if ((!u) || (u->exempt) || (u->quitting))
+			continue;
+
+		// Applying a line can remove lines, which clears their slot or the whole list
+		for (size_t i = 0; i < applyjob.lines.size(); i++)
 		{
-			safei = i;
-			safei++;
+			XLine* x = applyjob.lines[i];
+			if ((!x) || (!x->Matches(u)))
+				continue;
 
-			if (i->second->duration && current > i->second->expiry)
-			{
-				ExpireLine(n, i);
-			}
-			else
-				results.push_back(ConvToStr(numeric)+" "+user->nick+" :"+i->second->Displayable()+" "+
-					ConvToStr(i->second->set_time)+" "+ConvToStr(i->second->duration)+" "+i->second->source+" :"+i->second->reason);
-			i = safei;
+			applyjob.matches++;
+			x->Apply(u);
+			if (u->quitting)
+				break;
+		}
+	}
+
+	if ((IsApplyingLines()) && (applyjob.pos < applyjob.users.size()))
+	{
+		if (ServerInstance->Time() - applyjob.lastreport >= 5)
+		{
+			applyjob.lastreport = ServerInstance->Time();
+			ServerInstance->SNO->WriteToSnoMask('x', "Applying %lu line(s): checked %lu of %lu local users",
+				(unsigned long)applyjob.remaining, (unsigned long)applyjob.pos, (unsigned long)applyjob.users.size());
 		}
+		return;
+	}
+
+	if (applyjob.iterations > 1)
+	{
+		const uint64_t elapsed = (InspIRCd::GetMonotonicClock() - applyjob.start) / 1000000;
+		ServerInstance->SNO->WriteToSnoMask('x', "Finished applying %lu line(s) to %lu local users in %s ms over %u main loop iterations, %u matched",
+			(unsigned long)applyjob.lines.size(), (unsigned long)applyjob.users.size(), ConvToStr(elapsed).c_str(), applyjob.iterations, applyjob.matches);
+	}
+
+	applyjob.lines.clear();
+	std::vector<std::string>().swap(applyjob.users);
+	if (!queued_lines.empty())
+		StartApplyJob();
+}
+
+void XLineManager::InvokeStats(const std::string &type, int numeric, User* user, string_list &results)
+{
+	ExpireLines();
+
+	ContainerIter n = lookup_lines.find(type);
+
+	if (n != lookup_lines.end())
+	{
+		XLineLookup& list = n->second;
+		for (LookupIter i = list.begin(); i != list.end(); ++i)
+			results.push_back(ConvToStr(numeric)+" "+user->nick+" :"+i->second->Displayable()+" "+
+				ConvToStr(i->second->set_time)+" "+ConvToStr(i->second->duration)+" "+i->second->source+" :"+i->second->reason);
 	}
 }
 
@@ -515,6 +923,9 @@ XLineManager::~XLineManager()
 			delete j->second;
 		}
 	}
+
+	for (std::map<std::string, XLineIndex*>::iterator i = line_index.begin(); i != line_index.end(); ++i)
+		delete i->second;
 }
 
 void XLine::Apply(User* u)
@@ -552,10 +963,9 @@ bool KLine::Matches(User *u)
 	if (lu && lu->exempt)
 		return false;
 
-	if (InspIRCd::Match(u->ident, this->identmask, ascii_case_insensitive_map))
+	if (identmatch.Match(u->ident))
 	{
-		if (InspIRCd::MatchCIDR(u->host, this->hostmask, ascii_case_insensitive_map) ||
-		    InspIRCd::MatchCIDR(u->GetIPString(), this->hostmask, ascii_case_insensitive_map))
+		if (hostmatch.MatchCIDR(u->host) || hostmatch.MatchCIDR(u->GetIPString()))
 		{
 			return true;
 		}
@@ -575,10 +985,9 @@ bool GLine::Matches(User *u)
 	if (lu && lu->exempt)
 		return false;
 
-	if (InspIRCd::Match(u->ident, this->identmask, ascii_case_insensitive_map))
+	if (identmatch.Match(u->ident))
 	{
-		if (InspIRCd::MatchCIDR(u->host, this->hostmask, ascii_case_insensitive_map) ||
-		    InspIRCd::MatchCIDR(u->GetIPString(), this->hostmask, ascii_case_insensitive_map))
+		if (hostmatch.MatchCIDR(u->host) || hostmatch.MatchCIDR(u->GetIPString()))
 		{
 			return true;
 		}
@@ -598,10 +1007,9 @@ bool ELine::Matches(User *u)
 	if (lu && lu->exempt)
 		return false;
 
-	if (InspIRCd::Match(u->ident, this->identmask, ascii_case_insensitive_map))
+	if (identmatch.Match(u->ident))
 	{
-		if (InspIRCd::MatchCIDR(u->host, this->hostmask, ascii_case_insensitive_map) ||
-		    InspIRCd::MatchCIDR(u->GetIPString(), this->hostmask, ascii_case_insensitive_map))
+		if (hostmatch.MatchCIDR(u->host) || hostmatch.MatchCIDR(u->GetIPString()))
 		{
 			return true;
 		}
@@ -616,7 +1024,7 @@ bool ZLine::Matches(User *u)
 	if (lu && lu->exempt)
 		return false;
 
-	if (InspIRCd::MatchCIDR(u->GetIPString(), this->ipaddr))
+	if (ipmatch.MatchCIDR(u->GetIPString()))
 		return true;
 	else
 		return false;
@@ -630,7 +1038,7 @@ void ZLine::Apply(User* u)
 
 bool QLine::Matches(User *u)
 {
-	if (InspIRCd::Match(u->nick, this->nick))
+	if (nickmatch.Match(u->nick))
 		return true;
 
 	return false;
@@ -645,7 +1053,7 @@ void QLine::Apply(User* u)
 
 bool ZLine::Matches(const std::string &str)
 {
-	if (InspIRCd::MatchCIDR(str, this->ipaddr))
+	if (ipmatch.MatchCIDR(str))
 		return true;
 	else
 		return false;
@@ -653,7 +1061,7 @@ bool ZLine::Matches(const std::string &str)
 
 bool QLine::Matches(const std::string &str)
 {
-	if (InspIRCd::Match(str, this->nick))
+	if (nickmatch.Match(str))
 		return true;
 
 	return false;
@@ -718,6 +1126,36 @@ const std::string& QLine::Displayable()
 	return nick;
 }
 
+XLine::IndexKind ELine::GetIndexKey(std::string& key)
+{
+	key = hostmask;
+	return INDEX_HOST;
+}
+
+XLine::IndexKind KLine::GetIndexKey(std::string& key)
+{
+	key = hostmask;
+	return INDEX_HOST;
+}
+
+XLine::IndexKind GLine::GetIndexKey(std::string& key)
+{
+	key = hostmask;
+	return INDEX_HOST;
+}
+
+XLine::IndexKind ZLine::GetIndexKey(std::string& key)
+{
+	key = ipaddr;
+	return INDEX_IP;
+}
+
+XLine::IndexKind QLine::GetIndexKey(std::string& key)
+{
+	key = nick;
+	return INDEX_NICK;
+}
+
 bool KLine::IsBurstable()
 {
 	return false;